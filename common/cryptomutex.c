@@ -74,6 +74,12 @@
 #include <pthread.h>
 #include <openssl/crypto.h>
 
+/*
+ * OpenSSL 1.1.0 and later lock by themselves and ignore the locking callbacks,
+ * so neither the callbacks nor the mutexes are set up for them.
+ */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+
 static pthread_mutex_t *lock_cs;
 
 static void
@@ -118,3 +124,17 @@ Crypto_mutex_cleanup(void)
     }
     OPENSSL_free(lock_cs);
 }
+
+#else
+
+void
+Crypto_mutex_init(void)
+{
+}
+
+void
+Crypto_mutex_cleanup(void)
+{
+}
+
+#endif
@@ -14,21 +14,90 @@
 #endif
 
 #include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <strings.h>
 
+#include "stdaux.h"
 #include "ptrop.h"
 #include "xskip.h"
 #include "strpairarray.h"
 #include "inetmailbox.h"
 #include "inetmailheaders.h"
 
+#define INETMAILHEADERS_CHUNK_SIZE 8192
+#define INETMAILHEADERS_BUCKET_NUM 64   // must be a power of 2
+
+// a block of the arena the header names and values are copied into
+typedef struct InetMailHeaderChunk {
+    struct InetMailHeaderChunk *next;
+    size_t size;
+    size_t used;
+    char buf[];
+} InetMailHeaderChunk;
+
+typedef struct InetMailHeader {
+    const char *key;    // points into the arena
+    const char *val;    // points into the arena
+    int name_index;     // index of the InetMailHeaderName, -1 if key is NULL
+    int prev_same;      // the previous header with the same name, -1 if none
+    int next_same;      // the next header with the same name, -1 if none
+} InetMailHeader;
+
+// occurrences of a header field name
+typedef struct InetMailHeaderName {
+    uint32_t hash;
+    int next;           // the next name in the same bucket, -1 if none
+    int first;          // the first header with this name
+    int last;           // the last header with this name
+    size_t count;
+} InetMailHeaderName;
+
+/*
+ * headers are copied into the arena made of chunks which never move,
+ * so the pointers returned by InetMailHeaders_get() are valid until the object is reset.
+ * the headers of each field name are linked in both directions,
+ * and the names are indexed by the hash of the lowercased name.
+ * all the arrays and the first chunk are reused after reset.
+ */
 struct InetMailHeaders {
-    StrPairArray *headers;
+    InetMailHeader *header;
+    size_t header_num;
+    size_t header_capacity;
+    InetMailHeaderName *name;
+    size_t name_num;
+    size_t name_capacity;
+    int bucket[INETMAILHEADERS_BUCKET_NUM];
+    InetMailHeaderChunk *chunk; // the chunk being filled, the older ones follow
     HeaderStautus author_parse_stat;
     InetMailboxArray *authors;
 };
 
+static uint32_t
+InetMailHeaders_hash(const char *fieldname)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (const char *p = fieldname; '\0' != *p; ++p) {
+        hash ^= (uint32_t) tolower((unsigned char) *p);
+        hash *= 16777619U;
+    }   // end for
+    return hash;
+}   // end function: InetMailHeaders_hash
+
+static void
+InetMailHeaders_clearIndex(InetMailHeaders *self)
+{
+    self->header_num = 0;
+    self->name_num = 0;
+    for (size_t i = 0; i < INETMAILHEADERS_BUCKET_NUM; ++i) {
+        self->bucket[i] = -1;
+    }   // end for
+}   // end function: InetMailHeaders_clearIndex
+
 void
 InetMailHeaders_free(InetMailHeaders *self)
 {
@@ -36,13 +105,21 @@ InetMailHeaders_free(InetMailHeaders *self)
         return;
     }   // end if
 
-    StrPairArray_free(self->headers);
+    InetMailHeaderChunk *chunk = self->chunk;
+    while (NULL != chunk) {
+        InetMailHeaderChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }   // end while
+    free(self->header);
+    free(self->name);
     InetMailboxArray_free(self->authors);
     free(self);
 }   // end function: InetMailHeaders_free
 
 /**
  * create InetMailHeaders object
+ * @param size the number of headers expected, 0 for the default.
  * @return initialized InetMailHeaders object, or NULL if memory allocation failed.
  */
 InetMailHeaders *
@@ -53,10 +130,14 @@ InetMailHeaders_new(size_t size)
         return NULL;
     }   // end if
     memset(self, 0, sizeof(InetMailHeaders));
-    self->headers = StrPairArray_new(size);
-    if (NULL == self->headers) {
-        free(self);
-        return NULL;
+    InetMailHeaders_clearIndex(self);
+    if (0 < size) {
+        self->header = (InetMailHeader *) malloc(sizeof(InetMailHeader) * size);
+        if (NULL == self->header) {
+            free(self);
+            return NULL;
+        }   // end if
+        self->header_capacity = size;
     }   // end if
     self->author_parse_stat = HEADER_STAT_NULL;
     return self;
@@ -65,7 +146,18 @@ InetMailHeaders_new(size_t size)
 void
 InetMailHeaders_reset(InetMailHeaders *self)
 {
-    StrPairArray_reset(self->headers);
+    InetMailHeaders_clearIndex(self);
+    if (NULL != self->chunk) {
+        // keep only the oldest chunk, which is of the default size unless a huge header came first
+        InetMailHeaderChunk *chunk = self->chunk;
+        while (NULL != chunk->next) {
+            InetMailHeaderChunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }   // end while
+        chunk->used = 0;
+        self->chunk = chunk;
+    }   // end if
     self->author_parse_stat = HEADER_STAT_NULL;
     InetMailboxArray_free(self->authors);
     self->authors = NULL;
@@ -74,21 +166,204 @@ InetMailHeaders_reset(InetMailHeaders *self)
 size_t
 InetMailHeaders_getCount(const InetMailHeaders *self)
 {
-    return StrPairArray_getCount(self->headers);
+    return self->header_num;
 }   // end function: InetMailHeaders_getCount
 
 void
 InetMailHeaders_get(const InetMailHeaders *self, size_t pos, const char **pkey, const char **pval)
 {
-    return StrPairArray_get((self->headers), pos, pkey, pval);
+    assert(pos < self->header_num);
+    if (NULL != pkey) {
+        *pkey = self->header[pos].key;
+    }   // end if
+    if (NULL != pval) {
+        *pval = self->header[pos].val;
+    }   // end if
 }   // end function: InetMailHeaders_get
 
+/*
+ * @return a region of size bytes in the arena, or NULL if memory allocation failed.
+ */
+static char *
+InetMailHeaders_allocate(InetMailHeaders *self, size_t size)
+{
+    InetMailHeaderChunk *chunk = self->chunk;
+    if (NULL == chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = MAX(INETMAILHEADERS_CHUNK_SIZE, size);
+        chunk = (InetMailHeaderChunk *) malloc(sizeof(InetMailHeaderChunk) + chunk_size);
+        if (NULL == chunk) {
+            return NULL;
+        }   // end if
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = self->chunk;
+        self->chunk = chunk;
+    }   // end if
+    char *region = chunk->buf + chunk->used;
+    chunk->used += size;
+    return region;
+}   // end function: InetMailHeaders_allocate
+
+static int
+InetMailHeaders_findName(const InetMailHeaders *self, const char *fieldname, uint32_t hash)
+{
+    for (int i = self->bucket[hash & (INETMAILHEADERS_BUCKET_NUM - 1)]; 0 <= i;
+         i = self->name[i].next) {
+        if (hash == self->name[i].hash
+            && 0 == strcasecmp(self->header[self->name[i].first].key, fieldname)) {
+            return i;
+        }   // end if
+    }   // end for
+    return -1;
+}   // end function: InetMailHeaders_findName
+
+/*
+ * Links the header at pos to the headers with the same name.
+ * @return true on successful completion, false if memory allocation failed.
+ */
+static bool
+InetMailHeaders_index(InetMailHeaders *self, int pos)
+{
+    InetMailHeader *header = &(self->header[pos]);
+    uint32_t hash = InetMailHeaders_hash(header->key);
+    int name_index = InetMailHeaders_findName(self, header->key, hash);
+    if (name_index < 0) {
+        if (self->name_capacity <= self->name_num) {
+            size_t newcapacity = 0 < self->name_capacity ? self->name_capacity * 2 : 16;
+            InetMailHeaderName *newname = (InetMailHeaderName *)
+                realloc(self->name, sizeof(InetMailHeaderName) * newcapacity);
+            if (NULL == newname) {
+                return false;
+            }   // end if
+            self->name = newname;
+            self->name_capacity = newcapacity;
+        }   // end if
+        name_index = (int) self->name_num++;
+        InetMailHeaderName *name = &(self->name[name_index]);
+        name->hash = hash;
+        name->next = self->bucket[hash & (INETMAILHEADERS_BUCKET_NUM - 1)];
+        self->bucket[hash & (INETMAILHEADERS_BUCKET_NUM - 1)] = name_index;
+        name->first = pos;
+        name->last = -1;
+        name->count = 0;
+    }   // end if
+
+    InetMailHeaderName *name = &(self->name[name_index]);
+    header->name_index = name_index;
+    header->prev_same = name->last;
+    header->next_same = -1;
+    if (0 <= name->last) {
+        self->header[name->last].next_same = pos;
+    }   // end if
+    name->last = pos;
+    ++name->count;
+    return true;
+}   // end function: InetMailHeaders_index
+
 int
 InetMailHeaders_append(InetMailHeaders *self, const char *key, const char *val)
 {
-    return StrPairArray_append(self->headers, key, val);
+    if (self->header_capacity <= self->header_num) {
+        size_t newcapacity = 0 < self->header_capacity ? self->header_capacity * 2 : 32;
+        InetMailHeader *newheader =
+            (InetMailHeader *) realloc(self->header, sizeof(InetMailHeader) * newcapacity);
+        if (NULL == newheader) {
+            return -1;
+        }   // end if
+        self->header = newheader;
+        self->header_capacity = newcapacity;
+    }   // end if
+
+    int pos = (int) self->header_num;
+    InetMailHeader *header = &(self->header[pos]);
+    header->name_index = -1;
+    header->prev_same = -1;
+    header->next_same = -1;
+    if (NULL == key) {
+        header->key = NULL;
+        header->val = NULL;
+        ++self->header_num;
+        return pos;
+    }   // end if
+
+    // the value is copied right after the name
+    size_t keylen = strlen(key);
+    if (NULL == val) {
+        val = "";
+    }   // end if
+    size_t vallen = strlen(val);
+    char *copy = InetMailHeaders_allocate(self, keylen + vallen + 2);
+    if (NULL == copy) {
+        return -1;
+    }   // end if
+    memcpy(copy, key, keylen);
+    copy[keylen] = '\0';
+    memcpy(copy + keylen + 1, val, vallen);
+    copy[keylen + 1 + vallen] = '\0';
+    header->key = copy;
+    header->val = copy + keylen + 1;
+    ++self->header_num;
+    if (!InetMailHeaders_index(self, pos)) {
+        --self->header_num;
+        return -1;
+    }   // end if
+    return pos;
 }   // end function: InetMailHeaders_append
 
+/**
+ * @return the number of the headers whose name is fieldname (case-insensitive).
+ */
+size_t
+InetMailHeaders_countHeader(const InetMailHeaders *self, const char *fieldname)
+{
+    int name_index = InetMailHeaders_findName(self, fieldname, InetMailHeaders_hash(fieldname));
+    return 0 <= name_index ? self->name[name_index].count : 0;
+}   // end function: InetMailHeaders_countHeader
+
+/**
+ * @return the index of the first header whose name is fieldname (case-insensitive),
+ *         -1 if not found.
+ */
+int
+InetMailHeaders_getFirstIndex(const InetMailHeaders *self, const char *fieldname)
+{
+    int name_index = InetMailHeaders_findName(self, fieldname, InetMailHeaders_hash(fieldname));
+    return 0 <= name_index ? self->name[name_index].first : -1;
+}   // end function: InetMailHeaders_getFirstIndex
+
+/**
+ * @return the index of the last header whose name is fieldname (case-insensitive),
+ *         -1 if not found.
+ */
+int
+InetMailHeaders_getLastIndex(const InetMailHeaders *self, const char *fieldname)
+{
+    int name_index = InetMailHeaders_findName(self, fieldname, InetMailHeaders_hash(fieldname));
+    return 0 <= name_index ? self->name[name_index].last : -1;
+}   // end function: InetMailHeaders_getLastIndex
+
+/**
+ * @return the index of the next header with the same name as the header at pos,
+ *         -1 if pos is the last one.
+ */
+int
+InetMailHeaders_getNextIndex(const InetMailHeaders *self, int pos)
+{
+    assert(0 <= pos && (size_t) pos < self->header_num);
+    return self->header[pos].next_same;
+}   // end function: InetMailHeaders_getNextIndex
+
+/**
+ * @return the index of the previous header with the same name as the header at pos,
+ *         -1 if pos is the first one.
+ */
+int
+InetMailHeaders_getPrevIndex(const InetMailHeaders *self, int pos)
+{
+    assert(0 <= pos && (size_t) pos < self->header_num);
+    return self->header[pos].prev_same;
+}   // end function: InetMailHeaders_getPrevIndex
+
 /**
  * InetMailHeader オブジェクトから最初に fieldname にマッチするヘッダへのインデックスを返す.
  * @param multiple マッチするヘッダが複数存在することを示すフラグを受け取る変数へのポインタ.
@@ -100,13 +375,10 @@ InetMailHeaders_getHeaderIndexImpl(const InetMailHeaders *self, const char *fiel
                                    bool ignore_empty_header, bool *multiple)
 {
     int keyindex = -1;
-    int headernum = InetMailHeaders_getCount(self);
-    for (int i = 0; i < headernum; ++i) {
-        const char *headerf, *headerv;
-        InetMailHeaders_get(self, i, &headerf, &headerv);
-        if (0 != strcasecmp(headerf, fieldname)) {
-            continue;
-        }   // end if
+    for (int i = InetMailHeaders_getFirstIndex(self, fieldname); 0 <= i;
+         i = InetMailHeaders_getNextIndex(self, i)) {
+        const char *headerv;
+        InetMailHeaders_get(self, i, NULL, &headerv);
 
         // Header Field Name が一致した
 
@@ -124,9 +124,12 @@ LogHandler_stdout(int log_level __attribute__((unused)), const char *format, ...
 {
     va_list args;
     va_start(args, format);
+    // keep a line from being interleaved with the ones of the other threads
+    flockfile(stdout);
     vfprintf(stdout, format, args);
+    putc_unlocked('\n', stdout);
+    funlockfile(stdout);
     va_end(args);
-    putc('\n', stdout);
 }   // end function: LogHandler_stdout
 
 static void
@@ -134,9 +137,12 @@ LogHandler_stderr(int log_level __attribute__((unused)), const char *format, ...
 {
     va_list args;
     va_start(args, format);
+    // keep a line from being interleaved with the ones of the other threads
+    flockfile(stderr);
     vfprintf(stderr, format, args);
+    putc_unlocked('\n', stderr);
+    funlockfile(stderr);
     va_end(args);
-    putc('\n', stderr);
 }   // end function: LogHandler_stderr
 
 void
@@ -12,9 +12,169 @@
 # include "config.h"
 #endif
 
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
 
 #include "loghandler.h"
+#include "openssl_compat.h"
+
+// the number of the digest contexts each thread keeps for reuse
+#define OPENSSL_DIGEST_CONTEXT_CACHE_SIZE 16
+
+typedef struct OpenSSL_DigestContextCache {
+    size_t count;
+    EVP_MD_CTX *ctx[OPENSSL_DIGEST_CONTEXT_CACHE_SIZE];
+} OpenSSL_DigestContextCache;
+
+static pthread_once_t OpenSSL_digest_init_once = PTHREAD_ONCE_INIT;
+
+// key of the thread local storage to keep the digest contexts released
+static pthread_key_t OpenSSL_digest_context_key;
+static bool OpenSSL_digest_context_key_created = false;
+
+// the digest algorithms fetched once from the default provider
+static const EVP_MD *OpenSSL_digest_sha1 = NULL;
+static const EVP_MD *OpenSSL_digest_sha256 = NULL;
+
+static void
+OpenSSL_freeDigestContextCache(void *arg)
+{
+    OpenSSL_DigestContextCache *cache = (OpenSSL_DigestContextCache *) arg;
+    for (size_t i = 0; i < cache->count; ++i) {
+        EVP_MD_CTX_free(cache->ctx[i]);
+    }   // end for
+    free(cache);
+}   // end function: OpenSSL_freeDigestContextCache
+
+static void
+OpenSSL_initDigestsImpl(void)
+{
+    OpenSSL_digest_context_key_created =
+        (0 == pthread_key_create(&OpenSSL_digest_context_key, OpenSSL_freeDigestContextCache));
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+    OpenSSL_digest_sha1 = EVP_sha1();
+    OpenSSL_digest_sha256 = EVP_sha256();
+#else
+    // explicit fetches spare the per-call implicit fetches EVP_sha*() incur on OpenSSL 3
+    OpenSSL_digest_sha1 = EVP_MD_fetch(NULL, "SHA1", NULL);
+    OpenSSL_digest_sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+    if (NULL == OpenSSL_digest_sha1 || NULL == OpenSSL_digest_sha256) {
+        LogWarning("EVP_MD_fetch failed, falling back to implicit fetches");
+        OpenSSL_logErrors();
+        EVP_MD_free((EVP_MD *) OpenSSL_digest_sha1);
+        EVP_MD_free((EVP_MD *) OpenSSL_digest_sha256);
+        OpenSSL_digest_sha1 = EVP_sha1();
+        OpenSSL_digest_sha256 = EVP_sha256();
+    }   // end if
+#endif
+}   // end function: OpenSSL_initDigestsImpl
+
+/**
+ * Fetches the digest algorithms.
+ * Called at startup, otherwise on the first use of the digest algorithms or contexts.
+ */
+void
+OpenSSL_initDigests(void)
+{
+    pthread_once(&OpenSSL_digest_init_once, OpenSSL_initDigestsImpl);
+}   // end function: OpenSSL_initDigests
+
+/**
+ * Releases the digest algorithms and the digest contexts kept by the calling thread.
+ * The digest algorithms and contexts are not available afterwards.
+ */
+void
+OpenSSL_cleanupDigests(void)
+{
+    OpenSSL_initDigests();
+    if (OpenSSL_digest_context_key_created) {
+        OpenSSL_DigestContextCache *cache =
+            (OpenSSL_DigestContextCache *) pthread_getspecific(OpenSSL_digest_context_key);
+        if (NULL != cache) {
+            (void) pthread_setspecific(OpenSSL_digest_context_key, NULL);
+            OpenSSL_freeDigestContextCache(cache);
+        }   // end if
+        (void) pthread_key_delete(OpenSSL_digest_context_key);
+        OpenSSL_digest_context_key_created = false;
+    }   // end if
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    if (OpenSSL_digest_sha1 != EVP_sha1()) {
+        EVP_MD_free((EVP_MD *) OpenSSL_digest_sha1);
+        EVP_MD_free((EVP_MD *) OpenSSL_digest_sha256);
+    }   // end if
+#endif
+    OpenSSL_digest_sha1 = NULL;
+    OpenSSL_digest_sha256 = NULL;
+}   // end function: OpenSSL_cleanupDigests
+
+const EVP_MD *
+OpenSSL_getSha1(void)
+{
+    OpenSSL_initDigests();
+    return OpenSSL_digest_sha1;
+}   // end function: OpenSSL_getSha1
+
+const EVP_MD *
+OpenSSL_getSha256(void)
+{
+    OpenSSL_initDigests();
+    return OpenSSL_digest_sha256;
+}   // end function: OpenSSL_getSha256
+
+/**
+ * Takes a digest context, reusing one released by the calling thread if any.
+ * The context must be initialized by EVP_DigestInit_ex(),
+ * which reuses the state left in the context for the same digest algorithm.
+ * @return EVP_MD_CTX object, or NULL if memory allocation failed.
+ */
+EVP_MD_CTX *
+OpenSSL_newDigestContext(void)
+{
+    OpenSSL_initDigests();
+    if (OpenSSL_digest_context_key_created) {
+        OpenSSL_DigestContextCache *cache =
+            (OpenSSL_DigestContextCache *) pthread_getspecific(OpenSSL_digest_context_key);
+        if (NULL != cache && 0 < cache->count) {
+            return cache->ctx[--cache->count];
+        }   // end if
+    }   // end if
+    return EVP_MD_CTX_new();
+}   // end function: OpenSSL_newDigestContext
+
+/**
+ * Releases a digest context, which is kept by the calling thread for reuse if possible.
+ * @param ctx EVP_MD_CTX object taken by OpenSSL_newDigestContext() on any thread.
+ */
+void
+OpenSSL_freeDigestContext(EVP_MD_CTX *ctx)
+{
+    if (NULL == ctx) {
+        return;
+    }   // end if
+    if (OpenSSL_digest_context_key_created) {
+        OpenSSL_DigestContextCache *cache =
+            (OpenSSL_DigestContextCache *) pthread_getspecific(OpenSSL_digest_context_key);
+        if (NULL == cache) {
+            cache = (OpenSSL_DigestContextCache *) malloc(sizeof(OpenSSL_DigestContextCache));
+            if (NULL != cache) {
+                cache->count = 0;
+                if (0 != pthread_setspecific(OpenSSL_digest_context_key, cache)) {
+                    free(cache);
+                    cache = NULL;
+                }   // end if
+            }   // end if
+        }   // end if
+        if (NULL != cache && cache->count < OPENSSL_DIGEST_CONTEXT_CACHE_SIZE) {
+            cache->ctx[cache->count++] = ctx;
+            return;
+        }   // end if
+    }   // end if
+    EVP_MD_CTX_free(ctx);
+}   // end function: OpenSSL_freeDigestContext
 
 #if OPENSSL_VERSION_NUMBER < 0x30000000L
 
@@ -335,10 +335,10 @@ DkimAtps_appendHashedSdid(const char *sdid, DkimHashAlgorithm hashalg, XBuffer *
     const EVP_MD *digest_alg = NULL;
     switch (hashalg) {
     case DKIM_HASH_ALGORITHM_SHA1:
-        digest_alg = EVP_sha1();
+        digest_alg = OpenSSL_getSha1();
         break;
     case DKIM_HASH_ALGORITHM_SHA256:
-        digest_alg = EVP_sha256();
+        digest_alg = OpenSSL_getSha256();
         break;
     default:
         return DSTAT_PERMFAIL_UNSUPPORTED_HASH_ALGORITHM;
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2006-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "loghandler.h"
+#include "dkim.h"
+#include "dkimcryptopool.h"
+#include "dkimbodyqueue.h"
+
+typedef struct DkimBodyChunk {
+    struct DkimBodyChunk *next;
+    size_t len;
+    unsigned char buf[];
+} DkimBodyChunk;
+
+/*
+ * queue of the chunks of a message body, passed to the consumer in order on DkimCryptoPool.
+ * at most one job per queue is on the pool at a time, so the consumer is never run concurrently.
+ * the producer blocks while the queued chunks exceed queue_limit octets,
+ * which bounds the memory a message can hold.
+ */
+struct DkimBodyQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // signaled when a chunk is consumed
+    DkimBodyQueue_consumer *consumer;
+    void *arg;
+    size_t queue_limit;
+    size_t queued;          // the number of the octets queued or being consumed
+    bool draining;          // the job is on the pool
+    bool finished;
+    DkimBodyChunk *head;
+    DkimBodyChunk *tail;
+    DkimCryptoBatch batch;
+    DkimCryptoJob job;
+};
+
+/*
+ * DkimCryptoPool_task to pass the queued chunks to the consumer.
+ */
+static void
+DkimBodyQueue_drain(void *arg)
+{
+    DkimBodyQueue *self = (DkimBodyQueue *) arg;
+
+    (void) pthread_mutex_lock(&self->lock);
+    while (NULL != self->head) {
+        DkimBodyChunk *chunk = self->head;
+        self->head = chunk->next;
+        if (NULL == self->head) {
+            self->tail = NULL;
+        }   // end if
+        (void) pthread_mutex_unlock(&self->lock);
+
+        self->consumer(self->arg, chunk->buf, chunk->len);
+
+        (void) pthread_mutex_lock(&self->lock);
+        self->queued -= chunk->len;
+        free(chunk);
+        (void) pthread_cond_signal(&self->cond);
+    }   // end while
+    self->draining = false;
+    (void) pthread_mutex_unlock(&self->lock);
+}   // end function: DkimBodyQueue_drain
+
+/**
+ * Queues a copy of a chunk of the message body.
+ * Waits for the preceding chunks to be consumed if the queue is full.
+ * @return DSTAT_OK for success, otherwise status code that indicates error.
+ * @error DSTAT_SYSERR_NORESOURCE memory allocation error
+ */
+DkimStatus
+DkimBodyQueue_push(DkimBodyQueue *self, const unsigned char *buf, size_t len)
+{
+    assert(NULL != self);
+    assert(!self->finished);
+
+    DkimBodyChunk *chunk = (DkimBodyChunk *) malloc(sizeof(DkimBodyChunk) + len);
+    if (NULL == chunk) {
+        LogNoResource();
+        return DSTAT_SYSERR_NORESOURCE;
+    }   // end if
+    chunk->next = NULL;
+    chunk->len = len;
+    memcpy(chunk->buf, buf, len);
+
+    (void) pthread_mutex_lock(&self->lock);
+    // a chunk larger than the limit is accepted when the queue is empty
+    while (0 < self->queued && self->queue_limit < self->queued + len) {
+        (void) pthread_cond_wait(&self->cond, &self->lock);
+    }   // end while
+    if (NULL == self->tail) {
+        self->head = chunk;
+    } else {
+        self->tail->next = chunk;
+    }   // end if
+    self->tail = chunk;
+    self->queued += len;
+    bool submit = !self->draining;
+    self->draining = true;
+    (void) pthread_mutex_unlock(&self->lock);
+
+    if (submit) {
+        // runs DkimBodyQueue_drain() right here if the pool has no worker threads
+        DkimCryptoBatch_submit(&self->batch, &self->job, DkimBodyQueue_drain, self);
+    }   // end if
+    return DSTAT_OK;
+}   // end function: DkimBodyQueue_push
+
+/**
+ * Waits for all the queued chunks to be consumed.
+ * No chunk can be pushed afterwards.
+ */
+void
+DkimBodyQueue_finish(DkimBodyQueue *self)
+{
+    assert(NULL != self);
+
+    if (self->finished) {
+        return;
+    }   // end if
+    DkimCryptoBatch_wait(&self->batch);
+    self->finished = true;
+}   // end function: DkimBodyQueue_finish
+
+/**
+ * release DkimBodyQueue object, waiting for the queued chunks to be consumed.
+ * @param self DkimBodyQueue object to release
+ */
+void
+DkimBodyQueue_free(DkimBodyQueue *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+
+    DkimBodyQueue_finish(self);
+    (void) pthread_cond_destroy(&self->cond);
+    (void) pthread_mutex_destroy(&self->lock);
+    free(self);
+}   // end function: DkimBodyQueue_free
+
+/**
+ * create DkimBodyQueue object
+ * @param pool DkimCryptoPool object to run the consumer on.
+ * @param queue_limit the number of the octets which can be queued.
+ * @param consumer callback to receive the chunks.
+ * @return initialized DkimBodyQueue object, or NULL if initialization failed.
+ */
+DkimBodyQueue *
+DkimBodyQueue_new(DkimCryptoPool *pool, size_t queue_limit, DkimBodyQueue_consumer *consumer,
+                  void *arg)
+{
+    DkimBodyQueue *self = (DkimBodyQueue *) malloc(sizeof(DkimBodyQueue));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(DkimBodyQueue));
+
+    int ret = pthread_mutex_init(&self->lock, NULL);
+    if (0 != ret) {
+        free(self);
+        return NULL;
+    }   // end if
+    ret = pthread_cond_init(&self->cond, NULL);
+    if (0 != ret) {
+        (void) pthread_mutex_destroy(&self->lock);
+        free(self);
+        return NULL;
+    }   // end if
+    if (!DkimCryptoBatch_init(&self->batch, pool)) {
+        (void) pthread_cond_destroy(&self->cond);
+        (void) pthread_mutex_destroy(&self->lock);
+        free(self);
+        return NULL;
+    }   // end if
+
+    self->consumer = consumer;
+    self->arg = arg;
+    self->queue_limit = queue_limit;
+    return self;
+}   // end function: DkimBodyQueue_new
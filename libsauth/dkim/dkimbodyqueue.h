@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2006-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __DKIM_BODY_QUEUE_H__
+#define __DKIM_BODY_QUEUE_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "dkim.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct DkimBodyQueue DkimBodyQueue;
+
+/*
+ * callback of DkimBodyQueue, receives the chunks of the message body in order.
+ */
+typedef void DkimBodyQueue_consumer(void *arg, const unsigned char *buf, size_t len);
+
+extern DkimBodyQueue *DkimBodyQueue_new(DkimCryptoPool *pool, size_t queue_limit,
+                                        DkimBodyQueue_consumer *consumer, void *arg);
+extern void DkimBodyQueue_free(DkimBodyQueue *self);
+extern DkimStatus DkimBodyQueue_push(DkimBodyQueue *self, const unsigned char *buf, size_t len);
+extern void DkimBodyQueue_finish(DkimBodyQueue *self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DKIM_BODY_QUEUE_H__ */
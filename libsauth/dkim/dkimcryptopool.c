@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2006-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "loghandler.h"
+#include "dkim.h"
+#include "dkimcryptopool.h"
+
+/*
+ * fixed number of worker threads running the public key operations of DKIM.
+ * the worker threads are started on the first job, after the daemon has forked,
+ * and each of them is pinned to a CPU if requested.
+ * the jobs are run by the submitter itself if no worker thread is available.
+ */
+struct DkimCryptoPool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // signaled when a job is queued or the pool is shutting down
+    pthread_t *worker;
+    unsigned int worker_num;    // the number of the worker threads to start
+    unsigned int worker_started;
+    bool worker_failed;
+    bool pin_cores;
+    bool shutdown;
+    DkimCryptoJob *queue_head;
+    DkimCryptoJob *queue_tail;
+};
+
+static void *
+DkimCryptoPool_work(void *arg)
+{
+    DkimCryptoPool *self = (DkimCryptoPool *) arg;
+
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return NULL;
+    }   // end if
+    while (!self->shutdown) {
+        DkimCryptoJob *job = self->queue_head;
+        if (NULL == job) {
+            (void) pthread_cond_wait(&self->cond, &self->lock);
+            continue;
+        }   // end if
+        self->queue_head = job->next;
+        if (NULL == self->queue_head) {
+            self->queue_tail = NULL;
+        }   // end if
+        (void) pthread_mutex_unlock(&self->lock);
+
+        // the job belongs to the submitter, which may release it as soon as the batch completes
+        DkimCryptoBatch *batch = job->batch;
+        job->task(job->arg);
+
+        ret = pthread_mutex_lock(&self->lock);
+        if (0 != ret) {
+            LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+            return NULL;
+        }   // end if
+        if (0 == --batch->pending) {
+            (void) pthread_cond_signal(&batch->cond);
+        }   // end if
+    }   // end while
+    (void) pthread_mutex_unlock(&self->lock);
+    return NULL;
+}   // end function: DkimCryptoPool_work
+
+/*
+ * Pins the worker thread to the idx-th CPU the process is allowed to run on.
+ */
+static void
+DkimCryptoPool_pinWorker(pthread_t worker, unsigned int idx)
+{
+#if defined(CPU_SET)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (0 != sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        return;
+    }   // end if
+    int cpu_num = CPU_COUNT(&allowed);
+    if (cpu_num <= 0) {
+        return;
+    }   // end if
+    int target = (int) (idx % (unsigned int) cpu_num);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed) || 0 < target--) {
+            continue;
+        }   // end if
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        CPU_SET(cpu, &mask);
+        int ret = pthread_setaffinity_np(worker, sizeof(mask), &mask);
+        if (0 != ret) {
+            LogWarning("pthread_setaffinity_np failed: cpu=%d, errno=%s", cpu, strerror(ret));
+        }   // end if
+        return;
+    }   // end for
+#endif
+}   // end function: DkimCryptoPool_pinWorker
+
+/*
+ * Starts the worker threads, with the lock held.
+ * @return true if one or more worker threads are running, false otherwise.
+ */
+static bool
+DkimCryptoPool_start(DkimCryptoPool *self)
+{
+    if (0 < self->worker_started || self->worker_failed) {
+        return 0 < self->worker_started;
+    }   // end if
+    for (unsigned int i = 0; i < self->worker_num; ++i) {
+        int ret = pthread_create(&self->worker[i], NULL, DkimCryptoPool_work, self);
+        if (0 != ret) {
+            LogError("pthread_create failed: errno=%s", strerror(ret));
+            break;
+        }   // end if
+        if (self->pin_cores) {
+            DkimCryptoPool_pinWorker(self->worker[i], i);
+        }   // end if
+        ++self->worker_started;
+    }   // end for
+    if (0 == self->worker_started) {
+        self->worker_failed = true;
+        return false;
+    }   // end if
+    return true;
+}   // end function: DkimCryptoPool_start
+
+/**
+ * Prepares a batch of jobs.
+ * @param pool DkimCryptoPool object to run the jobs, NULL to run them on the submitter.
+ * @return true on successful completion, false if the batch cannot be initialized.
+ */
+bool
+DkimCryptoBatch_init(DkimCryptoBatch *batch, DkimCryptoPool *pool)
+{
+    assert(NULL != batch);
+
+    batch->pool = pool;
+    batch->pending = 0;
+    if (NULL == pool) {
+        return true;
+    }   // end if
+    int ret = pthread_cond_init(&batch->cond, NULL);
+    if (0 != ret) {
+        LogError("pthread_cond_init failed: errno=%s", strerror(ret));
+        return false;
+    }   // end if
+    return true;
+}   // end function: DkimCryptoBatch_init
+
+/**
+ * Queues a job to the pool.
+ * The task runs on the caller before returning if no worker thread is available.
+ * @param job a job object, which must be kept until DkimCryptoBatch_wait() returns.
+ */
+void
+DkimCryptoBatch_submit(DkimCryptoBatch *batch, DkimCryptoJob *job, DkimCryptoPool_task *task,
+                       void *arg)
+{
+    assert(NULL != batch);
+    assert(NULL != job);
+    assert(NULL != task);
+
+    job->next = NULL;
+    job->task = task;
+    job->arg = arg;
+    job->batch = batch;
+
+    DkimCryptoPool *pool = batch->pool;
+    if (NULL == pool) {
+        task(arg);
+        return;
+    }   // end if
+    int ret = pthread_mutex_lock(&pool->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        task(arg);
+        return;
+    }   // end if
+    if (!DkimCryptoPool_start(pool)) {
+        (void) pthread_mutex_unlock(&pool->lock);
+        task(arg);
+        return;
+    }   // end if
+    ++batch->pending;
+    if (NULL == pool->queue_tail) {
+        pool->queue_head = job;
+    } else {
+        pool->queue_tail->next = job;
+    }   // end if
+    pool->queue_tail = job;
+    (void) pthread_cond_signal(&pool->cond);
+    (void) pthread_mutex_unlock(&pool->lock);
+}   // end function: DkimCryptoBatch_submit
+
+/**
+ * Waits for all the jobs of the batch to finish, and releases the resources of the batch.
+ */
+void
+DkimCryptoBatch_wait(DkimCryptoBatch *batch)
+{
+    assert(NULL != batch);
+
+    DkimCryptoPool *pool = batch->pool;
+    if (NULL == pool) {
+        return;
+    }   // end if
+    int ret = pthread_mutex_lock(&pool->lock);
+    if (0 != ret) {
+        // the jobs may be still running, the condition variable must not be destroyed
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return;
+    }   // end if
+    while (0 < batch->pending) {
+        (void) pthread_cond_wait(&batch->cond, &pool->lock);
+    }   // end while
+    (void) pthread_mutex_unlock(&pool->lock);
+    (void) pthread_cond_destroy(&batch->cond);
+}   // end function: DkimCryptoBatch_wait
+
+/**
+ * release DkimCryptoPool object, waiting for the worker threads to finish.
+ * No batch may be in progress.
+ * @param self DkimCryptoPool object to release
+ */
+void
+DkimCryptoPool_free(DkimCryptoPool *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+
+    if (0 < self->worker_started) {
+        (void) pthread_mutex_lock(&self->lock);
+        self->shutdown = true;
+        (void) pthread_cond_broadcast(&self->cond);
+        (void) pthread_mutex_unlock(&self->lock);
+        for (unsigned int i = 0; i < self->worker_started; ++i) {
+            (void) pthread_join(self->worker[i], NULL);
+        }   // end for
+    }   // end if
+    free(self->worker);
+    (void) pthread_cond_destroy(&self->cond);
+    (void) pthread_mutex_destroy(&self->lock);
+    free(self);
+}   // end function: DkimCryptoPool_free
+
+/**
+ * create DkimCryptoPool object
+ * @param thread_num the number of the worker threads.
+ * @param pin_cores true to pin each worker thread to a CPU, false otherwise.
+ * @return initialized DkimCryptoPool object, or NULL if memory allocation failed.
+ */
+DkimCryptoPool *
+DkimCryptoPool_new(unsigned int thread_num, bool pin_cores)
+{
+    if (0 == thread_num) {
+        return NULL;
+    }   // end if
+
+    DkimCryptoPool *self = (DkimCryptoPool *) malloc(sizeof(DkimCryptoPool));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(DkimCryptoPool));
+
+    int ret = pthread_mutex_init(&self->lock, NULL);
+    if (0 != ret) {
+        free(self);
+        return NULL;
+    }   // end if
+    ret = pthread_cond_init(&self->cond, NULL);
+    if (0 != ret) {
+        (void) pthread_mutex_destroy(&self->lock);
+        free(self);
+        return NULL;
+    }   // end if
+    self->worker = (pthread_t *) malloc(sizeof(pthread_t) * thread_num);
+    if (NULL == self->worker) {
+        DkimCryptoPool_free(self);
+        return NULL;
+    }   // end if
+
+    self->worker_num = thread_num;
+    self->pin_cores = pin_cores;
+    return self;
+}   // end function: DkimCryptoPool_new
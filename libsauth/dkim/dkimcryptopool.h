@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2006-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __DKIM_CRYPTO_POOL_H__
+#define __DKIM_CRYPTO_POOL_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "dkim.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void DkimCryptoPool_task(void *arg);
+
+typedef struct DkimCryptoBatch DkimCryptoBatch;
+
+typedef struct DkimCryptoJob {
+    struct DkimCryptoJob *next;
+    DkimCryptoPool_task *task;
+    void *arg;
+    DkimCryptoBatch *batch;
+} DkimCryptoJob;
+
+/*
+ * a set of jobs submitted together, typically the signatures of a message.
+ * the submitter waits for all of them by DkimCryptoBatch_wait().
+ */
+struct DkimCryptoBatch {
+    DkimCryptoPool *pool;
+    size_t pending;         // the number of the jobs not finished yet, protected by the lock of the pool
+    pthread_cond_t cond;    // signaled when "pending" reaches 0
+};
+
+extern bool DkimCryptoBatch_init(DkimCryptoBatch *batch, DkimCryptoPool *pool);
+extern void DkimCryptoBatch_submit(DkimCryptoBatch *batch, DkimCryptoJob *job,
+                                   DkimCryptoPool_task *task, void *arg);
+extern void DkimCryptoBatch_wait(DkimCryptoBatch *batch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DKIM_CRYPTO_POOL_H__ */
@@ -23,27 +23,53 @@
 #include <openssl/err.h>
 #include <openssl/evp.h>
 
+#include "stdaux.h"
 #include "ptrop.h"
 #include "loghandler.h"
 #include "dkimlogger.h"
 #include "xbuffer.h"
-#include "strpairlist.h"
+#include "inetmailheaders.h"
 #include "openssl_compat.h"
 #include "dkimsignature.h"
 #include "dkimcanonicalizer.h"
+#include "dkimheadercache.h"
+#include "dkimsha256.h"
 #include "dkimdigester.h"
 
+// the number of the header field names DkimDigester_updateSignedHeaders() tracks on the stack
+#define DKIM_DIGESTER_CURSOR_NUM 32
+// the number of the body digests DkimDigester_flushBodies() passes to DkimSha256_flush() at once
+#define DKIM_DIGESTER_FLUSH_NUM 8
+
+typedef struct DkimHeaderCursor {
+    int first;  // the index of the first instance of the header field name
+    int next;   // the index of the instance to sign next, -1 if all the instances are signed
+} DkimHeaderCursor;
+
 struct DkimDigester {
     const EVP_MD *digest_alg;
     int pubkey_alg;
     EVP_MD_CTX *header_digest;
     EVP_MD_CTX *body_digest;
     DkimCanonicalizer *canon;
+    DkimC14nAlgorithm header_canon_alg;
+    DkimC14nAlgorithm body_canon_alg;
     bool keep_leading_header_space;
     /// body length limit. sig-l-tag itself. -1 for unlimited.
     long long body_length_limit;
     /// the number of octets included in the hash value at the time.
     long long current_body_length;
+    /// the DkimDigester object whose body digest is used instead of body_digest, NULL if none
+    DkimDigester *body_leader;
+    /// true if the body is hashed with body_sha256 instead of body_digest
+    bool body_deferred;
+    /// the body digest flushed by DkimDigester_flushBodies() together with the others
+    DkimSha256 body_sha256;
+    /// true if the body digest is finalized into body_md, or failed with body_status
+    bool body_finalized;
+    DkimStatus body_status;
+    unsigned char body_md[EVP_MAX_MD_SIZE];
+    unsigned int body_mdlen;
 
     FILE *fp_c14n_header;
     FILE *fp_c14n_body;
@@ -170,10 +196,10 @@ DkimDigester_new(DkimHashAlgorithm digest_alg,
 
     switch (digest_alg) {
     case DKIM_HASH_ALGORITHM_SHA1:
-        self->digest_alg = EVP_sha1();
+        self->digest_alg = OpenSSL_getSha1();
         break;
     case DKIM_HASH_ALGORITHM_SHA256:
-        self->digest_alg = EVP_sha256();
+        self->digest_alg = OpenSSL_getSha256();
         break;
     default:
         DkimLogPermFail("unsupported digest algorithm specified: digestalg=0x%x", digest_alg);
@@ -201,29 +227,31 @@ DkimDigester_new(DkimHashAlgorithm digest_alg,
         DkimDigester_free(self);
         return canon_stat;
     }   // end if
-    if (NULL == (self->header_digest = EVP_MD_CTX_new())) {
+    if (NULL == (self->header_digest = OpenSSL_newDigestContext())) {
         LogNoResource();
         DkimDigester_free(self);
         return DSTAT_SYSERR_NORESOURCE;
     }   // end if
-    if (0 == EVP_DigestInit(self->header_digest, self->digest_alg)) {
+    if (0 == EVP_DigestInit_ex(self->header_digest, self->digest_alg, NULL)) {
         DkimLogSysError("Digest Initialization (of header) failed");
         OpenSSL_logErrors();
         DkimDigester_free(self);
         return DSTAT_SYSERR_NORESOURCE;
     }   // end if
-    if (NULL == (self->body_digest = EVP_MD_CTX_new())) {
+    if (NULL == (self->body_digest = OpenSSL_newDigestContext())) {
         LogNoResource();
         DkimDigester_free(self);
         return DSTAT_SYSERR_NORESOURCE;
     }   // end if
-    if (0 == EVP_DigestInit(self->body_digest, self->digest_alg)) {
+    if (0 == EVP_DigestInit_ex(self->body_digest, self->digest_alg, NULL)) {
         DkimLogSysError("Digest Initialization (of body) failed");
         OpenSSL_logErrors();
         DkimDigester_free(self);
         return DSTAT_SYSERR_NORESOURCE;
     }   // end if
 
+    self->header_canon_alg = header_canon_alg;
+    self->body_canon_alg = body_canon_alg;
     self->body_length_limit = body_length_limit;
     self->keep_leading_header_space = keep_leading_header_space;
 
@@ -245,12 +273,9 @@ DkimDigester_free(DkimDigester *self)
     (void) DkimDigester_closeC14nDump(self);
     DkimCanonicalizer_free(self->canon);
 
-    if (NULL != self->header_digest) {
-        EVP_MD_CTX_free(self->header_digest);
-    }
-    if (NULL != self->body_digest) {
-        EVP_MD_CTX_free(self->body_digest);
-    }
+    // the digest contexts are kept for the following messages on this thread
+    OpenSSL_freeDigestContext(self->header_digest);
+    OpenSSL_freeDigestContext(self->body_digest);
 
     // No need to clean up "self->digest_alg"
 
@@ -292,7 +317,10 @@ DkimDigester_updateBodyChunk(DkimDigester *self, const unsigned char *buf, size_
     }   // end if
 
     if (0 < srclen) {
-        if (0 == EVP_DigestUpdate(self->body_digest, buf, srclen)) {
+        if (self->body_deferred) {
+            // buf is kept by the canonicalizer until its next call
+            DkimSha256_defer(&self->body_sha256, buf, srclen);
+        } else if (0 == EVP_DigestUpdate(self->body_digest, buf, srclen)) {
             DkimLogSysError("Digest update (of body) failed");
             OpenSSL_logErrors();
             return DSTAT_SYSERR_DIGEST_UPDATE_FAILURE;
@@ -306,6 +334,19 @@ DkimDigester_updateBodyChunk(DkimDigester *self, const unsigned char *buf, size_
     return DSTAT_OK;
 }   // end function: DkimDigester_updateBodyChunk
 
+/*
+ * compress the body deferred by DkimDigester_updateBodyChunk() alone,
+ * before the canonicalizer overwrites it.
+ */
+static void
+DkimDigester_flushBody(DkimDigester *self)
+{
+    if (self->body_deferred) {
+        DkimSha256 *ctx = &self->body_sha256;
+        DkimSha256_flush(&ctx, 1);
+    }   // end if
+}   // end function: DkimDigester_flushBody
+
 /**
  * update digest value of message body
  * @param self DkimDigester object
@@ -320,21 +361,188 @@ DkimDigester_updateBody(DkimDigester *self, const unsigned char *buf, size_t len
     assert(NULL != self);
     assert(NULL != buf);
 
+    if (NULL != self->body_leader) {
+        // the body is hashed by the leader
+        return DSTAT_OK;
+    }   // end if
     if (0 <= self->body_length_limit && self->body_length_limit <= self->current_body_length) {
         // return if the body length limit is already exceeded.
         return DSTAT_OK;
     }   // end if
+    DkimDigester_flushBody(self);
 
     const unsigned char *canonbuf;
     size_t canonsize;
-    DkimStatus canon_stat = DkimCanonicalizer_body(self->canon, buf, len, &canonbuf, &canonsize);
-    if (DSTAT_OK != canon_stat) {
-        return canon_stat;
+    DkimStatus ret = DkimCanonicalizer_body(self->canon, buf, len, &canonbuf, &canonsize);
+    if (DSTAT_OK == ret) {
+        // update digest after canonicalization
+        ret = DkimDigester_updateBodyChunk(self, canonbuf, canonsize);
+    }   // end if
+    if (DSTAT_OK != ret) {
+        // the DkimDigester objects sharing the body digest fail as well
+        self->body_finalized = true;
+        self->body_status = ret;
     }   // end if
-    // update digest after canonicalization
-    return DkimDigester_updateBodyChunk(self, canonbuf, canonsize);
+    return ret;
 }   // end function: DkimDigester_updateBody
 
+/**
+ * check whether the rest of the message body affects the body digest.
+ * @return false if the body digest is finalized, shared with another DkimDigester object,
+ *         or the body length limit is already reached, true otherwise.
+ */
+bool
+DkimDigester_needsBody(const DkimDigester *self)
+{
+    assert(NULL != self);
+
+    if (NULL != self->body_leader || self->body_finalized) {
+        return false;
+    }   // end if
+    return bool_cast(0 > self->body_length_limit
+                     || self->current_body_length < self->body_length_limit);
+}   // end function: DkimDigester_needsBody
+
+/**
+ * use the body digest of another DkimDigester object instead of computing the same one again.
+ * the body digests are shared only if the digest algorithm, the body canonicalization algorithm
+ * and the body length limit are all the same, and neither dumps the canonicalized body.
+ * @param leader DkimDigester object which hashes the body, which must outlive self.
+ *               DkimDigester_updateBody() of self does nothing afterwards.
+ * @return true if the body digest is shared, false otherwise.
+ */
+bool
+DkimDigester_shareBody(DkimDigester *self, DkimDigester *leader)
+{
+    assert(NULL != self);
+    assert(NULL != leader);
+
+    if (NULL != leader->body_leader || self->digest_alg != leader->digest_alg
+        || self->body_canon_alg != leader->body_canon_alg
+        || self->body_length_limit != leader->body_length_limit
+        || NULL != self->fp_c14n_body || NULL != leader->fp_c14n_body
+        || 0 < self->current_body_length || 0 < leader->current_body_length) {
+        return false;
+    }   // end if
+    self->body_leader = leader;
+    return true;
+}   // end function: DkimDigester_shareBody
+
+/**
+ * check whether the body digest can be computed together with those of
+ * the other DkimDigester objects by DkimDigester_flushBodies().
+ * only SHA-256 digests which are neither shared nor dumped are, before any body is hashed.
+ */
+bool
+DkimDigester_canDeferBody(const DkimDigester *self)
+{
+    assert(NULL != self);
+
+    return bool_cast(OpenSSL_getSha256() == self->digest_alg && NULL == self->body_leader
+                     && NULL == self->fp_c14n_body && 0 == self->current_body_length
+                     && !self->body_finalized);
+}   // end function: DkimDigester_canDeferBody
+
+/**
+ * let DkimDigester_updateBody() defer hashing the body, which is hashed by
+ * DkimDigester_flushBodies() afterwards together with the bodies of the other DkimDigester objects.
+ * DkimDigester_canDeferBody() must return true.
+ */
+void
+DkimDigester_deferBody(DkimDigester *self)
+{
+    assert(DkimDigester_canDeferBody(self));
+
+    DkimSha256_init(&self->body_sha256);
+    self->body_deferred = true;
+}   // end function: DkimDigester_deferBody
+
+/**
+ * hash the bodies deferred by DkimDigester_updateBody() of several DkimDigester objects at once,
+ * which must be called before the next DkimDigester_updateBody() of any of them
+ * to have their blocks compressed in parallel.
+ * @param digesters DkimDigester objects, those not deferring their bodies are ignored.
+ */
+void
+DkimDigester_flushBodies(DkimDigester *const digesters[], size_t num)
+{
+    assert(NULL != digesters);
+
+    DkimSha256 *ctx[DKIM_DIGESTER_FLUSH_NUM];
+    size_t ctxnum = 0;
+    for (size_t i = 0; i < num; ++i) {
+        if (digesters[i]->body_deferred) {
+            ctx[ctxnum++] = &digesters[i]->body_sha256;
+            if (DKIM_DIGESTER_FLUSH_NUM == ctxnum) {
+                DkimSha256_flush(ctx, ctxnum);
+                ctxnum = 0;
+            }   // end if
+        }   // end if
+    }   // end for
+    if (0 < ctxnum) {
+        DkimSha256_flush(ctx, ctxnum);
+    }   // end if
+}   // end function: DkimDigester_flushBodies
+
+/**
+ * finalize the body digest into body_md only once
+ * @return DSTAT_OK for success, otherwise status code that indicates error.
+ */
+static DkimStatus
+DkimDigester_finalizeBody(DkimDigester *self)
+{
+    if (self->body_finalized) {
+        return self->body_status;
+    }   // end if
+    self->body_finalized = true;
+    DkimDigester_flushBody(self);
+
+    // Flush the canonicalization buffer and finalize canonicalization.
+    const unsigned char *canonbuf;
+    size_t canonsize;
+    self->body_status = DkimCanonicalizer_finalizeBody(self->canon, &canonbuf, &canonsize);
+    if (DSTAT_OK != self->body_status) {
+        return self->body_status;
+    }   // end if
+    // Add the final chunk of the message body into the digest.
+    self->body_status = DkimDigester_updateBodyChunk(self, canonbuf, canonsize);
+    if (DSTAT_OK != self->body_status) {
+        return self->body_status;
+    }   // end if
+    if (self->body_deferred) {
+        DkimSha256_final(&self->body_sha256, self->body_md);
+        self->body_mdlen = DKIM_SHA256_DIGEST_SIZE;
+        return DSTAT_OK;
+    }   // end if
+    if (0 == EVP_DigestFinal_ex(self->body_digest, self->body_md, &self->body_mdlen)) {
+        DkimLogSysError("Digest finish (of body) failed");
+        OpenSSL_logErrors();
+        return self->body_status = DSTAT_SYSERR_DIGEST_UPDATE_FAILURE;
+    }   // end if
+    return DSTAT_OK;
+}   // end function: DkimDigester_finalizeBody
+
+/**
+ * update digest value with a canonicalized header field
+ * @return DSTAT_OK for success, otherwise status code that indicates error.
+ * @error DSTAT_SYSERR_DIGEST_UPDATE_FAILURE error on digest update (returned by OpenSSL EVP_DigestUpdate())
+ */
+static DkimStatus
+DkimDigester_updateCanonicalizedHeader(DkimDigester *self, const unsigned char *canonbuf,
+                                       size_t canonsize)
+{
+    // discard errors occurred in functions for debugging
+    (void) DkimDigester_dumpCanonicalizedHeader(self, canonbuf, canonsize);
+
+    if (0 == EVP_DigestUpdate(self->header_digest, canonbuf, canonsize)) {
+        DkimLogSysError("Digest update (of header) failed");
+        OpenSSL_logErrors();
+        return DSTAT_SYSERR_DIGEST_UPDATE_FAILURE;
+    }   // end if
+
+    return DSTAT_OK;
+}   // end function: DkimDigester_updateCanonicalizedHeader
+
 /**
  * update digest value of message header
  * @param self DkimDigester object
@@ -359,17 +567,7 @@ DkimDigester_updateHeader(DkimDigester *self, const char *headerf, const char *h
     if (DSTAT_OK != canon_stat) {
         return canon_stat;
     }   // end if
-
-    // discard errors occurred in functions for debugging
-    (void) DkimDigester_dumpCanonicalizedHeader(self, canonbuf, canonsize);
-
-    if (0 == EVP_DigestUpdate(self->header_digest, canonbuf, canonsize)) {
-        DkimLogSysError("Digest update (of header) failed");
-        OpenSSL_logErrors();
-        return DSTAT_SYSERR_DIGEST_UPDATE_FAILURE;
-    }   // end if
-
-    return DSTAT_OK;
+    return DkimDigester_updateCanonicalizedHeader(self, canonbuf, canonsize);
 }   // end function: DkimDigester_updateHeader
 
 /**
@@ -378,6 +576,8 @@ DkimDigester_updateHeader(DkimDigester *self, const char *headerf, const char *h
  * @param headers InetMailHeaders object that stores all headers.
  * @param signed_headers The names of the header fields included in the digest of the signature.
  *                       The parsed sig-h-tag itself.
+ * @param hcache DkimHeaderCache object to share the canonicalized header fields with
+ *               the other signatures of the message, NULL not to share.
  * @return DSTAT_OK for success, otherwise status code that indicates error.
  * @error DSTAT_SYSERR_NORESOURCE memory allocation error
  * @error DSTAT_SYSERR_IMPLERROR obvious implementation error
@@ -385,34 +585,22 @@ DkimDigester_updateHeader(DkimDigester *self, const char *headerf, const char *h
  */
 static DkimStatus
 DkimDigester_updateSignedHeaders(DkimDigester *self, const InetMailHeaders *headers,
-                                 const StrArray *signed_headers)
+                                 const StrArray *signed_headers, DkimHeaderCache *hcache)
 {
-    size_t n;
-    DkimStatus final_stat;
-
-    StrPairList *kvl = StrPairList_new();
-    if (NULL == kvl) {
-        LogNoResource();
-        return DSTAT_SYSERR_NORESOURCE;
-    }   // end if
-
-    // make a shallow copy of "headers"
-    StrPairListItem *cur = StrPairList_tail(kvl);
-    size_t headernum = InetMailHeaders_getCount(headers);
-    for (n = 0; n < headernum; ++n) {
-        const char *key, *val;
-        InetMailHeaders_get(headers, n, &key, &val);
-        cur = StrPairList_insertShallowly(kvl, cur, key, val);
-        if (NULL == cur) {
-            LogNoResource();
-            final_stat = DSTAT_SYSERR_NORESOURCE;
-            goto finally;
-        }   // end if
-    }   // end if
+    /*
+     * one cursor per header field name, walking the instances of the name
+     * from the bottom of the header block to the top.
+     * the cursors are kept on the stack unless the sig-h-tag has too many distinct names.
+     */
+    DkimHeaderCursor stack_cursor[DKIM_DIGESTER_CURSOR_NUM];
+    DkimHeaderCursor *cursor = stack_cursor;
+    size_t cursor_capacity = DKIM_DIGESTER_CURSOR_NUM;
+    size_t cursor_num = 0;
+    DkimStatus final_stat = DSTAT_OK;
 
     // choose header fields according to "signed_headers"
     size_t signed_header_num = StrArray_getCount(signed_headers);
-    for (n = 0; n < signed_header_num; ++n) {
+    for (size_t n = 0; n < signed_header_num; ++n) {
         const char *headerf = StrArray_get(signed_headers, n);
         /*
          * [RFC6376] 5.4.2.
@@ -424,17 +612,68 @@ DkimDigester_updateSignedHeaders(DkimDigester *self, const InetMailHeaders *head
          * DKIM-Signature header field and MUST sign such header fields in order
          * from the bottom of the header field block to the top.
          */
-        cur = StrPairList_rfindIgnoreCaseByKey(kvl, headerf, NULL);
-        if (NULL != cur) {
-            DkimStatus
-              update_stat = DkimDigester_updateHeader(self, StrPairListItem_key(cur),
-                                                      StrPairListItem_value(cur), true,
-                                                      self->keep_leading_header_space);
+        int first = InetMailHeaders_getFirstIndex(headers, headerf);
+        size_t c = 0;
+        if (0 <= first) {
+            // the index of the first instance identifies the header field name
+            for (; c < cursor_num && first != cursor[c].first; ++c);
+            if (c == cursor_num) {
+                if (cursor_capacity <= cursor_num) {
+                    // there are never more distinct names than the entries of the sig-h-tag
+                    DkimHeaderCursor *newcursor =
+                        (DkimHeaderCursor *) malloc(sizeof(DkimHeaderCursor) * signed_header_num);
+                    if (NULL == newcursor) {
+                        LogNoResource();
+                        final_stat = DSTAT_SYSERR_NORESOURCE;
+                        goto finally;
+                    }   // end if
+                    memcpy(newcursor, cursor, sizeof(DkimHeaderCursor) * cursor_num);
+                    if (stack_cursor != cursor) {
+                        free(cursor);
+                    }   // end if
+                    cursor = newcursor;
+                    cursor_capacity = signed_header_num;
+                }   // end if
+                cursor[c].first = first;
+                cursor[c].next = InetMailHeaders_getLastIndex(headers, headerf);
+                ++cursor_num;
+            }   // end if
+        }   // end if
+
+        if (0 <= first && 0 <= cursor[c].next) {
+            int pos = cursor[c].next;
+            cursor[c].next = InetMailHeaders_getPrevIndex(headers, pos);
+            const unsigned char *canonbuf;
+            size_t canonsize;
+            if (NULL == hcache
+                || !DkimHeaderCache_lookup(hcache, pos, self->header_canon_alg, &canonbuf,
+                                           &canonsize)) {
+                const char *key, *val;
+                InetMailHeaders_get(headers, pos, &key, &val);
+                DkimStatus canon_stat =
+                    DkimCanonicalizer_header(self->canon, key, val, true,
+                                             self->keep_leading_header_space, &canonbuf,
+                                             &canonsize);
+                if (DSTAT_OK != canon_stat) {
+                    final_stat = canon_stat;
+                    goto finally;
+                }   // end if
+                if (NULL != hcache) {
+                    DkimStatus store_stat =
+                        DkimHeaderCache_store(hcache, pos, self->header_canon_alg, canonbuf,
+                                              canonsize);
+                    if (DSTAT_OK != store_stat) {
+                        final_stat = store_stat;
+                        goto finally;
+                    }   // end if
+                }   // end if
+            }   // end if
+            DkimStatus update_stat =
+                DkimDigester_updateCanonicalizedHeader(self, canonbuf, canonsize);
             if (DSTAT_OK != update_stat) {
                 final_stat = update_stat;
                 goto finally;
             }   // end if
-            StrPairList_deleteShallowly(kvl, cur);
         } else {
             /*
              * treat as the null string if the header field specified by the sig-h-tag does not exist.
@@ -449,13 +688,14 @@ DkimDigester_updateSignedHeaders(DkimDigester *self, const InetMailHeaders *head
              * value, all punctuation, and the trailing CRLF).
              */
         }   // end if
-    }   // end if
-    final_stat = DSTAT_OK;
+    }   // end for
 
   finally:
-    StrPairList_freeShallowly(kvl);
+    if (stack_cursor != cursor) {
+        free(cursor);
+    }   // end if
     return final_stat;
-}   // end function: DkimDigester_digestHeaders
+}   // end function: DkimDigester_updateSignedHeaders
 
 /**
  * update the digest with the DKIM-Signature header
@@ -500,31 +740,61 @@ DkimDigester_updateSignatureHeader(DkimDigester *self, const DkimSignature *sign
 }   // end function: DkimDigester_updateSignatureHeader
 
 /**
- * compare the digests of the message headers and body to the digest value included in the DKIM-Signature headers
+ * compare the digest of the message body to the digest value included in the DKIM-Signature header.
+ * the body digest is finalized on the first call, so no more body can be added afterwards.
+ * @param signature DkimSignature object to verify
+ * @return DSTAT_OK if the digest value of message body matches,
+ *         otherwise status code that indicates error.
+ * @error DSTAT_PERMFAIL_BODY_HASH_DID_NOT_VERIFY the digest value of the message body does not match
+ * @error other errors
+ */
+DkimStatus
+DkimDigester_checkBodyHash(DkimDigester *self, const DkimSignature *signature)
+{
+    assert(NULL != self);
+    assert(NULL != signature);
+
+    // Calculation and verification of the message body hash.
+    // the body digest shared with the leader is finalized by the first one of the followers.
+    DkimDigester *body_owner = NULL != self->body_leader ? self->body_leader : self;
+    DkimStatus ret = DkimDigester_finalizeBody(body_owner);
+    if (DSTAT_OK != ret) {
+        return ret;
+    }   // end if
+
+    const XBuffer *bodyhash = DkimSignature_getBodyHash(signature);
+    if (!XBuffer_compareToBytes(bodyhash, body_owner->body_md, body_owner->body_mdlen)) {
+        DkimLogPermFail("Digest of message body mismatch");
+        return DSTAT_PERMFAIL_BODY_HASH_DID_NOT_VERIFY;
+    }   // end if
+    return DSTAT_OK;
+}   // end function: DkimDigester_checkBodyHash
+
+/**
+ * compare the digest of the message body to the digest value included in the DKIM-Signature header,
+ * and compute the digest of the message headers.
+ * the signature is verified by DkimDigester_verifySignature() afterwards.
  * @param headers InetMailHeaders object that stores all headers.
  * @param signature DkimSignature object to verify
  * @param pkey public key
- * @return DSTAT_INFO_DIGEST_MATCH if the digest value of message header fields and body matches,
+ * @param hcache DkimHeaderCache object shared among the signatures of the message,
+ *               may be NULL. The header fields must be canonicalized with the same
+ *               keep_leading_header_space setting for all the users of the cache.
+ * @return DSTAT_OK if the digest value of message body matches,
  *         otherwise status code that indicates error.
- * @error DSTAT_PERMFAIL_SIGNATURE_DID_NOT_VERIFY the digest value of the message header fields does not match
  * @error DSTAT_PERMFAIL_BODY_HASH_DID_NOT_VERIFY the digest value of the message body does not match
  * @error other errors
  */
 DkimStatus
-DkimDigester_verifyMessage(DkimDigester *self, const InetMailHeaders *headers,
-                           const DkimSignature *signature, EVP_PKEY *publickey)
+DkimDigester_digestMessage(DkimDigester *self, const InetMailHeaders *headers,
+                           const DkimSignature *signature, EVP_PKEY *publickey,
+                           DkimHeaderCache *hcache)
 {
     assert(NULL != self);
     assert(NULL != headers);
     assert(NULL != signature);
     assert(NULL != publickey);
 
-    const unsigned char *canonbuf;
-    const unsigned char *signbuf;
-    size_t canonsize, signlen;
-    unsigned char md[EVP_MD_size(self->digest_alg)];    // EVP_MAX_MD_SIZE instead of EVP_MD_size() is safer(?)
-    unsigned int mdlen;
-
     // check if the type of the public key is suitable for the algorithm
     // specified by sig-a-tag of the DKIM-Signature header.
     if (EVP_PKEY_base_id(publickey) != self->pubkey_alg) {
@@ -533,34 +803,16 @@ DkimDigester_verifyMessage(DkimDigester *self, const InetMailHeaders *headers,
         return DSTAT_PERMFAIL_PUBLICKEY_TYPE_MISMATCH;
     }   // end if
 
-    // Calculation and verification of the message body hash.
-    // Flush the canonicalization buffer and finalize canonicalization.
-    DkimStatus ret = DkimCanonicalizer_finalizeBody(self->canon, &canonbuf, &canonsize);
-    if (DSTAT_OK != ret) {
-        return ret;
-    }   // end if
-    // Add the final chunk of the message body into the digest.
-    ret = DkimDigester_updateBodyChunk(self, canonbuf, canonsize);
+    // Comparing the digest of the message body prior to the verification of the signature
+    DkimStatus ret = DkimDigester_checkBodyHash(self, signature);
     if (DSTAT_OK != ret) {
         return ret;
     }   // end if
-    if (0 == EVP_DigestFinal(self->body_digest, md, &mdlen)) {
-        DkimLogSysError("Digest finish (of body) failed");
-        OpenSSL_logErrors();
-        return DSTAT_SYSERR_DIGEST_UPDATE_FAILURE;
-    }   // end if
-
-    // Comparing the digest of the message body prior to the verification of the signature
-    const XBuffer *bodyhash = DkimSignature_getBodyHash(signature);
-    if (!XBuffer_compareToBytes(bodyhash, md, mdlen)) {
-        DkimLogPermFail("Digest of message body mismatch");
-        return DSTAT_PERMFAIL_BODY_HASH_DID_NOT_VERIFY;
-    }   // end if
 
     // Add the headers specified by sig-h-tag into the digest.
     ret =
         DkimDigester_updateSignedHeaders(self, headers,
-                                         DkimSignature_getSignedHeaderFields(signature));
+                                         DkimSignature_getSignedHeaderFields(signature), hcache);
     if (DSTAT_OK != ret) {
         return ret;
     }   // end if
@@ -573,9 +825,32 @@ DkimDigester_verifyMessage(DkimDigester *self, const InetMailHeaders *headers,
     // discard errors occurred in functions for debugging
     (void) DkimDigester_closeC14nDump(self);
 
+    return DSTAT_OK;
+}   // end function: DkimDigester_digestMessage
+
+/**
+ * verify the signature against the digest of the message headers computed by
+ * DkimDigester_digestMessage().
+ * this involves only the public key operation and the DkimDigester object,
+ * so it may be called on another thread.
+ * @param signature DkimSignature object to verify
+ * @param pkey public key
+ * @return DSTAT_INFO_DIGEST_MATCH if the signature is correct,
+ *         otherwise status code that indicates error.
+ * @error DSTAT_PERMFAIL_SIGNATURE_DID_NOT_VERIFY the digest value of the message header fields does not match
+ * @error other errors
+ */
+DkimStatus
+DkimDigester_verifySignature(DkimDigester *self, const DkimSignature *signature,
+                             EVP_PKEY *publickey)
+{
+    assert(NULL != self);
+    assert(NULL != signature);
+    assert(NULL != publickey);
+
     const XBuffer *headerhash = DkimSignature_getSignatureValue(signature);
-    signbuf = (const unsigned char *) XBuffer_getBytes(headerhash);
-    signlen = XBuffer_getSize(headerhash);
+    const unsigned char *signbuf = (const unsigned char *) XBuffer_getBytes(headerhash);
+    size_t signlen = XBuffer_getSize(headerhash);
     int vret = EVP_VerifyFinal(self->header_digest, signbuf, signlen, publickey);
     // EVP_VerifyFinal() returns 1 for a correct signature, 0 for failure and -1 if some other error occurred.
     switch (vret) {
@@ -593,6 +868,30 @@ DkimDigester_verifyMessage(DkimDigester *self, const InetMailHeaders *headers,
         OpenSSL_logErrors();
         return DSTAT_SYSERR_IMPLERROR;
     }   // end switch
+}   // end function: DkimDigester_verifySignature
+
+/**
+ * compare the digests of the message headers and body to the digest value included in the DKIM-Signature headers
+ * @param headers InetMailHeaders object that stores all headers.
+ * @param signature DkimSignature object to verify
+ * @param pkey public key
+ * @param hcache DkimHeaderCache object shared among the signatures of the message, may be NULL.
+ * @return DSTAT_INFO_DIGEST_MATCH if the digest value of message header fields and body matches,
+ *         otherwise status code that indicates error.
+ * @error DSTAT_PERMFAIL_SIGNATURE_DID_NOT_VERIFY the digest value of the message header fields does not match
+ * @error DSTAT_PERMFAIL_BODY_HASH_DID_NOT_VERIFY the digest value of the message body does not match
+ * @error other errors
+ */
+DkimStatus
+DkimDigester_verifyMessage(DkimDigester *self, const InetMailHeaders *headers,
+                           const DkimSignature *signature, EVP_PKEY *publickey,
+                           DkimHeaderCache *hcache)
+{
+    DkimStatus ret = DkimDigester_digestMessage(self, headers, signature, publickey, hcache);
+    if (DSTAT_OK != ret) {
+        return ret;
+    }   // end if
+    return DkimDigester_verifySignature(self, signature, publickey);
 }   // end function: DkimDigester_verifyMessage
 
 /**
@@ -638,7 +937,7 @@ DkimDigester_signMessage(DkimDigester *self, const InetMailHeaders *headers,
     unsigned char bodyhashbuf[EVP_MD_size(self->digest_alg)];   // EVP_MAX_MD_SIZE instead of EVP_MD_size() is safer(?)
     unsigned int bodyhashlen;
     bodyhashlen = EVP_MD_size(self->digest_alg);
-    if (0 == EVP_DigestFinal(self->body_digest, bodyhashbuf, &bodyhashlen)) {
+    if (0 == EVP_DigestFinal_ex(self->body_digest, bodyhashbuf, &bodyhashlen)) {
         DkimLogSysError("DigestFinal (of body) failed");
         OpenSSL_logErrors();
         return DSTAT_SYSERR_DIGEST_UPDATE_FAILURE;
@@ -651,7 +950,7 @@ DkimDigester_signMessage(DkimDigester *self, const InetMailHeaders *headers,
     // calculation of the message headers hash
     ret =
         DkimDigester_updateSignedHeaders(self, headers,
-                                         DkimSignature_getSignedHeaderFields(signature));
+                                         DkimSignature_getSignedHeaderFields(signature), NULL);
     if (DSTAT_OK != ret) {
         return ret;
     }   // end if
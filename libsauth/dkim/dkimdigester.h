@@ -18,6 +18,7 @@
 #include "inetmailheaders.h"
 #include "dkim.h"
 #include "dkimsignature.h"
+#include "dkimheadercache.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,8 +35,20 @@ extern DkimStatus DkimDigester_newWithSignature(const DkimSignature *signature,
                                                 DkimDigester **digester);
 extern void DkimDigester_free(DkimDigester *self);
 extern DkimStatus DkimDigester_updateBody(DkimDigester *self, const unsigned char *buf, size_t len);
+extern bool DkimDigester_shareBody(DkimDigester *self, DkimDigester *leader);
+extern bool DkimDigester_canDeferBody(const DkimDigester *self);
+extern void DkimDigester_deferBody(DkimDigester *self);
+extern void DkimDigester_flushBodies(DkimDigester *const digesters[], size_t num);
+extern bool DkimDigester_needsBody(const DkimDigester *self);
+extern DkimStatus DkimDigester_checkBodyHash(DkimDigester *self, const DkimSignature *signature);
+extern DkimStatus DkimDigester_digestMessage(DkimDigester *self, const InetMailHeaders *headers,
+                                             const DkimSignature *signature, EVP_PKEY *pkey,
+                                             DkimHeaderCache *hcache);
+extern DkimStatus DkimDigester_verifySignature(DkimDigester *self, const DkimSignature *signature,
+                                               EVP_PKEY *pkey);
 extern DkimStatus DkimDigester_verifyMessage(DkimDigester *self, const InetMailHeaders *headers,
-                                             const DkimSignature *signature, EVP_PKEY *pkey);
+                                             const DkimSignature *signature, EVP_PKEY *pkey,
+                                             DkimHeaderCache *hcache);
 extern DkimStatus DkimDigester_signMessage(DkimDigester *self, const InetMailHeaders *headers,
                                            DkimSignature *signature, EVP_PKEY *pkey);
 extern DkimStatus DkimDigester_enableC14nDump(DkimDigester *self, const char *fnHeaderDump,
@@ -128,6 +128,7 @@ static const DkimStatusMap dstat_description_table[] = {
     {DSTAT_PERMFAIL_KEY_REVOKED, "key revoked"},
     {DSTAT_PERMFAIL_INAPPROPRIATE_HASH_ALGORITHM, "inappropriate hash algorithm"},
     {DSTAT_PERMFAIL_INAPPROPRIATE_KEY_ALGORITHM, "inappropriate key algorithm"},
+    {DSTAT_POLICY_VERIFICATION_SKIPPED, "signature not verified"},
     {0, NULL},
 };
 
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2006-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "loghandler.h"
+#include "xbuffer.h"
+#include "dkimheadercache.h"
+
+// the header canonicalization algorithms to be cached, "simple" and "relaxed"
+#define DKIM_HEADER_CACHE_ALG_NUM 2
+#define DKIM_HEADER_CACHE_NONE SIZE_MAX
+
+typedef struct DkimHeaderCacheEntry {
+    size_t offset;  // the offset of the canonicalized header field in the buffer
+    size_t len;     // the length of the canonicalized header field, DKIM_HEADER_CACHE_NONE if not cached
+} DkimHeaderCacheEntry;
+
+/*
+ * canonicalized header fields of a message, shared among the verification frames.
+ * an entry is identified by the position of the header field in the InetMailHeaders object
+ * and the header canonicalization algorithm.
+ * the header fields are canonicalized with the trailing CRLF under the same
+ * keep_leading_header_space setting, as the frames of a DkimVerifier object do.
+ * the canonicalized bytes are kept in a single buffer and referred to by offset.
+ */
+struct DkimHeaderCache {
+    size_t header_num;
+    DkimHeaderCacheEntry *entry;    // header_num * DKIM_HEADER_CACHE_ALG_NUM entries
+    XBuffer *buf;
+};
+
+static DkimHeaderCacheEntry *
+DkimHeaderCache_getEntry(const DkimHeaderCache *self, size_t pos, DkimC14nAlgorithm canon_alg)
+{
+    if (self->header_num <= pos) {
+        return NULL;
+    }   // end if
+    switch (canon_alg) {
+    case DKIM_C14N_ALGORITHM_SIMPLE:
+        return &(self->entry[pos * DKIM_HEADER_CACHE_ALG_NUM]);
+    case DKIM_C14N_ALGORITHM_RELAXED:
+        return &(self->entry[pos * DKIM_HEADER_CACHE_ALG_NUM + 1]);
+    default:
+        return NULL;
+    }   // end switch
+}   // end function: DkimHeaderCache_getEntry
+
+/**
+ * Looks up a canonicalized header field.
+ * @param pos the position of the header field in the InetMailHeaders object.
+ * @param canonbuf receives the canonicalized header field,
+ *                 valid until the next call of DkimHeaderCache_store().
+ * @return true if the header field is cached, false otherwise.
+ */
+bool
+DkimHeaderCache_lookup(const DkimHeaderCache *self, size_t pos, DkimC14nAlgorithm canon_alg,
+                       const unsigned char **canonbuf, size_t *canonsize)
+{
+    assert(NULL != self);
+
+    const DkimHeaderCacheEntry *entry = DkimHeaderCache_getEntry(self, pos, canon_alg);
+    if (NULL == entry || DKIM_HEADER_CACHE_NONE == entry->len) {
+        return false;
+    }   // end if
+    *canonbuf = (const unsigned char *) XBuffer_getBytes(self->buf) + entry->offset;
+    *canonsize = entry->len;
+    return true;
+}   // end function: DkimHeaderCache_lookup
+
+/**
+ * Keeps a canonicalized header field.
+ * Header fields out of range or canonicalized by the other algorithms are silently ignored.
+ * @param pos the position of the header field in the InetMailHeaders object.
+ * @return DSTAT_OK for success, otherwise status code that indicates error.
+ * @error DSTAT_SYSERR_NORESOURCE memory allocation error
+ */
+DkimStatus
+DkimHeaderCache_store(DkimHeaderCache *self, size_t pos, DkimC14nAlgorithm canon_alg,
+                      const unsigned char *canonbuf, size_t canonsize)
+{
+    assert(NULL != self);
+
+    DkimHeaderCacheEntry *entry = DkimHeaderCache_getEntry(self, pos, canon_alg);
+    if (NULL == entry) {
+        return DSTAT_OK;
+    }   // end if
+    size_t offset = XBuffer_getSize(self->buf);
+    if (0 > XBuffer_appendBytes(self->buf, canonbuf, canonsize)) {
+        LogNoResource();
+        return DSTAT_SYSERR_NORESOURCE;
+    }   // end if
+    entry->offset = offset;
+    entry->len = canonsize;
+    return DSTAT_OK;
+}   // end function: DkimHeaderCache_store
+
+/**
+ * release DkimHeaderCache object
+ * @param self DkimHeaderCache object to release
+ */
+void
+DkimHeaderCache_free(DkimHeaderCache *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    XBuffer_free(self->buf);
+    free(self->entry);
+    free(self);
+}   // end function: DkimHeaderCache_free
+
+/**
+ * create DkimHeaderCache object
+ * @param header_num the number of the header fields of the message.
+ * @return initialized DkimHeaderCache object, or NULL if memory allocation failed.
+ */
+DkimHeaderCache *
+DkimHeaderCache_new(size_t header_num)
+{
+    DkimHeaderCache *self = (DkimHeaderCache *) malloc(sizeof(DkimHeaderCache));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(DkimHeaderCache));
+    self->header_num = header_num;
+    self->entry =
+        (DkimHeaderCacheEntry *) malloc(sizeof(DkimHeaderCacheEntry) * DKIM_HEADER_CACHE_ALG_NUM
+                                        * (0 < header_num ? header_num : 1));
+    self->buf = XBuffer_new(4096);
+    if (NULL == self->entry || NULL == self->buf) {
+        DkimHeaderCache_free(self);
+        return NULL;
+    }   // end if
+    for (size_t i = 0; i < header_num * DKIM_HEADER_CACHE_ALG_NUM; ++i) {
+        self->entry[i].offset = 0;
+        self->entry[i].len = DKIM_HEADER_CACHE_NONE;
+    }   // end for
+    return self;
+}   // end function: DkimHeaderCache_new
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2006-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __DKIM_HEADER_CACHE_H__
+#define __DKIM_HEADER_CACHE_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "dkim.h"
+#include "dkimenum.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct DkimHeaderCache DkimHeaderCache;
+
+extern DkimHeaderCache *DkimHeaderCache_new(size_t header_num);
+extern void DkimHeaderCache_free(DkimHeaderCache *self);
+extern bool DkimHeaderCache_lookup(const DkimHeaderCache *self, size_t pos,
+                                   DkimC14nAlgorithm canon_alg, const unsigned char **canonbuf,
+                                   size_t *canonsize);
+extern DkimStatus DkimHeaderCache_store(DkimHeaderCache *self, size_t pos,
+                                        DkimC14nAlgorithm canon_alg,
+                                        const unsigned char *canonbuf, size_t canonsize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DKIM_HEADER_CACHE_H__ */
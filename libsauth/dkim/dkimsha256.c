@@ -0,0 +1,548 @@
+/*
+ * Copyright (c) 2006-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * Multi-buffer SHA-256 for the body digests of the DKIM signatures of a message.
+ * The body digests which cannot be shared (with different canonicalization, l= tag)
+ * are hashed over almost the same data, so their blocks are compressed together:
+ * two at a time interleaved with the SHA extensions (SHA-NI), or eight at a time
+ * in the SIMD lanes of AVX2. The engine is chosen by CPUID at run time.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+# define DKIM_SHA256_X86
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
+#include "stdaux.h"
+#include "dkimsha256.h"
+
+// the number of the contexts compressed at once with AVX2
+#define DKIM_SHA256_AVX2_LANES 8
+// the number of the contexts from which AVX2 outruns hashing each of them alone
+#define DKIM_SHA256_AVX2_MIN_LANES 4
+
+typedef enum DkimSha256Engine {
+    DKIM_SHA256_ENGINE_SCALAR,
+    DKIM_SHA256_ENGINE_AVX2,
+    DKIM_SHA256_ENGINE_SHANI,
+} DkimSha256Engine;
+
+static pthread_once_t DkimSha256_engine_once = PTHREAD_ONCE_INIT;
+static DkimSha256Engine DkimSha256_engine = DKIM_SHA256_ENGINE_SCALAR;
+
+static const uint32_t DkimSha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t DkimSha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define DKIM_SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static uint32_t
+DkimSha256_load32(const unsigned char *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8)
+        | (uint32_t) p[3];
+}   // end function: DkimSha256_load32
+
+static void
+DkimSha256_compressScalar(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+    for (; 0 < blocks; --blocks, data += DKIM_SHA256_BLOCK_SIZE) {
+        uint32_t w[64];
+        for (int t = 0; t < 16; ++t) {
+            w[t] = DkimSha256_load32(data + 4 * t);
+        }   // end for
+        for (int t = 16; t < 64; ++t) {
+            uint32_t s0 = DKIM_SHA256_ROTR(w[t - 15], 7) ^ DKIM_SHA256_ROTR(w[t - 15], 18)
+                ^ (w[t - 15] >> 3);
+            uint32_t s1 = DKIM_SHA256_ROTR(w[t - 2], 17) ^ DKIM_SHA256_ROTR(w[t - 2], 19)
+                ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }   // end for
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t < 64; ++t) {
+            uint32_t t1 = h + (DKIM_SHA256_ROTR(e, 6) ^ DKIM_SHA256_ROTR(e, 11)
+                               ^ DKIM_SHA256_ROTR(e, 25))
+                + ((e & f) ^ (~e & g)) + DkimSha256_k[t] + w[t];
+            uint32_t t2 = (DKIM_SHA256_ROTR(a, 2) ^ DKIM_SHA256_ROTR(a, 13)
+                           ^ DKIM_SHA256_ROTR(a, 22))
+                + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }   // end for
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }   // end for
+}   // end function: DkimSha256_compressScalar
+
+#ifdef DKIM_SHA256_X86
+
+#define DKIM_SHA256_TARGET_SHANI __attribute__((target("sha,sse4.1")))
+#define DKIM_SHA256_TARGET_AVX2 __attribute__((target("avx2")))
+
+/*
+ * the state of a context being compressed with SHA-NI
+ */
+typedef struct DkimSha256NiLane {
+    __m128i abef;
+    __m128i cdgh;
+    __m128i msg[4];
+} DkimSha256NiLane;
+
+static inline __attribute__((always_inline)) DKIM_SHA256_TARGET_SHANI void
+DkimSha256_niLoad(DkimSha256NiLane *lane, const uint32_t *state)
+{
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0xb1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (state + 4)), 0x1b);
+    lane->abef = _mm_alignr_epi8(cdab, efgh, 8);
+    lane->cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+}   // end function: DkimSha256_niLoad
+
+static inline __attribute__((always_inline)) DKIM_SHA256_TARGET_SHANI void
+DkimSha256_niStore(const DkimSha256NiLane *lane, uint32_t *state)
+{
+    __m128i feba = _mm_shuffle_epi32(lane->abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(lane->cdgh, 0xb1);
+    _mm_storeu_si128((__m128i *) state, _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128((__m128i *) (state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}   // end function: DkimSha256_niStore
+
+/*
+ * rounds 4 * group to 4 * group + 3 of a block
+ */
+static inline __attribute__((always_inline)) DKIM_SHA256_TARGET_SHANI void
+DkimSha256_niRounds(DkimSha256NiLane *lane, const unsigned char *block, int group)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i *msg = lane->msg;
+    if (group < 4) {
+        msg[group] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (block + 16 * group)),
+                                      bswap);
+    } else {
+        __m128i tmp = _mm_sha256msg1_epu32(msg[group & 3], msg[(group + 1) & 3]);
+        tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[(group + 3) & 3], msg[(group + 2) & 3], 4));
+        msg[group & 3] = _mm_sha256msg2_epu32(tmp, msg[(group + 3) & 3]);
+    }   // end if
+    __m128i wk = _mm_add_epi32(msg[group & 3],
+                               _mm_loadu_si128((const __m128i *) (DkimSha256_k + 4 * group)));
+    lane->cdgh = _mm_sha256rnds2_epu32(lane->cdgh, lane->abef, wk);
+    lane->abef = _mm_sha256rnds2_epu32(lane->abef, lane->cdgh, _mm_shuffle_epi32(wk, 0x0e));
+}   // end function: DkimSha256_niRounds
+
+/*
+ * compresses the same number of blocks of nlanes contexts, interleaving the rounds
+ * to hide the latency of the SHA instructions.
+ */
+static inline __attribute__((always_inline)) DKIM_SHA256_TARGET_SHANI void
+DkimSha256_compressNiLanes(uint32_t *const state[], const unsigned char *const data[],
+                           int nlanes, size_t blocks)
+{
+    DkimSha256NiLane lane[2];
+    for (int i = 0; i < nlanes; ++i) {
+        DkimSha256_niLoad(&lane[i], state[i]);
+    }   // end for
+    for (size_t offset = 0; 0 < blocks; --blocks, offset += DKIM_SHA256_BLOCK_SIZE) {
+        __m128i abef[2], cdgh[2];
+        for (int i = 0; i < nlanes; ++i) {
+            abef[i] = lane[i].abef;
+            cdgh[i] = lane[i].cdgh;
+        }   // end for
+#pragma GCC unroll 16
+        for (int group = 0; group < 16; ++group) {
+            for (int i = 0; i < nlanes; ++i) {
+                DkimSha256_niRounds(&lane[i], data[i] + offset, group);
+            }   // end for
+        }   // end for
+        for (int i = 0; i < nlanes; ++i) {
+            lane[i].abef = _mm_add_epi32(lane[i].abef, abef[i]);
+            lane[i].cdgh = _mm_add_epi32(lane[i].cdgh, cdgh[i]);
+        }   // end for
+    }   // end for
+    for (int i = 0; i < nlanes; ++i) {
+        DkimSha256_niStore(&lane[i], state[i]);
+    }   // end for
+}   // end function: DkimSha256_compressNiLanes
+
+static DKIM_SHA256_TARGET_SHANI void
+DkimSha256_compressNi(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+    DkimSha256_compressNiLanes(&state, &data, 1, blocks);
+}   // end function: DkimSha256_compressNi
+
+static DKIM_SHA256_TARGET_SHANI void
+DkimSha256_compressNiPair(uint32_t *const state[], const unsigned char *const data[],
+                          size_t blocks)
+{
+    DkimSha256_compressNiLanes(state, data, 2, blocks);
+}   // end function: DkimSha256_compressNiPair
+
+#define DKIM_SHA256_ROTR8X32(x, n) \
+    _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+/*
+ * transposes 8x8 matrix of 32-bit words in place.
+ */
+static inline __attribute__((always_inline)) DKIM_SHA256_TARGET_AVX2 void
+DkimSha256_transpose8x32(__m256i *r)
+{
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}   // end function: DkimSha256_transpose8x32
+
+/*
+ * compresses the same number of blocks of 8 contexts, one in each 32-bit lane.
+ */
+static DKIM_SHA256_TARGET_AVX2 void
+DkimSha256_compressAvx2(uint32_t *const state[], const unsigned char *const data[],
+                        size_t blocks)
+{
+    const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                          12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m256i s[8];
+    for (int i = 0; i < DKIM_SHA256_AVX2_LANES; ++i) {
+        s[i] = _mm256_loadu_si256((const __m256i *) state[i]);
+    }   // end for
+    DkimSha256_transpose8x32(s);
+
+    for (size_t offset = 0; 0 < blocks; --blocks, offset += DKIM_SHA256_BLOCK_SIZE) {
+        __m256i w[16];
+        for (int half = 0; half < 2; ++half) {
+            for (int i = 0; i < DKIM_SHA256_AVX2_LANES; ++i) {
+                w[8 * half + i] = _mm256_shuffle_epi8(
+                    _mm256_loadu_si256((const __m256i *) (data[i] + offset + 32 * half)), bswap);
+            }   // end for
+            DkimSha256_transpose8x32(w + 8 * half);
+        }   // end for
+
+        __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int t = 0; t < 64; ++t) {
+            if (16 <= t) {
+                __m256i w15 = w[(t - 15) & 15];
+                __m256i w2 = w[(t - 2) & 15];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(DKIM_SHA256_ROTR8X32(w15, 7),
+                                                               DKIM_SHA256_ROTR8X32(w15, 18)),
+                                              _mm256_srli_epi32(w15, 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(DKIM_SHA256_ROTR8X32(w2, 17),
+                                                               DKIM_SHA256_ROTR8X32(w2, 19)),
+                                              _mm256_srli_epi32(w2, 10));
+                w[t & 15] = _mm256_add_epi32(_mm256_add_epi32(w[t & 15], s0),
+                                             _mm256_add_epi32(w[(t - 7) & 15], s1));
+            }   // end if
+            __m256i sigma1 = _mm256_xor_si256(_mm256_xor_si256(DKIM_SHA256_ROTR8X32(e, 6),
+                                                               DKIM_SHA256_ROTR8X32(e, 11)),
+                                              DKIM_SHA256_ROTR8X32(e, 25));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, sigma1),
+                                          _mm256_add_epi32(_mm256_add_epi32(ch, w[t & 15]),
+                                                           _mm256_set1_epi32(DkimSha256_k[t])));
+            __m256i sigma0 = _mm256_xor_si256(_mm256_xor_si256(DKIM_SHA256_ROTR8X32(a, 2),
+                                                               DKIM_SHA256_ROTR8X32(a, 13)),
+                                              DKIM_SHA256_ROTR8X32(a, 22));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b),
+                                          _mm256_and_si256(c, _mm256_or_si256(a, b)));
+            h = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi32(d, t1);
+            d = c;
+            c = b;
+            b = a;
+            a = _mm256_add_epi32(t1, _mm256_add_epi32(sigma0, maj));
+        }   // end for
+        s[0] = _mm256_add_epi32(s[0], a);
+        s[1] = _mm256_add_epi32(s[1], b);
+        s[2] = _mm256_add_epi32(s[2], c);
+        s[3] = _mm256_add_epi32(s[3], d);
+        s[4] = _mm256_add_epi32(s[4], e);
+        s[5] = _mm256_add_epi32(s[5], f);
+        s[6] = _mm256_add_epi32(s[6], g);
+        s[7] = _mm256_add_epi32(s[7], h);
+    }   // end for
+
+    DkimSha256_transpose8x32(s);
+    for (int i = 0; i < DKIM_SHA256_AVX2_LANES; ++i) {
+        _mm256_storeu_si256((__m256i *) state[i], s[i]);
+    }   // end for
+}   // end function: DkimSha256_compressAvx2
+
+#endif
+
+static void
+DkimSha256_initEngine(void)
+{
+#ifdef DKIM_SHA256_X86
+    __builtin_cpu_init();
+    unsigned int eax, ebx, ecx, edx;
+    if (__builtin_cpu_supports("sse4.1") && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)
+        && (ebx & bit_SHA)) {
+        DkimSha256_engine = DKIM_SHA256_ENGINE_SHANI;
+    } else if (__builtin_cpu_supports("avx2")) {
+        DkimSha256_engine = DKIM_SHA256_ENGINE_AVX2;
+    }   // end if
+#endif
+}   // end function: DkimSha256_initEngine
+
+static DkimSha256Engine
+DkimSha256_getEngine(void)
+{
+    pthread_once(&DkimSha256_engine_once, DkimSha256_initEngine);
+    return DkimSha256_engine;
+}   // end function: DkimSha256_getEngine
+
+/*
+ * compresses blocks of a single context.
+ */
+static void
+DkimSha256_compress(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+#ifdef DKIM_SHA256_X86
+    if (DKIM_SHA256_ENGINE_SHANI == DkimSha256_getEngine()) {
+        DkimSha256_compressNi(state, data, blocks);
+        return;
+    }   // end if
+#endif
+    DkimSha256_compressScalar(state, data, blocks);
+}   // end function: DkimSha256_compress
+
+/*
+ * compresses the same number of blocks of the deferred data of nlanes contexts.
+ */
+static void
+DkimSha256_compressLanes(DkimSha256 *const lane[], size_t nlanes, size_t blocks)
+{
+#ifdef DKIM_SHA256_X86
+    switch (DkimSha256_getEngine()) {
+    case DKIM_SHA256_ENGINE_SHANI:
+        for (size_t i = 0; i + 1 < nlanes; i += 2) {
+            uint32_t *state[2] = { lane[i]->state, lane[i + 1]->state };
+            const unsigned char *data[2] = { lane[i]->pending, lane[i + 1]->pending };
+            DkimSha256_compressNiPair(state, data, blocks);
+        }   // end for
+        if (0 != nlanes % 2) {
+            DkimSha256_compressNi(lane[nlanes - 1]->state, lane[nlanes - 1]->pending, blocks);
+        }   // end if
+        return;
+    case DKIM_SHA256_ENGINE_AVX2:
+        if (1 < nlanes) {
+            // the unused lanes compress garbage of their own
+            uint32_t dummy_state[DKIM_SHA256_AVX2_LANES][8];
+            uint32_t *state[DKIM_SHA256_AVX2_LANES];
+            const unsigned char *data[DKIM_SHA256_AVX2_LANES];
+            for (size_t i = 0; i < DKIM_SHA256_AVX2_LANES; ++i) {
+                if (i < nlanes) {
+                    state[i] = lane[i]->state;
+                    data[i] = lane[i]->pending;
+                } else {
+                    memset(dummy_state[i], 0, sizeof(dummy_state[i]));
+                    state[i] = dummy_state[i];
+                    data[i] = lane[0]->pending;
+                }   // end if
+            }   // end for
+            DkimSha256_compressAvx2(state, data, blocks);
+            return;
+        }   // end if
+        break;
+    default:
+        break;
+    }   // end switch
+#endif
+    for (size_t i = 0; i < nlanes; ++i) {
+        DkimSha256_compressScalar(lane[i]->state, lane[i]->pending, blocks);
+    }   // end for
+}   // end function: DkimSha256_compressLanes
+
+/**
+ * check whether hashing num contexts together with DkimSha256_flush() is faster
+ * than hashing each of them alone with OpenSSL.
+ * @param num the number of the contexts hashed together
+ */
+bool
+DkimSha256_isMultiBufferEffective(size_t num)
+{
+    switch (DkimSha256_getEngine()) {
+    case DKIM_SHA256_ENGINE_SHANI:
+        return bool_cast(2 <= num);
+    case DKIM_SHA256_ENGINE_AVX2:
+        return bool_cast(DKIM_SHA256_AVX2_MIN_LANES <= num);
+    default:
+        return false;
+    }   // end switch
+}   // end function: DkimSha256_isMultiBufferEffective
+
+void
+DkimSha256_init(DkimSha256 *self)
+{
+    assert(NULL != self);
+    memset(self, 0, sizeof(DkimSha256));
+    memcpy(self->state, DkimSha256_iv, sizeof(self->state));
+}   // end function: DkimSha256_init
+
+/**
+ * pass data to the context, which is compressed by DkimSha256_flush() later.
+ * a partial block at the beginning may be compressed immediately.
+ * @param data the data to hash, which must be kept until DkimSha256_flush() returns.
+ */
+void
+DkimSha256_defer(DkimSha256 *self, const unsigned char *data, size_t len)
+{
+    assert(NULL != self);
+    assert(0 == self->pendinglen);
+
+    self->length += len;
+    if (0 < self->blocklen) {
+        size_t fill = DKIM_SHA256_BLOCK_SIZE - self->blocklen;
+        if (len < fill) {
+            memcpy(self->block + self->blocklen, data, len);
+            self->blocklen += len;
+            return;
+        }   // end if
+        memcpy(self->block + self->blocklen, data, fill);
+        DkimSha256_compress(self->state, self->block, 1);
+        self->blocklen = 0;
+        data += fill;
+        len -= fill;
+    }   // end if
+    self->pending = data;
+    self->pendinglen = len;
+}   // end function: DkimSha256_defer
+
+/**
+ * compress the data deferred by DkimSha256_defer() of num contexts,
+ * the whole blocks of which are compressed in parallel as long as any two of them remain.
+ */
+void
+DkimSha256_flush(DkimSha256 *const ctx[], size_t num)
+{
+    assert(NULL != ctx);
+
+    for (;;) {
+        DkimSha256 *lane[DKIM_SHA256_AVX2_LANES];
+        size_t nlanes = 0;
+        size_t blocks = SIZE_MAX;
+        for (size_t i = 0; i < num && nlanes < DKIM_SHA256_AVX2_LANES; ++i) {
+            size_t lane_blocks = ctx[i]->pendinglen / DKIM_SHA256_BLOCK_SIZE;
+            if (0 < lane_blocks) {
+                lane[nlanes++] = ctx[i];
+                blocks = MIN(blocks, lane_blocks);
+            }   // end if
+        }   // end for
+        if (0 == nlanes) {
+            break;
+        }   // end if
+        DkimSha256_compressLanes(lane, nlanes, blocks);
+        for (size_t i = 0; i < nlanes; ++i) {
+            lane[i]->pending += blocks * DKIM_SHA256_BLOCK_SIZE;
+            lane[i]->pendinglen -= blocks * DKIM_SHA256_BLOCK_SIZE;
+        }   // end for
+    }   // end for
+
+    // keep the partial blocks left
+    for (size_t i = 0; i < num; ++i) {
+        if (0 < ctx[i]->pendinglen) {
+            memcpy(ctx[i]->block, ctx[i]->pending, ctx[i]->pendinglen);
+            ctx[i]->blocklen = ctx[i]->pendinglen;
+        }   // end if
+        ctx[i]->pending = NULL;
+        ctx[i]->pendinglen = 0;
+    }   // end for
+}   // end function: DkimSha256_flush
+
+/**
+ * finalize the digest.
+ * @param md a buffer to receive the digest, at least DKIM_SHA256_DIGEST_SIZE octets.
+ */
+void
+DkimSha256_final(DkimSha256 *self, unsigned char *md)
+{
+    assert(NULL != self);
+    assert(NULL != md);
+
+    DkimSha256_flush(&self, 1);
+
+    uint64_t bitlen = self->length * 8;
+    self->block[self->blocklen++] = 0x80;
+    if (DKIM_SHA256_BLOCK_SIZE - 8 < self->blocklen) {
+        memset(self->block + self->blocklen, 0, DKIM_SHA256_BLOCK_SIZE - self->blocklen);
+        DkimSha256_compress(self->state, self->block, 1);
+        self->blocklen = 0;
+    }   // end if
+    memset(self->block + self->blocklen, 0, DKIM_SHA256_BLOCK_SIZE - 8 - self->blocklen);
+    for (int i = 0; i < 8; ++i) {
+        self->block[DKIM_SHA256_BLOCK_SIZE - 1 - i] = (unsigned char) (bitlen >> (8 * i));
+    }   // end for
+    DkimSha256_compress(self->state, self->block, 1);
+    self->blocklen = 0;
+
+    for (int i = 0; i < 8; ++i) {
+        md[4 * i] = (unsigned char) (self->state[i] >> 24);
+        md[4 * i + 1] = (unsigned char) (self->state[i] >> 16);
+        md[4 * i + 2] = (unsigned char) (self->state[i] >> 8);
+        md[4 * i + 3] = (unsigned char) self->state[i];
+    }   // end for
+}   // end function: DkimSha256_final
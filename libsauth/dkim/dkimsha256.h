@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2006-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __DKIM_SHA256_H__
+#define __DKIM_SHA256_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DKIM_SHA256_BLOCK_SIZE 64
+#define DKIM_SHA256_DIGEST_SIZE 32
+
+/*
+ * SHA-256 digest context whose data can be hashed together with those of the other contexts.
+ */
+typedef struct DkimSha256 {
+    uint32_t state[8];
+    /// the number of octets passed to the context so far
+    uint64_t length;
+    /// a partial block not compressed yet
+    unsigned char block[DKIM_SHA256_BLOCK_SIZE];
+    size_t blocklen;
+    /// the data deferred by DkimSha256_defer() until DkimSha256_flush()
+    const unsigned char *pending;
+    size_t pendinglen;
+} DkimSha256;
+
+extern bool DkimSha256_isMultiBufferEffective(size_t num);
+extern void DkimSha256_init(DkimSha256 *self);
+extern void DkimSha256_defer(DkimSha256 *self, const unsigned char *data, size_t len);
+extern void DkimSha256_flush(DkimSha256 *const ctx[], size_t num);
+extern void DkimSha256_final(DkimSha256 *self, unsigned char *md);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DKIM_SHA256_H__ */
@@ -144,3 +144,73 @@ DkimVerificationPolicy_setMaxClockSkew(DkimVerificationPolicy *self, time_t skew
     assert(NULL != self);
     self->max_clock_skew = skew;
 }   // end function: DkimVerificationPolicy_setMaxClockSkew
+
+/**
+ * Verifies the signatures on the worker threads of the pool.
+ * @param pool DkimCryptoPool object, which must outlive the policy. NULL to verify on the caller.
+ */
+void
+DkimVerificationPolicy_setCryptoPool(DkimVerificationPolicy *self, DkimCryptoPool *pool)
+{
+    assert(NULL != self);
+    self->crypto_pool = pool;
+}   // end function: DkimVerificationPolicy_setCryptoPool
+
+/**
+ * Hashes the message body on the worker threads of the pool set by
+ * DkimVerificationPolicy_setCryptoPool(), so that DkimVerifier_updateBody() returns
+ * without waiting for the hashing.
+ * @param queue_limit the number of octets of the message body which can be queued per message.
+ *                    0 to hash the body on the caller.
+ */
+void
+DkimVerificationPolicy_setBodyQueueLimit(DkimVerificationPolicy *self, size_t queue_limit)
+{
+    assert(NULL != self);
+    self->body_queue_limit = queue_limit;
+}   // end function: DkimVerificationPolicy_setBodyQueueLimit
+
+/**
+ * enable/disable the lazy verification mode.
+ * the signatures by the Author Domain are verified first, the ones by the domains
+ * aligned with the Author Domain in the DMARC relaxed mode next, the third-party signatures
+ * bearing "atps" tags for the Author Domain next, and then the others.
+ * the rest of the signatures are neither looked up their public keys nor verified
+ * once a signature by the Author Domain is valid, or once the signatures for ATPS are verified
+ * after a valid signature. their results become "policy".
+ * Disabled by default.
+ * @param enable true to enable the lazy verification mode, false to disable.
+ */
+void
+DkimVerificationPolicy_setLazyVerification(DkimVerificationPolicy *self, bool enable)
+{
+    assert(NULL != self);
+    self->lazy_verification = enable;
+}   // end function: DkimVerificationPolicy_setLazyVerification
+
+/**
+ * set the Public Suffix List to find the signatures aligned with the Author Domain
+ * in the lazy verification mode. no signatures are ranked as aligned without it.
+ * @param publicsuffix PublicSuffix object, which must outlive self. NULL to unset.
+ */
+void
+DkimVerificationPolicy_setPublicSuffix(DkimVerificationPolicy *self,
+                                       const PublicSuffix *publicsuffix)
+{
+    assert(NULL != self);
+    self->public_suffix = publicsuffix;
+}   // end function: DkimVerificationPolicy_setPublicSuffix
+
+/**
+ * enable/disable the body hash first mode.
+ * the public key of each signature is retrieved at DkimVerifier_verify()
+ * only if the body hash of the signature matches, instead of at DkimVerifier_new().
+ * Disabled by default.
+ * @param enable true to check the body hash first, false to retrieve the public keys first.
+ */
+void
+DkimVerificationPolicy_setBodyHashFirst(DkimVerificationPolicy *self, bool enable)
+{
+    assert(NULL != self);
+    self->body_hash_first = enable;
+}   // end function: DkimVerificationPolicy_setBodyHashFirst
@@ -14,6 +14,7 @@
 
 #include <sys/types.h>
 #include <stdbool.h>
+#include "dkim.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -41,6 +42,22 @@ struct DkimVerificationPolicy {
     unsigned int min_rsa_key_length;
     // Maximum number of seconds of clock skew to validate DKIM signatures.
     time_t max_clock_skew;
+    // worker threads to verify the signatures on, NULL to verify them on the caller.
+    // just a reference.
+    DkimCryptoPool *crypto_pool;
+    // the number of octets of the message body queued to be hashed on crypto_pool.
+    // 0 means the body is hashed on the caller.
+    size_t body_queue_limit;
+    // verifies the signatures by the Author Domain first, then the ones aligned with it,
+    // the ones for ATPS, and the others, and stops once a valid signature decides the outcome.
+    // the public keys are retrieved only for the signatures to verify.
+    bool lazy_verification;
+    // Public Suffix List to find the signatures aligned with the Author Domain
+    // in the lazy verification mode, NULL if not available. just a reference.
+    const PublicSuffix *public_suffix;
+    // checks the body hash of each signature before retrieving its public key,
+    // so that no public keys are retrieved for the signatures whose body hash does not match.
+    bool body_hash_first;
 };
 
 #ifdef __cplusplus
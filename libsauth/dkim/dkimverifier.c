@@ -42,7 +42,27 @@
 #include "dkimatps.h"
 #include "dkimsignature.h"
 #include "dkimdigester.h"
+#include "dkimsha256.h"
+#include "dkimheadercache.h"
+#include "dkimcryptopool.h"
+#include "dkimbodyqueue.h"
 #include "dkimverificationpolicy.h"
+#include "dmarc.h"
+
+// the number of the body digests DkimVerifier_hashBody() flushes at once
+#define DKIM_VERIFIER_FLUSH_NUM 8
+
+/*
+ * the groups of the signatures verified in order in the lazy verification mode.
+ * the signatures in the latter groups are verified only if none in the former ones is valid.
+ */
+typedef enum DkimVerificationRank {
+    DKIM_VERIFICATION_RANK_AUTHOR_DOMAIN = 0,   // signed by the Author Domain itself
+    DKIM_VERIFICATION_RANK_ALIGNED, // signed by the same Organizational Domain as the Author Domain
+    DKIM_VERIFICATION_RANK_ATPS,    // third-party signatures bearing "atps" tags for the Author Domain
+    DKIM_VERIFICATION_RANK_OTHERS,
+    DKIM_VERIFICATION_RANK_NUM,
+} DkimVerificationRank;
 
 typedef struct DkimVerificationFrame {
     /// status of the verification process for each DKIM-Signature header
@@ -55,6 +75,12 @@ typedef struct DkimVerificationFrame {
     DkimDigester *digester;
     /// DKIM verification results
     DkimFrameResult result;
+    /// job to verify the signature on DkimCryptoPool
+    DkimCryptoJob crypto_job;
+    /// true if the message has been verified against the signature, successfully or not
+    bool verified;
+    /// the order of the verification in the lazy verification mode
+    DkimVerificationRank rank;
 } DkimVerificationFrame;
 
 typedef struct DkimPolicyFrame {
@@ -87,6 +113,14 @@ struct DkimVerifier {
 
     /// reference to InetMailHeaders object
     const InetMailHeaders *headers;
+    /// canonicalized header fields shared among the verification frames, NULL if not shared
+    DkimHeaderCache *hcache;
+    /// the message body waiting to be hashed on DkimCryptoPool, NULL if hashed on the caller
+    DkimBodyQueue *bqueue;
+    /// true if the body is hashed on the caller
+    bool body_sync;
+    /// true if the body digests are hashed together by DkimDigester_flushBodies()
+    bool body_deferred;
     /// Array of DkimVerificationFrame
     DkimVerificationFrameArray *vframe;
     bool have_temporary_error;
@@ -210,6 +244,14 @@ DkimVerificationFrame_buildResult(DkimVerificationFrame *self)
          */
         self->result.score = DKIM_BASE_SCORE_PASS;
         break;
+    case DSTAT_POLICY_VERIFICATION_SKIPPED:
+        /*
+         * [RFC5451] 2.4.1.
+         * policy:  The message was signed but the signature or signatures were
+         *    not acceptable to the verifier.
+         */
+        self->result.score = DKIM_BASE_SCORE_POLICY;
+        break;
     case DSTAT_PERMFAIL_SIGNATURE_DID_NOT_VERIFY:
     case DSTAT_PERMFAIL_BODY_HASH_DID_NOT_VERIFY:
         /*
@@ -299,6 +341,9 @@ DkimVerifier_free(DkimVerifier *self)
     }   // end if
 
     // self->headers must not be released. it is just a reference.
+    // the body queue refers to the verification frames
+    DkimBodyQueue_free(self->bqueue);
+    DkimHeaderCache_free(self->hcache);
     DkimVerificationFrameArray_free(self->vframe);
     DkimPolicyFrameArray_free(self->pframe);
     free(self);
@@ -360,11 +405,15 @@ DkimVerifier_setupFrame(DkimVerifier *self, const char *headerf, const char *hea
                                              (frame->signature)),
          DkimEnum_lookupC14nAlgorithmByValue(DkimSignature_getBodyC14nAlgorithm(frame->signature)));
 
-    // retrieve public key
-    frame->status =
-        DkimPublicKey_lookup(self->vpolicy, frame->signature, self->resolver, &(frame->publickey));
-    if (DSTAT_OK != frame->status) {
-        return frame->status;
+    // retrieve public key, which is deferred to DkimVerifier_verify()
+    // in the lazy verification mode and the body hash first mode
+    if (!self->vpolicy->lazy_verification && !self->vpolicy->body_hash_first) {
+        frame->status =
+            DkimPublicKey_lookup(self->vpolicy, frame->signature, self->resolver,
+                                 &(frame->publickey));
+        if (DSTAT_OK != frame->status) {
+            return frame->status;
+        }   // end if
     }   // end if
 
     // create DkimDigester object
@@ -427,18 +476,10 @@ DkimVerifier_new(const DkimVerificationPolicy *vpolicy, DnsResolver *resolver,
     self->headers = headers;
 
     // setup verification frames as many as DKIM-Signature headers
-    size_t headernum = InetMailHeaders_getCount(self->headers);
-    for (size_t headeridx = 0; headeridx < headernum; ++headeridx) {
+    for (int headeridx = InetMailHeaders_getFirstIndex(self->headers, DKIM_SIGNHEADER);
+         0 <= headeridx; headeridx = InetMailHeaders_getNextIndex(self->headers, headeridx)) {
         const char *headerf, *headerv;
         InetMailHeaders_get(self->headers, headeridx, &headerf, &headerv);
-        if (NULL == headerf || NULL == headerv) {
-            continue;
-        }   // end if
-
-        if (0 != strcasecmp(DKIM_SIGNHEADER, headerf)) {
-            // headerf is not DKIM-Signature
-            continue;
-        }   // end if
 
         // A DKIM-Signature header is found
         ++(self->sigheader_num);
@@ -479,6 +520,123 @@ DkimVerifier_new(const DkimVerificationPolicy *vpolicy, DnsResolver *resolver,
     return self->status = DSTAT_OK;
 }   // end function: DkimVerifier_new
 
+/*
+ * DkimBodyQueue_consumer to update the body digest of each verification frame,
+ * which may run on a worker thread.
+ */
+static void
+DkimVerifier_hashBody(void *arg, const unsigned char *bodyp, size_t len)
+{
+    DkimVerifier *self = (DkimVerifier *) arg;
+
+    // update digest for each verification frame
+    size_t framenum = DkimVerificationFrameArray_getCount(self->vframe);
+    for (size_t frameidx = 0; frameidx < framenum; ++frameidx) {
+        DkimVerificationFrame *frame = DkimVerificationFrameArray_get(self->vframe, frameidx);
+        // skip verification frames with errors
+        if (DSTAT_OK != frame->status) {
+            continue;
+        }   // end if
+
+        frame->status = DkimDigester_updateBody(frame->digester, bodyp, len);
+        if (DSTAT_OK != frame->status) {
+            DkimLogPermFail("body digest update failed for signature no.%u",
+                            (unsigned int) frameidx);
+            // doesn't return to continue the other verification frames
+        }   // end if
+    }   // end if
+
+    if (self->body_deferred) {
+        // hash the canonicalized chunks of all the frames at once
+        DkimDigester *digesters[DKIM_VERIFIER_FLUSH_NUM];
+        size_t num = 0;
+        for (size_t frameidx = 0; frameidx < framenum; ++frameidx) {
+            DkimVerificationFrame *frame = DkimVerificationFrameArray_get(self->vframe, frameidx);
+            if (DSTAT_OK == frame->status) {
+                digesters[num++] = frame->digester;
+                if (DKIM_VERIFIER_FLUSH_NUM == num) {
+                    DkimDigester_flushBodies(digesters, num);
+                    num = 0;
+                }   // end if
+            }   // end if
+        }   // end for
+        DkimDigester_flushBodies(digesters, num);
+    }   // end if
+}   // end function: DkimVerifier_hashBody
+
+/*
+ * Lets the verification frames which hash the body in the same way share a single body digest,
+ * so that a message signed several times over by the mailing lists it passed through
+ * is hashed about once. The rest of the SHA-256 body digests are hashed together
+ * with multi-buffer SHA-256 if there are enough of them to pay off.
+ */
+static void
+DkimVerifier_shareBodyDigests(DkimVerifier *self)
+{
+    size_t framenum = DkimVerificationFrameArray_getCount(self->vframe);
+    for (size_t frameidx = 1; frameidx < framenum; ++frameidx) {
+        DkimVerificationFrame *frame = DkimVerificationFrameArray_get(self->vframe, frameidx);
+        if (DSTAT_OK != frame->status) {
+            continue;
+        }   // end if
+        for (size_t leaderidx = 0; leaderidx < frameidx; ++leaderidx) {
+            DkimVerificationFrame *leader = DkimVerificationFrameArray_get(self->vframe, leaderidx);
+            if (DSTAT_OK == leader->status
+                && DkimDigester_shareBody(frame->digester, leader->digester)) {
+                break;
+            }   // end if
+        }   // end for
+    }   // end for
+
+    size_t deferrable = 0;
+    for (size_t frameidx = 0; frameidx < framenum; ++frameidx) {
+        DkimVerificationFrame *frame = DkimVerificationFrameArray_get(self->vframe, frameidx);
+        if (DSTAT_OK == frame->status && DkimDigester_canDeferBody(frame->digester)) {
+            ++deferrable;
+        }   // end if
+    }   // end for
+    if (!DkimSha256_isMultiBufferEffective(deferrable)) {
+        return;
+    }   // end if
+    for (size_t frameidx = 0; frameidx < framenum; ++frameidx) {
+        DkimVerificationFrame *frame = DkimVerificationFrameArray_get(self->vframe, frameidx);
+        if (DSTAT_OK == frame->status && DkimDigester_canDeferBody(frame->digester)) {
+            DkimDigester_deferBody(frame->digester);
+        }   // end if
+    }   // end for
+    self->body_deferred = true;
+}   // end function: DkimVerifier_shareBodyDigests
+
+/**
+ * check whether DkimVerifier_updateBody() still needs the rest of the message body.
+ * the caller can stop passing the message body once this function returns false.
+ * @param self DkimVerifier object
+ * @return false if no verification frame needs the rest of the message body,
+ *         because all of them have failed, or have reached their body length limits.
+ *         true otherwise, including while the body is hashed on DkimCryptoPool.
+ */
+bool
+DkimVerifier_needsBody(const DkimVerifier *self)
+{
+    assert(NULL != self);
+
+    if (DSTAT_OK != self->status) {
+        return false;
+    }   // end if
+    if (NULL != self->bqueue) {
+        // the verification frames are being updated on the worker threads
+        return true;
+    }   // end if
+    size_t framenum = DkimVerificationFrameArray_getCount(self->vframe);
+    for (size_t frameidx = 0; frameidx < framenum; ++frameidx) {
+        const DkimVerificationFrame *frame = DkimVerificationFrameArray_get(self->vframe, frameidx);
+        if (DSTAT_OK == frame->status && DkimDigester_needsBody(frame->digester)) {
+            return true;
+        }   // end if
+    }   // end for
+    return false;
+}   // end function: DkimVerifier_needsBody
+
 /**
  * @param self DkimVerifier object
  * @return DSTAT_OK for success, otherwise status code that indicates error.
@@ -493,25 +651,156 @@ DkimVerifier_updateBody(DkimVerifier *self, const unsigned char *bodyp, size_t l
         return DSTAT_OK;
     }   // end if
 
-    // update digest for each verification frame
+    if (NULL == self->bqueue && !self->body_sync) {
+        DkimVerifier_shareBodyDigests(self);
+        /*
+         * the body is hashed on DkimCryptoPool while the caller receives the following chunks,
+         * if the policy allows and any frame needs the body. it is hashed on the caller otherwise.
+         */
+        if (NULL != self->vpolicy->crypto_pool && 0 < self->vpolicy->body_queue_limit
+            && DkimVerifier_needsBody(self)) {
+            self->bqueue =
+                DkimBodyQueue_new(self->vpolicy->crypto_pool, self->vpolicy->body_queue_limit,
+                                  DkimVerifier_hashBody, self);
+            if (NULL == self->bqueue) {
+                LogWarning("failed to initialize body queue, hashing the body synchronously");
+            }   // end if
+        }   // end if
+        self->body_sync = (NULL == self->bqueue);
+    }   // end if
+    if (self->body_sync) {
+        DkimVerifier_hashBody(self, bodyp, len);
+        return DSTAT_OK;
+    }   // end if
+    return DkimBodyQueue_push(self->bqueue, bodyp, len);
+}   // end function: DkimVerifier_updateBody
+
+/*
+ * DkimCryptoPool_task to verify the signature of a frame, which may run on a worker thread.
+ */
+static void
+DkimVerifier_verifySignature(void *arg)
+{
+    DkimVerificationFrame *frame = (DkimVerificationFrame *) arg;
+    frame->status =
+        DkimDigester_verifySignature(frame->digester, frame->signature,
+                                     DkimPublicKey_getPublicKey(frame->publickey));
+}   // end function: DkimVerifier_verifySignature
+
+/*
+ * Classifies the verification frames into DkimVerificationRank by the Authors of the message.
+ * All the frames fall into DKIM_VERIFICATION_RANK_OTHERS if the Authors are not available.
+ */
+static void
+DkimVerifier_rankFrames(DkimVerifier *self)
+{
+    const InetMailboxArray *authors = NULL;
+    if (HEADER_STAT_OK != InetMailHeaders_extractAuthors(self->headers, &authors)) {
+        authors = NULL;
+    }   // end if
+    size_t authornum = NULL != authors ? InetMailboxArray_getCount(authors) : 0;
+    if (0 < self->vpolicy->author_limit) {
+        authornum = MIN(authornum, self->vpolicy->author_limit);
+    }   // end if
+
     size_t framenum = DkimVerificationFrameArray_getCount(self->vframe);
     for (size_t frameidx = 0; frameidx < framenum; ++frameidx) {
         DkimVerificationFrame *frame = DkimVerificationFrameArray_get(self->vframe, frameidx);
-        // skip verification frames with errors
+        frame->rank = DKIM_VERIFICATION_RANK_OTHERS;
         if (DSTAT_OK != frame->status) {
             continue;
         }   // end if
+        const char *sdid = DkimSignature_getSdid(frame->signature);
+        const char *orgl_sdid = NULL != self->vpolicy->public_suffix
+            ? PublicSuffix_getOrganizationalDomain(self->vpolicy->public_suffix, sdid) : NULL;
+        const char *atps_domain = DkimSignature_getAtpsDomain(frame->signature);
+        for (size_t authoridx = 0; authoridx < authornum; ++authoridx) {
+            const char *author_domain =
+                InetMailbox_getDomain(InetMailboxArray_get(authors, authoridx));
+            if (InetDomain_equals(sdid, author_domain)) {
+                frame->rank = DKIM_VERIFICATION_RANK_AUTHOR_DOMAIN;
+                break;
+            }   // end if
+            // DMARC relaxed alignment
+            const char *orgl_author_domain = NULL != orgl_sdid
+                ? PublicSuffix_getOrganizationalDomain(self->vpolicy->public_suffix,
+                                                       author_domain) : NULL;
+            if (NULL != orgl_author_domain && InetDomain_equals(orgl_sdid, orgl_author_domain)) {
+                frame->rank = DKIM_VERIFICATION_RANK_ALIGNED;
+            } else if (self->vpolicy->enable_atps && NULL != atps_domain
+                       && InetDomain_equals(atps_domain, author_domain)) {
+                frame->rank = MIN(frame->rank, DKIM_VERIFICATION_RANK_ATPS);
+            }   // end if
+        }   // end for
+    }   // end for
+}   // end function: DkimVerifier_rankFrames
 
-        frame->status = DkimDigester_updateBody(frame->digester, bodyp, len);
-        if (DSTAT_OK != frame->status) {
-            DkimLogPermFail("body digest update failed for signature no.%u",
-                            (unsigned int) frameidx);
-            // doesn't return to continue the other verification frames
-        }   // end if
+/*
+ * Verifies the verification frames not verified yet,
+ * retrieving the public keys deferred by DkimVerifier_setupFrame() beforehand.
+ * @param lazy true to verify the frames of the specified rank only.
+ * @return true if any of the frames verified here has a valid signature, false otherwise.
+ */
+static bool
+DkimVerifier_verifyFrames(DkimVerifier *self, bool lazy, DkimVerificationRank rank)
+{
+    size_t framenum = DkimVerificationFrameArray_getCount(self->vframe);
+
+    /*
+     * the public key operations of the frames run together on the worker threads if available.
+     * the frames are verified one by one on this thread otherwise.
+     */
+    DkimCryptoBatch batch;
+    if (!DkimCryptoBatch_init(&batch, self->vpolicy->crypto_pool)) {
+        (void) DkimCryptoBatch_init(&batch, NULL);
     }   // end if
+    for (size_t frameidx = 0; frameidx < framenum; ++frameidx) {
+        DkimVerificationFrame *frame = DkimVerificationFrameArray_get(self->vframe, frameidx);
+        // skip verification frames with errors
+        if (DSTAT_OK != frame->status || frame->verified || (lazy && rank != frame->rank)) {
+            continue;
+        }   // end if
 
-    return DSTAT_OK;
-}   // end function: DkimVerifier_updateBody
+        if (NULL == frame->publickey) {
+            // retrieve the public key deferred by DkimVerifier_setupFrame()
+            if (self->vpolicy->body_hash_first) {
+                // no public key is needed for the signatures whose body hash does not match
+                frame->status = DkimDigester_checkBodyHash(frame->digester, frame->signature);
+                if (DSTAT_OK != frame->status) {
+                    frame->verified = true;
+                    continue;
+                }   // end if
+            }   // end if
+            frame->status =
+                DkimPublicKey_lookup(self->vpolicy, frame->signature, self->resolver,
+                                     &(frame->publickey));
+            if (DSTAT_OK != frame->status) {
+                continue;
+            }   // end if
+        }   // end if
+
+        // the header fields are digested on this thread as the frames share the cache
+        frame->status =
+            DkimDigester_digestMessage(frame->digester, self->headers, frame->signature,
+                                       DkimPublicKey_getPublicKey(frame->publickey),
+                                       self->hcache);
+        frame->verified = true;
+        if (DSTAT_OK == frame->status) {
+            DkimCryptoBatch_submit(&batch, &frame->crypto_job, DkimVerifier_verifySignature,
+                                   frame);
+        }   // end if
+    }   // end for
+    DkimCryptoBatch_wait(&batch);
+
+    for (size_t frameidx = 0; frameidx < framenum; ++frameidx) {
+        const DkimVerificationFrame *frame = DkimVerificationFrameArray_get(self->vframe, frameidx);
+        if (frame->verified && (!lazy || rank == frame->rank)
+            && DkimVerificationFrame_isSignatureVerified(frame)) {
+            return true;
+        }   // end if
+    }   // end for
+    return false;
+}   // end function: DkimVerifier_verifyFrames
 
 /**
  * @param self DkimVerifier object
@@ -527,18 +816,56 @@ DkimVerifier_verify(DkimVerifier *self)
         return self->status;
     }   // end if
 
+    // wait for the body to be hashed
+    if (NULL != self->bqueue) {
+        DkimBodyQueue_finish(self->bqueue);
+    }   // end if
+
     size_t framenum = DkimVerificationFrameArray_getCount(self->vframe);
+    if (1 < framenum && NULL == self->hcache) {
+        /*
+         * signatures of a message tend to sign the same header fields (From, Subject, Date, ...)
+         * with the same header canonicalization algorithm,
+         * so the header fields canonicalized for a frame are reused by the following frames.
+         * the frames run without the cache if it cannot be allocated.
+         */
+        self->hcache = DkimHeaderCache_new(InetMailHeaders_getCount(self->headers));
+        if (NULL == self->hcache) {
+            LogNoResource();
+        }   // end if
+    }   // end if
+    if (self->vpolicy->lazy_verification) {
+        /*
+         * a valid signature by the Author Domain decides DKIM, DMARC, ADSP and ATPS at once.
+         * a valid aligned one decides DMARC but not ADSP, which may still pass by ATPS,
+         * so the signatures for ATPS are verified before stopping.
+         */
+        DkimVerifier_rankFrames(self);
+        bool valid = false;
+        for (int rank = 0; rank < DKIM_VERIFICATION_RANK_NUM; ++rank) {
+            if (DkimVerifier_verifyFrames(self, true, (DkimVerificationRank) rank)) {
+                if (DKIM_VERIFICATION_RANK_AUTHOR_DOMAIN == rank) {
+                    break;
+                }   // end if
+                valid = true;
+            }   // end if
+            if (valid && DKIM_VERIFICATION_RANK_ATPS <= rank) {
+                break;
+            }   // end if
+        }   // end for
+    } else {
+        (void) DkimVerifier_verifyFrames(self, false, DKIM_VERIFICATION_RANK_OTHERS);
+    }   // end if
+
     for (size_t frameidx = 0; frameidx < framenum; ++frameidx) {
         DkimVerificationFrame *frame = DkimVerificationFrameArray_get(self->vframe, frameidx);
-        // skip verification frames with errors
-        if (DSTAT_OK != frame->status) {
+        if (!frame->verified) {
+            if (DSTAT_OK == frame->status) {
+                // left unverified as the outcome has been decided in the lazy verification mode
+                frame->status = DSTAT_POLICY_VERIFICATION_SKIPPED;
+            }   // end if
             continue;
-        }   // end if
-
-        frame->status =
-            DkimDigester_verifyMessage(frame->digester, self->headers, frame->signature,
-                                       DkimPublicKey_getPublicKey(frame->publickey));
-        if (DSTAT_ISTMPERR(frame->status)) {
+        } else if (DSTAT_ISTMPERR(frame->status)) {
             self->have_temporary_error = true;
         } else if (DSTAT_ISSYSERR(frame->status)) {
             self->have_system_error = true;
@@ -138,6 +138,7 @@ typedef enum DkimStatus {
     DSTAT_PERMFAIL_MULTIPLE_DNSRR,  // multiple DNS RR records are found
     // [Policy Violation]
     DSTAT_POLICY_TOOMANY_SIGNATURES = DSTATCAT_POLICY,  // too many signatures in a single message
+    DSTAT_POLICY_VERIFICATION_SKIPPED,  // not verified as the other signatures have decided the outcome
     // [Misconfigurations]
     DSTAT_CFGERR_SYNTAX_VIOLATION = DSTATCAT_CFGERR,    // syntax error at configuration directives
     DSTAT_CFGERR_EMPTY_VALUE,   // empty value or NULL is specified for configuration
@@ -153,6 +154,8 @@ typedef struct DkimVerificationPolicy DkimVerificationPolicy;
 typedef struct DkimVerifier DkimVerifier;
 typedef struct DkimSignPolicy DkimSignPolicy;
 typedef struct DkimSigner DkimSigner;
+typedef struct DkimCryptoPool DkimCryptoPool;
+typedef struct PublicSuffix PublicSuffix;
 typedef struct DkimFrameResult {
     DkimBaseScore score;
     DkimStatus stauts;
@@ -175,6 +178,18 @@ extern void DkimVerificationPolicy_verifyAtpsDelegation(DkimVerificationPolicy *
 extern void DkimVerificationPolicy_setRfc4871Compatible(DkimVerificationPolicy *self, bool enable);
 extern void DkimVerificationPolicy_setMinRSAKeyLength(DkimVerificationPolicy *self, unsigned int keylen);
 extern void DkimVerificationPolicy_setMaxClockSkew(DkimVerificationPolicy *self, time_t skew);
+extern void DkimVerificationPolicy_setCryptoPool(DkimVerificationPolicy *self,
+                                                DkimCryptoPool *pool);
+extern void DkimVerificationPolicy_setBodyQueueLimit(DkimVerificationPolicy *self,
+                                                     size_t queue_limit);
+extern void DkimVerificationPolicy_setLazyVerification(DkimVerificationPolicy *self, bool enable);
+extern void DkimVerificationPolicy_setPublicSuffix(DkimVerificationPolicy *self,
+                                                   const PublicSuffix *publicsuffix);
+extern void DkimVerificationPolicy_setBodyHashFirst(DkimVerificationPolicy *self, bool enable);
+
+// DkimCryptoPool
+extern DkimCryptoPool *DkimCryptoPool_new(unsigned int thread_num, bool pin_cores);
+extern void DkimCryptoPool_free(DkimCryptoPool *self);
 
 // DkimVerifier
 extern void DkimVerifier_free(DkimVerifier *self);
@@ -183,6 +198,7 @@ extern DkimStatus DkimVerifier_new(const DkimVerificationPolicy *vpolicy, DnsRes
                                    DkimVerifier **verifier);
 extern DkimStatus DkimVerifier_updateBody(DkimVerifier *self, const unsigned char *bodyp,
                                           size_t len);
+extern bool DkimVerifier_needsBody(const DkimVerifier *self);
 extern DkimStatus DkimVerifier_verify(DkimVerifier *self);
 extern DkimStatus DkimVerifier_enableC14nDump(DkimVerifier *self, const char *basedir,
                                               const char *prefix);
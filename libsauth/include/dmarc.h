@@ -41,7 +41,6 @@ typedef enum DmarcReceiverPolicy {
 } DmarcReceiverPolicy;
 
 typedef struct DmarcAligner DmarcAligner;
-typedef struct PublicSuffix PublicSuffix;
 
 extern DkimStatus DmarcAligner_new(const PublicSuffix *publicsuffix, DnsResolver *resolver, DmarcAligner **aligner);
 extern void DmarcAligner_free(DmarcAligner *self);
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2008-2014 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __DNS_CAPTURE_H__
+#define __DNS_CAPTURE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "dnsresolv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern DnsCapture *DnsCapture_newRecorder(const char *filename);
+extern DnsCapture *DnsCapture_newReplayer(const char *filename, double latency_scale);
+extern void DnsCapture_free(DnsCapture *self);
+extern bool DnsCapture_isReplayer(const DnsCapture *self);
+extern void DnsCapture_record(DnsCapture *self, const char *qname, uint16_t rrtype,
+                              dns_stat_t status, const void *resp, uint64_t latency);
+extern bool DnsCapture_replay(DnsCapture *self, const char *qname, uint16_t rrtype,
+                              dns_stat_t *status, void **resp, uint64_t *latency);
+extern void DnsCapture_delay(const DnsCapture *self, uint64_t latency);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DNS_CAPTURE_H__ */
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2008-2014 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __DNS_CIRCUIT_BREAKER_H__
+#define __DNS_CIRCUIT_BREAKER_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "dnsresolv.h"
+#include "dmarc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum DnsCircuitState {
+    DNS_CIRCUIT_CLOSED = 0,
+    DNS_CIRCUIT_OPEN,
+    DNS_CIRCUIT_HALF_OPEN,
+} DnsCircuitState;
+
+/*
+ * @param zone the zone name.
+ * @param state the current state of the breaker.
+ * @param failure_count the number of failed lookups in the current window.
+ * @param query_count the number of lookups in the current window.
+ * @param remaining seconds until the breaker becomes half-open, 0 unless DNS_CIRCUIT_OPEN.
+ */
+typedef void DnsCircuitBreaker_callback(const char *zone, DnsCircuitState state,
+                                        unsigned int failure_count, unsigned int query_count,
+                                        time_t remaining, void *arg);
+
+extern DnsCircuitBreaker *DnsCircuitBreaker_new(unsigned int threshold, unsigned int min_queries,
+                                                time_t window, time_t cooling_time);
+extern void DnsCircuitBreaker_free(DnsCircuitBreaker *self);
+extern void DnsCircuitBreaker_setPublicSuffix(DnsCircuitBreaker *self,
+                                              const PublicSuffix *public_suffix);
+extern bool DnsCircuitBreaker_allow(DnsCircuitBreaker *self, const char *qname);
+extern bool DnsCircuitBreaker_isClosed(DnsCircuitBreaker *self, const char *qname);
+extern void DnsCircuitBreaker_report(DnsCircuitBreaker *self, const char *qname,
+                                     dns_stat_t status);
+extern void DnsCircuitBreaker_iterate(DnsCircuitBreaker *self,
+                                      DnsCircuitBreaker_callback *callback, void *arg);
+extern const char *DnsCircuitBreaker_symbolizeState(DnsCircuitState state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DNS_CIRCUIT_BREAKER_H__ */
@@ -12,6 +12,7 @@
 #ifndef __DNS_RESOLV_H__
 #define __DNS_RESOLV_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -52,27 +53,32 @@ typedef enum dns_stat_t dns_stat_t;
 
 typedef struct DnsAResponse {
     size_t num;
+    uint32_t ttl;   // the smallest TTL among the answer records
     struct in_addr addr[];
 } DnsAResponse;
 
 typedef struct DnsAaaaResponse {
     size_t num;
+    uint32_t ttl;   // the smallest TTL among the answer records
     struct in6_addr addr[];
 } DnsAaaaResponse;
 
 typedef struct DnsPtrResponse {
     size_t num;
+    uint32_t ttl;   // the smallest TTL among the answer records
     char *domain[];
 } DnsPtrResponse;
 
 typedef struct DnsTxtResponse {
     size_t num;
+    uint32_t ttl;   // the smallest TTL among the answer records
     char *data[];
 } DnsTxtResponse;
 typedef struct DnsTxtResponse DnsSpfResponse;
 
 typedef struct DnsMxResponse {
     size_t num;
+    uint32_t ttl;   // the smallest TTL among the answer records
     struct mxentry {
         uint16_t preference;
         char domain[];
@@ -80,17 +86,71 @@ typedef struct DnsMxResponse {
 } DnsMxResponse;
 
 typedef struct DnsResolver DnsResolver;
+typedef struct DnsCircuitBreaker DnsCircuitBreaker;
+typedef struct DnsRttTable DnsRttTable;
+typedef struct DnsCapture DnsCapture;
 typedef DnsResolver *(DnsResolver_initializer)(const char *initfile);
 
+/*
+ * the limits and the spend of DNS lookups shared by all the authentication methods
+ * which use the same DnsResolver object (typically per message).
+ */
+typedef struct DnsResolverBudget {
+    uint64_t time_limit;        // total time of lookups in microseconds, 0 for unlimited
+    unsigned int query_limit;   // the number of lookups, 0 for unlimited
+    uint64_t deadline;          // monotonic time in microseconds when time_limit runs out, 0 for unlimited
+    uint64_t elapsed;           // total time spent on lookups in microseconds
+    unsigned int query_count;   // the number of lookups issued
+    unsigned int refused_count; // the number of lookups refused due to the exhausted budget
+    unsigned int speculative_count; // the number of speculative lookups, not charged to the budget
+} DnsResolverBudget;
+
+/*
+ * a lookup issued with DnsResolver_lookupBatch().
+ */
+typedef struct DnsBatchQuery {
+    uint16_t rrtype;            // ns_t_a, ns_t_aaaa, ns_t_mx, ns_t_txt or 99 (as ns_t_spf)
+    const char *qname;
+    bool speculative;           // looked up ahead of need, exempt from the budget and the circuit breaker
+    bool dropped;               // set if the speculative lookup is not performed
+    dns_stat_t status;
+    void *resp;                 // the response of the type corresponding to rrtype if status is DNS_STAT_NOERROR
+    const char *error_symbol;   // the error symbol if status is not DNS_STAT_NOERROR
+    uint64_t elapsed;           // time until the lookup is settled in microseconds, set by the engine
+} DnsBatchQuery;
+
 extern void DnsAResponse_free(DnsAResponse *self);
 extern void DnsAaaaResponse_free(DnsAaaaResponse *self);
 extern void DnsMxResponse_free(DnsMxResponse *self);
 extern void DnsTxtResponse_free(DnsTxtResponse *self);
 extern void DnsSpfResponse_free(DnsSpfResponse *self);
 extern void DnsPtrResponse_free(DnsPtrResponse *self);
+extern DnsAResponse *DnsAResponse_duplicate(const DnsAResponse *self);
+extern DnsAaaaResponse *DnsAaaaResponse_duplicate(const DnsAaaaResponse *self);
+extern DnsMxResponse *DnsMxResponse_duplicate(const DnsMxResponse *self);
+extern DnsTxtResponse *DnsTxtResponse_duplicate(const DnsTxtResponse *self);
+extern DnsSpfResponse *DnsSpfResponse_duplicate(const DnsSpfResponse *self);
+extern DnsPtrResponse *DnsPtrResponse_duplicate(const DnsPtrResponse *self);
 extern const char *DnsResolver_symbolizeErrorCode(dns_stat_t status);
 extern DnsResolver *DnsResolver_new(const char *modname, const char *initfile);
 extern DnsResolver_initializer *DnsResolver_lookupInitializer(const char *modname);
+extern void DnsResolver_setBudget(DnsResolver *self, uint64_t time_limit, unsigned int query_limit);
+extern const DnsResolverBudget *DnsResolver_getBudget(const DnsResolver *self);
+extern void DnsResolver_setCircuitBreaker(DnsResolver *self, DnsCircuitBreaker *breaker);
+extern void DnsResolver_setHedging(DnsResolver *self, DnsRttTable *rtt_table);
+extern void DnsResolver_setCapture(DnsResolver *self, DnsCapture *capture);
+extern const char *DnsResolver_getErrorSymbol(const DnsResolver *self);
+extern dns_stat_t DnsResolver_lookupA(DnsResolver *self, const char *domain, DnsAResponse **resp);
+extern dns_stat_t DnsResolver_lookupAaaa(DnsResolver *self, const char *domain,
+                                         DnsAaaaResponse **resp);
+extern dns_stat_t DnsResolver_lookupMx(DnsResolver *self, const char *domain, DnsMxResponse **resp);
+extern dns_stat_t DnsResolver_lookupTxt(DnsResolver *self, const char *domain,
+                                        DnsTxtResponse **resp);
+extern dns_stat_t DnsResolver_lookupSpf(DnsResolver *self, const char *domain,
+                                        DnsSpfResponse **resp);
+extern dns_stat_t DnsResolver_lookupPtr(DnsResolver *self, sa_family_t af, const void *addr,
+                                        DnsPtrResponse **resp);
+extern void DnsResolver_lookupBatch(DnsResolver *self, DnsBatchQuery *query, size_t num);
 
 struct DnsResolver_vtbl {
     const char *name;
@@ -98,12 +158,17 @@ struct DnsResolver_vtbl {
     const char *(*getErrorSymbol)(const DnsResolver *self);
     void (*setTimeout)(const DnsResolver *self, time_t timeout);
     void (*setRetryCount)(const DnsResolver *self, int retry);
+    time_t (*getTimeout)(const DnsResolver *self);
+    int (*getRetryCount)(const DnsResolver *self);
     dns_stat_t (*lookupA)(DnsResolver *self, const char *domain, DnsAResponse **resp);
     dns_stat_t (*lookupAaaa)(DnsResolver *self, const char *domain, DnsAaaaResponse **resp);
     dns_stat_t (*lookupMx)(DnsResolver *self, const char *domain, DnsMxResponse **resp);
     dns_stat_t (*lookupTxt)(DnsResolver *self, const char *domain, DnsTxtResponse **resp);
     dns_stat_t (*lookupSpf)(DnsResolver *self, const char *domain, DnsSpfResponse **resp);
     dns_stat_t (*lookupPtr)(DnsResolver *self, sa_family_t af, const void *addr, DnsPtrResponse **resp);
+    // optional, NULL if the engine can only look up one by one.
+    // sets dropped of the speculative lookups not answered along with the others.
+    void (*lookupBatch)(DnsResolver *self, DnsBatchQuery **query, size_t num);
 };
 
 #define DnsResolver_name(_resolver) ((_resolver)->vtbl->name)
@@ -113,18 +178,19 @@ struct DnsResolver_vtbl {
             (_resolver)->vtbl->free(_resolver); \
         } \
     } while (0)
-#define DnsResolver_getErrorSymbol(_resolver) ((_resolver)->vtbl->getErrorSymbol(_resolver))
 #define DnsResolver_setTimeout(_resolver, _timeout) ((_resolver)->vtbl->setTimeout(_resolver, _timeout))
 #define DnsResolver_setRetryCount(_resolver, _retry) ((_resolver)->vtbl->setRetryCount(_resolver, _retry))
-#define DnsResolver_lookupA(_resolver, _domain, _resp) ((_resolver)->vtbl->lookupA(_resolver, _domain, _resp))
-#define DnsResolver_lookupAaaa(_resolver, _domain, _resp) ((_resolver)->vtbl->lookupAaaa(_resolver, _domain, _resp))
-#define DnsResolver_lookupMx(_resolver, _domain, _resp) ((_resolver)->vtbl->lookupMx(_resolver, _domain, _resp))
-#define DnsResolver_lookupTxt(_resolver, _domain, _resp) ((_resolver)->vtbl->lookupTxt(_resolver, _domain, _resp))
-#define DnsResolver_lookupSpf(_resolver, _domain, _resp) ((_resolver)->vtbl->lookupSpf(_resolver, _domain, _resp))
-#define DnsResolver_lookupPtr(_resolver, _af, _addr, _resp) ((_resolver)->vtbl->lookupPtr(_resolver, _af, _addr, _resp))
 
 #define DnsResolver_MEMBER              \
-    const struct DnsResolver_vtbl *vtbl
+    const struct DnsResolver_vtbl *vtbl; \
+    DnsResolverBudget budget; \
+    DnsCircuitBreaker *breaker; \
+    DnsRttTable *rtt_table; \
+    DnsCapture *capture; \
+    const char *refusal; \
+    bool timeout_capped; \
+    time_t saved_timeout; \
+    int saved_retry
 
 struct DnsResolver {
     DnsResolver_MEMBER;
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2008-2014 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __DNS_RTT_TABLE_H__
+#define __DNS_RTT_TABLE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "dnsresolv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern DnsRttTable *DnsRttTable_new(unsigned int min_delay, unsigned int max_delay);
+extern void DnsRttTable_free(DnsRttTable *self);
+extern unsigned int DnsRttTable_getHedgeDelay(DnsRttTable *self, const struct sockaddr *addr,
+                                              socklen_t addrlen);
+extern unsigned int DnsRttTable_getFailureCount(DnsRttTable *self, const struct sockaddr *addr,
+                                                socklen_t addrlen);
+extern void DnsRttTable_updateRtt(DnsRttTable *self, const struct sockaddr *addr,
+                                  socklen_t addrlen, unsigned int rtt);
+extern void DnsRttTable_updateFailure(DnsRttTable *self, const struct sockaddr *addr,
+                                      socklen_t addrlen);
+extern int DnsRttTable_exchange(DnsRttTable *self, const struct sockaddr *const servers[],
+                                const socklen_t addrlen[], size_t nsnum,
+                                const unsigned char *query, size_t querylen, unsigned char *buf,
+                                size_t buflen, uint64_t timeout, int *bad_rcode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DNS_RTT_TABLE_H__ */
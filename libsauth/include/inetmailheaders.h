@@ -42,6 +42,11 @@ extern InetMailboxArray *InetMailHeaders_parseMailboxList(const char *head, cons
 extern size_t InetMailHeaders_getCount(const InetMailHeaders *self);
 extern void InetMailHeaders_get(const InetMailHeaders *self, size_t pos, const char **pkey, const char **pval);
 extern int InetMailHeaders_append(InetMailHeaders *self, const char *key, const char *val);
+extern size_t InetMailHeaders_countHeader(const InetMailHeaders *self, const char *fieldname);
+extern int InetMailHeaders_getFirstIndex(const InetMailHeaders *self, const char *fieldname);
+extern int InetMailHeaders_getLastIndex(const InetMailHeaders *self, const char *fieldname);
+extern int InetMailHeaders_getNextIndex(const InetMailHeaders *self, int pos);
+extern int InetMailHeaders_getPrevIndex(const InetMailHeaders *self, int pos);
 
 // header field name of From header (as Author)
 #ifndef FROMHEADER
@@ -36,5 +36,11 @@ inline int EVP_PKEY_base_id(const EVP_PKEY *pkey) {
 #endif
 
 extern void OpenSSL_logErrors(void);
+extern void OpenSSL_initDigests(void);
+extern void OpenSSL_cleanupDigests(void);
+extern const EVP_MD *OpenSSL_getSha1(void);
+extern const EVP_MD *OpenSSL_getSha256(void);
+extern EVP_MD_CTX *OpenSSL_newDigestContext(void);
+extern void OpenSSL_freeDigestContext(EVP_MD_CTX *ctx);
 
 #endif /* __OPENSSL_EVP_COMPAT_H__ */
@@ -13,6 +13,7 @@
 #define __SPF_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -79,8 +80,31 @@ typedef enum SpfCustomAction {
     SPF_CUSTOM_ACTION_LOGGING,
 } SpfCustomAction;
 
+typedef enum SpfEvalProgress {
+    SPF_EVAL_PROGRESS_DONE = 0,
+    SPF_EVAL_PROGRESS_NEED_DNS,    // the evaluation is suspended until the pending DNS lookups are answered
+} SpfEvalProgress;
+
 typedef struct SpfEvalPolicy SpfEvalPolicy;
 typedef struct SpfEvaluator SpfEvaluator;
+typedef struct SpfFlatCache SpfFlatCache;
+typedef struct SpfCostTable SpfCostTable;
+
+// the cost of an evaluation
+typedef struct SpfEvalCost {
+    unsigned int dns_mech_count;    // mechanisms and modifiers which involve DNS lookups
+    unsigned int void_lookup_count;
+    unsigned int include_depth;     // the deepest nesting of "include:" mechanisms
+    unsigned int query_count;       // DNS lookups the evaluation waited for
+    uint64_t elapsed;               // wall time in microseconds
+} SpfEvalCost;
+
+/*
+ * callback of SpfCostTable_iterate(), receives the totals of the evaluations of the domain
+ * and the maximum of each item.
+ */
+typedef void SpfCostTable_callback(const char *domain, uint64_t eval_count, uint64_t query_count,
+                                   uint64_t elapsed, const SpfEvalCost *max, void *arg);
 
 // SpfEvalPolicy
 extern SpfEvalPolicy *SpfEvalPolicy_new(void);
@@ -92,6 +116,9 @@ extern SpfStat SpfEvalPolicy_setLocalPolicyExplanation(SpfEvalPolicy *self, cons
 extern void SpfEvalPolicy_setExplanationLookup(SpfEvalPolicy *self, bool flag);
 extern void SpfEvalPolicy_setPlusAllDirectiveHandling(SpfEvalPolicy *self, SpfCustomAction action);
 extern void SpfEvalPolicy_setVoidLookupLimit(SpfEvalPolicy *self, int void_lookup_limit);
+extern void SpfEvalPolicy_setPrefetchDepth(SpfEvalPolicy *self, unsigned int prefetch_depth);
+extern void SpfEvalPolicy_setFlatCache(SpfEvalPolicy *self, SpfFlatCache *cache);
+extern void SpfEvalPolicy_setCostTable(SpfEvalPolicy *self, SpfCostTable *table);
 
 // SpfEvaluator
 extern SpfEvaluator *SpfEvaluator_new(const SpfEvalPolicy *policy, DnsResolver *resolver);
@@ -101,14 +128,41 @@ extern bool SpfEvaluator_isSenderContext(const SpfEvaluator *self);
 extern const InetMailbox *SpfEvaluator_getSender(const SpfEvaluator *self);
 extern const char *SpfEvaluator_getEvaluatedDomain(const SpfEvaluator *self);
 extern const char *SpfEvaluator_getExplanation(const SpfEvaluator *self);
+extern void SpfEvaluator_getCost(const SpfEvaluator *self, SpfEvalCost *cost);
 extern SpfScore SpfEvaluator_eval(SpfEvaluator *self, SpfRecordScope scope);
+extern void SpfEvaluator_evalPair(SpfEvaluator *self, SpfRecordScope scope, SpfScore *score,
+                                  SpfEvaluator *peer, SpfRecordScope peer_scope,
+                                  SpfScore *peer_score);
+extern SpfEvalProgress SpfEvaluator_start(SpfEvaluator *self, SpfRecordScope scope,
+                                          SpfScore *score);
+extern SpfEvalProgress SpfEvaluator_resume(SpfEvaluator *self, SpfScore *score);
+extern size_t SpfEvaluator_getQueryCount(const SpfEvaluator *self);
+extern const char *SpfEvaluator_getQuery(const SpfEvaluator *self, size_t index, int *rrtype);
+extern void SpfEvaluator_setAnswer(SpfEvaluator *self, size_t index, dns_stat_t status,
+                                   void *resp, const char *error_symbol);
+extern dns_stat_t SpfEvaluator_lookupQuery(SpfEvaluator *self, size_t index,
+                                           DnsResolver *resolver);
+extern void SpfEvaluator_lookupQueries(SpfEvaluator *self, DnsResolver *resolver);
 extern bool SpfEvaluator_setSender(SpfEvaluator *self, const InetMailbox *sender);
 extern bool SpfEvaluator_setHeloDomain(SpfEvaluator *self, const char *domain);
+extern bool SpfEvaluator_setHeloResult(SpfEvaluator *self, SpfRecordScope scope, SpfScore score,
+                                       const char *explanation);
 extern bool SpfEvaluator_setIpAddr(SpfEvaluator *self, sa_family_t sa_family,
                                   const struct sockaddr *addr);
 extern bool SpfEvaluator_setIpAddrString(SpfEvaluator *self, sa_family_t sa_family,
                                         const char *address);
 
+// SpfFlatCache
+extern SpfFlatCache *SpfFlatCache_new(const SpfEvalPolicy *policy, DnsResolver *resolver,
+                                      size_t max_entries, time_t max_ttl);
+extern void SpfFlatCache_free(SpfFlatCache *self);
+
+// SpfCostTable
+extern SpfCostTable *SpfCostTable_new(size_t max_entries);
+extern void SpfCostTable_free(SpfCostTable *self);
+extern void SpfCostTable_add(SpfCostTable *self, const char *domain, const SpfEvalCost *cost);
+extern void SpfCostTable_iterate(SpfCostTable *self, SpfCostTable_callback *callback, void *arg);
+
 // SpfEnum
 extern SpfScore SpfEnum_lookupScoreByKeyword(const char *keyword);
 extern SpfScore SpfEnum_lookupScoreByKeywordSlice(const char *head, const char *tail);
@@ -16,19 +16,24 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <netdb.h>
+#include <poll.h>
 #include <resolv.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <arpa/nameser.h>
 #include <netinet/in.h>
 
 #include "stdaux.h"
 #include "dnsresolv.h"
 #include "dnsresolv_internal.h"
+#include "dnsrtttable.h"
 #include "bindresolver.h"
 
 #if defined(USE_LIBRESOLV) && !defined(NS_MAXMSG)
@@ -134,18 +139,102 @@ BindResolver_setRetryCount(const DnsResolver *base, int retry)
     self->resolver.retry = retry;
 }   // end function: BindResolver_setRetryCount
 
+static time_t
+BindResolver_getTimeout(const DnsResolver *base)
+{
+    const BindResolver *self = (const BindResolver *) base;
+    return (time_t) self->resolver.retrans;
+}   // end function: BindResolver_getTimeout
+
+static int
+BindResolver_getRetryCount(const DnsResolver *base)
+{
+    const BindResolver *self = (const BindResolver *) base;
+    return self->resolver.retry;
+}   // end function: BindResolver_getRetryCount
+
+static uint64_t
+BindResolver_getMonotonicMsec(void)
+{
+    struct timespec ts;
+    if (0 != clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        return 0;
+    }   // end if
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}   // end function: BindResolver_getMonotonicMsec
+
 /*
- * throw a DNS query and receive a response of it
- * @return
+ * check the ID and the question section of the response.
+ * the question in the response is never compressed, and the length octets of labels
+ * are not affected by the case folding, so that the section can be compared octet by octet.
  */
-static dns_stat_t
-BindResolver_query(BindResolver *self, const char *domain, uint16_t rrtype)
+static bool
+BindResolver_isResponseTo(const unsigned char *query, int querylen, const unsigned char *resp,
+                          int resplen)
 {
-    BindResolver_resetErrorState(self);
-    self->msglen = res_nquery(&self->resolver, domain, ns_c_in, rrtype, self->msgbuf, NS_MAXMSG);
-    if (0 > self->msglen) {
-        return BindResolver_setHerrno(self, self->resolver.res_h_errno);
+    if (resplen < querylen || 0 != memcmp(query, resp, NS_INT16SZ)
+        || 1 != ns_get16(resp + 2 * NS_INT16SZ)) {
+        return false;
+    }   // end if
+    for (int i = NS_HFIXEDSZ; i < querylen; ++i) {
+        if (tolower(query[i]) != tolower(resp[i])) {
+            return false;
+        }   // end if
+    }   // end for
+    return true;
+}   // end function: BindResolver_isResponseTo
+
+/*
+ * send a query to the nameservers in the hedged manner with DnsRttTable_exchange().
+ * @return the length of the response stored in self->msgbuf,
+ *         -1 on failure with self->resolver.res_h_errno set in the same manner as res_nquery(),
+ *         -2 if hedging is not applicable (only one IPv4 nameserver, IPv6 nameservers
+ *         or a truncated response) and res_nquery() should be used instead.
+ */
+static int
+BindResolver_hedgedQuery(BindResolver *self, const char *domain, uint16_t rrtype)
+{
+    unsigned char query[NS_PACKETSZ];
+    int querylen = res_nmkquery(&self->resolver, ns_o_query, domain, ns_c_in, rrtype, NULL, 0,
+                                NULL, query, sizeof(query));
+    if (0 > querylen) {
+        return -2;
+    }   // end if
+
+    size_t nsnum = 0;
+    const struct sockaddr *servers[MAXNS];
+    socklen_t addrlen[MAXNS];
+    for (int i = 0; i < self->resolver.nscount && i < MAXNS; ++i) {
+        const struct sockaddr_in *addr = &self->resolver.nsaddr_list[i];
+        if (AF_INET != addr->sin_family) {
+            return -2;
+        }   // end if
+        servers[nsnum] = (const struct sockaddr *) addr;
+        addrlen[nsnum] = sizeof(struct sockaddr_in);
+        ++nsnum;
+    }   // end for
+    if (nsnum < 2) {
+        return -2;
+    }   // end if
+
+    int bad_rcode;
+    uint64_t timeout = (uint64_t) self->resolver.retrans * 1000 * MAX(self->resolver.retry, 1);
+    int msglen = DnsRttTable_exchange(self->rtt_table, servers, addrlen, nsnum, query,
+                                      (size_t) querylen, self->msgbuf, NS_MAXMSG, timeout,
+                                      &bad_rcode);
+    if (-1 == msglen) {
+        self->resolver.res_h_errno =
+            (0 > bad_rcode || ns_r_servfail == bad_rcode) ? TRY_AGAIN : NO_RECOVERY;
     }   // end if
+    return msglen;
+}   // end function: BindResolver_hedgedQuery
+
+/*
+ * parse the header of the response stored in self->msgbuf
+ */
+static dns_stat_t
+BindResolver_initMessage(BindResolver *self)
+{
     if (0 > ns_initparse(self->msgbuf, self->msglen, &self->msghanlde)) {
         return BindResolver_setError(self, DNS_STAT_FORMERR);
     }   // end if
@@ -154,16 +243,35 @@ BindResolver_query(BindResolver *self, const char *domain, uint16_t rrtype)
         return BindResolver_setRcode(self, rcode_flag);
     }   // end if
     return DNS_STAT_NOERROR;
-}   // end function: BindResolver_query
+}   // end function: BindResolver_initMessage
 
+/*
+ * throw a DNS query and receive a response of it
+ * @return
+ */
 static dns_stat_t
-BindResolver_lookupA(DnsResolver *base, const char *domain, DnsAResponse **resp)
+BindResolver_query(BindResolver *self, const char *domain, uint16_t rrtype)
 {
-    BindResolver *self = (BindResolver *) base;
-    int query_stat = BindResolver_query(self, domain, ns_t_a);
-    if (DNS_STAT_NOERROR != query_stat) {
-        return query_stat;
+    BindResolver_resetErrorState(self);
+    self->msglen = -2;
+    if (NULL != self->rtt_table) {
+        self->msglen = BindResolver_hedgedQuery(self, domain, rrtype);
+    }   // end if
+    if (-2 == self->msglen) {
+        self->msglen = res_nquery(&self->resolver, domain, ns_c_in, rrtype, self->msgbuf, NS_MAXMSG);
+    }   // end if
+    if (0 > self->msglen) {
+        return BindResolver_setHerrno(self, self->resolver.res_h_errno);
     }   // end if
+    return BindResolver_initMessage(self);
+}   // end function: BindResolver_query
+
+/*
+ * extract A RRs from the response stored in self->msgbuf
+ */
+static dns_stat_t
+BindResolver_parseAResponse(BindResolver *self, DnsAResponse **resp)
+{
     size_t msg_count = ns_msg_count(self->msghanlde, ns_s_an);
     if (0 == msg_count) {
         return BindResolver_setError(self, DNS_STAT_NODATA);
@@ -181,6 +289,9 @@ BindResolver_lookupA(DnsResolver *base, const char *domain, DnsAResponse **resp)
         if (0 != parse_stat) {
             goto formerr;
         }   // end if
+        if (0 == n || ns_rr_ttl(rr) < respobj->ttl) {
+            respobj->ttl = ns_rr_ttl(rr);
+        }   // end if
         if (ns_t_a != ns_rr_type(rr)) {
             continue;
         }   // end if
@@ -203,16 +314,25 @@ BindResolver_lookupA(DnsResolver *base, const char *domain, DnsAResponse **resp)
   nodata:
     DnsAResponse_free(respobj);
     return BindResolver_setError(self, DNS_STAT_NOVALIDANSWER);
-}   // end function: BindResolver_lookupA
+}   // end function: BindResolver_parseAResponse
 
 static dns_stat_t
-BindResolver_lookupAaaa(DnsResolver *base, const char *domain, DnsAaaaResponse **resp)
+BindResolver_lookupA(DnsResolver *base, const char *domain, DnsAResponse **resp)
 {
     BindResolver *self = (BindResolver *) base;
-    int query_stat = BindResolver_query(self, domain, ns_t_aaaa);
+    int query_stat = BindResolver_query(self, domain, ns_t_a);
     if (DNS_STAT_NOERROR != query_stat) {
         return query_stat;
     }   // end if
+    return BindResolver_parseAResponse(self, resp);
+}   // end function: BindResolver_lookupA
+
+/*
+ * extract AAAA RRs from the response stored in self->msgbuf
+ */
+static dns_stat_t
+BindResolver_parseAaaaResponse(BindResolver *self, DnsAaaaResponse **resp)
+{
     size_t msg_count = ns_msg_count(self->msghanlde, ns_s_an);
     if (0 == msg_count) {
         return BindResolver_setError(self, DNS_STAT_NODATA);
@@ -230,6 +350,9 @@ BindResolver_lookupAaaa(DnsResolver *base, const char *domain, DnsAaaaResponse *
         if (0 != parse_stat) {
             goto formerr;
         }   // end if
+        if (0 == n || ns_rr_ttl(rr) < respobj->ttl) {
+            respobj->ttl = ns_rr_ttl(rr);
+        }   // end if
         if (ns_t_aaaa != ns_rr_type(rr)) {
             continue;
         }   // end if
@@ -252,16 +375,25 @@ BindResolver_lookupAaaa(DnsResolver *base, const char *domain, DnsAaaaResponse *
   nodata:
     DnsAaaaResponse_free(respobj);
     return BindResolver_setError(self, DNS_STAT_NOVALIDANSWER);
-}   // end function: BindResolver_lookupAaaa
+}   // end function: BindResolver_parseAaaaResponse
 
 static dns_stat_t
-BindResolver_lookupMx(DnsResolver *base, const char *domain, DnsMxResponse **resp)
+BindResolver_lookupAaaa(DnsResolver *base, const char *domain, DnsAaaaResponse **resp)
 {
     BindResolver *self = (BindResolver *) base;
-    int query_stat = BindResolver_query(self, domain, ns_t_mx);
+    int query_stat = BindResolver_query(self, domain, ns_t_aaaa);
     if (DNS_STAT_NOERROR != query_stat) {
         return query_stat;
     }   // end if
+    return BindResolver_parseAaaaResponse(self, resp);
+}   // end function: BindResolver_lookupAaaa
+
+/*
+ * extract MX RRs from the response stored in self->msgbuf
+ */
+static dns_stat_t
+BindResolver_parseMxResponse(BindResolver *self, DnsMxResponse **resp)
+{
     size_t msg_count = ns_msg_count(self->msghanlde, ns_s_an);
     if (0 == msg_count) {
         return BindResolver_setError(self, DNS_STAT_NODATA);
@@ -279,6 +411,9 @@ BindResolver_lookupMx(DnsResolver *base, const char *domain, DnsMxResponse **res
         if (0 != parse_stat) {
             goto formerr;
         }   // end if
+        if (0 == n || ns_rr_ttl(rr) < respobj->ttl) {
+            respobj->ttl = ns_rr_ttl(rr);
+        }   // end if
         if (ns_t_mx != ns_rr_type(rr)) {
             continue;
         }   // end if
@@ -326,19 +461,25 @@ BindResolver_lookupMx(DnsResolver *base, const char *domain, DnsMxResponse **res
   noresource:
     DnsMxResponse_free(respobj);
     return BindResolver_setError(self, DNS_STAT_NOMEMORY);
-}   // end function: BindResolver_lookupMx
+}   // end function: BindResolver_parseMxResponse
 
-/**
- * @return DNS_STAT_NOERROR on success.
- */
-static int
-BindResolver_lookupTxtData(BindResolver *self, uint16_t rrtype, const char *domain,
-                           DnsTxtResponse **resp)
+static dns_stat_t
+BindResolver_lookupMx(DnsResolver *base, const char *domain, DnsMxResponse **resp)
 {
-    int query_stat = BindResolver_query(self, domain, rrtype);
+    BindResolver *self = (BindResolver *) base;
+    int query_stat = BindResolver_query(self, domain, ns_t_mx);
     if (DNS_STAT_NOERROR != query_stat) {
         return query_stat;
     }   // end if
+    return BindResolver_parseMxResponse(self, resp);
+}   // end function: BindResolver_lookupMx
+
+/*
+ * extract TXT RRs or SPF RRs from the response stored in self->msgbuf
+ */
+static dns_stat_t
+BindResolver_parseTxtResponse(BindResolver *self, uint16_t rrtype, DnsTxtResponse **resp)
+{
     size_t msg_count = ns_msg_count(self->msghanlde, ns_s_an);
     if (0 == msg_count) {
         return BindResolver_setError(self, DNS_STAT_NODATA);
@@ -356,6 +497,9 @@ BindResolver_lookupTxtData(BindResolver *self, uint16_t rrtype, const char *doma
         if (0 != parse_stat) {
             goto formerr;
         }   // end if
+        if (0 == n || ns_rr_ttl(rr) < respobj->ttl) {
+            respobj->ttl = ns_rr_ttl(rr);
+        }   // end if
         if (rrtype != ns_rr_type(rr)) {
             continue;
         }   // end if
@@ -397,6 +541,20 @@ BindResolver_lookupTxtData(BindResolver *self, uint16_t rrtype, const char *doma
   noresource:
     DnsTxtResponse_free(respobj);
     return BindResolver_setError(self, DNS_STAT_NOMEMORY);
+}   // end function: BindResolver_parseTxtResponse
+
+/**
+ * @return DNS_STAT_NOERROR on success.
+ */
+static int
+BindResolver_lookupTxtData(BindResolver *self, uint16_t rrtype, const char *domain,
+                           DnsTxtResponse **resp)
+{
+    int query_stat = BindResolver_query(self, domain, rrtype);
+    if (DNS_STAT_NOERROR != query_stat) {
+        return query_stat;
+    }   // end if
+    return BindResolver_parseTxtResponse(self, rrtype, resp);
 }   // end function: BindResolver_lookupTxtData
 
 static dns_stat_t
@@ -413,6 +571,437 @@ BindResolver_lookupSpf(DnsResolver *base, const char *domain, DnsSpfResponse **r
     return BindResolver_lookupTxtData(self, 99 /* as ns_t_spf */ , domain, resp);
 }   // end function: BindResolver_lookupSpf
 
+/*
+ * extract RRs of the type from the response stored in self->msgbuf
+ */
+static dns_stat_t
+BindResolver_parseBatchResponse(BindResolver *self, uint16_t rrtype, void **resp)
+{
+    switch (rrtype) {
+    case ns_t_a:
+        return BindResolver_parseAResponse(self, (DnsAResponse **) resp);
+    case ns_t_aaaa:
+        return BindResolver_parseAaaaResponse(self, (DnsAaaaResponse **) resp);
+    case ns_t_mx:
+        return BindResolver_parseMxResponse(self, (DnsMxResponse **) resp);
+    case ns_t_txt:
+    case 99 /* as ns_t_spf */:
+        return BindResolver_parseTxtResponse(self, rrtype, (DnsTxtResponse **) resp);
+    default:
+        return BindResolver_setError(self, DNS_STAT_BADREQUEST);
+    }   // end switch
+}   // end function: BindResolver_parseBatchResponse
+
+typedef struct BindResolverBatchEntry {
+    unsigned char query[NS_PACKETSZ];
+    int querylen;
+    unsigned char *msgbuf;  // the acceptable response, NULL until received
+    int msglen;
+    int bad_rcode;          // the last bad rcode received, -1 if none
+    unsigned int awaiting;  // the number of the nameservers asked and not answered yet
+    bool fallback;          // should be looked up by res_nquery()
+    bool speculative;       // not waited for, dropped unless answered along with the others
+    uint64_t settled;       // monotonic time in milliseconds the response is received
+} BindResolverBatchEntry;
+
+/*
+ * a nameserver a batch is sent to in the hedged manner.
+ */
+typedef struct BindResolverBatchServer {
+    uint64_t sent_at;       // monotonic time in milliseconds the queries are sent
+    bool responded;         // any response has been received
+    bool sampled;           // the RTT has been recorded to the table
+} BindResolverBatchServer;
+
+/*
+ * @return the index of the nameserver in self->resolver.nsaddr_list, -1 if not found.
+ */
+static int
+BindResolver_findNameserver(const BindResolver *self, const struct sockaddr_in *from)
+{
+    for (int i = 0; i < self->resolver.nscount && i < MAXNS; ++i) {
+        const struct sockaddr_in *addr = &self->resolver.nsaddr_list[i];
+        if (addr->sin_port == from->sin_port && addr->sin_addr.s_addr == from->sin_addr.s_addr) {
+            return i;
+        }   // end if
+    }   // end for
+    return -1;
+}   // end function: BindResolver_findNameserver
+
+/*
+ * receive a response and assign it to the query it answers.
+ * @param server the nameservers indexed in the same manner as self->resolver.nsaddr_list
+ *               to record the RTT and the failures to self->rtt_table, NULL not to record.
+ * @return the settled query, NULL if none.
+ */
+static BindResolverBatchEntry *
+BindResolver_receiveBatchResponse(BindResolver *self, int fd, BindResolverBatchEntry *entry,
+                                  size_t num, BindResolverBatchServer *server, uint64_t now)
+{
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    int len = (int) recvfrom(fd, self->msgbuf, NS_MAXMSG, 0, (struct sockaddr *) &from, &fromlen);
+    int ns = (0 > len || sizeof(from) != fromlen || AF_INET != from.sin_family)
+        ? -1 : BindResolver_findNameserver(self, &from);
+    if (0 > ns) {
+        return NULL;
+    }   // end if
+    const struct sockaddr *addr = (const struct sockaddr *) &self->resolver.nsaddr_list[ns];
+    for (size_t i = 0; i < num; ++i) {
+        BindResolverBatchEntry *e = &entry[i];
+        if (e->fallback || NULL != e->msgbuf
+            || !BindResolver_isResponseTo(e->query, e->querylen, self->msgbuf, len)) {
+            continue;
+        }   // end if
+        if (0 < e->awaiting) {
+            --e->awaiting;
+        }   // end if
+        if (NULL != server) {
+            server[ns].responded = true;
+        }   // end if
+        const HEADER *header = (const HEADER *) self->msgbuf;
+        if (header->tc) {
+            e->fallback = true; // let res_nquery() retry over TCP
+            return e;
+        }   // end if
+        switch (header->rcode) {
+        case ns_r_noerror:
+        case ns_r_nxdomain:
+            if (NULL != server && !server[ns].sampled) {
+                // one sample per batch as the queries are sent in a burst
+                DnsRttTable_updateRtt(self->rtt_table, addr, sizeof(struct sockaddr_in),
+                                      (unsigned int) (now - server[ns].sent_at));
+                server[ns].sampled = true;
+            }   // end if
+            e->msgbuf = (unsigned char *) malloc(len);
+            if (NULL == e->msgbuf) {
+                e->fallback = true;
+                return e;
+            }   // end if
+            memcpy(e->msgbuf, self->msgbuf, len);
+            e->msglen = len;
+            return e;
+        default:
+            if (NULL != server) {
+                DnsRttTable_updateFailure(self->rtt_table, addr, sizeof(struct sockaddr_in));
+            }   // end if
+            e->bad_rcode = header->rcode;   // ask the next nameserver
+            return NULL;
+        }   // end switch
+    }   // end for
+    return NULL;
+}   // end function: BindResolver_receiveBatchResponse
+
+/*
+ * send the queries not settled yet to the nameserver.
+ */
+static void
+BindResolver_sendBatch(int fd, BindResolverBatchEntry *entry, size_t num,
+                       const struct sockaddr *addr)
+{
+    for (size_t i = 0; i < num; ++i) {
+        BindResolverBatchEntry *e = &entry[i];
+        if (e->fallback || NULL != e->msgbuf) {
+            continue;
+        }   // end if
+        if (e->querylen == sendto(fd, e->query, e->querylen, 0, addr, sizeof(struct sockaddr_in))) {
+            ++e->awaiting;
+        }   // end if
+    }   // end for
+}   // end function: BindResolver_sendBatch
+
+/*
+ * count the non-speculative queries waiting for a response.
+ * @param starving set to true if any of the non-speculative queries not settled yet
+ *                 has no nameserver to wait for.
+ */
+static size_t
+BindResolver_countAwaiting(const BindResolverBatchEntry *entry, size_t num, bool *starving)
+{
+    size_t awaiting = 0;
+    *starving = false;
+    for (size_t i = 0; i < num; ++i) {
+        const BindResolverBatchEntry *e = &entry[i];
+        if (e->speculative || e->fallback || NULL != e->msgbuf) {
+            continue;
+        }   // end if
+        if (0 < e->awaiting) {
+            ++awaiting;
+        } else {
+            *starving = true;
+        }   // end if
+    }   // end for
+    return awaiting;
+}   // end function: BindResolver_countAwaiting
+
+/*
+ * take the responses already received without waiting,
+ * so that the speculative queries answered along with the others are not dropped.
+ */
+static void
+BindResolver_drainBatch(BindResolver *self, int fd, BindResolverBatchEntry *entry, size_t num)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+    while (0 < poll(&pfd, 1, 0)) {
+        uint64_t now = BindResolver_getMonotonicMsec();
+        BindResolverBatchEntry *settled =
+            BindResolver_receiveBatchResponse(self, fd, entry, num, NULL, now);
+        if (NULL != settled) {
+            settled->settled = now;
+        }   // end if
+    }   // end while
+}   // end function: BindResolver_drainBatch
+
+/*
+ * exchange a batch with the nameservers in the same order as res_nquery(),
+ * waiting for each nameserver until the retransmission timeout.
+ * @param remaining the number of the non-speculative queries not settled yet.
+ */
+static void
+BindResolver_exchangeBatch(BindResolver *self, int fd, BindResolverBatchEntry *entry, size_t num,
+                           size_t remaining)
+{
+    int nsnum = MIN(self->resolver.nscount, MAXNS);
+    for (int attempt = 0; attempt < MAX(self->resolver.retry, 1) && 0 < remaining; ++attempt) {
+        for (int ns = 0; ns < nsnum && 0 < remaining; ++ns) {
+            for (size_t i = 0; i < num; ++i) {
+                entry[i].awaiting = 0;
+            }   // end for
+            BindResolver_sendBatch(fd, entry, num,
+                                   (const struct sockaddr *) &self->resolver.nsaddr_list[ns]);
+            bool starving;
+            size_t awaiting = BindResolver_countAwaiting(entry, num, &starving);
+
+            uint64_t now = BindResolver_getMonotonicMsec();
+            uint64_t deadline = now + (uint64_t) self->resolver.retrans * 1000;
+            while (0 < awaiting && 0 < remaining && now < deadline) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+                int nready = poll(&pfd, 1, (int) (deadline - now));
+                now = BindResolver_getMonotonicMsec();
+                if (0 > nready) {
+                    if (EINTR == errno) {
+                        continue;
+                    }   // end if
+                    break;
+                }   // end if
+                if (0 == nready) {
+                    break;
+                }   // end if
+                BindResolverBatchEntry *settled =
+                    BindResolver_receiveBatchResponse(self, fd, entry, num, NULL, now);
+                if (NULL != settled) {
+                    settled->settled = now;
+                    if (!settled->speculative) {
+                        --remaining;
+                    }   // end if
+                }   // end if
+                awaiting = BindResolver_countAwaiting(entry, num, &starving);
+            }   // end while
+        }   // end for
+    }   // end for
+}   // end function: BindResolver_exchangeBatch
+
+/*
+ * exchange a batch with the nameservers in the hedged manner as DnsRttTable_exchange() does,
+ * that is, send the queries not settled yet to the next nameserver after the hedging delay
+ * of the previous one, and take the responses from any of them until the timeout.
+ * the RTTs and the failures observed are recorded to self->rtt_table.
+ * @param remaining the number of the non-speculative queries not settled yet.
+ */
+static void
+BindResolver_hedgeBatch(BindResolver *self, int fd, BindResolverBatchEntry *entry, size_t num,
+                        size_t remaining)
+{
+    // order the nameservers, those which have failed consecutively last
+    int nsnum = MIN(self->resolver.nscount, MAXNS);
+    int order[MAXNS];
+    unsigned int failure_count[MAXNS];
+    for (int i = 0; i < nsnum; ++i) {
+        unsigned int failure =
+            DnsRttTable_getFailureCount(self->rtt_table,
+                                        (const struct sockaddr *) &self->resolver.nsaddr_list[i],
+                                        sizeof(struct sockaddr_in));
+        int pos = i;
+        for (; 0 < pos && failure < failure_count[pos - 1]; --pos) {
+            order[pos] = order[pos - 1];
+            failure_count[pos] = failure_count[pos - 1];
+        }   // end for
+        order[pos] = i;
+        failure_count[pos] = failure;
+    }   // end for
+
+    BindResolverBatchServer server[MAXNS];
+    memset(server, 0, sizeof(server));
+    int sentnum = 0;
+    uint64_t now = BindResolver_getMonotonicMsec();
+    uint64_t deadline =
+        now + (uint64_t) self->resolver.retrans * 1000 * MAX(self->resolver.retry, 1);
+    uint64_t next_send = now;
+    while (0 < remaining && now < deadline) {
+        if (sentnum < nsnum && next_send <= now) {
+            int ns = order[sentnum++];
+            const struct sockaddr *addr = (const struct sockaddr *) &self->resolver.nsaddr_list[ns];
+            BindResolver_sendBatch(fd, entry, num, addr);
+            server[ns].sent_at = now;
+            next_send = now + DnsRttTable_getHedgeDelay(self->rtt_table, addr,
+                                                        sizeof(struct sockaddr_in));
+        } else {
+            uint64_t wait = deadline - now;
+            if (sentnum < nsnum && next_send - now < wait) {
+                wait = next_send - now;
+            }   // end if
+            struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+            int nready = poll(&pfd, 1, (int) wait);
+            now = BindResolver_getMonotonicMsec();
+            if (0 > nready) {
+                if (EINTR == errno) {
+                    continue;
+                }   // end if
+                break;
+            }   // end if
+            if (0 == nready) {
+                continue;   // time to send to the next nameserver or to give up
+            }   // end if
+            BindResolverBatchEntry *settled =
+                BindResolver_receiveBatchResponse(self, fd, entry, num, server, now);
+            if (NULL != settled) {
+                settled->settled = now;
+                if (!settled->speculative) {
+                    --remaining;
+                }   // end if
+            }   // end if
+        }   // end if
+        bool starving;
+        size_t awaiting = BindResolver_countAwaiting(entry, num, &starving);
+        if (starving && sentnum < nsnum) {
+            next_send = now;    // ask the next nameserver at once
+        } else if (0 == awaiting && sentnum == nsnum) {
+            break;  // all the nameservers have answered badly
+        }   // end if
+    }   // end while
+
+    // the nameservers which haven't responded at all
+    for (int i = 0; i < sentnum; ++i) {
+        int ns = order[i];
+        if (!server[ns].responded) {
+            DnsRttTable_updateFailure(self->rtt_table,
+                                      (const struct sockaddr *) &self->resolver.nsaddr_list[ns],
+                                      sizeof(struct sockaddr_in));
+        }   // end if
+    }   // end for
+}   // end function: BindResolver_hedgeBatch
+
+/*
+ * look up a single query of a batch with res_nquery().
+ */
+static dns_stat_t
+BindResolver_lookupBatchQuery(BindResolver *self, const DnsBatchQuery *query, void **resp)
+{
+    int query_stat = BindResolver_query(self, query->qname, query->rrtype);
+    if (DNS_STAT_NOERROR != query_stat) {
+        return query_stat;
+    }   // end if
+    return BindResolver_parseBatchResponse(self, query->rrtype, resp);
+}   // end function: BindResolver_lookupBatchQuery
+
+/*
+ * send multiple queries concurrently over UDP from a single socket,
+ * trying the nameservers in the same order as res_nquery() for the queries not answered yet,
+ * or in the hedged manner if the RTT table is set as the single queries are.
+ * the queries which can't be sent in this way (IPv6 nameservers, TCP mode,
+ * truncated responses) are looked up one by one.
+ * speculative queries are never waited for: they are dropped unless answered
+ * by the time all the others are settled, and never looked up one by one.
+ */
+static void
+BindResolver_lookupBatch(DnsResolver *base, DnsBatchQuery **query, size_t num)
+{
+    BindResolver *self = (BindResolver *) base;
+    BindResolverBatchEntry *entry =
+        (BindResolverBatchEntry *) malloc(sizeof(BindResolverBatchEntry) * num);
+    if (NULL == entry) {
+        for (size_t i = 0; i < num; ++i) {
+            query[i]->status = DNS_STAT_NOMEMORY;
+            query[i]->resp = NULL;
+        }   // end for
+        return;
+    }   // end if
+
+    bool udp_available = 0 < self->resolver.nscount && !(RES_USEVC & self->resolver.options);
+    for (int i = 0; i < self->resolver.nscount && i < MAXNS; ++i) {
+        if (AF_INET != self->resolver.nsaddr_list[i].sin_family) {
+            udp_available = false;
+        }   // end if
+    }   // end for
+    int fd = udp_available ? socket(AF_INET, SOCK_DGRAM, 0) : -1;
+
+    uint64_t start = BindResolver_getMonotonicMsec();
+    // the number of the non-speculative queries not settled yet
+    size_t remaining = 0;
+    for (size_t i = 0; i < num; ++i) {
+        BindResolverBatchEntry *e = &entry[i];
+        e->msgbuf = NULL;
+        e->msglen = 0;
+        e->bad_rcode = -1;
+        e->awaiting = 0;
+        e->speculative = query[i]->speculative;
+        e->querylen = 0 <= fd ? res_nmkquery(&self->resolver, ns_o_query, query[i]->qname, ns_c_in,
+                                             query[i]->rrtype, NULL, 0, NULL, e->query,
+                                             sizeof(e->query)) : -1;
+        e->fallback = 0 > e->querylen;
+        if (!e->fallback && !e->speculative) {
+            ++remaining;
+        }   // end if
+    }   // end for
+
+    if (0 < remaining) {
+        if (NULL != self->rtt_table && 2 <= MIN(self->resolver.nscount, MAXNS)) {
+            BindResolver_hedgeBatch(self, fd, entry, num, remaining);
+        } else {
+            BindResolver_exchangeBatch(self, fd, entry, num, remaining);
+        }   // end if
+        BindResolver_drainBatch(self, fd, entry, num);
+    }   // end if
+    if (0 <= fd) {
+        close(fd);
+    }   // end if
+
+    for (size_t i = 0; i < num; ++i) {
+        BindResolverBatchEntry *e = &entry[i];
+        void *resp = NULL;
+        dns_stat_t status;
+        query[i]->dropped = false;
+        if (e->speculative && NULL == e->msgbuf) {
+            query[i]->dropped = true;
+            query[i]->status = DNS_STAT_RESOLVER;
+            query[i]->resp = NULL;
+            continue;
+        }   // end if
+        if (e->fallback) {
+            status = BindResolver_lookupBatchQuery(self, query[i], &resp);
+            e->settled = BindResolver_getMonotonicMsec();
+        } else if (NULL != e->msgbuf) {
+            BindResolver_resetErrorState(self);
+            memcpy(self->msgbuf, e->msgbuf, e->msglen);
+            self->msglen = e->msglen;
+            free(e->msgbuf);
+            status = BindResolver_initMessage(self);
+            if (DNS_STAT_NOERROR == status) {
+                status = BindResolver_parseBatchResponse(self, query[i]->rrtype, &resp);
+            }   // end if
+        } else {
+            // no acceptable response, mapped in the same manner as res_nquery()
+            int herrno = (0 > e->bad_rcode || ns_r_servfail == e->bad_rcode) ? TRY_AGAIN : NO_RECOVERY;
+            status = BindResolver_setHerrno(self, herrno);
+            e->settled = BindResolver_getMonotonicMsec();
+        }   // end if
+        query[i]->status = status;
+        query[i]->resp = resp;
+        query[i]->elapsed = start < e->settled ? (e->settled - start) * 1000 : 0;
+    }   // end for
+    free(entry);
+}   // end function: BindResolver_lookupBatch
+
 static dns_stat_t
 BindResolver_lookupPtr(DnsResolver *base, sa_family_t sa_family, const void *addr,
                        DnsPtrResponse **resp)
@@ -455,6 +1044,9 @@ BindResolver_lookupPtr(DnsResolver *base, sa_family_t sa_family, const void *add
         if (0 != parse_stat) {
             goto formerr;
         }   // end if
+        if (0 == n || ns_rr_ttl(rr) < respobj->ttl) {
+            respobj->ttl = ns_rr_ttl(rr);
+        }   // end if
         if (ns_t_ptr != ns_rr_type(rr)) {
             continue;
         }   // end if
@@ -517,12 +1109,15 @@ static const struct DnsResolver_vtbl BindResolver_vtbl = {
     BindResolver_getErrorSymbol,
     BindResolver_setTimeout,
     BindResolver_setRetryCount,
+    BindResolver_getTimeout,
+    BindResolver_getRetryCount,
     BindResolver_lookupA,
     BindResolver_lookupAaaa,
     BindResolver_lookupMx,
     BindResolver_lookupTxt,
     BindResolver_lookupSpf,
     BindResolver_lookupPtr,
+    BindResolver_lookupBatch,
 };
 
 DnsResolver *
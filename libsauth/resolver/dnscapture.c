@@ -0,0 +1,631 @@
+/*
+ * Copyright (c) 2008-2014 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * Capture of DNS lookups to reproduce the workload of production offline.
+ *
+ * A recorder appends every lookup made through the attached resolvers to a log file,
+ * and a replayer answers lookups from the log instead of the resolver engine.
+ * When the same (qname, qtype) pair is recorded more than once, the replayer
+ * returns the recorded answers in the recorded order, and starts over after the last one.
+ *
+ * The log file begins with the 8 bytes magic "YDNSCAP1", followed by records.
+ * All integers are in network byte order.
+ *   uint32 latency (in microseconds)
+ *   uint16 qtype
+ *   uint16 status (dns_stat_t)
+ *   uint8  length of qname
+ *   qname (lower case without the trailing dot)
+ *   uint16 the number of answers, 0 unless status is NOERROR
+ *   answers:
+ *     A:             4 bytes address
+ *     AAAA:          16 bytes address
+ *     MX:            uint16 preference, uint16 length, exchange
+ *     TXT, SPF, PTR: uint16 length, data
+ * TTLs are not recorded, the replayed answers have TTL 0 so that nothing caches them.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+
+#include "loghandler.h"
+#include "xbuffer.h"
+#include "dnsresolv.h"
+#include "dnscapture.h"
+
+#define DNS_CAPTURE_MAGIC "YDNSCAP1"
+#define DNS_CAPTURE_MAGIC_LEN (sizeof(DNS_CAPTURE_MAGIC) - 1)
+#define DNS_CAPTURE_BUCKET_NUM 4093
+
+typedef struct DnsCaptureAnswer {
+    uint32_t latency;   // in microseconds
+    dns_stat_t status;
+    uint16_t ancount;
+    const unsigned char *rdata; // points into DnsCapture::image
+} DnsCaptureAnswer;
+
+typedef struct DnsCaptureEntry {
+    struct DnsCaptureEntry *next;
+    uint16_t rrtype;
+    size_t answer_num;
+    size_t answer_cap;
+    size_t cursor;
+    DnsCaptureAnswer *answer;
+    char qname[];
+} DnsCaptureEntry;
+
+struct DnsCapture {
+    // recorder
+    int fd;
+    // replayer
+    pthread_mutex_t lock;
+    unsigned char *image;
+    double latency_scale;
+    size_t entry_num;
+    DnsCaptureEntry *bucket[DNS_CAPTURE_BUCKET_NUM];
+};
+
+/*
+ * normalize a domain name into lower case without the trailing dot
+ * @return the length of the normalized name, or 0 if the name is too long
+ */
+static size_t
+DnsCapture_normalizeName(const char *qname, char *buf, size_t buflen)
+{
+    size_t len = strlen(qname);
+    if (0 < len && '.' == qname[len - 1]) {
+        --len;
+    }   // end if
+    if (buflen <= len) {
+        return 0;
+    }   // end if
+    for (size_t i = 0; i < len; ++i) {
+        buf[i] = tolower((unsigned char) qname[i]);
+    }   // end for
+    buf[len] = '\0';
+    return len;
+}   // end function: DnsCapture_normalizeName
+
+static unsigned int
+DnsCapture_hash(const char *qname, uint16_t rrtype)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (const char *p = qname; '\0' != *p; ++p) {
+        hash ^= (uint32_t) (unsigned char) *p;
+        hash *= 16777619U;
+    }   // end for
+    hash ^= rrtype;
+    hash *= 16777619U;
+    return hash % DNS_CAPTURE_BUCKET_NUM;
+}   // end function: DnsCapture_hash
+
+static void
+DnsCapture_append16(XBuffer *xbuf, uint16_t value)
+{
+    uint16_t nvalue = htons(value);
+    XBuffer_appendBytes(xbuf, &nvalue, sizeof(nvalue));
+}   // end function: DnsCapture_append16
+
+static void
+DnsCapture_append32(XBuffer *xbuf, uint32_t value)
+{
+    uint32_t nvalue = htonl(value);
+    XBuffer_appendBytes(xbuf, &nvalue, sizeof(nvalue));
+}   // end function: DnsCapture_append32
+
+static void
+DnsCapture_appendString(XBuffer *xbuf, const char *s)
+{
+    size_t len = strlen(s);
+    if (UINT16_MAX < len) {
+        len = UINT16_MAX;   // never happens as long as the answer fits in a DNS message
+    }   // end if
+    DnsCapture_append16(xbuf, (uint16_t) len);
+    XBuffer_appendBytes(xbuf, s, len);
+}   // end function: DnsCapture_appendString
+
+/**
+ * Appends a lookup to the log.
+ * Each record is written by a single write(2) to the file opened with O_APPEND,
+ * so that records from recorders sharing the file (across reloads) don't interleave.
+ * @param resp the response of the lookup, must be NULL unless status is DNS_STAT_NOERROR.
+ *             DnsPtrResponse is assumed to have the same layout as DnsTxtResponse.
+ * @param latency the time spent on the lookup in microseconds.
+ */
+void
+DnsCapture_record(DnsCapture *self, const char *qname, uint16_t rrtype, dns_stat_t status,
+                  const void *resp, uint64_t latency)
+{
+    assert(NULL != self);
+
+    char name[NS_MAXDNAME];
+    size_t namelen = DnsCapture_normalizeName(qname, name, sizeof(name));
+    if (0 == namelen || UINT8_MAX < namelen || 0 > self->fd) {
+        return;
+    }   // end if
+
+    XBuffer *xbuf = XBuffer_new(256);
+    if (NULL == xbuf) {
+        LogNoResource();
+        return;
+    }   // end if
+    DnsCapture_append32(xbuf, UINT32_MAX < latency ? UINT32_MAX : (uint32_t) latency);
+    DnsCapture_append16(xbuf, rrtype);
+    DnsCapture_append16(xbuf, (uint16_t) status);
+    XBuffer_appendByte(xbuf, (unsigned char) namelen);
+    XBuffer_appendBytes(xbuf, name, namelen);
+    if (DNS_STAT_NOERROR != status || NULL == resp) {
+        DnsCapture_append16(xbuf, 0);
+    } else if (ns_t_a == rrtype) {
+        const DnsAResponse *aresp = (const DnsAResponse *) resp;
+        DnsCapture_append16(xbuf, (uint16_t) aresp->num);
+        XBuffer_appendBytes(xbuf, aresp->addr, NS_INADDRSZ * aresp->num);
+    } else if (ns_t_aaaa == rrtype) {
+        const DnsAaaaResponse *aaaaresp = (const DnsAaaaResponse *) resp;
+        DnsCapture_append16(xbuf, (uint16_t) aaaaresp->num);
+        XBuffer_appendBytes(xbuf, aaaaresp->addr, NS_IN6ADDRSZ * aaaaresp->num);
+    } else if (ns_t_mx == rrtype) {
+        const DnsMxResponse *mxresp = (const DnsMxResponse *) resp;
+        DnsCapture_append16(xbuf, (uint16_t) mxresp->num);
+        for (size_t i = 0; i < mxresp->num; ++i) {
+            DnsCapture_append16(xbuf, mxresp->exchange[i]->preference);
+            DnsCapture_appendString(xbuf, mxresp->exchange[i]->domain);
+        }   // end for
+    } else {
+        const DnsTxtResponse *txtresp = (const DnsTxtResponse *) resp;
+        DnsCapture_append16(xbuf, (uint16_t) txtresp->num);
+        for (size_t i = 0; i < txtresp->num; ++i) {
+            DnsCapture_appendString(xbuf, txtresp->data[i]);
+        }   // end for
+    }   // end if
+
+    if (0 != XBuffer_status(xbuf)) {
+        LogNoResource();
+    } else if (0 > write(self->fd, XBuffer_getBytes(xbuf), XBuffer_getSize(xbuf))) {
+        LogError("failed to write DNS capture: errno=%s", strerror(errno));
+    }   // end if
+    XBuffer_free(xbuf);
+}   // end function: DnsCapture_record
+
+static uint16_t
+DnsCapture_read16(const unsigned char *p)
+{
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}   // end function: DnsCapture_read16
+
+static uint32_t
+DnsCapture_read32(const unsigned char *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}   // end function: DnsCapture_read32
+
+/*
+ * @return the length of the answers, or 0 if they overrun the tail.
+ */
+static size_t
+DnsCapture_measureAnswers(const unsigned char *head, const unsigned char *tail, uint16_t rrtype,
+                          uint16_t ancount)
+{
+    const unsigned char *p = head;
+    for (uint16_t i = 0; i < ancount; ++i) {
+        if (ns_t_a == rrtype) {
+            p += NS_INADDRSZ;
+        } else if (ns_t_aaaa == rrtype) {
+            p += NS_IN6ADDRSZ;
+        } else {
+            if (ns_t_mx == rrtype) {
+                p += 2; // preference
+            }   // end if
+            if (tail < p + 2) {
+                return 0;
+            }   // end if
+            p += 2 + DnsCapture_read16(p);
+        }   // end if
+        if (tail < p) {
+            return 0;
+        }   // end if
+    }   // end for
+    return (size_t) (p - head);
+}   // end function: DnsCapture_measureAnswers
+
+static DnsCaptureEntry *
+DnsCapture_findEntry(const DnsCapture *self, const char *qname, uint16_t rrtype)
+{
+    DnsCaptureEntry *entry = self->bucket[DnsCapture_hash(qname, rrtype)];
+    for (; NULL != entry; entry = entry->next) {
+        if (rrtype == entry->rrtype && 0 == strcmp(entry->qname, qname)) {
+            return entry;
+        }   // end if
+    }   // end for
+    return NULL;
+}   // end function: DnsCapture_findEntry
+
+static bool
+DnsCapture_addAnswer(DnsCapture *self, const char *qname, uint16_t rrtype,
+                     const DnsCaptureAnswer *answer)
+{
+    DnsCaptureEntry *entry = DnsCapture_findEntry(self, qname, rrtype);
+    if (NULL == entry) {
+        size_t namelen = strlen(qname);
+        entry = (DnsCaptureEntry *) malloc(sizeof(DnsCaptureEntry) + namelen + 1);
+        if (NULL == entry) {
+            return false;
+        }   // end if
+        memset(entry, 0, sizeof(DnsCaptureEntry));
+        entry->rrtype = rrtype;
+        memcpy(entry->qname, qname, namelen + 1);
+        unsigned int pos = DnsCapture_hash(qname, rrtype);
+        entry->next = self->bucket[pos];
+        self->bucket[pos] = entry;
+        ++self->entry_num;
+    }   // end if
+    if (entry->answer_cap <= entry->answer_num) {
+        size_t newcap = 0 < entry->answer_cap ? entry->answer_cap * 2 : 1;
+        DnsCaptureAnswer *newanswer =
+            (DnsCaptureAnswer *) realloc(entry->answer, newcap * sizeof(DnsCaptureAnswer));
+        if (NULL == newanswer) {
+            return false;
+        }   // end if
+        entry->answer = newanswer;
+        entry->answer_cap = newcap;
+    }   // end if
+    entry->answer[entry->answer_num++] = *answer;
+    return true;
+}   // end function: DnsCapture_addAnswer
+
+static bool
+DnsCapture_load(DnsCapture *self, const char *filename)
+{
+    bool result = false;
+    FILE *fp = fopen(filename, "rb");
+    if (NULL == fp) {
+        LogError("failed to open DNS capture: file=%s, errno=%s", filename, strerror(errno));
+        return false;
+    }   // end if
+    struct stat st;
+    if (0 != fstat(fileno(fp), &st)) {
+        LogError("fstat failed: file=%s, errno=%s", filename, strerror(errno));
+        goto cleanup;
+    }   // end if
+    size_t size = (size_t) st.st_size;
+    self->image = (unsigned char *) malloc(0 < size ? size : 1);
+    if (NULL == self->image) {
+        LogNoResource();
+        goto cleanup;
+    }   // end if
+    if (size != fread(self->image, 1, size, fp)) {
+        LogError("failed to read DNS capture: file=%s", filename);
+        goto cleanup;
+    }   // end if
+    if (size < DNS_CAPTURE_MAGIC_LEN
+        || 0 != memcmp(self->image, DNS_CAPTURE_MAGIC, DNS_CAPTURE_MAGIC_LEN)) {
+        LogError("not a DNS capture: file=%s", filename);
+        goto cleanup;
+    }   // end if
+
+    size_t record_num = 0;
+    const unsigned char *tail = self->image + size;
+    const unsigned char *p = self->image + DNS_CAPTURE_MAGIC_LEN;
+    while (p < tail) {
+        // latency(4) + qtype(2) + status(2) + qname length(1)
+        if (tail < p + 9 || tail < p + 9 + p[8] + 2) {
+            LogWarning("DNS capture is truncated: file=%s, records=%zu", filename, record_num);
+            break;
+        }   // end if
+        DnsCaptureAnswer answer;
+        answer.latency = DnsCapture_read32(p);
+        uint16_t rrtype = DnsCapture_read16(p + 4);
+        answer.status = (dns_stat_t) DnsCapture_read16(p + 6);
+        char qname[UINT8_MAX + 1];
+        memcpy(qname, p + 9, p[8]);
+        qname[p[8]] = '\0';
+        p += 9 + p[8];
+        answer.ancount = DnsCapture_read16(p);
+        answer.rdata = p + 2;
+        p += 2;
+        size_t rdatalen = DnsCapture_measureAnswers(p, tail, rrtype, answer.ancount);
+        if (0 < answer.ancount && 0 == rdatalen) {
+            LogWarning("DNS capture is truncated: file=%s, records=%zu", filename, record_num);
+            break;
+        }   // end if
+        p += rdatalen;
+        if (!DnsCapture_addAnswer(self, qname, rrtype, &answer)) {
+            LogNoResource();
+            goto cleanup;
+        }   // end if
+        ++record_num;
+    }   // end while
+    LogInfo("DNS capture loaded: file=%s, records=%zu, queries=%zu", filename, record_num,
+            self->entry_num);
+    result = true;
+
+  cleanup:
+    fclose(fp);
+    return result;
+}   // end function: DnsCapture_load
+
+static void
+DnsCapture_sleep(uint64_t usec)
+{
+    if (0 == usec) {
+        return;
+    }   // end if
+    struct timespec ts;
+    ts.tv_sec = (time_t) (usec / 1000000);
+    ts.tv_nsec = (long) (usec % 1000000) * 1000;
+    while (0 != nanosleep(&ts, &ts) && EINTR == errno);
+}   // end function: DnsCapture_sleep
+
+static char *
+DnsCapture_readString(const unsigned char **p)
+{
+    uint16_t len = DnsCapture_read16(*p);
+    char *s = (char *) malloc(len + 1);
+    if (NULL != s) {
+        memcpy(s, *p + 2, len);
+        s[len] = '\0';
+    }   // end if
+    *p += 2 + len;
+    return s;
+}   // end function: DnsCapture_readString
+
+/*
+ * build a response object from the recorded answers.
+ * DnsPtrResponse is built as DnsTxtResponse since they have the same layout.
+ */
+static dns_stat_t
+DnsCapture_buildResponse(const DnsCaptureAnswer *answer, uint16_t rrtype, void **resp)
+{
+    const unsigned char *p = answer->rdata;
+    size_t num = answer->ancount;
+    if (ns_t_a == rrtype) {
+        DnsAResponse *aresp =
+            (DnsAResponse *) malloc(sizeof(DnsAResponse) + num * sizeof(struct in_addr));
+        if (NULL == aresp) {
+            return DNS_STAT_NOMEMORY;
+        }   // end if
+        memcpy(aresp->addr, p, num * NS_INADDRSZ);
+        aresp->num = num;
+        aresp->ttl = 0;
+        *resp = aresp;
+    } else if (ns_t_aaaa == rrtype) {
+        DnsAaaaResponse *aaaaresp =
+            (DnsAaaaResponse *) malloc(sizeof(DnsAaaaResponse) + num * sizeof(struct in6_addr));
+        if (NULL == aaaaresp) {
+            return DNS_STAT_NOMEMORY;
+        }   // end if
+        memcpy(aaaaresp->addr, p, num * NS_IN6ADDRSZ);
+        aaaaresp->num = num;
+        aaaaresp->ttl = 0;
+        *resp = aaaaresp;
+    } else if (ns_t_mx == rrtype) {
+        DnsMxResponse *mxresp =
+            (DnsMxResponse *) malloc(sizeof(DnsMxResponse) + num * sizeof(struct mxentry *));
+        if (NULL == mxresp) {
+            return DNS_STAT_NOMEMORY;
+        }   // end if
+        mxresp->num = 0;
+        mxresp->ttl = 0;
+        for (size_t i = 0; i < num; ++i) {
+            uint16_t preference = DnsCapture_read16(p);
+            uint16_t len = DnsCapture_read16(p + 2);
+            struct mxentry *entry = (struct mxentry *) malloc(sizeof(struct mxentry) + len + 1);
+            if (NULL == entry) {
+                DnsMxResponse_free(mxresp);
+                return DNS_STAT_NOMEMORY;
+            }   // end if
+            entry->preference = preference;
+            memcpy(entry->domain, p + 4, len);
+            entry->domain[len] = '\0';
+            mxresp->exchange[mxresp->num++] = entry;
+            p += 4 + len;
+        }   // end for
+        *resp = mxresp;
+    } else {
+        DnsTxtResponse *txtresp =
+            (DnsTxtResponse *) malloc(sizeof(DnsTxtResponse) + num * sizeof(char *));
+        if (NULL == txtresp) {
+            return DNS_STAT_NOMEMORY;
+        }   // end if
+        txtresp->num = 0;
+        txtresp->ttl = 0;
+        for (size_t i = 0; i < num; ++i) {
+            char *data = DnsCapture_readString(&p);
+            if (NULL == data) {
+                DnsTxtResponse_free(txtresp);
+                return DNS_STAT_NOMEMORY;
+            }   // end if
+            txtresp->data[txtresp->num++] = data;
+        }   // end for
+        *resp = txtresp;
+    }   // end if
+    return DNS_STAT_NOERROR;
+}   // end function: DnsCapture_buildResponse
+
+/**
+ * Answers a lookup from the log, sleeping for the recorded latency multiplied by the scale.
+ * @param status the recorded status is stored, or DNS_STAT_NOMEMORY.
+ * @param resp the response object is stored if status is DNS_STAT_NOERROR.
+ * @param latency if not NULL, the recorded latency is stored instead of sleeping for it,
+ *                so that concurrent lookups can be delayed at once with DnsCapture_delay().
+ * @return true if the lookup is recorded, false otherwise.
+ */
+bool
+DnsCapture_replay(DnsCapture *self, const char *qname, uint16_t rrtype, dns_stat_t *status,
+                  void **resp, uint64_t *latency)
+{
+    assert(NULL != self);
+
+    char name[NS_MAXDNAME];
+    if (0 == DnsCapture_normalizeName(qname, name, sizeof(name))) {
+        return false;
+    }   // end if
+    DnsCaptureEntry *entry = DnsCapture_findEntry(self, name, rrtype);
+    if (NULL == entry) {
+        return false;
+    }   // end if
+
+    // entries are immutable after loading except for the cursor
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return false;
+    }   // end if
+    const DnsCaptureAnswer *answer = &entry->answer[entry->cursor];
+    entry->cursor = (entry->cursor + 1) % entry->answer_num;
+    ret = pthread_mutex_unlock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+
+    if (NULL != latency) {
+        *latency = answer->latency;
+    } else {
+        DnsCapture_delay(self, answer->latency);
+    }   // end if
+    *status = answer->status;
+    if (DNS_STAT_NOERROR == answer->status) {
+        *status = DnsCapture_buildResponse(answer, rrtype, resp);
+    }   // end if
+    return true;
+}   // end function: DnsCapture_replay
+
+/**
+ * Sleeps for the latency multiplied by the scale.
+ * @param latency in microseconds.
+ */
+void
+DnsCapture_delay(const DnsCapture *self, uint64_t latency)
+{
+    DnsCapture_sleep((uint64_t) (latency * self->latency_scale));
+}   // end function: DnsCapture_delay
+
+bool
+DnsCapture_isReplayer(const DnsCapture *self)
+{
+    return NULL != self->image;
+}   // end function: DnsCapture_isReplayer
+
+static DnsCapture *
+DnsCapture_new(void)
+{
+    DnsCapture *self = (DnsCapture *) malloc(sizeof(DnsCapture));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(DnsCapture));
+    self->fd = -1;
+
+    int ret = pthread_mutex_init(&self->lock, NULL);
+    if (0 != ret) {
+        free(self);
+        return NULL;
+    }   // end if
+    return self;
+}   // end function: DnsCapture_new
+
+/**
+ * @param filename the log file to append lookups to, created if it doesn't exist.
+ */
+DnsCapture *
+DnsCapture_newRecorder(const char *filename)
+{
+    DnsCapture *self = DnsCapture_new();
+    if (NULL == self) {
+        LogNoResource();
+        return NULL;
+    }   // end if
+    self->fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (0 > self->fd) {
+        LogError("failed to open DNS capture: file=%s, errno=%s", filename, strerror(errno));
+        goto cleanup;
+    }   // end if
+    struct stat st;
+    if (0 != fstat(self->fd, &st)) {
+        LogError("fstat failed: file=%s, errno=%s", filename, strerror(errno));
+        goto cleanup;
+    }   // end if
+    if (0 == st.st_size
+        && (ssize_t) DNS_CAPTURE_MAGIC_LEN
+           != write(self->fd, DNS_CAPTURE_MAGIC, DNS_CAPTURE_MAGIC_LEN)) {
+        LogError("failed to write DNS capture: file=%s, errno=%s", filename, strerror(errno));
+        goto cleanup;
+    }   // end if
+    return self;
+
+  cleanup:
+    DnsCapture_free(self);
+    return NULL;
+}   // end function: DnsCapture_newRecorder
+
+/**
+ * @param filename the log file written by a recorder.
+ * @param latency_scale the factor applied to the recorded latencies, 0 to answer immediately.
+ */
+DnsCapture *
+DnsCapture_newReplayer(const char *filename, double latency_scale)
+{
+    DnsCapture *self = DnsCapture_new();
+    if (NULL == self) {
+        LogNoResource();
+        return NULL;
+    }   // end if
+    self->latency_scale = 0.0 < latency_scale ? latency_scale : 0.0;
+    if (!DnsCapture_load(self, filename)) {
+        DnsCapture_free(self);
+        return NULL;
+    }   // end if
+    return self;
+}   // end function: DnsCapture_newReplayer
+
+void
+DnsCapture_free(DnsCapture *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    if (0 <= self->fd) {
+        close(self->fd);
+    }   // end if
+    for (size_t i = 0; i < DNS_CAPTURE_BUCKET_NUM; ++i) {
+        DnsCaptureEntry *entry = self->bucket[i];
+        while (NULL != entry) {
+            DnsCaptureEntry *next = entry->next;
+            free(entry->answer);
+            free(entry);
+            entry = next;
+        }   // end while
+    }   // end for
+    free(self->image);
+    (void) pthread_mutex_destroy(&self->lock);
+    free(self);
+}   // end function: DnsCapture_free
@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2008-2014 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "loghandler.h"
+#include "keywordmap.h"
+#include "dnsresolv.h"
+#include "dnscircuitbreaker.h"
+
+#define DNS_CIRCUIT_BUCKET_NUM 1021
+#define DNS_CIRCUIT_MAX_ZONES 4096
+// the number of labels of the zone name used without the public suffix list
+#define DNS_CIRCUIT_ZONE_LABELS 3
+
+typedef struct DnsCircuitEntry {
+    struct DnsCircuitEntry *next;
+    DnsCircuitState state;
+    unsigned int query_count;
+    unsigned int failure_count;
+    time_t window_start;
+    time_t opened_at;
+    bool probing;   // a probe is in flight while half-open
+    char zone[];
+} DnsCircuitEntry;
+
+struct DnsCircuitBreaker {
+    pthread_mutex_t lock;
+    unsigned int threshold;     // failure rate in percent to open the breaker
+    unsigned int min_queries;   // the number of lookups needed to judge the failure rate
+    time_t window;
+    time_t cooling_time;
+    const PublicSuffix *public_suffix;
+    size_t entry_num;
+    DnsCircuitEntry *bucket[DNS_CIRCUIT_BUCKET_NUM];
+};
+
+static const KeywordMap dns_circuit_state_tbl[] = {
+    {"closed", DNS_CIRCUIT_CLOSED},
+    {"open", DNS_CIRCUIT_OPEN},
+    {"half-open", DNS_CIRCUIT_HALF_OPEN},
+    {NULL, DNS_CIRCUIT_CLOSED},
+};
+
+static time_t
+DnsCircuitBreaker_now(void)
+{
+    struct timespec ts;
+    if (0 != clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        return time(NULL);
+    }   // end if
+    return ts.tv_sec;
+}   // end function: DnsCircuitBreaker_now
+
+/*
+ * 問い合わせ名から状態を管理するゾーン名を取り出す.
+ * "_" で始まるラベル (_spf, _domainkey, _dmarc, _adsp など) とそれより左側のラベルを取り除き,
+ * SPF の include 先, DKIM のセレクタ, DMARC レコードを参照元のドメインにまとめる.
+ * さらに組織ドメイン (Public Suffix List がない場合は右側の DNS_CIRCUIT_ZONE_LABELS 個のラベル) に
+ * 切り詰め, ホスト名ごとにエントリが作られないようにする.
+ * @return the length of the zone name
+ */
+static size_t
+DnsCircuitBreaker_extractZone(const DnsCircuitBreaker *self, const char *qname, const char **zone)
+{
+    const char *head = qname;
+    for (const char *p = qname; '\0' != *p; ++p) {
+        if ('_' == *p && (p == qname || '.' == *(p - 1))) {
+            const char *dot = strchr(p, '.');
+            if (NULL == dot) {
+                break;
+            }   // end if
+            head = dot + 1;
+            p = dot;
+        }   // end if
+    }   // end for
+    size_t len = strlen(head);
+    if (0 < len && '.' == head[len - 1]) {
+        --len;
+    }   // end if
+
+    const char *orgdomain = NULL;
+    if (NULL != self->public_suffix && 0 < len) {
+        orgdomain = PublicSuffix_getOrganizationalDomain(self->public_suffix, head);
+    }   // end if
+    if (NULL == orgdomain) {
+        orgdomain = head + len;
+        for (int labels = 0; head < orgdomain && labels < DNS_CIRCUIT_ZONE_LABELS; ++labels) {
+            for (--orgdomain; head < orgdomain && '.' != *(orgdomain - 1); --orgdomain);
+        }   // end for
+    }   // end if
+    *zone = orgdomain;
+    return len - (size_t) (orgdomain - head);
+}   // end function: DnsCircuitBreaker_extractZone
+
+static unsigned int
+DnsCircuitBreaker_hash(const char *zone, size_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint32_t) tolower((unsigned char) zone[i]);
+        hash *= 16777619U;
+    }   // end for
+    return hash % DNS_CIRCUIT_BUCKET_NUM;
+}   // end function: DnsCircuitBreaker_hash
+
+static DnsCircuitEntry *
+DnsCircuitBreaker_find(DnsCircuitBreaker *self, unsigned int hash, const char *zone, size_t len)
+{
+    for (DnsCircuitEntry *entry = self->bucket[hash]; NULL != entry; entry = entry->next) {
+        if (0 == strncasecmp(entry->zone, zone, len) && '\0' == entry->zone[len]) {
+            return entry;
+        }   // end if
+    }   // end for
+    return NULL;
+}   // end function: DnsCircuitBreaker_find
+
+/*
+ * 上限に達している場合は, 観測期間が過ぎて閉じている状態のエントリを捨てて空きを作る.
+ * @return true if there is room for a new entry, false otherwise.
+ */
+static bool
+DnsCircuitBreaker_purge(DnsCircuitBreaker *self, time_t now)
+{
+    if (self->entry_num < DNS_CIRCUIT_MAX_ZONES) {
+        return true;
+    }   // end if
+    for (size_t i = 0; i < DNS_CIRCUIT_BUCKET_NUM; ++i) {
+        DnsCircuitEntry **pp = &self->bucket[i];
+        while (NULL != *pp) {
+            DnsCircuitEntry *entry = *pp;
+            if (DNS_CIRCUIT_CLOSED == entry->state && entry->window_start + self->window <= now) {
+                *pp = entry->next;
+                free(entry);
+                --self->entry_num;
+            } else {
+                pp = &entry->next;
+            }   // end if
+        }   // end while
+    }   // end for
+    return self->entry_num < DNS_CIRCUIT_MAX_ZONES;
+}   // end function: DnsCircuitBreaker_purge
+
+static DnsCircuitEntry *
+DnsCircuitBreaker_insert(DnsCircuitBreaker *self, unsigned int hash, const char *zone, size_t len,
+                         time_t now)
+{
+    if (!DnsCircuitBreaker_purge(self, now)) {
+        return NULL;
+    }   // end if
+    DnsCircuitEntry *entry = (DnsCircuitEntry *) malloc(sizeof(DnsCircuitEntry) + len + 1);
+    if (NULL == entry) {
+        LogNoResource();
+        return NULL;
+    }   // end if
+    memset(entry, 0, sizeof(DnsCircuitEntry));
+    for (size_t i = 0; i < len; ++i) {
+        entry->zone[i] = tolower((unsigned char) zone[i]);
+    }   // end for
+    entry->zone[len] = '\0';
+    entry->state = DNS_CIRCUIT_CLOSED;
+    entry->window_start = now;
+    entry->next = self->bucket[hash];
+    self->bucket[hash] = entry;
+    ++self->entry_num;
+    return entry;
+}   // end function: DnsCircuitBreaker_insert
+
+static void
+DnsCircuitBreaker_open(DnsCircuitBreaker *self, DnsCircuitEntry *entry, time_t now)
+{
+    entry->state = DNS_CIRCUIT_OPEN;
+    entry->opened_at = now;
+    entry->probing = false;
+    LogNotice("DNS circuit breaker opened: zone=%s, failure=%u/%u, cooling=%ds", entry->zone,
+              entry->failure_count, entry->query_count, (int) self->cooling_time);
+}   // end function: DnsCircuitBreaker_open
+
+/**
+ * Checks whether a lookup for the given name may be sent.
+ * Once the cooling-off period of an open breaker has passed, the breaker becomes half-open
+ * and only one lookup at a time is allowed as a probe.
+ * @return true if the lookup may be sent, false if it should fail immediately.
+ */
+bool
+DnsCircuitBreaker_allow(DnsCircuitBreaker *self, const char *qname)
+{
+    assert(NULL != self);
+
+    const char *zone;
+    size_t len = DnsCircuitBreaker_extractZone(self, qname, &zone);
+    unsigned int hash = DnsCircuitBreaker_hash(zone, len);
+
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return true;
+    }   // end if
+
+    bool allowed = true;
+    DnsCircuitEntry *entry = DnsCircuitBreaker_find(self, hash, zone, len);
+    if (NULL != entry) {
+        time_t now = DnsCircuitBreaker_now();
+        switch (entry->state) {
+        case DNS_CIRCUIT_OPEN:
+            if (entry->opened_at + self->cooling_time <= now) {
+                entry->state = DNS_CIRCUIT_HALF_OPEN;
+                entry->probing = true;
+                entry->opened_at = now;
+            } else {
+                allowed = false;
+            }   // end if
+            break;
+        case DNS_CIRCUIT_HALF_OPEN:
+            if (entry->probing && now < entry->opened_at + self->cooling_time) {
+                allowed = false;
+            } else {
+                // the previous probe has been lost; send another one
+                entry->probing = true;
+                entry->opened_at = now;
+            }   // end if
+            break;
+        case DNS_CIRCUIT_CLOSED:
+        default:
+            break;
+        }   // end switch
+    }   // end if
+
+    ret = pthread_mutex_unlock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+
+    return allowed;
+}   // end function: DnsCircuitBreaker_allow
+
+/**
+ * Checks whether the breaker for the given name is closed without changing its state,
+ * so that a lookup which is not reported doesn't take the place of the probe.
+ * @return true if the breaker is closed, false otherwise.
+ */
+bool
+DnsCircuitBreaker_isClosed(DnsCircuitBreaker *self, const char *qname)
+{
+    assert(NULL != self);
+
+    const char *zone;
+    size_t len = DnsCircuitBreaker_extractZone(self, qname, &zone);
+    unsigned int hash = DnsCircuitBreaker_hash(zone, len);
+
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return true;
+    }   // end if
+
+    const DnsCircuitEntry *entry = DnsCircuitBreaker_find(self, hash, zone, len);
+    bool closed = NULL == entry || DNS_CIRCUIT_CLOSED == entry->state;
+
+    ret = pthread_mutex_unlock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+
+    return closed;
+}   // end function: DnsCircuitBreaker_isClosed
+
+/**
+ * Records the result of a lookup.
+ * Timeouts and SERVFAIL count as failures, any other response from the authoritative
+ * servers (including NXDOMAIN and NODATA) counts as success.
+ */
+void
+DnsCircuitBreaker_report(DnsCircuitBreaker *self, const char *qname, dns_stat_t status)
+{
+    assert(NULL != self);
+
+    bool failed;
+    switch (status) {
+    case DNS_STAT_SERVFAIL:
+    case DNS_STAT_RESOLVER:    // includes timeouts
+        failed = true;
+        break;
+    case DNS_STAT_NOMEMORY:
+    case DNS_STAT_RESOLVER_INTERNAL:
+    case DNS_STAT_BADREQUEST:
+        return; // local failures tell nothing about the zone
+    default:
+        failed = false;
+        break;
+    }   // end switch
+
+    const char *zone;
+    size_t len = DnsCircuitBreaker_extractZone(self, qname, &zone);
+    unsigned int hash = DnsCircuitBreaker_hash(zone, len);
+
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return;
+    }   // end if
+
+    time_t now = DnsCircuitBreaker_now();
+    DnsCircuitEntry *entry = DnsCircuitBreaker_find(self, hash, zone, len);
+    if (NULL == entry && failed) {
+        // zones are tracked after their first failure to keep the table small
+        entry = DnsCircuitBreaker_insert(self, hash, zone, len, now);
+    }   // end if
+    if (NULL == entry) {
+        goto finally;
+    }   // end if
+
+    switch (entry->state) {
+    case DNS_CIRCUIT_HALF_OPEN:
+        if (failed) {
+            DnsCircuitBreaker_open(self, entry, now);
+        } else {
+            LogNotice("DNS circuit breaker closed: zone=%s", entry->zone);
+            entry->state = DNS_CIRCUIT_CLOSED;
+            entry->probing = false;
+            entry->query_count = 0;
+            entry->failure_count = 0;
+            entry->window_start = now;
+        }   // end if
+        break;
+    case DNS_CIRCUIT_CLOSED:
+        if (entry->window_start + self->window <= now) {
+            entry->query_count = 0;
+            entry->failure_count = 0;
+            entry->window_start = now;
+        }   // end if
+        ++entry->query_count;
+        if (failed) {
+            ++entry->failure_count;
+        }   // end if
+        if (self->min_queries <= entry->query_count
+            && entry->query_count * self->threshold <= entry->failure_count * 100) {
+            DnsCircuitBreaker_open(self, entry, now);
+        }   // end if
+        break;
+    case DNS_CIRCUIT_OPEN:
+    default:
+        // results of lookups sent before the breaker opened
+        break;
+    }   // end switch
+
+  finally:
+    ret = pthread_mutex_unlock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+}   // end function: DnsCircuitBreaker_report
+
+/**
+ * Calls the callback for each zone being tracked.
+ * @attention the callback is called with the lock held, so it must not block.
+ */
+void
+DnsCircuitBreaker_iterate(DnsCircuitBreaker *self, DnsCircuitBreaker_callback *callback, void *arg)
+{
+    assert(NULL != self);
+
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return;
+    }   // end if
+
+    time_t now = DnsCircuitBreaker_now();
+    for (size_t i = 0; i < DNS_CIRCUIT_BUCKET_NUM; ++i) {
+        for (DnsCircuitEntry *entry = self->bucket[i]; NULL != entry; entry = entry->next) {
+            time_t remaining = 0;
+            if (DNS_CIRCUIT_OPEN == entry->state && now < entry->opened_at + self->cooling_time) {
+                remaining = entry->opened_at + self->cooling_time - now;
+            }   // end if
+            callback(entry->zone, entry->state, entry->failure_count, entry->query_count,
+                     remaining, arg);
+        }   // end for
+    }   // end for
+
+    ret = pthread_mutex_unlock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+}   // end function: DnsCircuitBreaker_iterate
+
+const char *
+DnsCircuitBreaker_symbolizeState(DnsCircuitState state)
+{
+    return KeywordMap_lookupByValue(dns_circuit_state_tbl, state);
+}   // end function: DnsCircuitBreaker_symbolizeState
+
+/**
+ * @param threshold failure rate in percent at or above which the breaker for a zone opens.
+ * @param min_queries the number of lookups in a window needed before judging the failure rate.
+ * @param window the length of the observation window in seconds.
+ * @param cooling_time seconds to keep the breaker open before probing.
+ */
+DnsCircuitBreaker *
+DnsCircuitBreaker_new(unsigned int threshold, unsigned int min_queries, time_t window,
+                      time_t cooling_time)
+{
+    DnsCircuitBreaker *self = (DnsCircuitBreaker *) malloc(sizeof(DnsCircuitBreaker));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(DnsCircuitBreaker));
+
+    int ret = pthread_mutex_init(&self->lock, NULL);
+    if (0 != ret) {
+        free(self);
+        return NULL;
+    }   // end if
+
+    self->threshold = threshold;
+    self->min_queries = 0 < min_queries ? min_queries : 1;
+    self->window = window;
+    self->cooling_time = cooling_time;
+    return self;
+}   // end function: DnsCircuitBreaker_new
+
+/**
+ * Sets the public suffix list to aggregate lookups by the organizational domain.
+ * Without it, lookups are aggregated by the rightmost labels of the name.
+ * @param public_suffix the public suffix list, NULL to detach.
+ * @attention the public suffix list must outlive the breaker.
+ */
+void
+DnsCircuitBreaker_setPublicSuffix(DnsCircuitBreaker *self, const PublicSuffix *public_suffix)
+{
+    self->public_suffix = public_suffix;
+}   // end function: DnsCircuitBreaker_setPublicSuffix
+
+void
+DnsCircuitBreaker_free(DnsCircuitBreaker *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+
+    for (size_t i = 0; i < DNS_CIRCUIT_BUCKET_NUM; ++i) {
+        DnsCircuitEntry *entry = self->bucket[i];
+        while (NULL != entry) {
+            DnsCircuitEntry *next = entry->next;
+            free(entry);
+            entry = next;
+        }   // end while
+    }   // end for
+    (void) pthread_mutex_destroy(&self->lock);
+    free(self);
+}   // end function: DnsCircuitBreaker_free
@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/nameser.h>
 
@@ -27,6 +28,9 @@
 #include "keywordmap.h"
 #include "dnsresolv.h"
 #include "dnsresolv_internal.h"
+#include "dnscircuitbreaker.h"
+#include "dnscapture.h"
+#include "zoneresolver.h"
 
 #if defined(HAVE_LIBBIND) || defined(USE_LIBRESOLV)
 #include "bindresolver.h"
@@ -92,6 +96,129 @@ DnsPtrResponse_free(DnsPtrResponse *self)
     free(self);
 }   // end function: DnsPtrResponse_free
 
+/*
+ * free the response of the type corresponding to rrtype, such as DnsBatchQuery::resp.
+ */
+void
+DnsResolver_freeResponse(uint16_t rrtype, void *resp)
+{
+    switch (rrtype) {
+    case ns_t_a:
+        DnsAResponse_free((DnsAResponse *) resp);
+        break;
+    case ns_t_aaaa:
+        DnsAaaaResponse_free((DnsAaaaResponse *) resp);
+        break;
+    case ns_t_mx:
+        DnsMxResponse_free((DnsMxResponse *) resp);
+        break;
+    case ns_t_txt:
+    case 99 /* as ns_t_spf */:
+        DnsTxtResponse_free((DnsTxtResponse *) resp);
+        break;
+    case ns_t_ptr:
+        DnsPtrResponse_free((DnsPtrResponse *) resp);
+        break;
+    default:
+        break;
+    }   // end switch
+}   // end function: DnsResolver_freeResponse
+
+DnsAResponse *
+DnsAResponse_duplicate(const DnsAResponse *self)
+{
+    size_t size = sizeof(DnsAResponse) + sizeof(struct in_addr) * self->num;
+    DnsAResponse *copy = (DnsAResponse *) malloc(size);
+    if (NULL == copy) {
+        return NULL;
+    }   // end if
+    memcpy(copy, self, size);
+    return copy;
+}   // end function: DnsAResponse_duplicate
+
+DnsAaaaResponse *
+DnsAaaaResponse_duplicate(const DnsAaaaResponse *self)
+{
+    size_t size = sizeof(DnsAaaaResponse) + sizeof(struct in6_addr) * self->num;
+    DnsAaaaResponse *copy = (DnsAaaaResponse *) malloc(size);
+    if (NULL == copy) {
+        return NULL;
+    }   // end if
+    memcpy(copy, self, size);
+    return copy;
+}   // end function: DnsAaaaResponse_duplicate
+
+DnsMxResponse *
+DnsMxResponse_duplicate(const DnsMxResponse *self)
+{
+    DnsMxResponse *copy =
+        (DnsMxResponse *) malloc(sizeof(DnsMxResponse) + sizeof(struct mxentry *) * self->num);
+    if (NULL == copy) {
+        return NULL;
+    }   // end if
+    copy->num = 0;
+    copy->ttl = self->ttl;
+    for (size_t n = 0; n < self->num; ++n) {
+        size_t size = sizeof(struct mxentry) + strlen(self->exchange[n]->domain) + 1;
+        copy->exchange[n] = (struct mxentry *) malloc(size);
+        if (NULL == copy->exchange[n]) {
+            DnsMxResponse_free(copy);
+            return NULL;
+        }   // end if
+        memcpy(copy->exchange[n], self->exchange[n], size);
+        ++copy->num;
+    }   // end for
+    return copy;
+}   // end function: DnsMxResponse_duplicate
+
+DnsTxtResponse *
+DnsTxtResponse_duplicate(const DnsTxtResponse *self)
+{
+    DnsTxtResponse *copy =
+        (DnsTxtResponse *) malloc(sizeof(DnsTxtResponse) + sizeof(char *) * self->num);
+    if (NULL == copy) {
+        return NULL;
+    }   // end if
+    copy->num = 0;
+    copy->ttl = self->ttl;
+    for (size_t n = 0; n < self->num; ++n) {
+        copy->data[n] = strdup(self->data[n]);
+        if (NULL == copy->data[n]) {
+            DnsTxtResponse_free(copy);
+            return NULL;
+        }   // end if
+        ++copy->num;
+    }   // end for
+    return copy;
+}   // end function: DnsTxtResponse_duplicate
+
+DnsSpfResponse *
+DnsSpfResponse_duplicate(const DnsSpfResponse *self)
+{
+    return DnsTxtResponse_duplicate(self);
+}   // end function: DnsSpfResponse_duplicate
+
+DnsPtrResponse *
+DnsPtrResponse_duplicate(const DnsPtrResponse *self)
+{
+    DnsPtrResponse *copy =
+        (DnsPtrResponse *) malloc(sizeof(DnsPtrResponse) + sizeof(char *) * self->num);
+    if (NULL == copy) {
+        return NULL;
+    }   // end if
+    copy->num = 0;
+    copy->ttl = self->ttl;
+    for (size_t n = 0; n < self->num; ++n) {
+        copy->domain[n] = strdup(self->domain[n]);
+        if (NULL == copy->domain[n]) {
+            DnsPtrResponse_free(copy);
+            return NULL;
+        }   // end if
+        ++copy->num;
+    }   // end for
+    return copy;
+}   // end function: DnsPtrResponse_duplicate
+
 const char *
 DnsResolver_symbolizeErrorCode(dns_stat_t status)
 {
@@ -185,6 +312,7 @@ static const DnsResolverInitilizerMap resolver_initializer_table[] = {
 #if defined(USE_LIBRESOLV)
     {"resolv", BindResolver_new},
 #endif
+    {"zone", ZoneResolver_new},
     {NULL, NULL},   // sentinel
 };
 
@@ -206,3 +334,518 @@ DnsResolver_new(const char *modname, const char *initfile)
     DnsResolver_initializer *initializer = DnsResolver_lookupInitializer(modname);
     return NULL != initializer ? initializer(initfile) : NULL;
 }   // end function: DnsResolver_new
+
+static uint64_t
+DnsResolver_getMonotonicTime(void)
+{
+    struct timespec ts;
+    if (0 != clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        return 0;
+    }   // end if
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}   // end function: DnsResolver_getMonotonicTime
+
+/**
+ * Sets the limits of DNS lookups and clears the spend recorded so far.
+ * The time limit is a deadline counted from this call.
+ * Once either limit is reached, the subsequent lookups fail immediately
+ * with DNS_STAT_RESOLVER and DnsResolver_getErrorSymbol() returns "BUDGET_EXHAUSTED".
+ * The timeout and the retry count of each lookup are cut down
+ * so that the lookup doesn't run far beyond the deadline.
+ * @param time_limit the time allowed for lookups in milliseconds, 0 for unlimited.
+ * @param query_limit the number of lookups, 0 for unlimited.
+ */
+void
+DnsResolver_setBudget(DnsResolver *self, uint64_t time_limit, unsigned int query_limit)
+{
+    memset(&self->budget, 0, sizeof(self->budget));
+    self->budget.time_limit = time_limit * 1000;
+    self->budget.query_limit = query_limit;
+    if (0 < time_limit) {
+        self->budget.deadline = DnsResolver_getMonotonicTime() + self->budget.time_limit;
+    }   // end if
+}   // end function: DnsResolver_setBudget
+
+const DnsResolverBudget *
+DnsResolver_getBudget(const DnsResolver *self)
+{
+    return &self->budget;
+}   // end function: DnsResolver_getBudget
+
+/**
+ * Attaches the circuit breaker shared among resolvers.
+ * While the breaker for a zone is open, lookups for the zone fail immediately
+ * with DNS_STAT_RESOLVER and DnsResolver_getErrorSymbol() returns "CIRCUIT_OPEN".
+ * @param breaker the circuit breaker, NULL to detach.
+ * @attention the breaker must outlive the resolver.
+ */
+void
+DnsResolver_setCircuitBreaker(DnsResolver *self, DnsCircuitBreaker *breaker)
+{
+    self->breaker = breaker;
+}   // end function: DnsResolver_setCircuitBreaker
+
+/**
+ * Enables hedged queries.
+ * If a nameserver doesn't respond within the delay estimated from the RTT statistics,
+ * the same query is also sent to the next nameserver and the first acceptable response wins.
+ * Engines which don't support hedging ignore this setting.
+ * @param rtt_table the RTT statistics of nameservers shared among resolvers, NULL to disable.
+ * @attention the table must outlive the resolver.
+ */
+void
+DnsResolver_setHedging(DnsResolver *self, DnsRttTable *rtt_table)
+{
+    self->rtt_table = rtt_table;
+}   // end function: DnsResolver_setHedging
+
+/**
+ * Attaches the capture of DNS lookups shared among resolvers.
+ * With a recorder, every lookup is appended to the log.
+ * With a replayer, lookups are answered from the log and the engine is not used at all.
+ * Lookups not in the log fail with DNS_STAT_RESOLVER
+ * and DnsResolver_getErrorSymbol() returns "NOT_RECORDED".
+ * @param capture the capture, NULL to detach.
+ * @attention the capture must outlive the resolver.
+ */
+void
+DnsResolver_setCapture(DnsResolver *self, DnsCapture *capture)
+{
+    self->capture = capture;
+}   // end function: DnsResolver_setCapture
+
+const char *
+DnsResolver_getErrorSymbol(const DnsResolver *self)
+{
+    return NULL != self->refusal ? self->refusal : self->vtbl->getErrorSymbol(self);
+}   // end function: DnsResolver_getErrorSymbol
+
+/*
+ * cut down the timeout and the retry count of the engine to the time remaining until the deadline.
+ * the engines take the timeout in seconds, so that it is rounded up.
+ */
+static void
+DnsResolver_capTimeout(DnsResolver *self, uint64_t now)
+{
+    if (0 == self->budget.deadline || self->budget.deadline <= now) {
+        return;
+    }   // end if
+    if (!self->timeout_capped) {
+        self->saved_timeout = self->vtbl->getTimeout(self);
+        self->saved_retry = self->vtbl->getRetryCount(self);
+    }   // end if
+    uint64_t remaining = self->budget.deadline - now;
+    time_t timeout = (time_t) ((remaining + 999999) / 1000000);
+    if (0 < self->saved_timeout && self->saved_timeout < timeout) {
+        timeout = self->saved_timeout;
+    }   // end if
+    int retry = self->saved_retry;
+    uint64_t tries = remaining / 1000000 / (uint64_t) timeout;
+    if (tries < (uint64_t) retry) {
+        retry = MAX((int) tries, 1);
+    }   // end if
+    if (!self->timeout_capped && timeout == self->saved_timeout && retry == self->saved_retry) {
+        return;
+    }   // end if
+    self->vtbl->setTimeout(self, timeout);
+    self->vtbl->setRetryCount(self, retry);
+    self->timeout_capped = true;
+}   // end function: DnsResolver_capTimeout
+
+static void
+DnsResolver_restoreTimeout(DnsResolver *self)
+{
+    if (self->timeout_capped) {
+        self->vtbl->setTimeout(self, self->saved_timeout);
+        self->vtbl->setRetryCount(self, self->saved_retry);
+        self->timeout_capped = false;
+    }   // end if
+}   // end function: DnsResolver_restoreTimeout
+
+/*
+ * @param capped whether the timeout of the lookup has been cut down by DnsResolver_capTimeout().
+ * @return true if the lookup has failed by running into the deadline,
+ *         which tells nothing about the zone and shouldn't be reported to the circuit breaker.
+ */
+static bool
+DnsResolver_isCutShort(const DnsResolver *self, bool capped, dns_stat_t status, uint64_t end)
+{
+    // the engines report timeouts as either of them
+    return capped && (DNS_STAT_SERVFAIL == status || DNS_STAT_RESOLVER == status)
+        && 0 < self->budget.deadline && self->budget.deadline <= end;
+}   // end function: DnsResolver_isCutShort
+
+/**
+ * @param qname the name to look up, NULL if the circuit breaker doesn't apply.
+ * @return true if the budget and the circuit breaker allow a lookup, false otherwise.
+ */
+static bool
+DnsResolver_beginLookup(DnsResolver *self, const char *qname, uint64_t *start)
+{
+    DnsResolverBudget *budget = &self->budget;
+    uint64_t now = DnsResolver_getMonotonicTime();
+    if ((0 < budget->query_limit && budget->query_limit <= budget->query_count)
+        || (0 < budget->deadline && budget->deadline <= now)) {
+        ++budget->refused_count;
+        self->refusal = "BUDGET_EXHAUSTED";
+        return false;
+    }   // end if
+    if (NULL != self->breaker && NULL != qname && !DnsCircuitBreaker_allow(self->breaker, qname)) {
+        self->refusal = "CIRCUIT_OPEN";
+        return false;
+    }   // end if
+    self->refusal = NULL;
+    DnsResolver_capTimeout(self, now);
+    *start = now;
+    return true;
+}   // end function: DnsResolver_beginLookup
+
+/*
+ * answer a lookup from the capture instead of the engine if a replayer is attached.
+ * @return true if the lookup is answered, false if the engine should be used.
+ */
+static bool
+DnsResolver_replay(DnsResolver *self, const char *qname, uint16_t rrtype, void **resp,
+                   dns_stat_t *status)
+{
+    if (NULL == self->capture || !DnsCapture_isReplayer(self->capture)) {
+        return false;
+    }   // end if
+    if (NULL == qname || !DnsCapture_replay(self->capture, qname, rrtype, status, resp, NULL)) {
+        self->refusal = "NOT_RECORDED";
+        *status = DNS_STAT_RESOLVER;
+    } else if (DNS_STAT_NOERROR != *status) {
+        // the error symbol of the engine has nothing to do with the replayed status
+        self->refusal = DnsResolver_symbolizeErrorCode(*status);
+    }   // end if
+    return true;
+}   // end function: DnsResolver_replay
+
+/**
+ * @param qname the name looked up, NULL if the circuit breaker doesn't apply.
+ * @param capture_qname the name recorded to the capture.
+ */
+static void
+DnsResolver_endLookup(DnsResolver *self, const char *qname, const char *capture_qname,
+                      uint16_t rrtype, dns_stat_t status, void **resp, uint64_t start)
+{
+    bool capped = self->timeout_capped;
+    DnsResolver_restoreTimeout(self);
+    uint64_t end = DnsResolver_getMonotonicTime();
+    uint64_t elapsed = start < end ? end - start : 0;
+    ++self->budget.query_count;
+    self->budget.elapsed += elapsed;
+    if (NULL != self->breaker && NULL != qname
+        && !DnsResolver_isCutShort(self, capped, status, end)) {
+        DnsCircuitBreaker_report(self->breaker, qname, status);
+    }   // end if
+    if (NULL != self->capture && NULL != capture_qname && !DnsCapture_isReplayer(self->capture)) {
+        DnsCapture_record(self->capture, capture_qname, rrtype, status,
+                          DNS_STAT_NOERROR == status ? *resp : NULL, elapsed);
+    }   // end if
+}   // end function: DnsResolver_endLookup
+
+dns_stat_t
+DnsResolver_lookupA(DnsResolver *self, const char *domain, DnsAResponse **resp)
+{
+    uint64_t start;
+    if (!DnsResolver_beginLookup(self, domain, &start)) {
+        return DNS_STAT_RESOLVER;
+    }   // end if
+    dns_stat_t status;
+    if (!DnsResolver_replay(self, domain, ns_t_a, (void **) resp, &status)) {
+        status = self->vtbl->lookupA(self, domain, resp);
+    }   // end if
+    DnsResolver_endLookup(self, domain, domain, ns_t_a, status, (void **) resp, start);
+    return status;
+}   // end function: DnsResolver_lookupA
+
+dns_stat_t
+DnsResolver_lookupAaaa(DnsResolver *self, const char *domain, DnsAaaaResponse **resp)
+{
+    uint64_t start;
+    if (!DnsResolver_beginLookup(self, domain, &start)) {
+        return DNS_STAT_RESOLVER;
+    }   // end if
+    dns_stat_t status;
+    if (!DnsResolver_replay(self, domain, ns_t_aaaa, (void **) resp, &status)) {
+        status = self->vtbl->lookupAaaa(self, domain, resp);
+    }   // end if
+    DnsResolver_endLookup(self, domain, domain, ns_t_aaaa, status, (void **) resp, start);
+    return status;
+}   // end function: DnsResolver_lookupAaaa
+
+dns_stat_t
+DnsResolver_lookupMx(DnsResolver *self, const char *domain, DnsMxResponse **resp)
+{
+    uint64_t start;
+    if (!DnsResolver_beginLookup(self, domain, &start)) {
+        return DNS_STAT_RESOLVER;
+    }   // end if
+    dns_stat_t status;
+    if (!DnsResolver_replay(self, domain, ns_t_mx, (void **) resp, &status)) {
+        status = self->vtbl->lookupMx(self, domain, resp);
+    }   // end if
+    DnsResolver_endLookup(self, domain, domain, ns_t_mx, status, (void **) resp, start);
+    return status;
+}   // end function: DnsResolver_lookupMx
+
+dns_stat_t
+DnsResolver_lookupTxt(DnsResolver *self, const char *domain, DnsTxtResponse **resp)
+{
+    uint64_t start;
+    if (!DnsResolver_beginLookup(self, domain, &start)) {
+        return DNS_STAT_RESOLVER;
+    }   // end if
+    dns_stat_t status;
+    if (!DnsResolver_replay(self, domain, ns_t_txt, (void **) resp, &status)) {
+        status = self->vtbl->lookupTxt(self, domain, resp);
+    }   // end if
+    DnsResolver_endLookup(self, domain, domain, ns_t_txt, status, (void **) resp, start);
+    return status;
+}   // end function: DnsResolver_lookupTxt
+
+dns_stat_t
+DnsResolver_lookupSpf(DnsResolver *self, const char *domain, DnsSpfResponse **resp)
+{
+    uint64_t start;
+    if (!DnsResolver_beginLookup(self, domain, &start)) {
+        return DNS_STAT_RESOLVER;
+    }   // end if
+    dns_stat_t status;
+    if (!DnsResolver_replay(self, domain, 99 /* as ns_t_spf */, (void **) resp, &status)) {
+        status = self->vtbl->lookupSpf(self, domain, resp);
+    }   // end if
+    DnsResolver_endLookup(self, domain, domain, 99 /* as ns_t_spf */, status, (void **) resp, start);
+    return status;
+}   // end function: DnsResolver_lookupSpf
+
+dns_stat_t
+DnsResolver_lookupPtr(DnsResolver *self, sa_family_t af, const void *addr, DnsPtrResponse **resp)
+{
+    uint64_t start;
+    // reverse zones are not subject to the circuit breaker
+    if (!DnsResolver_beginLookup(self, NULL, &start)) {
+        return DNS_STAT_RESOLVER;
+    }   // end if
+    char revname[DNS_IP6_REVENT_MAXLEN];
+    const char *capture_qname = NULL;
+    if (NULL != self->capture
+        && ((AF_INET == af
+             && DnsResolver_expandReverseEntry4((const struct in_addr *) addr, revname,
+                                                sizeof(revname)))
+            || (AF_INET6 == af
+                && DnsResolver_expandReverseEntry6((const struct in6_addr *) addr, revname,
+                                                   sizeof(revname))))) {
+        capture_qname = revname;
+    }   // end if
+    dns_stat_t status;
+    if (!DnsResolver_replay(self, capture_qname, ns_t_ptr, (void **) resp, &status)) {
+        status = self->vtbl->lookupPtr(self, af, addr, resp);
+    }   // end if
+    DnsResolver_endLookup(self, NULL, capture_qname, ns_t_ptr, status, (void **) resp, start);
+    return status;
+}   // end function: DnsResolver_lookupPtr
+
+/*
+ * look up a single query of a batch in the same manner as DnsResolver_lookupA() and so on.
+ */
+static void
+DnsResolver_lookupBatchQuery(DnsResolver *self, DnsBatchQuery *query)
+{
+    switch (query->rrtype) {
+    case ns_t_a:;
+        DnsAResponse *resp4 = NULL;
+        query->status = DnsResolver_lookupA(self, query->qname, &resp4);
+        query->resp = resp4;
+        break;
+    case ns_t_aaaa:;
+        DnsAaaaResponse *resp6 = NULL;
+        query->status = DnsResolver_lookupAaaa(self, query->qname, &resp6);
+        query->resp = resp6;
+        break;
+    case ns_t_mx:;
+        DnsMxResponse *respmx = NULL;
+        query->status = DnsResolver_lookupMx(self, query->qname, &respmx);
+        query->resp = respmx;
+        break;
+    case ns_t_txt:;
+        DnsTxtResponse *resptxt = NULL;
+        query->status = DnsResolver_lookupTxt(self, query->qname, &resptxt);
+        query->resp = resptxt;
+        break;
+    case 99 /* as ns_t_spf */:;
+        DnsSpfResponse *respspf = NULL;
+        query->status = DnsResolver_lookupSpf(self, query->qname, &respspf);
+        query->resp = respspf;
+        break;
+    default:
+        abort();
+    }   // end switch
+    query->error_symbol = DnsResolver_getErrorSymbol(self);
+}   // end function: DnsResolver_lookupBatchQuery
+
+/*
+ * speculative lookups are sent only while less than this percentage of the budget is used.
+ */
+#define DNS_SPECULATION_BUDGET_PERCENT 75
+
+/*
+ * @return true if speculative lookups may be sent, false if they should be dropped
+ *         as the budget is nearly used up.
+ */
+static bool
+DnsResolver_canSpeculate(const DnsResolver *self)
+{
+    const DnsResolverBudget *budget = &self->budget;
+    if (0 < budget->query_limit
+        && (uint64_t) budget->query_limit * DNS_SPECULATION_BUDGET_PERCENT
+        <= (uint64_t) budget->query_count * 100) {
+        return false;
+    }   // end if
+    if (0 < budget->deadline) {
+        uint64_t now = DnsResolver_getMonotonicTime();
+        if (budget->deadline <= now
+            || (budget->deadline - now) * 100
+            <= budget->time_limit * (100 - DNS_SPECULATION_BUDGET_PERCENT)) {
+            return false;
+        }   // end if
+    }   // end if
+    return true;
+}   // end function: DnsResolver_canSpeculate
+
+/*
+ * answer the lookups of a batch from the capture as if they were sent concurrently,
+ * that is, sleep only for the longest of the recorded latencies of the non-speculative lookups.
+ * the speculative lookups are dropped in the same manner as the engines do
+ * if they are not recorded or their latencies are longer than that.
+ */
+static void
+DnsResolver_replayBatch(DnsResolver *self, DnsBatchQuery **query, size_t num)
+{
+    uint64_t max_latency = 0;
+    for (size_t i = 0; i < num; ++i) {
+        DnsBatchQuery *q = query[i];
+        q->elapsed = 0;
+        q->dropped = false;
+        if (!DnsCapture_replay(self->capture, q->qname, q->rrtype, &q->status, &q->resp,
+                               &q->elapsed)) {
+            q->status = DNS_STAT_RESOLVER;
+            q->error_symbol = "NOT_RECORDED";
+            q->dropped = q->speculative;
+        }   // end if
+        if (!q->speculative) {
+            max_latency = MAX(max_latency, q->elapsed);
+        }   // end if
+    }   // end for
+    for (size_t i = 0; i < num; ++i) {
+        DnsBatchQuery *q = query[i];
+        if (q->speculative && !q->dropped && max_latency < q->elapsed) {
+            if (DNS_STAT_NOERROR == q->status) {
+                DnsResolver_freeResponse(q->rrtype, q->resp);
+            }   // end if
+            q->resp = NULL;
+            q->dropped = true;
+        }   // end if
+    }   // end for
+    DnsCapture_delay(self->capture, max_latency);
+}   // end function: DnsResolver_replayBatch
+
+/**
+ * Looks up multiple RRs at once.
+ * Engines which support it send all the queries concurrently,
+ * the others look them up one by one.
+ * Each lookup is subject to the budget, the circuit breaker and the capture
+ * in the same manner as DnsResolver_lookupA() and so on,
+ * except that the time spent on concurrent lookups is charged to the budget only once.
+ * A replayer answers the batch in the same manner, including the recorded speculative lookups,
+ * sleeping only for the longest latency.
+ * Speculative lookups are sent only along with the others concurrently
+ * while less than DNS_SPECULATION_BUDGET_PERCENT percent of the budget is used
+ * and the circuit breaker for the zone is closed. They are not charged to the budget
+ * and their results are not reported to the circuit breaker.
+ * Otherwise they are dropped, and so are those not answered
+ * by the time all the others are settled, as nobody waits for them.
+ * PTR RR lookups are not supported.
+ * @param query the lookups. rrtype, qname and speculative of each element must be set,
+ *              dropped, status, resp and error_symbol are set on return.
+ */
+void
+DnsResolver_lookupBatch(DnsResolver *self, DnsBatchQuery *query, size_t num)
+{
+    bool replaying = NULL != self->capture && DnsCapture_isReplayer(self->capture);
+    if (NULL == self->vtbl->lookupBatch || num < 2) {
+        for (size_t i = 0; i < num; ++i) {
+            query[i].resp = NULL;
+            // looking up ahead one by one only delays the lookups needed
+            query[i].dropped = query[i].speculative;
+            if (!query[i].dropped) {
+                DnsResolver_lookupBatchQuery(self, &query[i]);
+            }   // end if
+        }   // end for
+        return;
+    }   // end if
+
+    DnsBatchQuery *admitted[num];
+    size_t admitted_num = 0;
+    uint64_t start = 0;
+    bool speculate = DnsResolver_canSpeculate(self);
+    for (size_t i = 0; i < num; ++i) {
+        query[i].resp = NULL;
+        query[i].error_symbol = NULL;
+        query[i].elapsed = 0;
+        query[i].dropped = false;
+        if (query[i].speculative) {
+            if (!speculate || (NULL != self->breaker
+                               && !DnsCircuitBreaker_isClosed(self->breaker, query[i].qname))) {
+                query[i].dropped = true;
+                continue;
+            }   // end if
+            ++self->budget.speculative_count;
+            admitted[admitted_num++] = &query[i];
+            continue;
+        }   // end if
+        if (!DnsResolver_beginLookup(self, query[i].qname, &start)) {
+            query[i].status = DNS_STAT_RESOLVER;
+            query[i].error_symbol = self->refusal;
+            continue;
+        }   // end if
+        // charged here so that the query limit applies within the batch
+        ++self->budget.query_count;
+        admitted[admitted_num++] = &query[i];
+    }   // end for
+    self->refusal = NULL;
+    if (0 == admitted_num) {
+        return;
+    }   // end if
+
+    start = DnsResolver_getMonotonicTime();
+    if (replaying) {
+        DnsResolver_replayBatch(self, admitted, admitted_num);
+    } else {
+        self->vtbl->lookupBatch(self, admitted, admitted_num);
+    }   // end if
+    bool capped = self->timeout_capped;
+    DnsResolver_restoreTimeout(self);
+    uint64_t end = DnsResolver_getMonotonicTime();
+    uint64_t elapsed = start < end ? end - start : 0;
+    self->budget.elapsed += elapsed;
+
+    for (size_t i = 0; i < admitted_num; ++i) {
+        DnsBatchQuery *q = admitted[i];
+        if (q->dropped) {
+            continue;
+        }   // end if
+        if (DNS_STAT_NOERROR != q->status && NULL == q->error_symbol) {
+            q->error_symbol = DnsResolver_symbolizeErrorCode(q->status);
+        }   // end if
+        if (NULL != self->breaker && !q->speculative
+            && !DnsResolver_isCutShort(self, capped, q->status, end)) {
+            DnsCircuitBreaker_report(self->breaker, q->qname, q->status);
+        }   // end if
+        if (NULL != self->capture && !replaying) {
+            DnsCapture_record(self->capture, q->qname, q->rrtype, q->status,
+                              DNS_STAT_NOERROR == q->status ? q->resp : NULL, q->elapsed);
+        }   // end if
+    }   // end for
+}   // end function: DnsResolver_lookupBatch
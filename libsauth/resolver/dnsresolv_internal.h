@@ -14,6 +14,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <netinet/in.h>
 
 #ifdef __cplusplus
@@ -28,6 +29,7 @@ extern "C" {
 
 extern bool DnsResolver_expandReverseEntry4(const struct in_addr *addr4, char *buf, size_t buflen);
 extern bool DnsResolver_expandReverseEntry6(const struct in6_addr *addr6, char *buf, size_t buflen);
+extern void DnsResolver_freeResponse(uint16_t rrtype, void *resp);
 
 #ifdef __cplusplus
 }
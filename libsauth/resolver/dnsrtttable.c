@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2008-2014 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/nameser.h>
+
+#include "loghandler.h"
+#include "dnsresolv.h"
+#include "dnsrtttable.h"
+
+#define DNS_RTT_MAX_SERVERS 32
+#define DNS_RTT_SAMPLE_NUM 32   // the number of recent samples to estimate the percentile
+#define DNS_RTT_PERCENTILE 95
+
+typedef struct DnsRttEntry {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    unsigned int sample[DNS_RTT_SAMPLE_NUM];    // in milliseconds
+    size_t sample_num;
+    size_t sample_next;
+    unsigned int failure_count; // consecutive failures
+} DnsRttEntry;
+
+/*
+ * RTT statistics per nameserver shared among resolvers.
+ */
+struct DnsRttTable {
+    pthread_mutex_t lock;
+    unsigned int min_delay; // in milliseconds
+    unsigned int max_delay; // in milliseconds
+    size_t entry_num;
+    DnsRttEntry entry[DNS_RTT_MAX_SERVERS];
+};
+
+static DnsRttEntry *
+DnsRttTable_find(DnsRttTable *self, const struct sockaddr *addr, socklen_t addrlen, bool create)
+{
+    if (sizeof(struct sockaddr_storage) < addrlen) {
+        return NULL;
+    }   // end if
+    for (size_t i = 0; i < self->entry_num; ++i) {
+        if (self->entry[i].addrlen == addrlen && 0 == memcmp(&self->entry[i].addr, addr, addrlen)) {
+            return &self->entry[i];
+        }   // end if
+    }   // end for
+    if (!create || DNS_RTT_MAX_SERVERS <= self->entry_num) {
+        return NULL;
+    }   // end if
+    DnsRttEntry *entry = &self->entry[self->entry_num++];
+    memset(entry, 0, sizeof(DnsRttEntry));
+    memcpy(&entry->addr, addr, addrlen);
+    entry->addrlen = addrlen;
+    return entry;
+}   // end function: DnsRttTable_find
+
+static int
+DnsRttTable_compareSample(const void *p1, const void *p2)
+{
+    unsigned int s1 = *(const unsigned int *) p1;
+    unsigned int s2 = *(const unsigned int *) p2;
+    return (s1 > s2) - (s1 < s2);
+}   // end function: DnsRttTable_compareSample
+
+/**
+ * Returns how long to wait for a response from the nameserver
+ * before sending the same query to the next one,
+ * that is the 95th percentile of the recent RTTs clamped to [min_delay, max_delay].
+ * max_delay is returned for nameservers without samples.
+ * @return the delay in milliseconds.
+ */
+unsigned int
+DnsRttTable_getHedgeDelay(DnsRttTable *self, const struct sockaddr *addr, socklen_t addrlen)
+{
+    assert(NULL != self);
+
+    unsigned int delay = self->max_delay;
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return delay;
+    }   // end if
+
+    DnsRttEntry *entry = DnsRttTable_find(self, addr, addrlen, false);
+    if (NULL != entry && 0 < entry->sample_num) {
+        unsigned int sorted[DNS_RTT_SAMPLE_NUM];
+        memcpy(sorted, entry->sample, sizeof(unsigned int) * entry->sample_num);
+        qsort(sorted, entry->sample_num, sizeof(unsigned int), DnsRttTable_compareSample);
+        delay = sorted[(entry->sample_num - 1) * DNS_RTT_PERCENTILE / 100];
+    }   // end if
+
+    ret = pthread_mutex_unlock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+
+    if (delay < self->min_delay) {
+        delay = self->min_delay;
+    } else if (self->max_delay < delay) {
+        delay = self->max_delay;
+    }   // end if
+    return delay;
+}   // end function: DnsRttTable_getHedgeDelay
+
+/**
+ * @return the number of consecutive failures of the nameserver.
+ */
+unsigned int
+DnsRttTable_getFailureCount(DnsRttTable *self, const struct sockaddr *addr, socklen_t addrlen)
+{
+    assert(NULL != self);
+
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return 0;
+    }   // end if
+
+    DnsRttEntry *entry = DnsRttTable_find(self, addr, addrlen, false);
+    unsigned int failure_count = NULL != entry ? entry->failure_count : 0;
+
+    ret = pthread_mutex_unlock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+    return failure_count;
+}   // end function: DnsRttTable_getFailureCount
+
+/**
+ * Records a response from the nameserver.
+ * @param rtt the round-trip time in milliseconds.
+ */
+void
+DnsRttTable_updateRtt(DnsRttTable *self, const struct sockaddr *addr, socklen_t addrlen,
+                      unsigned int rtt)
+{
+    assert(NULL != self);
+
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return;
+    }   // end if
+
+    DnsRttEntry *entry = DnsRttTable_find(self, addr, addrlen, true);
+    if (NULL != entry) {
+        entry->sample[entry->sample_next] = rtt;
+        entry->sample_next = (entry->sample_next + 1) % DNS_RTT_SAMPLE_NUM;
+        if (entry->sample_num < DNS_RTT_SAMPLE_NUM) {
+            ++entry->sample_num;
+        }   // end if
+        entry->failure_count = 0;
+    }   // end if
+
+    ret = pthread_mutex_unlock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+}   // end function: DnsRttTable_updateRtt
+
+/**
+ * Records that the nameserver didn't respond within the timeout
+ * or responded with SERVFAIL or REFUSED.
+ */
+void
+DnsRttTable_updateFailure(DnsRttTable *self, const struct sockaddr *addr, socklen_t addrlen)
+{
+    assert(NULL != self);
+
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return;
+    }   // end if
+
+    DnsRttEntry *entry = DnsRttTable_find(self, addr, addrlen, true);
+    if (NULL != entry) {
+        ++entry->failure_count;
+    }   // end if
+
+    ret = pthread_mutex_unlock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+}   // end function: DnsRttTable_updateFailure
+
+static uint64_t
+DnsRttTable_getMonotonicMsec(void)
+{
+    struct timespec ts;
+    if (0 != clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        return 0;
+    }   // end if
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}   // end function: DnsRttTable_getMonotonicMsec
+
+/*
+ * check the ID and the question section of the response.
+ * the question in the response is never compressed, and the length octets of labels
+ * are not affected by the case folding, so that the section can be compared octet by octet.
+ */
+static bool
+DnsRttTable_isResponseTo(const unsigned char *query, size_t querylen, const unsigned char *resp,
+                         ssize_t resplen)
+{
+    // compare the ID and QDCOUNT
+    if (resplen < (ssize_t) querylen || 0 != memcmp(query, resp, NS_INT16SZ)
+        || 0 != resp[2 * NS_INT16SZ] || 1 != resp[2 * NS_INT16SZ + 1]) {
+        return false;
+    }   // end if
+    for (size_t i = NS_HFIXEDSZ; i < querylen; ++i) {
+        if (tolower(query[i]) != tolower(resp[i])) {
+            return false;
+        }   // end if
+    }   // end for
+    return true;
+}   // end function: DnsRttTable_isResponseTo
+
+/**
+ * Sends a query over UDP to the nameservers one after another, each after the hedging delay
+ * of the previous one, and takes the first response which is neither SERVFAIL, REFUSED,
+ * NOTIMP nor FORMERR.
+ * Nameservers which have failed consecutively are tried last.
+ * The RTTs and the failures observed are recorded to the table.
+ * @param servers the nameservers in the configured order.
+ * @param addrlen the length of each element of servers.
+ * @param query the query message in the wire format.
+ * @param buf the buffer to store the response.
+ * @param timeout the time to wait for responses in milliseconds.
+ * @param bad_rcode the RCODE of the last unacceptable response, or -1 if there is no response,
+ *                  is stored on failure.
+ * @return the length of the response stored in buf, -1 if no acceptable response is received
+ *         within the timeout, -2 if the response is truncated and should be retried over TCP.
+ */
+int
+DnsRttTable_exchange(DnsRttTable *self, const struct sockaddr *const servers[],
+                     const socklen_t addrlen[], size_t nsnum, const unsigned char *query,
+                     size_t querylen, unsigned char *buf, size_t buflen, uint64_t timeout,
+                     int *bad_rcode)
+{
+    assert(NULL != self);
+
+    // order the nameservers
+    size_t order[nsnum];
+    unsigned int failure_count[nsnum];
+    for (size_t i = 0; i < nsnum; ++i) {
+        unsigned int failure = DnsRttTable_getFailureCount(self, servers[i], addrlen[i]);
+        // insertion sort keeping the configured order among the same failure count
+        size_t pos = i;
+        for (; 0 < pos && failure < failure_count[pos - 1]; --pos) {
+            order[pos] = order[pos - 1];
+            failure_count[pos] = failure_count[pos - 1];
+        }   // end for
+        order[pos] = i;
+        failure_count[pos] = failure;
+    }   // end for
+
+    struct pollfd pfd[nsnum];
+    uint64_t sent_at[nsnum];
+    size_t sentnum = 0;
+    size_t respnum = 0;
+    int msglen = -1;
+    uint64_t now = DnsRttTable_getMonotonicMsec();
+    uint64_t deadline = now + timeout;
+    uint64_t next_send = now;
+    *bad_rcode = -1;
+
+    while (true) {
+        if (sentnum < nsnum && next_send <= now) {
+            const struct sockaddr *addr = servers[order[sentnum]];
+            socklen_t len = addrlen[order[sentnum]];
+            int fd = socket(addr->sa_family, SOCK_DGRAM, 0);
+            if (0 <= fd && (0 > connect(fd, addr, len)
+                            || (ssize_t) querylen != send(fd, query, querylen, 0))) {
+                close(fd);
+                fd = -1;
+            }   // end if
+            pfd[sentnum].fd = fd;
+            pfd[sentnum].events = POLLIN;
+            pfd[sentnum].revents = 0;
+            sent_at[sentnum] = now;
+            if (0 > fd) {
+                ++respnum;  // counted as answered so as not to wait for it
+                next_send = now;
+            } else {
+                next_send = now + DnsRttTable_getHedgeDelay(self, addr, len);
+            }   // end if
+            ++sentnum;
+            continue;
+        }   // end if
+        if (sentnum == nsnum && respnum == nsnum) {
+            break;  // all the nameservers have answered badly
+        }   // end if
+        if (deadline <= now) {
+            break;
+        }   // end if
+
+        uint64_t wait = deadline - now;
+        if (sentnum < nsnum && next_send - now < wait) {
+            wait = next_send - now;
+        }   // end if
+        int nready = poll(pfd, sentnum, (int) wait);
+        now = DnsRttTable_getMonotonicMsec();
+        if (0 > nready) {
+            if (EINTR == errno) {
+                continue;
+            }   // end if
+            break;
+        }   // end if
+
+        for (size_t i = 0; i < sentnum && 0 < nready; ++i) {
+            if (0 > pfd[i].fd || 0 == pfd[i].revents) {
+                continue;
+            }   // end if
+            --nready;
+            const struct sockaddr *addr = servers[order[i]];
+            socklen_t len = addrlen[order[i]];
+            ssize_t recvlen = recv(pfd[i].fd, buf, buflen, 0);
+            if (0 > recvlen && (POLLERR | POLLHUP) & pfd[i].revents) {
+                // ICMP unreachable and so on
+                DnsRttTable_updateFailure(self, addr, len);
+                close(pfd[i].fd);
+                pfd[i].fd = -1;
+                ++respnum;
+                next_send = now;
+                continue;
+            }   // end if
+            if (!DnsRttTable_isResponseTo(query, querylen, buf, recvlen)) {
+                continue;
+            }   // end if
+            const HEADER *header = (const HEADER *) buf;
+            if (header->tc) {
+                msglen = -2;    // to be retried over TCP
+                goto finally;
+            }   // end if
+            switch (header->rcode) {
+            case ns_r_noerror:
+            case ns_r_nxdomain:
+                DnsRttTable_updateRtt(self, addr, len, (unsigned int) (now - sent_at[i]));
+                msglen = (int) recvlen;
+                goto finally;
+            default:
+                DnsRttTable_updateFailure(self, addr, len);
+                *bad_rcode = header->rcode;
+                close(pfd[i].fd);
+                pfd[i].fd = -1;
+                ++respnum;
+                next_send = now;    // ask the next nameserver at once
+                break;
+            }   // end switch
+        }   // end for
+    }   // end while
+
+    // no acceptable response
+    for (size_t i = 0; i < sentnum; ++i) {
+        if (0 <= pfd[i].fd) {
+            DnsRttTable_updateFailure(self, servers[order[i]], addrlen[order[i]]);
+        }   // end if
+    }   // end for
+
+  finally:
+    for (size_t i = 0; i < sentnum; ++i) {
+        if (0 <= pfd[i].fd) {
+            close(pfd[i].fd);
+        }   // end if
+    }   // end for
+    return msglen;
+}   // end function: DnsRttTable_exchange
+
+/**
+ * @param min_delay the lower bound of the hedging delay in milliseconds.
+ * @param max_delay the upper bound of the hedging delay in milliseconds,
+ *                  also used for nameservers without RTT samples.
+ */
+DnsRttTable *
+DnsRttTable_new(unsigned int min_delay, unsigned int max_delay)
+{
+    DnsRttTable *self = (DnsRttTable *) malloc(sizeof(DnsRttTable));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(DnsRttTable));
+
+    int ret = pthread_mutex_init(&self->lock, NULL);
+    if (0 != ret) {
+        free(self);
+        return NULL;
+    }   // end if
+
+    self->min_delay = min_delay;
+    self->max_delay = min_delay < max_delay ? max_delay : min_delay;
+    return self;
+}   // end function: DnsRttTable_new
+
+void
+DnsRttTable_free(DnsRttTable *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    (void) pthread_mutex_destroy(&self->lock);
+    free(self);
+}   // end function: DnsRttTable_free
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -33,6 +34,7 @@
 #include "ptrop.h"
 #include "dnsresolv.h"
 #include "dnsresolv_internal.h"
+#include "dnsrtttable.h"
 #include "ldnsresolver.h"
 
 #ifndef _PATH_RESCONF
@@ -44,6 +46,7 @@ typedef struct LdnsResolver {
     ldns_resolver *res;
     dns_stat_t status;
     ldns_status res_stat;
+    uint8_t msgbuf[LDNS_MAX_PACKETLEN];
 } LdnsResolver;
 
 static dns_stat_t
@@ -105,13 +108,21 @@ LdnsResolver_resetErrorState(LdnsResolver *self)
 {
     self->status = DNS_STAT_NOERROR;
     self->res_stat = LDNS_STATUS_OK;
-    // reset the rtt of the nameservers marked as unreachable (LDNS_RESOLV_RTT_INF)
+}   // end function: LdnsResolver_resetErrorState
+
+/*
+ * reset the rtt of the nameservers marked as unreachable (LDNS_RESOLV_RTT_INF)
+ * so that ldns_resolver_send() tries them again.
+ */
+static void
+LdnsResolver_reviveNameservers(LdnsResolver *self)
+{
     for (size_t i = 0; i < ldns_resolver_nameserver_count(self->res); ++i) {
         if (LDNS_RESOLV_RTT_INF == ldns_resolver_nameserver_rtt(self->res, i)) {
             ldns_resolver_set_nameserver_rtt(self->res, i, LDNS_RESOLV_RTT_MIN);
         }   // end if
     }   // end for
-}   // end function: LdnsResolver_resetErrorState
+}   // end function: LdnsResolver_reviveNameservers
 
 static const char *
 LdnsResolver_getErrorSymbol(const DnsResolver *base)
@@ -139,6 +150,102 @@ LdnsResolver_setRetryCount(const DnsResolver *base, int retry)
     ldns_resolver_set_retry(self->res, (uint8_t) retry);
 }   // end function: LdnsResolver_setRetryCount
 
+static time_t
+LdnsResolver_getTimeout(const DnsResolver *base)
+{
+    const LdnsResolver *self = (const LdnsResolver *) base;
+    return ldns_resolver_timeout(self->res).tv_sec;
+}   // end function: LdnsResolver_getTimeout
+
+static int
+LdnsResolver_getRetryCount(const DnsResolver *base)
+{
+    const LdnsResolver *self = (const LdnsResolver *) base;
+    return (int) ldns_resolver_retry(self->res);
+}   // end function: LdnsResolver_getRetryCount
+
+/*
+ * send a query to the nameservers in the hedged manner with DnsRttTable_exchange().
+ * @param bad_rcode the RCODE of the last unacceptable response, or -1 if there is no response,
+ *                  is stored on failure.
+ * @return LDNS_STATUS_OK on success,
+ *         LDNS_STATUS_NOT_IMPL if hedging is not applicable (only one nameserver
+ *         or a truncated response) and ldns_resolver_send() should be used instead.
+ */
+static ldns_status
+LdnsResolver_hedgedQuery(LdnsResolver *self, const ldns_rdf *rdf_domain, ldns_rr_type rrtype,
+                         ldns_pkt **packet, int *bad_rcode)
+{
+    size_t nscount = ldns_resolver_nameserver_count(self->res);
+    if (nscount < 2) {
+        return LDNS_STATUS_NOT_IMPL;
+    }   // end if
+
+    ldns_rdf **nameservers = ldns_resolver_nameservers(self->res);
+    uint8_t family = ldns_resolver_ip6(self->res);
+    uint16_t port = htons(ldns_resolver_port(self->res));
+    struct sockaddr_storage ss[nscount];
+    const struct sockaddr *servers[nscount];
+    socklen_t addrlen[nscount];
+    size_t nsnum = 0;
+    for (size_t i = 0; i < nscount; ++i) {
+        const ldns_rdf *ns = nameservers[i];
+        memset(&ss[nsnum], 0, sizeof(struct sockaddr_storage));
+        if (LDNS_RDF_TYPE_A == ldns_rdf_get_type(ns) && LDNS_RESOLV_INET6 != family
+            && NS_INADDRSZ == ldns_rdf_size(ns)) {
+            struct sockaddr_in *sin = (struct sockaddr_in *) &ss[nsnum];
+            sin->sin_family = AF_INET;
+            sin->sin_port = port;
+            memcpy(&sin->sin_addr, ldns_rdf_data(ns), NS_INADDRSZ);
+            addrlen[nsnum] = sizeof(struct sockaddr_in);
+        } else if (LDNS_RDF_TYPE_AAAA == ldns_rdf_get_type(ns) && LDNS_RESOLV_INET != family
+                   && NS_IN6ADDRSZ == ldns_rdf_size(ns)) {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss[nsnum];
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = port;
+            memcpy(&sin6->sin6_addr, ldns_rdf_data(ns), NS_IN6ADDRSZ);
+            addrlen[nsnum] = sizeof(struct sockaddr_in6);
+        } else {
+            continue;
+        }   // end if
+        servers[nsnum] = (const struct sockaddr *) &ss[nsnum];
+        ++nsnum;
+    }   // end for
+    if (nsnum < 2) {
+        return LDNS_STATUS_NOT_IMPL;
+    }   // end if
+
+    ldns_pkt *query =
+        ldns_pkt_query_new(ldns_rdf_clone(rdf_domain), rrtype, LDNS_RR_CLASS_IN, LDNS_RD);
+    if (NULL == query) {
+        return LDNS_STATUS_MEM_ERR;
+    }   // end if
+    ldns_pkt_set_id(query, ldns_get_random());
+    uint8_t *wire = NULL;
+    size_t wirelen = 0;
+    ldns_status status = ldns_pkt2wire(&wire, query, &wirelen);
+    ldns_pkt_free(query);
+    if (LDNS_STATUS_OK != status) {
+        return status;
+    }   // end if
+
+    struct timeval tv = ldns_resolver_timeout(self->res);
+    uint64_t timeout = ((uint64_t) tv.tv_sec * 1000 + (uint64_t) tv.tv_usec / 1000)
+        * MAX(ldns_resolver_retry(self->res), 1);
+    int msglen = DnsRttTable_exchange(self->rtt_table, servers, addrlen, nsnum, wire, wirelen,
+                                      self->msgbuf, sizeof(self->msgbuf), timeout, bad_rcode);
+    LDNS_FREE(wire);
+    switch (msglen) {
+    case -2:
+        return LDNS_STATUS_NOT_IMPL;
+    case -1:
+        return LDNS_STATUS_NETWORK_ERR;
+    default:
+        *bad_rcode = -1;
+        return ldns_wire2pkt(packet, self->msgbuf, (size_t) msglen);
+    }   // end switch
+}   // end function: LdnsResolver_hedgedQuery
+
 /*
  * throw a DNS query and receive a response of it
  * @return
@@ -153,10 +260,23 @@ LdnsResolver_query(LdnsResolver *self, const char *domain, ldns_rr_type rrtype,
         return LdnsResolver_setError(self, DNS_STAT_BADREQUEST);
     }   // end if
     ldns_pkt *packet = NULL;
-    ldns_status status =
-        ldns_resolver_send(&packet, self->res, rdf_domain, rrtype, LDNS_RR_CLASS_IN, LDNS_RD);
+    ldns_status status = LDNS_STATUS_NOT_IMPL;
+    int bad_rcode = -1;
+    if (NULL != self->rtt_table) {
+        status = LdnsResolver_hedgedQuery(self, rdf_domain, rrtype, &packet, &bad_rcode);
+    }   // end if
+    if (LDNS_STATUS_NOT_IMPL == status) {
+        bad_rcode = -1;
+        LdnsResolver_reviveNameservers(self);
+        status =
+            ldns_resolver_send(&packet, self->res, rdf_domain, rrtype, LDNS_RR_CLASS_IN, LDNS_RD);
+    }   // end if
     ldns_rdf_deep_free(rdf_domain);
     if (status != LDNS_STATUS_OK) {
+        if (0 <= bad_rcode) {
+            // all the nameservers have answered with SERVFAIL, REFUSED and so on
+            return LdnsResolver_setRcode(self, (ldns_pkt_rcode) bad_rcode);
+        }   // end if
         return LdnsResolver_setResolverError(self, status);
     }   // end if
     if (NULL == packet) {
@@ -199,6 +319,9 @@ LdnsResolver_lookupA(DnsResolver *base, const char *domain, DnsAResponse **resp)
     respobj->num = 0;
     for (size_t rridx = 0; rridx < rr_count; ++rridx) {
         ldns_rr *rr = ldns_rr_list_rr(rrlist, rridx);
+        if (0 == rridx || ldns_rr_ttl(rr) < respobj->ttl) {
+            respobj->ttl = ldns_rr_ttl(rr);
+        }   // end if
         if (LDNS_RR_TYPE_A != ldns_rr_get_type(rr)) {
             continue;
         }   // end if
@@ -253,6 +376,9 @@ LdnsResolver_lookupAaaa(DnsResolver *base, const char *domain, DnsAaaaResponse *
     respobj->num = 0;
     for (size_t rridx = 0; rridx < rr_count; ++rridx) {
         ldns_rr *rr = ldns_rr_list_rr(rrlist, rridx);
+        if (0 == rridx || ldns_rr_ttl(rr) < respobj->ttl) {
+            respobj->ttl = ldns_rr_ttl(rr);
+        }   // end if
         if (LDNS_RR_TYPE_AAAA != ldns_rr_get_type(rr)) {
             continue;
         }   // end if
@@ -355,6 +481,9 @@ LdnsResolver_lookupMx(DnsResolver *base, const char *domain, DnsMxResponse **res
     // expand compressed domain name
     for (size_t rridx = 0; rridx < rr_count; ++rridx) {
         ldns_rr *rr = ldns_rr_list_rr(rrlist, rridx);
+        if (0 == rridx || ldns_rr_ttl(rr) < respobj->ttl) {
+            respobj->ttl = ldns_rr_ttl(rr);
+        }   // end if
         if (LDNS_RR_TYPE_MX != ldns_rr_get_type(rr)) {
             continue;
         }   // end if
@@ -432,6 +561,9 @@ LdnsResolver_lookupTxtData(LdnsResolver *self, ldns_rr_type rrtype, const char *
     // concatenate multiple rdfs for each RR
     for (size_t rridx = 0; rridx < rr_count; ++rridx) {
         ldns_rr *rr = ldns_rr_list_rr(rrlist, rridx);
+        if (0 == rridx || ldns_rr_ttl(rr) < respobj->ttl) {
+            respobj->ttl = ldns_rr_ttl(rr);
+        }   // end if
         if (rrtype != ldns_rr_get_type(rr)) {
             continue;
         }   // end if
@@ -543,6 +675,9 @@ LdnsResolver_lookupPtr(DnsResolver *base, sa_family_t sa_family, const void *add
     // expand compressed domain name
     for (size_t rridx = 0; rridx < rr_count; ++rridx) {
         ldns_rr *rr = ldns_rr_list_rr(rrlist, rridx);
+        if (0 == rridx || ldns_rr_ttl(rr) < respobj->ttl) {
+            respobj->ttl = ldns_rr_ttl(rr);
+        }   // end if
         if (LDNS_RR_TYPE_PTR != ldns_rr_get_type(rr)) {
             continue;
         }   // end if
@@ -606,6 +741,8 @@ static const struct DnsResolver_vtbl LdnsResolver_vtbl = {
     LdnsResolver_getErrorSymbol,
     LdnsResolver_setTimeout,
     LdnsResolver_setRetryCount,
+    LdnsResolver_getTimeout,
+    LdnsResolver_getRetryCount,
     LdnsResolver_lookupA,
     LdnsResolver_lookupAaaa,
     LdnsResolver_lookupMx,
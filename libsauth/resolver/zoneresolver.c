@@ -0,0 +1,1247 @@
+/*
+ * Copyright (c) 2008-2014 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+/*
+ * DNS resolver engine which answers from zone files loaded into memory,
+ * for benchmarks and tests without network.
+ *
+ * The initfile is a zone file in the master file format (RFC 1035 section 5)
+ * and supports A, AAAA, MX, TXT, SPF, PTR and CNAME records.
+ * Records of other types only make their owner names exist.
+ * Names which don't appear in the zone files are answered with NXDOMAIN,
+ * existing names without records of the queried type with NODATA.
+ *
+ * In addition to $ORIGIN, $TTL and $INCLUDE, the following directives
+ * control the simulation of the network. They apply to the whole database.
+ *   $LATENCY fixed <msec>
+ *   $LATENCY uniform <min-msec> <max-msec>
+ *   $LATENCY exponential <mean-msec>
+ *   $LATENCY normal <mean-msec> <stddev-msec>
+ *   $LOSS <ratio>          ratio of queries to be lost, each of them costs the timeout
+ *   $SERVFAIL <ratio>      ratio of queries to be answered with SERVFAIL
+ *   $SEED <integer>        seed of the pseudo random numbers
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+
+#include "stdaux.h"
+#include "loghandler.h"
+#include "dnsresolv.h"
+#include "dnsresolv_internal.h"
+#include "zoneresolver.h"
+
+#define ZONE_MAX_INCLUDE_DEPTH 8
+#define ZONE_MAX_CNAME_CHAIN 8
+#define ZONE_MAX_TOKENS 256
+#define ZONE_DEFAULT_TIMEOUT 5
+#define ZONE_DEFAULT_RETRY 1
+#define ZONE_RRTYPE_SPF 99
+#define ZONE_DEFAULT_TTL 3600   // used until $TTL appears
+
+typedef enum ZoneLatencyDist {
+    ZONE_LATENCY_NONE = 0,
+    ZONE_LATENCY_FIXED,
+    ZONE_LATENCY_UNIFORM,
+    ZONE_LATENCY_EXPONENTIAL,
+    ZONE_LATENCY_NORMAL,
+} ZoneLatencyDist;
+
+typedef struct ZoneRecord {
+    struct ZoneRecord *next;
+    uint16_t rrtype;
+    uint16_t preference;    // MX
+    uint32_t ttl;
+    union {
+        struct in_addr addr4;
+        struct in6_addr addr6;
+    } addr;
+    char data[];    // TXT/SPF strings concatenated, or the domain name of MX, PTR and CNAME
+} ZoneRecord;
+
+typedef struct ZoneNode {
+    struct ZoneNode *next;
+    ZoneRecord *record;
+    char name[];
+} ZoneNode;
+
+typedef struct ZoneDatabase {
+    struct ZoneDatabase *next;
+    unsigned int refcount;
+    unsigned int instance_count;
+    char *path;
+    // identify the version of the zone file so that an edited file is loaded again
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+    ZoneLatencyDist latency_dist;
+    double latency_param1;  // in milliseconds
+    double latency_param2;  // in milliseconds
+    double loss_rate;
+    double servfail_rate;
+    long seed;
+    size_t node_num;
+    size_t bucket_num;
+    ZoneNode **bucket;
+} ZoneDatabase;
+
+typedef struct ZoneResolver {
+    DnsResolver_MEMBER;
+    ZoneDatabase *db;
+    dns_stat_t status;
+    time_t timeout;
+    int retry;
+    unsigned short xsubi[3];
+    bool deferring;         // accumulate the simulated delay instead of sleeping
+    double deferred_delay;  // in milliseconds
+} ZoneResolver;
+
+typedef struct ZoneParser {
+    ZoneDatabase *db;
+    const char *filename;
+    size_t lineno;
+    char origin[NS_MAXDNAME];
+    char owner[NS_MAXDNAME];
+    uint32_t default_ttl;   // set by $TTL
+    uint32_t ttl;           // TTL of the record being parsed
+} ZoneParser;
+
+// zone databases are shared among resolvers loading the same file
+static pthread_mutex_t zone_database_lock = PTHREAD_MUTEX_INITIALIZER;
+static ZoneDatabase *zone_database_list = NULL;
+
+static unsigned int
+ZoneDatabase_hash(const char *name)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (const char *p = name; '\0' != *p; ++p) {
+        hash ^= (uint32_t) (unsigned char) *p;
+        hash *= 16777619U;
+    }   // end for
+    return hash;
+}   // end function: ZoneDatabase_hash
+
+static ZoneNode *
+ZoneDatabase_findNode(const ZoneDatabase *self, const char *name)
+{
+    if (0 == self->bucket_num) {
+        return NULL;
+    }   // end if
+    ZoneNode *node = self->bucket[ZoneDatabase_hash(name) % self->bucket_num];
+    for (; NULL != node; node = node->next) {
+        if (0 == strcmp(node->name, name)) {
+            return node;
+        }   // end if
+    }   // end for
+    return NULL;
+}   // end function: ZoneDatabase_findNode
+
+static bool
+ZoneDatabase_rehash(ZoneDatabase *self)
+{
+    size_t bucket_num = 0 < self->bucket_num ? self->bucket_num * 2 + 1 : 1021;
+    ZoneNode **bucket = (ZoneNode **) calloc(bucket_num, sizeof(ZoneNode *));
+    if (NULL == bucket) {
+        return false;
+    }   // end if
+    for (size_t i = 0; i < self->bucket_num; ++i) {
+        ZoneNode *node = self->bucket[i];
+        while (NULL != node) {
+            ZoneNode *next = node->next;
+            size_t pos = ZoneDatabase_hash(node->name) % bucket_num;
+            node->next = bucket[pos];
+            bucket[pos] = node;
+            node = next;
+        }   // end while
+    }   // end for
+    free(self->bucket);
+    self->bucket = bucket;
+    self->bucket_num = bucket_num;
+    return true;
+}   // end function: ZoneDatabase_rehash
+
+/*
+ * @param name normalized domain name (lower case without the trailing dot)
+ */
+static ZoneNode *
+ZoneDatabase_addNode(ZoneDatabase *self, const char *name)
+{
+    ZoneNode *node = ZoneDatabase_findNode(self, name);
+    if (NULL != node) {
+        return node;
+    }   // end if
+    if (self->bucket_num <= self->node_num && !ZoneDatabase_rehash(self)) {
+        return NULL;
+    }   // end if
+    size_t namelen = strlen(name);
+    node = (ZoneNode *) malloc(sizeof(ZoneNode) + namelen + 1);
+    if (NULL == node) {
+        return NULL;
+    }   // end if
+    memset(node, 0, sizeof(ZoneNode));
+    memcpy(node->name, name, namelen + 1);
+    size_t pos = ZoneDatabase_hash(name) % self->bucket_num;
+    node->next = self->bucket[pos];
+    self->bucket[pos] = node;
+    ++self->node_num;
+    return node;
+}   // end function: ZoneDatabase_addNode
+
+static void
+ZoneDatabase_free(ZoneDatabase *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    for (size_t i = 0; i < self->bucket_num; ++i) {
+        ZoneNode *node = self->bucket[i];
+        while (NULL != node) {
+            ZoneNode *next = node->next;
+            ZoneRecord *record = node->record;
+            while (NULL != record) {
+                ZoneRecord *next_record = record->next;
+                free(record);
+                record = next_record;
+            }   // end while
+            free(node);
+            node = next;
+        }   // end while
+    }   // end for
+    free(self->bucket);
+    free(self->path);
+    free(self);
+}   // end function: ZoneDatabase_free
+
+/*
+ * normalize a domain name into lower case without the trailing dot
+ * @return false if the name is too long
+ */
+static bool
+ZoneParser_normalizeName(const char *name, const char *origin, char *buf, size_t buflen)
+{
+    size_t len = 0;
+    if (0 == strcmp(name, "@")) {
+        name = origin;
+        origin = NULL;
+    }   // end if
+    size_t namelen = strlen(name);
+    bool absolute = (0 < namelen && '.' == name[namelen - 1]);
+    if (absolute) {
+        --namelen;
+    }   // end if
+    if (buflen <= namelen) {
+        return false;
+    }   // end if
+    for (size_t i = 0; i < namelen; ++i) {
+        buf[len++] = tolower((unsigned char) name[i]);
+    }   // end for
+    if (!absolute && NULL != origin && '\0' != *origin) {
+        size_t originlen = strlen(origin);
+        if (buflen <= len + 1 + originlen) {
+            return false;
+        }   // end if
+        if (0 < len) {
+            buf[len++] = '.';
+        }   // end if
+        memcpy(buf + len, origin, originlen);
+        len += originlen;
+    }   // end if
+    buf[len] = '\0';
+    return true;
+}   // end function: ZoneParser_normalizeName
+
+/*
+ * truncate a comment outside of quoted strings
+ * @return the depth of the parentheses after the line
+ */
+static int
+ZoneParser_stripComment(char *line, int depth)
+{
+    bool quoted = false;
+    for (char *p = line; '\0' != *p; ++p) {
+        if (quoted) {
+            if ('\\' == *p && '\0' != *(p + 1)) {
+                ++p;
+            } else if ('"' == *p) {
+                quoted = false;
+            }   // end if
+            continue;
+        }   // end if
+        switch (*p) {
+        case '"':
+            quoted = true;
+            break;
+        case ';':
+        case '\n':
+        case '\r':
+            *p = '\0';
+            return depth;
+        case '(':
+            ++depth;
+            break;
+        case ')':
+            --depth;
+            break;
+        default:
+            break;
+        }   // end switch
+    }   // end for
+    return depth;
+}   // end function: ZoneParser_stripComment
+
+/*
+ * split a logical line into tokens in place.
+ * quoted strings are unescaped and parentheses are dropped.
+ * @return the number of tokens, or -1 if there are too many tokens.
+ */
+static int
+ZoneParser_tokenize(char *line, char **tokens, bool *quoted, size_t maxtokens)
+{
+    size_t num = 0;
+    char *p = line;
+    while (true) {
+        while (isspace((unsigned char) *p) || '(' == *p || ')' == *p) {
+            ++p;
+        }   // end while
+        if ('\0' == *p) {
+            break;
+        }   // end if
+        if (maxtokens <= num) {
+            return -1;
+        }   // end if
+        if ('"' == *p) {
+            char *src = ++p;
+            char *dst = p;
+            tokens[num] = dst;
+            quoted[num] = true;
+            while ('\0' != *src && '"' != *src) {
+                if ('\\' == *src && isdigit((unsigned char) *(src + 1))
+                    && isdigit((unsigned char) *(src + 2)) && isdigit((unsigned char) *(src + 3))) {
+                    // \DDD
+                    *dst++ = (char) ((*(src + 1) - '0') * 100 + (*(src + 2) - '0') * 10 + (*(src + 3) - '0'));
+                    src += 4;
+                } else if ('\\' == *src && '\0' != *(src + 1)) {
+                    *dst++ = *(src + 1);
+                    src += 2;
+                } else {
+                    *dst++ = *src++;
+                }   // end if
+            }   // end while
+            p = ('"' == *src) ? src + 1 : src;
+            *dst = '\0';
+        } else {
+            tokens[num] = p;
+            quoted[num] = false;
+            while ('\0' != *p && !isspace((unsigned char) *p) && '(' != *p && ')' != *p) {
+                ++p;
+            }   // end while
+            if ('\0' != *p) {
+                *p++ = '\0';
+            }   // end if
+        }   // end if
+        ++num;
+    }   // end while
+    return (int) num;
+}   // end function: ZoneParser_tokenize
+
+static bool
+ZoneParser_isTtl(const char *token)
+{
+    if (!isdigit((unsigned char) *token)) {
+        return false;
+    }   // end if
+    for (const char *p = token; '\0' != *p; ++p) {
+        if (!isdigit((unsigned char) *p) && NULL == strchr("smhdwSMHDW", *p)) {
+            return false;
+        }   // end if
+    }   // end for
+    return true;
+}   // end function: ZoneParser_isTtl
+
+/*
+ * parses a TTL such as "3600" or "1h30m".
+ */
+static uint32_t
+ZoneParser_parseTtl(const char *token)
+{
+    uint32_t ttl = 0;
+    const char *p = token;
+    while ('\0' != *p) {
+        char *tail;
+        unsigned long value = strtoul(p, &tail, 10);
+        switch (tolower((unsigned char) *tail)) {
+        case 'w':
+            value *= 7;
+            // fall through
+        case 'd':
+            value *= 24;
+            // fall through
+        case 'h':
+            value *= 60;
+            // fall through
+        case 'm':
+            value *= 60;
+            // fall through
+        case 's':
+            ++tail;
+            break;
+        default:
+            break;
+        }   // end switch
+        ttl += (uint32_t) value;
+        if (tail == p) {
+            break;
+        }   // end if
+        p = tail;
+    }   // end while
+    return ttl;
+}   // end function: ZoneParser_parseTtl
+
+static bool
+ZoneParser_addRecord(ZoneParser *self, ZoneNode *node, uint16_t rrtype, const void *addr,
+                     size_t addrlen, uint16_t preference, const char *data, size_t datalen)
+{
+    ZoneRecord *record = (ZoneRecord *) malloc(sizeof(ZoneRecord) + datalen + 1);
+    if (NULL == record) {
+        LogNoResource();
+        return false;
+    }   // end if
+    memset(record, 0, sizeof(ZoneRecord));
+    record->rrtype = rrtype;
+    record->preference = preference;
+    record->ttl = self->ttl;
+    if (NULL != addr) {
+        memcpy(&record->addr, addr, addrlen);
+    }   // end if
+    if (NULL != data) {
+        memcpy(record->data, data, datalen);
+    }   // end if
+    record->data[datalen] = '\0';
+
+    // keep the order in the zone file
+    ZoneRecord **tail = &node->record;
+    while (NULL != *tail) {
+        tail = &(*tail)->next;
+    }   // end while
+    *tail = record;
+    return true;
+}   // end function: ZoneParser_addRecord
+
+static bool ZoneParser_load(ZoneParser *self, const char *filename, int depth);
+
+static bool
+ZoneParser_parseDirective(ZoneParser *self, char **tokens, int ntokens, int depth)
+{
+    ZoneDatabase *db = self->db;
+    const char *directive = tokens[0];
+    if (0 == strcasecmp(directive, "$ORIGIN") && 2 == ntokens) {
+        return ZoneParser_normalizeName(tokens[1], self->origin, self->origin, sizeof(self->origin));
+    } else if (0 == strcasecmp(directive, "$TTL") && 2 == ntokens) {
+        if (!ZoneParser_isTtl(tokens[1])) {
+            return false;
+        }   // end if
+        self->default_ttl = ZoneParser_parseTtl(tokens[1]);
+        return true;
+    } else if (0 == strcasecmp(directive, "$INCLUDE") && (2 == ntokens || 3 == ntokens)) {
+        char path[FILENAME_MAX];
+        const char *slash = strrchr(self->filename, '/');
+        if ('/' != *tokens[1] && NULL != slash) {
+            snprintf(path, sizeof(path), "%.*s/%s", (int) (slash - self->filename), self->filename,
+                     tokens[1]);
+        } else {
+            snprintf(path, sizeof(path), "%s", tokens[1]);
+        }   // end if
+        ZoneParser child;
+        memset(&child, 0, sizeof(child));
+        child.db = db;
+        child.default_ttl = self->default_ttl;
+        memcpy(child.origin, self->origin, sizeof(child.origin));
+        if (3 == ntokens
+            && !ZoneParser_normalizeName(tokens[2], self->origin, child.origin,
+                                         sizeof(child.origin))) {
+            return false;
+        }   // end if
+        return ZoneParser_load(&child, path, depth + 1);
+    } else if (0 == strcasecmp(directive, "$LATENCY") && 3 <= ntokens) {
+        const char *dist = tokens[1];
+        db->latency_param1 = strtod(tokens[2], NULL);
+        db->latency_param2 = 4 <= ntokens ? strtod(tokens[3], NULL) : 0.0;
+        if (0 == strcasecmp(dist, "fixed")) {
+            db->latency_dist = ZONE_LATENCY_FIXED;
+        } else if (0 == strcasecmp(dist, "uniform") && 4 == ntokens) {
+            db->latency_dist = ZONE_LATENCY_UNIFORM;
+        } else if (0 == strcasecmp(dist, "exponential")) {
+            db->latency_dist = ZONE_LATENCY_EXPONENTIAL;
+        } else if (0 == strcasecmp(dist, "normal") && 4 == ntokens) {
+            db->latency_dist = ZONE_LATENCY_NORMAL;
+        } else {
+            return false;
+        }   // end if
+        return true;
+    } else if (0 == strcasecmp(directive, "$LOSS") && 2 == ntokens) {
+        db->loss_rate = strtod(tokens[1], NULL);
+        return true;
+    } else if (0 == strcasecmp(directive, "$SERVFAIL") && 2 == ntokens) {
+        db->servfail_rate = strtod(tokens[1], NULL);
+        return true;
+    } else if (0 == strcasecmp(directive, "$SEED") && 2 == ntokens) {
+        db->seed = strtol(tokens[1], NULL, 10);
+        return true;
+    }   // end if
+    return false;
+}   // end function: ZoneParser_parseDirective
+
+static bool
+ZoneParser_parseRecord(ZoneParser *self, char **tokens, bool *quoted, int ntokens,
+                       bool inherit_owner)
+{
+    int pos = 0;
+    if (!inherit_owner) {
+        if (!ZoneParser_normalizeName(tokens[pos++], self->origin, self->owner,
+                                      sizeof(self->owner))) {
+            return false;
+        }   // end if
+    } else if ('\0' == self->owner[0]) {
+        return false;   // no previous owner
+    }   // end if
+
+    // TTL and class in any order
+    self->ttl = self->default_ttl;
+    for (int i = 0; i < 2 && pos < ntokens; ++i) {
+        if (ZoneParser_isTtl(tokens[pos])) {
+            self->ttl = ZoneParser_parseTtl(tokens[pos++]);
+        } else if (0 == strcasecmp(tokens[pos], "IN") || 0 == strcasecmp(tokens[pos], "CH")
+                   || 0 == strcasecmp(tokens[pos], "HS")) {
+            ++pos;
+        }   // end if
+    }   // end for
+    if (ntokens <= pos) {
+        return false;
+    }   // end if
+    const char *type = tokens[pos++];
+    int nrdata = ntokens - pos;
+    char **rdata = tokens + pos;
+
+    ZoneNode *node = ZoneDatabase_addNode(self->db, self->owner);
+    if (NULL == node) {
+        LogNoResource();
+        return false;
+    }   // end if
+
+    // register the empty non-terminals between the owner and the origin
+    size_t originlen = strlen(self->origin);
+    size_t ownerlen = strlen(self->owner);
+    if (0 < originlen && originlen < ownerlen
+        && 0 == strcmp(self->owner + ownerlen - originlen, self->origin)
+        && '.' == self->owner[ownerlen - originlen - 1]) {
+        for (const char *p = strchr(self->owner, '.'); NULL != p && p + 1 <= self->owner + ownerlen - originlen;
+             p = strchr(p + 1, '.')) {
+            if (NULL == ZoneDatabase_addNode(self->db, p + 1)) {
+                LogNoResource();
+                return false;
+            }   // end if
+        }   // end for
+    }   // end if
+
+    if (0 == strcasecmp(type, "A")) {
+        struct in_addr addr4;
+        if (1 != nrdata || 1 != inet_pton(AF_INET, rdata[0], &addr4)) {
+            return false;
+        }   // end if
+        return ZoneParser_addRecord(self, node, ns_t_a, &addr4, sizeof(addr4), 0, NULL, 0);
+    } else if (0 == strcasecmp(type, "AAAA")) {
+        struct in6_addr addr6;
+        if (1 != nrdata || 1 != inet_pton(AF_INET6, rdata[0], &addr6)) {
+            return false;
+        }   // end if
+        return ZoneParser_addRecord(self, node, ns_t_aaaa, &addr6, sizeof(addr6), 0, NULL, 0);
+    } else if (0 == strcasecmp(type, "MX")) {
+        char exchange[NS_MAXDNAME];
+        if (2 != nrdata || !isdigit((unsigned char) *rdata[0])
+            || !ZoneParser_normalizeName(rdata[1], self->origin, exchange, sizeof(exchange))) {
+            return false;
+        }   // end if
+        return ZoneParser_addRecord(self, node, ns_t_mx, NULL, 0,
+                                    (uint16_t) strtoul(rdata[0], NULL, 10), exchange,
+                                    strlen(exchange));
+    } else if (0 == strcasecmp(type, "PTR") || 0 == strcasecmp(type, "CNAME")) {
+        char target[NS_MAXDNAME];
+        if (1 != nrdata
+            || !ZoneParser_normalizeName(rdata[0], self->origin, target, sizeof(target))) {
+            return false;
+        }   // end if
+        return ZoneParser_addRecord(self, node,
+                                    0 == strcasecmp(type, "PTR") ? ns_t_ptr : ns_t_cname, NULL, 0,
+                                    0, target, strlen(target));
+    } else if (0 == strcasecmp(type, "TXT") || 0 == strcasecmp(type, "SPF")) {
+        // character-strings are concatenated as the other engines do
+        char data[NS_MAXMSG > 65535 ? 65535 : NS_MAXMSG];
+        size_t datalen = 0;
+        if (0 == nrdata) {
+            return false;
+        }   // end if
+        for (int i = 0; i < nrdata; ++i) {
+            size_t len = strlen(rdata[i]);
+            if (!quoted[pos + i] && 0 == len) {
+                return false;
+            }   // end if
+            if (sizeof(data) <= datalen + len) {
+                return false;
+            }   // end if
+            memcpy(data + datalen, rdata[i], len);
+            datalen += len;
+        }   // end for
+        return ZoneParser_addRecord(self, node,
+                                    0 == strcasecmp(type, "TXT") ? ns_t_txt : ZONE_RRTYPE_SPF,
+                                    NULL, 0, 0, data, datalen);
+    }   // end if
+
+    // other types only make the owner exist
+    return true;
+}   // end function: ZoneParser_parseRecord
+
+static bool
+ZoneParser_load(ZoneParser *self, const char *filename, int depth)
+{
+    if (ZONE_MAX_INCLUDE_DEPTH < depth) {
+        LogError("zone files are nested too deeply: file=%s", filename);
+        return false;
+    }   // end if
+    FILE *fp = fopen(filename, "r");
+    if (NULL == fp) {
+        LogError("failed to open zone file: file=%s, errno=%s", filename, strerror(errno));
+        return false;
+    }   // end if
+    self->filename = filename;
+    self->lineno = 0;
+
+    bool result = false;
+    char *line = NULL;
+    size_t linecap = 0;
+    char *logical = NULL;
+    size_t logical_len = 0;
+    size_t logical_start = 0;
+    int paren_depth = 0;
+    char *tokens[ZONE_MAX_TOKENS];
+    bool quoted[ZONE_MAX_TOKENS];
+
+    while (0 <= getline(&line, &linecap, fp)) {
+        ++self->lineno;
+        if (0 == logical_len) {
+            logical_start = self->lineno;
+        }   // end if
+        paren_depth = ZoneParser_stripComment(line, paren_depth);
+        size_t len = strlen(line);
+        char *newbuf = (char *) realloc(logical, logical_len + len + 2);
+        if (NULL == newbuf) {
+            LogNoResource();
+            goto cleanup;
+        }   // end if
+        logical = newbuf;
+        memcpy(logical + logical_len, line, len);
+        logical_len += len;
+        logical[logical_len++] = ' ';
+        logical[logical_len] = '\0';
+        if (0 < paren_depth) {
+            continue;
+        }   // end if
+
+        bool inherit_owner = isspace((unsigned char) logical[0]);
+        int ntokens = ZoneParser_tokenize(logical, tokens, quoted, ZONE_MAX_TOKENS);
+        logical_len = 0;
+        if (0 == ntokens) {
+            continue;
+        }   // end if
+        bool parsed = (0 < ntokens && '$' == tokens[0][0] && !inherit_owner)
+            ? ZoneParser_parseDirective(self, tokens, ntokens, depth)
+            : (0 < ntokens && ZoneParser_parseRecord(self, tokens, quoted, ntokens, inherit_owner));
+        if (!parsed) {
+            LogError("zone file parse error: file=%s, line=%zu", filename, logical_start);
+            goto cleanup;
+        }   // end if
+        self->filename = filename;  // restore after $INCLUDE
+    }   // end while
+    if (0 != paren_depth) {
+        LogError("zone file parse error: unbalanced parentheses: file=%s, line=%zu", filename,
+                 logical_start);
+        goto cleanup;
+    }   // end if
+    result = true;
+
+  cleanup:
+    free(logical);
+    free(line);
+    fclose(fp);
+    return result;
+}   // end function: ZoneParser_load
+
+/*
+ * the database is shared among resolvers as long as the zone file is not modified.
+ * modifications of the files included with $INCLUDE are not detected.
+ */
+static ZoneDatabase *
+ZoneDatabase_acquire(const char *path)
+{
+    struct stat st;
+    if (0 != stat(path, &st)) {
+        LogError("failed to stat zone file: file=%s, errno=%s", path, strerror(errno));
+        return NULL;
+    }   // end if
+
+    int ret = pthread_mutex_lock(&zone_database_lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return NULL;
+    }   // end if
+
+    ZoneDatabase *db = zone_database_list;
+    for (; NULL != db; db = db->next) {
+        if (0 == strcmp(db->path, path) && db->dev == st.st_dev && db->ino == st.st_ino
+            && db->mtime == st.st_mtime && db->size == st.st_size) {
+            break;
+        }   // end if
+    }   // end for
+
+    if (NULL == db) {
+        db = (ZoneDatabase *) malloc(sizeof(ZoneDatabase));
+        if (NULL == db) {
+            LogNoResource();
+            goto finally;
+        }   // end if
+        memset(db, 0, sizeof(ZoneDatabase));
+        db->dev = st.st_dev;
+        db->ino = st.st_ino;
+        db->mtime = st.st_mtime;
+        db->size = st.st_size;
+        db->path = strdup(path);
+        if (NULL == db->path) {
+            LogNoResource();
+            ZoneDatabase_free(db);
+            db = NULL;
+            goto finally;
+        }   // end if
+        ZoneParser parser;
+        memset(&parser, 0, sizeof(parser));
+        parser.db = db;
+        parser.default_ttl = ZONE_DEFAULT_TTL;
+        if (!ZoneParser_load(&parser, path, 0)) {
+            ZoneDatabase_free(db);
+            db = NULL;
+            goto finally;
+        }   // end if
+        LogInfo("zone file loaded: file=%s, names=%zu", path, db->node_num);
+        db->next = zone_database_list;
+        zone_database_list = db;
+    }   // end if
+    ++db->refcount;
+    ++db->instance_count;
+
+  finally:
+    ret = pthread_mutex_unlock(&zone_database_lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+    return db;
+}   // end function: ZoneDatabase_acquire
+
+static void
+ZoneDatabase_release(ZoneDatabase *db)
+{
+    int ret = pthread_mutex_lock(&zone_database_lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return;
+    }   // end if
+
+    if (0 == --db->refcount) {
+        for (ZoneDatabase **pp = &zone_database_list; NULL != *pp; pp = &(*pp)->next) {
+            if (db == *pp) {
+                *pp = db->next;
+                break;
+            }   // end if
+        }   // end for
+        ZoneDatabase_free(db);
+    }   // end if
+
+    ret = pthread_mutex_unlock(&zone_database_lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+}   // end function: ZoneDatabase_release
+
+static dns_stat_t
+ZoneResolver_setError(ZoneResolver *self, dns_stat_t status)
+{
+    self->status = status;
+    return status;  // for caller's convenience
+}   // end function: ZoneResolver_setError
+
+static const char *
+ZoneResolver_getErrorSymbol(const DnsResolver *base)
+{
+    const ZoneResolver *self = (const ZoneResolver *) base;
+    return DnsResolver_symbolizeErrorCode(self->status);
+}   // end function: ZoneResolver_getErrorSymbol
+
+static void
+ZoneResolver_setTimeout(const DnsResolver *base, time_t timeout)
+{
+    ZoneResolver *self = (ZoneResolver *) base;
+    self->timeout = timeout;
+}   // end function: ZoneResolver_setTimeout
+
+static void
+ZoneResolver_setRetryCount(const DnsResolver *base, int retry)
+{
+    ZoneResolver *self = (ZoneResolver *) base;
+    self->retry = retry;
+}   // end function: ZoneResolver_setRetryCount
+
+static time_t
+ZoneResolver_getTimeout(const DnsResolver *base)
+{
+    const ZoneResolver *self = (const ZoneResolver *) base;
+    return self->timeout;
+}   // end function: ZoneResolver_getTimeout
+
+static int
+ZoneResolver_getRetryCount(const DnsResolver *base)
+{
+    const ZoneResolver *self = (const ZoneResolver *) base;
+    return self->retry;
+}   // end function: ZoneResolver_getRetryCount
+
+static void
+ZoneResolver_sleep(double msec)
+{
+    if (msec <= 0.0) {
+        return;
+    }   // end if
+    struct timespec ts;
+    ts.tv_sec = (time_t) (msec / 1000.0);
+    ts.tv_nsec = (long) ((msec - ts.tv_sec * 1000.0) * 1000000.0);
+    while (0 != nanosleep(&ts, &ts) && EINTR == errno);
+}   // end function: ZoneResolver_sleep
+
+static double
+ZoneResolver_sampleLatency(ZoneResolver *self)
+{
+    const ZoneDatabase *db = self->db;
+    switch (db->latency_dist) {
+    case ZONE_LATENCY_FIXED:
+        return db->latency_param1;
+    case ZONE_LATENCY_UNIFORM:
+        return db->latency_param1 + (db->latency_param2 - db->latency_param1) * erand48(self->xsubi);
+    case ZONE_LATENCY_EXPONENTIAL:
+        return -db->latency_param1 * log(1.0 - erand48(self->xsubi));
+    case ZONE_LATENCY_NORMAL:;
+        // Box-Muller transform
+        double u1 = 1.0 - erand48(self->xsubi);
+        double u2 = erand48(self->xsubi);
+        double sample = db->latency_param1 + db->latency_param2 * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+        return 0.0 < sample ? sample : 0.0;
+    case ZONE_LATENCY_NONE:
+    default:
+        return 0.0;
+    }   // end switch
+}   // end function: ZoneResolver_sampleLatency
+
+static void
+ZoneResolver_delay(ZoneResolver *self, double msec)
+{
+    if (self->deferring) {
+        self->deferred_delay += msec;
+    } else {
+        ZoneResolver_sleep(msec);
+    }   // end if
+}   // end function: ZoneResolver_delay
+
+/*
+ * simulate the network
+ * @return DNS_STAT_NOERROR if the query should be answered from the database.
+ */
+static dns_stat_t
+ZoneResolver_simulate(ZoneResolver *self)
+{
+    const ZoneDatabase *db = self->db;
+    for (int attempt = 0; attempt <= self->retry; ++attempt) {
+        if (0.0 < db->loss_rate && erand48(self->xsubi) < db->loss_rate) {
+            ZoneResolver_delay(self, self->timeout * 1000.0);
+            continue;
+        }   // end if
+        ZoneResolver_delay(self, ZoneResolver_sampleLatency(self));
+        if (0.0 < db->servfail_rate && erand48(self->xsubi) < db->servfail_rate) {
+            return DNS_STAT_SERVFAIL;
+        }   // end if
+        return DNS_STAT_NOERROR;
+    }   // end for
+    return DNS_STAT_RESOLVER;   // timed out
+}   // end function: ZoneResolver_simulate
+
+/*
+ * find the node which holds the records of the type, following CNAME records.
+ */
+static dns_stat_t
+ZoneResolver_query(ZoneResolver *self, const char *domain, uint16_t rrtype, const ZoneNode **found,
+                   size_t *count, uint32_t *ttl)
+{
+    self->status = DNS_STAT_NOERROR;
+    dns_stat_t sim_stat = ZoneResolver_simulate(self);
+    if (DNS_STAT_NOERROR != sim_stat) {
+        return ZoneResolver_setError(self, sim_stat);
+    }   // end if
+
+    char name[NS_MAXDNAME];
+    if (!ZoneParser_normalizeName(domain, NULL, name, sizeof(name))) {
+        return ZoneResolver_setError(self, DNS_STAT_BADREQUEST);
+    }   // end if
+    *ttl = UINT32_MAX;
+    for (int chain = 0; chain <= ZONE_MAX_CNAME_CHAIN; ++chain) {
+        const ZoneNode *node = ZoneDatabase_findNode(self->db, name);
+        if (NULL == node) {
+            return ZoneResolver_setError(self, DNS_STAT_NXDOMAIN);
+        }   // end if
+        size_t num = 0;
+        const ZoneRecord *cname = NULL;
+        for (const ZoneRecord *record = node->record; NULL != record; record = record->next) {
+            if (rrtype == record->rrtype) {
+                ++num;
+                *ttl = MIN(*ttl, record->ttl);
+            } else if (ns_t_cname == record->rrtype) {
+                cname = record;
+            }   // end if
+        }   // end for
+        if (0 < num) {
+            *found = node;
+            *count = num;
+            return DNS_STAT_NOERROR;
+        }   // end if
+        if (NULL == cname) {
+            return ZoneResolver_setError(self, DNS_STAT_NODATA);
+        }   // end if
+        *ttl = MIN(*ttl, cname->ttl);
+        snprintf(name, sizeof(name), "%s", cname->data);
+    }   // end for
+    return ZoneResolver_setError(self, DNS_STAT_SERVFAIL);  // CNAME loop
+}   // end function: ZoneResolver_query
+
+static dns_stat_t
+ZoneResolver_lookupA(DnsResolver *base, const char *domain, DnsAResponse **resp)
+{
+    ZoneResolver *self = (ZoneResolver *) base;
+    const ZoneNode *node;
+    size_t num;
+    uint32_t ttl;
+    dns_stat_t query_stat = ZoneResolver_query(self, domain, ns_t_a, &node, &num, &ttl);
+    if (DNS_STAT_NOERROR != query_stat) {
+        return query_stat;
+    }   // end if
+    DnsAResponse *respobj =
+        (DnsAResponse *) malloc(sizeof(DnsAResponse) + num * sizeof(struct in_addr));
+    if (NULL == respobj) {
+        return ZoneResolver_setError(self, DNS_STAT_NOMEMORY);
+    }   // end if
+    respobj->num = 0;
+    respobj->ttl = ttl;
+    for (const ZoneRecord *record = node->record; NULL != record; record = record->next) {
+        if (ns_t_a == record->rrtype) {
+            memcpy(&(respobj->addr[respobj->num++]), &record->addr.addr4, sizeof(struct in_addr));
+        }   // end if
+    }   // end for
+    *resp = respobj;
+    return DNS_STAT_NOERROR;
+}   // end function: ZoneResolver_lookupA
+
+static dns_stat_t
+ZoneResolver_lookupAaaa(DnsResolver *base, const char *domain, DnsAaaaResponse **resp)
+{
+    ZoneResolver *self = (ZoneResolver *) base;
+    const ZoneNode *node;
+    size_t num;
+    uint32_t ttl;
+    dns_stat_t query_stat = ZoneResolver_query(self, domain, ns_t_aaaa, &node, &num, &ttl);
+    if (DNS_STAT_NOERROR != query_stat) {
+        return query_stat;
+    }   // end if
+    DnsAaaaResponse *respobj =
+        (DnsAaaaResponse *) malloc(sizeof(DnsAaaaResponse) + num * sizeof(struct in6_addr));
+    if (NULL == respobj) {
+        return ZoneResolver_setError(self, DNS_STAT_NOMEMORY);
+    }   // end if
+    respobj->num = 0;
+    respobj->ttl = ttl;
+    for (const ZoneRecord *record = node->record; NULL != record; record = record->next) {
+        if (ns_t_aaaa == record->rrtype) {
+            memcpy(&(respobj->addr[respobj->num++]), &record->addr.addr6, sizeof(struct in6_addr));
+        }   // end if
+    }   // end for
+    *resp = respobj;
+    return DNS_STAT_NOERROR;
+}   // end function: ZoneResolver_lookupAaaa
+
+static dns_stat_t
+ZoneResolver_lookupMx(DnsResolver *base, const char *domain, DnsMxResponse **resp)
+{
+    ZoneResolver *self = (ZoneResolver *) base;
+    const ZoneNode *node;
+    size_t num;
+    uint32_t ttl;
+    dns_stat_t query_stat = ZoneResolver_query(self, domain, ns_t_mx, &node, &num, &ttl);
+    if (DNS_STAT_NOERROR != query_stat) {
+        return query_stat;
+    }   // end if
+    DnsMxResponse *respobj =
+        (DnsMxResponse *) malloc(sizeof(DnsMxResponse) + num * sizeof(struct mxentry *));
+    if (NULL == respobj) {
+        return ZoneResolver_setError(self, DNS_STAT_NOMEMORY);
+    }   // end if
+    respobj->num = 0;
+    respobj->ttl = ttl;
+    for (const ZoneRecord *record = node->record; NULL != record; record = record->next) {
+        if (ns_t_mx != record->rrtype) {
+            continue;
+        }   // end if
+        size_t domainlen = strlen(record->data);
+        struct mxentry *entry =
+            (struct mxentry *) malloc(sizeof(struct mxentry) + sizeof(char[domainlen + 1]));
+        if (NULL == entry) {
+            DnsMxResponse_free(respobj);
+            return ZoneResolver_setError(self, DNS_STAT_NOMEMORY);
+        }   // end if
+        entry->preference = record->preference;
+        memcpy(entry->domain, record->data, domainlen + 1);
+        respobj->exchange[respobj->num++] = entry;
+    }   // end for
+    *resp = respobj;
+    return DNS_STAT_NOERROR;
+}   // end function: ZoneResolver_lookupMx
+
+/*
+ * @return DNS_STAT_NOERROR on success.
+ */
+static dns_stat_t
+ZoneResolver_lookupStrings(ZoneResolver *self, const char *domain, uint16_t rrtype,
+                           DnsTxtResponse **resp)
+{
+    const ZoneNode *node;
+    size_t num;
+    uint32_t ttl;
+    dns_stat_t query_stat = ZoneResolver_query(self, domain, rrtype, &node, &num, &ttl);
+    if (DNS_STAT_NOERROR != query_stat) {
+        return query_stat;
+    }   // end if
+    DnsTxtResponse *respobj =
+        (DnsTxtResponse *) malloc(sizeof(DnsTxtResponse) + num * sizeof(char *));
+    if (NULL == respobj) {
+        return ZoneResolver_setError(self, DNS_STAT_NOMEMORY);
+    }   // end if
+    respobj->num = 0;
+    respobj->ttl = ttl;
+    for (const ZoneRecord *record = node->record; NULL != record; record = record->next) {
+        if (rrtype != record->rrtype) {
+            continue;
+        }   // end if
+        char *data = strdup(record->data);
+        if (NULL == data) {
+            DnsTxtResponse_free(respobj);
+            return ZoneResolver_setError(self, DNS_STAT_NOMEMORY);
+        }   // end if
+        respobj->data[respobj->num++] = data;
+    }   // end for
+    *resp = respobj;
+    return DNS_STAT_NOERROR;
+}   // end function: ZoneResolver_lookupStrings
+
+static dns_stat_t
+ZoneResolver_lookupTxt(DnsResolver *base, const char *domain, DnsTxtResponse **resp)
+{
+    return ZoneResolver_lookupStrings((ZoneResolver *) base, domain, ns_t_txt, resp);
+}   // end function: ZoneResolver_lookupTxt
+
+static dns_stat_t
+ZoneResolver_lookupSpf(DnsResolver *base, const char *domain, DnsSpfResponse **resp)
+{
+    return ZoneResolver_lookupStrings((ZoneResolver *) base, domain, ZONE_RRTYPE_SPF, resp);
+}   // end function: ZoneResolver_lookupSpf
+
+/*
+ * answer the queries as if they were sent concurrently,
+ * that is, sleep only for the longest of the simulated delays of the non-speculative queries.
+ * the speculative queries delayed longer than that are dropped as they are not waited for.
+ */
+static void
+ZoneResolver_lookupBatch(DnsResolver *base, DnsBatchQuery **query, size_t num)
+{
+    ZoneResolver *self = (ZoneResolver *) base;
+    double delay[num];
+    double max_delay = 0.0;
+    self->deferring = true;
+    for (size_t i = 0; i < num; ++i) {
+        DnsAResponse *resp4 = NULL;
+        DnsAaaaResponse *resp6 = NULL;
+        DnsMxResponse *respmx = NULL;
+        DnsTxtResponse *resptxt = NULL;
+        self->deferred_delay = 0.0;
+        switch (query[i]->rrtype) {
+        case ns_t_a:
+            query[i]->status = ZoneResolver_lookupA(base, query[i]->qname, &resp4);
+            query[i]->resp = resp4;
+            break;
+        case ns_t_aaaa:
+            query[i]->status = ZoneResolver_lookupAaaa(base, query[i]->qname, &resp6);
+            query[i]->resp = resp6;
+            break;
+        case ns_t_mx:
+            query[i]->status = ZoneResolver_lookupMx(base, query[i]->qname, &respmx);
+            query[i]->resp = respmx;
+            break;
+        case ns_t_txt:
+            query[i]->status = ZoneResolver_lookupTxt(base, query[i]->qname, &resptxt);
+            query[i]->resp = resptxt;
+            break;
+        case 99 /* as ns_t_spf */:
+            query[i]->status = ZoneResolver_lookupSpf(base, query[i]->qname, &resptxt);
+            query[i]->resp = resptxt;
+            break;
+        default:
+            query[i]->status = ZoneResolver_setError(self, DNS_STAT_BADREQUEST);
+            query[i]->resp = NULL;
+            break;
+        }   // end switch
+        delay[i] = self->deferred_delay;
+        query[i]->elapsed = (uint64_t) (self->deferred_delay * 1000);
+        if (!query[i]->speculative) {
+            max_delay = MAX(max_delay, self->deferred_delay);
+        }   // end if
+    }   // end for
+    self->deferring = false;
+    for (size_t i = 0; i < num; ++i) {
+        query[i]->dropped = query[i]->speculative && max_delay < delay[i];
+        if (query[i]->dropped) {
+            if (DNS_STAT_NOERROR == query[i]->status) {
+                DnsResolver_freeResponse(query[i]->rrtype, query[i]->resp);
+            }   // end if
+            query[i]->resp = NULL;
+        }   // end if
+    }   // end for
+    ZoneResolver_sleep(max_delay);
+}   // end function: ZoneResolver_lookupBatch
+
+static dns_stat_t
+ZoneResolver_lookupPtr(DnsResolver *base, sa_family_t sa_family, const void *addr,
+                       DnsPtrResponse **resp)
+{
+    ZoneResolver *self = (ZoneResolver *) base;
+    char domain[DNS_IP6_REVENT_MAXLEN];
+    switch (sa_family) {
+    case AF_INET:
+        if (!DnsResolver_expandReverseEntry4((const struct in_addr *) addr, domain, sizeof(domain))) {
+            return ZoneResolver_setError(self, DNS_STAT_BADREQUEST);
+        }   // end if
+        break;
+    case AF_INET6:
+        if (!DnsResolver_expandReverseEntry6((const struct in6_addr *) addr, domain, sizeof(domain))) {
+            return ZoneResolver_setError(self, DNS_STAT_BADREQUEST);
+        }   // end if
+        break;
+    default:
+        return ZoneResolver_setError(self, DNS_STAT_BADREQUEST);
+    }   // end switch
+    // DnsPtrResponse has the same layout as DnsTxtResponse
+    return ZoneResolver_lookupStrings(self, domain, ns_t_ptr, (DnsTxtResponse **) resp);
+}   // end function: ZoneResolver_lookupPtr
+
+static void
+ZoneResolver_free(DnsResolver *base)
+{
+    if (NULL == base) {
+        return;
+    }   // end if
+
+    ZoneResolver *self = (ZoneResolver *) base;
+    if (NULL != self->db) {
+        ZoneDatabase_release(self->db);
+    }   // end if
+    free(self);
+}   // end function: ZoneResolver_free
+
+static const struct DnsResolver_vtbl ZoneResolver_vtbl = {
+    "zone",
+    ZoneResolver_free,
+    ZoneResolver_getErrorSymbol,
+    ZoneResolver_setTimeout,
+    ZoneResolver_setRetryCount,
+    ZoneResolver_getTimeout,
+    ZoneResolver_getRetryCount,
+    ZoneResolver_lookupA,
+    ZoneResolver_lookupAaaa,
+    ZoneResolver_lookupMx,
+    ZoneResolver_lookupTxt,
+    ZoneResolver_lookupSpf,
+    ZoneResolver_lookupPtr,
+    ZoneResolver_lookupBatch,
+};
+
+/**
+ * @param initfile the path to the zone file.
+ */
+DnsResolver *
+ZoneResolver_new(const char *initfile)
+{
+    if (NULL == initfile) {
+        LogError("zone file is not specified");
+        return NULL;
+    }   // end if
+    ZoneResolver *self = (ZoneResolver *) malloc(sizeof(ZoneResolver));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(ZoneResolver));
+    self->db = ZoneDatabase_acquire(initfile);
+    if (NULL == self->db) {
+        goto cleanup;
+    }   // end if
+    self->vtbl = &ZoneResolver_vtbl;
+    self->timeout = ZONE_DEFAULT_TIMEOUT;
+    self->retry = ZONE_DEFAULT_RETRY;
+    // each instance has its own sequence of pseudo random numbers derived from the seed
+    long seed = self->db->seed + (long) self->db->instance_count;
+    self->xsubi[0] = 0x330e;
+    self->xsubi[1] = (unsigned short) seed;
+    self->xsubi[2] = (unsigned short) (seed >> 16);
+    return (DnsResolver *) self;
+
+  cleanup:
+    ZoneResolver_free((DnsResolver *) self);
+    return NULL;
+}   // end function: ZoneResolver_new
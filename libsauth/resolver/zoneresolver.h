@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2008-2014 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __ZONE_RESOLVER_H__
+#define __ZONE_RESOLVER_H__
+
+#include "dnsresolv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern DnsResolver *ZoneResolver_new(const char *initfile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ZONE_RESOLVER_H__ */
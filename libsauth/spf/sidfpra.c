@@ -34,6 +34,21 @@
 #define SIDF_PRA_RECEIVED_HEADER "Received"
 #define SIDF_PRA_RETURN_PATH_HEADER "Return-Path"
 
+/*
+ * @return true if a header named fieldname exists between the headers at head and tail (exclusive).
+ */
+static bool
+SidfPra_existsBetween(const InetMailHeaders *headers, const char *fieldname, int head, int tail)
+{
+    for (int i = InetMailHeaders_getFirstIndex(headers, fieldname); 0 <= i && i < tail;
+         i = InetMailHeaders_getNextIndex(headers, i)) {
+        if (head < i) {
+            return true;
+        }   // end if
+    }   // end for
+    return false;
+}   // end function: SidfPra_existsBetween
+
 static int
 SidfPra_lookup(const InetMailHeaders *headers)
 {
@@ -45,17 +60,15 @@ SidfPra_lookup(const InetMailHeaders *headers)
 
     if (0 <= resent_sender_pos) {
         if (0 <= resent_from_pos && resent_from_pos < resent_sender_pos) {
-            for (int i = resent_from_pos + 1; i < resent_sender_pos; ++i) {
-                const char *headerf, *headerv;
-                InetMailHeaders_get(headers, i, &headerf, &headerv);
-                if (0 == strcasecmp(headerf, SIDF_PRA_RECEIVED_HEADER)
-                    || 0 == strcasecmp(headerf, SIDF_PRA_RETURN_PATH_HEADER)) {
-                    // RFC4407 では, Resent-From と　Resent-Sender の間に
-                    // Received や Return-Path ヘッダが存在する場合は step 2 に進めとあるが,
-                    // ここでは Resent-From の存在を確認しているので, resent_from_pos を返せばよい.
-                    return resent_from_pos;
-                }   // end if
-            }   // end for
+            if (SidfPra_existsBetween(headers, SIDF_PRA_RECEIVED_HEADER, resent_from_pos,
+                                      resent_sender_pos)
+                || SidfPra_existsBetween(headers, SIDF_PRA_RETURN_PATH_HEADER, resent_from_pos,
+                                         resent_sender_pos)) {
+                // RFC4407 では, Resent-From と　Resent-Sender の間に
+                // Received や Return-Path ヘッダが存在する場合は step 2 に進めとあるが,
+                // ここでは Resent-From の存在を確認しているので, resent_from_pos を返せばよい.
+                return resent_from_pos;
+            }   // end if
         }   // end if
         return resent_sender_pos;
     }   // end if
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2008-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "stdaux.h"
+#include "loghandler.h"
+#include "spf.h"
+
+#define SPF_COST_TABLE_BUCKET_NUM 251
+
+typedef struct SpfCostEntry {
+    struct SpfCostEntry *next;
+    uint64_t eval_count;
+    uint64_t query_count;   // the total number of DNS lookups
+    uint64_t elapsed;       // the total wall time in microseconds
+    SpfEvalCost max;        // the most expensive evaluation for each item
+    size_t heap_index;      // the position in SpfCostTable::heap
+    char *domain;
+} SpfCostEntry;
+
+/*
+ * bounded table of the domains whose most expensive evaluations cost the most DNS lookups.
+ * the cost of a domain is the number of DNS lookups of its most expensive evaluation,
+ * and the wall time of that evaluation breaks ties.
+ * when the table is full, a domain not in the table replaces the cheapest entry
+ * if its evaluation costs more than that entry.
+ * the entries are also kept in a binary min-heap by cost to find the cheapest one at once,
+ * as the costs of the entries only increase.
+ */
+struct SpfCostTable {
+    pthread_mutex_t lock;
+    size_t max_entries;
+    size_t entry_num;
+    SpfCostEntry **heap;    // the cheapest entry first, max_entries elements
+    SpfCostEntry *bucket[SPF_COST_TABLE_BUCKET_NUM];
+};
+
+static unsigned int
+SpfCostTable_hash(const char *domain)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (const char *p = domain; '\0' != *p; ++p) {
+        hash ^= (uint32_t) tolower((unsigned char) *p);
+        hash *= 16777619U;
+    }   // end for
+    return hash % SPF_COST_TABLE_BUCKET_NUM;
+}   // end function: SpfCostTable_hash
+
+/*
+ * @return negative if the first cost is cheaper than the second, positive if more expensive,
+ *         0 if equal.
+ */
+static int
+SpfCostTable_compareCost(uint64_t query_count1, uint64_t elapsed1, uint64_t query_count2,
+                         uint64_t elapsed2)
+{
+    if (query_count1 != query_count2) {
+        return query_count1 < query_count2 ? -1 : 1;
+    }   // end if
+    if (elapsed1 != elapsed2) {
+        return elapsed1 < elapsed2 ? -1 : 1;
+    }   // end if
+    return 0;
+}   // end function: SpfCostTable_compareCost
+
+static bool
+SpfCostTable_isCheaper(const SpfCostEntry *entry1, const SpfCostEntry *entry2)
+{
+    return SpfCostTable_compareCost(entry1->max.query_count, entry1->max.elapsed,
+                                    entry2->max.query_count, entry2->max.elapsed) < 0;
+}   // end function: SpfCostTable_isCheaper
+
+static void
+SpfCostTable_placeEntry(SpfCostTable *self, SpfCostEntry *entry, size_t pos)
+{
+    self->heap[pos] = entry;
+    entry->heap_index = pos;
+}   // end function: SpfCostTable_placeEntry
+
+/*
+ * move the entry toward the root of the heap while it is cheaper than its parent.
+ */
+static void
+SpfCostTable_siftUp(SpfCostTable *self, SpfCostEntry *entry)
+{
+    size_t pos = entry->heap_index;
+    while (0 < pos) {
+        size_t parent = (pos - 1) / 2;
+        if (!SpfCostTable_isCheaper(entry, self->heap[parent])) {
+            break;
+        }   // end if
+        SpfCostTable_placeEntry(self, self->heap[parent], pos);
+        pos = parent;
+    }   // end while
+    SpfCostTable_placeEntry(self, entry, pos);
+}   // end function: SpfCostTable_siftUp
+
+/*
+ * move the entry toward the leaves of the heap while either of its children is cheaper.
+ */
+static void
+SpfCostTable_siftDown(SpfCostTable *self, SpfCostEntry *entry)
+{
+    size_t pos = entry->heap_index;
+    while (true) {
+        size_t child = pos * 2 + 1;
+        if (self->entry_num <= child) {
+            break;
+        }   // end if
+        if (child + 1 < self->entry_num
+            && SpfCostTable_isCheaper(self->heap[child + 1], self->heap[child])) {
+            ++child;
+        }   // end if
+        if (!SpfCostTable_isCheaper(self->heap[child], entry)) {
+            break;
+        }   // end if
+        SpfCostTable_placeEntry(self, self->heap[child], pos);
+        pos = child;
+    }   // end while
+    SpfCostTable_placeEntry(self, entry, pos);
+}   // end function: SpfCostTable_siftDown
+
+static void
+SpfCostTable_unlink(SpfCostTable *self, SpfCostEntry *target)
+{
+    for (SpfCostEntry **pp = &self->bucket[SpfCostTable_hash(target->domain)]; NULL != *pp;
+         pp = &(*pp)->next) {
+        if (target == *pp) {
+            *pp = target->next;
+            return;
+        }   // end if
+    }   // end for
+}   // end function: SpfCostTable_unlink
+
+/*
+ * @return the entry for the domain, NULL if the domain is not worth an entry
+ *         or memory allocation failed.
+ */
+static SpfCostEntry *
+SpfCostTable_insert(SpfCostTable *self, unsigned int hash, const char *domain,
+                    const SpfEvalCost *cost)
+{
+    char *newdomain = strdup(domain);
+    if (NULL == newdomain) {
+        LogNoResource();
+        return NULL;
+    }   // end if
+    for (char *p = newdomain; '\0' != *p; ++p) {
+        *p = tolower((unsigned char) *p);
+    }   // end for
+
+    SpfCostEntry *entry;
+    if (self->entry_num < self->max_entries) {
+        entry = (SpfCostEntry *) malloc(sizeof(SpfCostEntry));
+        if (NULL == entry) {
+            LogNoResource();
+            free(newdomain);
+            return NULL;
+        }   // end if
+        memset(entry, 0, sizeof(SpfCostEntry));
+        // the entry costs nothing yet, SpfCostTable_add() sifts it down
+        entry->heap_index = self->entry_num++;
+        SpfCostTable_siftUp(self, entry);
+    } else {
+        // the table is full, take over the cheapest entry at the root of the heap
+        entry = 0 < self->entry_num ? self->heap[0] : NULL;
+        if (NULL == entry
+            || SpfCostTable_compareCost(cost->query_count, cost->elapsed,
+                                        entry->max.query_count, entry->max.elapsed) <= 0) {
+            free(newdomain);
+            return NULL;
+        }   // end if
+        SpfCostTable_unlink(self, entry);
+        free(entry->domain);
+        // stays at the root until SpfCostTable_add() sifts it down
+        memset(entry, 0, sizeof(SpfCostEntry));
+    }   // end if
+    entry->domain = newdomain;
+    entry->next = self->bucket[hash];
+    self->bucket[hash] = entry;
+    return entry;
+}   // end function: SpfCostTable_insert
+
+/**
+ * Accounts the cost of an evaluation to the domain.
+ * @param domain the <domain> argument of the top-level check_host().
+ */
+void
+SpfCostTable_add(SpfCostTable *self, const char *domain, const SpfEvalCost *cost)
+{
+    assert(NULL != self);
+    assert(NULL != domain);
+    assert(NULL != cost);
+
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return;
+    }   // end if
+
+    unsigned int hash = SpfCostTable_hash(domain);
+    SpfCostEntry *entry = self->bucket[hash];
+    for (; NULL != entry; entry = entry->next) {
+        if (0 == strcasecmp(entry->domain, domain)) {
+            break;
+        }   // end if
+    }   // end for
+    if (NULL == entry) {
+        entry = SpfCostTable_insert(self, hash, domain, cost);
+    }   // end if
+    if (NULL != entry) {
+        ++entry->eval_count;
+        entry->query_count += cost->query_count;
+        entry->elapsed += cost->elapsed;
+        entry->max.dns_mech_count = MAX(entry->max.dns_mech_count, cost->dns_mech_count);
+        entry->max.void_lookup_count = MAX(entry->max.void_lookup_count, cost->void_lookup_count);
+        entry->max.include_depth = MAX(entry->max.include_depth, cost->include_depth);
+        entry->max.query_count = MAX(entry->max.query_count, cost->query_count);
+        entry->max.elapsed = MAX(entry->max.elapsed, cost->elapsed);
+        // the cost never decreases
+        SpfCostTable_siftDown(self, entry);
+    }   // end if
+
+    ret = pthread_mutex_unlock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+}   // end function: SpfCostTable_add
+
+static int
+SpfCostTable_compareEntry(const void *p1, const void *p2)
+{
+    const SpfCostEntry *entry1 = *(const SpfCostEntry * const *) p1;
+    const SpfCostEntry *entry2 = *(const SpfCostEntry * const *) p2;
+    // the most expensive first
+    return SpfCostTable_compareCost(entry2->max.query_count, entry2->max.elapsed,
+                                    entry1->max.query_count, entry1->max.elapsed);
+}   // end function: SpfCostTable_compareEntry
+
+/**
+ * Enumerates the domains from the most expensive one.
+ * The callback is called with the lock held.
+ */
+void
+SpfCostTable_iterate(SpfCostTable *self, SpfCostTable_callback *callback, void *arg)
+{
+    assert(NULL != self);
+
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return;
+    }   // end if
+
+    if (0 < self->entry_num) {
+        SpfCostEntry **sorted = (SpfCostEntry **) malloc(sizeof(SpfCostEntry *) * self->entry_num);
+        if (NULL != sorted) {
+            memcpy(sorted, self->heap, sizeof(SpfCostEntry *) * self->entry_num);
+            qsort(sorted, self->entry_num, sizeof(SpfCostEntry *), SpfCostTable_compareEntry);
+            for (size_t i = 0; i < self->entry_num; ++i) {
+                callback(sorted[i]->domain, sorted[i]->eval_count, sorted[i]->query_count,
+                         sorted[i]->elapsed, &(sorted[i]->max), arg);
+            }   // end for
+            free(sorted);
+        } else {
+            LogNoResource();
+        }   // end if
+    }   // end if
+
+    ret = pthread_mutex_unlock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+}   // end function: SpfCostTable_iterate
+
+/**
+ * release SpfCostTable object
+ * @param self SpfCostTable object to release
+ */
+void
+SpfCostTable_free(SpfCostTable *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    for (size_t i = 0; i < SPF_COST_TABLE_BUCKET_NUM; ++i) {
+        SpfCostEntry *entry = self->bucket[i];
+        while (NULL != entry) {
+            SpfCostEntry *next = entry->next;
+            free(entry->domain);
+            free(entry);
+            entry = next;
+        }   // end while
+    }   // end for
+    free(self->heap);
+    (void) pthread_mutex_destroy(&self->lock);
+    free(self);
+}   // end function: SpfCostTable_free
+
+/**
+ * create SpfCostTable object
+ * @param max_entries the number of the domains to keep track of.
+ * @return initialized SpfCostTable object, or NULL if memory allocation failed.
+ */
+SpfCostTable *
+SpfCostTable_new(size_t max_entries)
+{
+    SpfCostTable *self = (SpfCostTable *) malloc(sizeof(SpfCostTable));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(SpfCostTable));
+    self->heap = (SpfCostEntry **) malloc(sizeof(SpfCostEntry *) * MAX(max_entries, 1));
+    if (NULL == self->heap) {
+        free(self);
+        return NULL;
+    }   // end if
+    int ret = pthread_mutex_init(&self->lock, NULL);
+    if (0 != ret) {
+        free(self->heap);
+        free(self);
+        errno = ret;
+        return NULL;
+    }   // end if
+    self->max_entries = max_entries;
+    return self;
+}   // end function: SpfCostTable_new
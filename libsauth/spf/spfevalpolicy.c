@@ -51,6 +51,9 @@ SpfEvalPolicy_new(void)
     self->max_mxrr_per_mxmech = SPF_EVAL_MAX_MXMECH_MXRR;
     self->max_ptrrr_per_ptrmech = SPF_EVAL_MAX_PTRMECH_PTRRR;
     self->void_lookup_limit = SPF_EVAL_VOID_LOOKUP_LIMIT;
+    self->prefetch_depth = 0;
+    self->flat_cache = NULL;
+    self->cost_table = NULL;
     self->overwrite_all_directive_score = SPF_SCORE_NULL;
     self->action_on_plus_all_directive = SPF_CUSTOM_ACTION_NULL;
     self->action_on_malicious_ip4_cidr_length = SPF_CUSTOM_ACTION_NULL;
@@ -117,6 +120,45 @@ SpfEvalPolicy_setVoidLookupLimit(SpfEvalPolicy *self, int void_lookup_limit)
     self->void_lookup_limit = void_lookup_limit;
 }   // end function: SpfEvalPolicy_setVoidLookupLimit
 
+/**
+ * Enables speculative DNS lookups of the targets of records.
+ * The lookups are started as soon as a record is parsed and performed concurrently
+ * with the lookup the evaluation is waiting for, so that a deep include tree
+ * is resolved in about one round trip per level.
+ * Speculative lookups don't count toward the limit of DNS mechanisms.
+ * @param prefetch_depth the number of targets looked up ahead per record, 0 to disable.
+ */
+void
+SpfEvalPolicy_setPrefetchDepth(SpfEvalPolicy *self, unsigned int prefetch_depth)
+{
+    self->prefetch_depth = prefetch_depth;
+}   // end function: SpfEvalPolicy_setPrefetchDepth
+
+/**
+ * Looks up the result of check_host() in the cache of flattened records
+ * before evaluating the record of the domain.
+ * The records of the domains evaluated are flattened in the background,
+ * the evaluations proceed as usual until then.
+ * @param cache SpfFlatCache object created with this policy, NULL to disable.
+ *              The cache must be released after the SpfEvaluator objects evaluating with it.
+ */
+void
+SpfEvalPolicy_setFlatCache(SpfEvalPolicy *self, SpfFlatCache *cache)
+{
+    self->flat_cache = cache;
+}   // end function: SpfEvalPolicy_setFlatCache
+
+/**
+ * Accounts the cost of each evaluation to its <domain> in the table.
+ * @param table SpfCostTable object, NULL to disable.
+ *              The table must be released after the SpfEvaluator objects evaluating with it.
+ */
+void
+SpfEvalPolicy_setCostTable(SpfEvalPolicy *self, SpfCostTable *table)
+{
+    self->cost_table = table;
+}   // end function: SpfEvalPolicy_setCostTable
+
 /**
  * release SpfEvalPolicy object
  * @param self SpfEvalPolicy object to release
@@ -53,6 +53,15 @@ struct SpfEvalPolicy {
     // RFC7208 recommends this as 2.
     // Do not modify this unless you know exactly what you're doing.
     int void_lookup_limit;
+    // the number of targets of "include:", "a", "mx", "exists:" and "redirect=" looked up
+    // speculatively as soon as a record is parsed, 0 to disable.
+    unsigned int prefetch_depth;
+    // cache of the records flattened into prefixes of the client addresses, NULL to disable.
+    // not owned by the policy.
+    SpfFlatCache *flat_cache;
+    // table the costs of the evaluations are accounted to, NULL to disable.
+    // not owned by the policy.
+    SpfCostTable *cost_table;
     // "all" メカニズムにどんな qualifier が付いていようとスコアを上書きする.
     // SPF_SCORE_NULL の場合は通常動作 (レコードに書かれている qualifier を使用)
     SpfScore overwrite_all_directive_score;
@@ -15,8 +15,11 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <time.h>
 #include <assert.h>
 #include <sys/socket.h>
 #include <arpa/nameser.h>
@@ -39,6 +42,7 @@
 #include "spfrecord.h"
 #include "spfevaluator.h"
 #include "spfmacro.h"
+#include "spfflatcache.h"
 
 #define SPF_EVAL_DEFAULT_LOCALPART "postmaster"
 
@@ -49,8 +53,10 @@ typedef struct SpfRawRecord {
     SpfRecordScope scope;
 } SpfRawRecord;
 
-static SpfScore SpfEvaluator_checkHost(SpfEvaluator *self, const char *domain,
-                                       bool count_void_lookup);
+static void SpfEvaluator_deliverScore(SpfEvaluator *self, SpfScore eval_score);
+static void SpfEvaluator_onMechanismResult(SpfEvaluator *self, SpfScore eval_score);
+static void SpfEvaluator_beginCheckHost(SpfEvaluator *self, SpfEvalFrameType type,
+                                        const char *domain, bool count_void_lookup);
 
 static unsigned int
 SpfEvaluator_getDepth(const SpfEvaluator *self)
@@ -113,13 +119,27 @@ SpfEvaluator_getExplanation(const SpfEvaluator *self)
     return self->explanation;
 }   // end function: SpfEvaluator_getExplanation
 
+/**
+ * @param cost receives the cost of the last evaluation,
+ *             all zero if the evaluation hit the flattened record cache or is in progress.
+ */
+void
+SpfEvaluator_getCost(const SpfEvaluator *self, SpfEvalCost *cost)
+{
+    *cost = self->cost;
+}   // end function: SpfEvaluator_getCost
+
 static SpfStat
 SpfEvaluator_setExplanation(SpfEvaluator *self, const char *domain, const char *exp_macro)
 {
     const char *nextp;
     XBuffer_reset(self->xbuf);
+    SpfMacroProgram_reset(self->macro_program);
     SpfStat parse_stat =
-        SpfMacro_parseExplainString(self, exp_macro, STRTAIL(exp_macro), &nextp, self->xbuf);
+        SpfMacro_compileExplainString(self->macro_program, exp_macro, STRTAIL(exp_macro), &nextp);
+    if (SPF_STAT_OK == parse_stat && STRTAIL(exp_macro) == nextp) {
+        parse_stat = SpfMacro_expand(self->macro_program, self, self->xbuf);
+    }   // end if
     if (SPF_STAT_OK == parse_stat && STRTAIL(exp_macro) == nextp) {
         LogDebug("explanation record: domain=%s, exp=%s", domain, XBuffer_getString(self->xbuf));
         if (NULL != self->explanation) {
@@ -182,168 +202,278 @@ SpfEvaluator_incrementVoidLookupCounter(SpfEvaluator *self, dns_stat_t query_sta
     return SPF_SCORE_NULL;
 }   // end function: SpfEvaluator_incrementVoidLookupCounter
 
-/**
- * @return 成功した場合は SPF_SCORE_NULL, SPFレコード取得の際にエラーが発生した場合は SPF_SCORE_NULL 以外.
- */
-static SpfScore
-SpfEvaluator_fetch(SpfEvaluator *self, const char *domain, bool count_void_lookup,
-                   DnsTxtResponse **txtresp)
+
+static void
+SpfEvaluator_freeResponse(int rrtype, void *resp)
 {
-    if (self->policy->lookup_spf_rr) {
-        dns_stat_t spfquery_stat = DnsResolver_lookupSpf(self->resolver, domain, txtresp);
-        switch (spfquery_stat) {
-        case DNS_STAT_NOERROR:
-            /*
-             * RFC4406, 4408 とも SPF RR が存在した場合は全ての TXT RR を破棄するので,
-             * SPF RR が見つかった場合は TXT RR をルックアップせずにこのまま戻せばよい.
-             * [RFC4406] 4.4.
-             * 1. If any records of type SPF are in the set, then all records of
-             *    type TXT are discarded.
-             * [RFC4408] 4.5.
-             * 2. If any records of type SPF are in the set, then all records of
-             *    type TXT are discarded.
-             */
-            return SPF_SCORE_NULL;
-        case DNS_STAT_NODATA:
-        case DNS_STAT_NOVALIDANSWER:
-            // SPF RR がないので TXT RR にフォールバック
-            break;
-        case DNS_STAT_NXDOMAIN:
-            /*
-             * [RFC4406] 4.3.
-             * When performing the PRA version of the test, if the DNS query returns
-             * "non-existent domain" (RCODE 3), then check_host() exits immediately
-             * with the result "Fail".
-             * [RFC4408] 4.3.
-             * If the <domain> is malformed (label longer than 63 characters, zero-
-             * length label not at the end, etc.) or is not a fully qualified domain
-             * name, or if the DNS lookup returns "domain does not exist" (RCODE 3),
-             * check_host() immediately returns the result "None".
-             */
-            return (self->scope & SPF_RECORD_SCOPE_SPF2_PRA)
-                ? SPF_SCORE_FAIL : SPF_SCORE_NONE;
-        case DNS_STAT_FORMERR:
-        case DNS_STAT_SERVFAIL:
-        case DNS_STAT_NOTIMPL:
-        case DNS_STAT_REFUSED:
-        case DNS_STAT_YXDOMAIN:
-        case DNS_STAT_YXRRSET:
-        case DNS_STAT_NXRRSET:
-        case DNS_STAT_NOTAUTH:
-        case DNS_STAT_NOTZONE:
-        case DNS_STAT_RESERVED11:
-        case DNS_STAT_RESERVED12:
-        case DNS_STAT_RESERVED13:
-        case DNS_STAT_RESERVED14:
-        case DNS_STAT_RESERVED15:
-        case DNS_STAT_RESOLVER:
-        case DNS_STAT_RESOLVER_INTERNAL:
-            /*
-             * [RFC4408] 4.4.
-             * If all DNS lookups that are made return a server failure (RCODE 2),
-             * or other error (RCODE other than 0 or 3), or time out, then
-             * check_host() exits immediately with the result "TempError".
-             */
-            LogDnsError("spf", domain, "SPF Record", DnsResolver_getErrorSymbol(self->resolver));
-            return SPF_SCORE_TEMPERROR;
-        case DNS_STAT_BADREQUEST:
-        case DNS_STAT_SYSTEM:
-        case DNS_STAT_NOMEMORY:
-        default:
-            LogDnsError("spf", domain, "SPF Record", DnsResolver_getErrorSymbol(self->resolver));
-            return SPF_SCORE_SYSERROR;
-        }   // end switch
+    if (NULL == resp) {
+        return;
     }   // end if
+    switch (rrtype) {
+    case ns_t_a:
+        DnsAResponse_free((DnsAResponse *) resp);
+        break;
+    case ns_t_aaaa:
+        DnsAaaaResponse_free((DnsAaaaResponse *) resp);
+        break;
+    case ns_t_mx:
+        DnsMxResponse_free((DnsMxResponse *) resp);
+        break;
+    case ns_t_txt:
+    case 99 /* as ns_t_spf */:
+        DnsTxtResponse_free((DnsTxtResponse *) resp);
+        break;
+    case ns_t_ptr:
+        DnsPtrResponse_free((DnsPtrResponse *) resp);
+        break;
+    default:
+        abort();
+    }   // end switch
+}   // end function: SpfEvaluator_freeResponse
 
-    // TXT RR を引く
-    dns_stat_t txtquery_stat = DnsResolver_lookupTxt(self->resolver, domain, txtresp);
-    switch (txtquery_stat) {
-    case DNS_STAT_NOERROR:
-        return SPF_SCORE_NULL;
-    case DNS_STAT_NODATA:  // NOERROR
-        /*
-         * [RFC4406] 4.4.
-         * If there are no matching records remaining after the initial DNS
-         * query or any subsequent optional DNS queries, then check_host() exits
-         * immediately with the result "None".
-         * [RFC4408] 4.5.
-         * If no matching records are returned, an SPF client MUST assume that
-         * the domain makes no SPF declarations.  SPF processing MUST stop and
-         * return "None".
-         */
-        if (count_void_lookup
-            && SPF_SCORE_PERMERROR == SpfEvaluator_incrementVoidLookupCounter(self,
-                                                                              txtquery_stat)) {
-            LogDnsError("txt", domain, "SPF Record", "VOIDLOOKUP_EXCEEDS");
-            return SPF_SCORE_PERMERROR;
+static void *
+SpfEvaluator_duplicateResponse(int rrtype, const void *resp)
+{
+    switch (rrtype) {
+    case ns_t_a:
+        return DnsAResponse_duplicate((const DnsAResponse *) resp);
+    case ns_t_aaaa:
+        return DnsAaaaResponse_duplicate((const DnsAaaaResponse *) resp);
+    case ns_t_mx:
+        return DnsMxResponse_duplicate((const DnsMxResponse *) resp);
+    case ns_t_txt:
+    case 99 /* as ns_t_spf */:
+        return DnsTxtResponse_duplicate((const DnsTxtResponse *) resp);
+    case ns_t_ptr:
+        return DnsPtrResponse_duplicate((const DnsPtrResponse *) resp);
+    default:
+        abort();
+    }   // end switch
+}   // end function: SpfEvaluator_duplicateResponse
+
+static void
+SpfEvaluator_releaseQuery(SpfDnsQuery *query)
+{
+    SpfEvaluator_freeResponse(query->rrtype, query->resp);
+    query->resp = NULL;
+    if (query->speculative) {
+        free((char *) query->qname);
+        query->qname = NULL;
+    }   // end if
+}   // end function: SpfEvaluator_releaseQuery
+
+static void
+SpfEvaluator_clearQueries(SpfEvaluator *self)
+{
+    for (size_t i = 0; i < self->query_num; ++i) {
+        SpfEvaluator_releaseQuery(&(self->query[i]));
+    }   // end for
+    self->query_num = 0;
+}   // end function: SpfEvaluator_clearQueries
+
+static void
+SpfEvaluator_clearAnswers(SpfEvaluator *self)
+{
+    for (size_t i = 0; i < self->answer_num; ++i) {
+        SpfEvaluator_releaseQuery(&(self->answer[i]));
+    }   // end for
+    self->answer_num = 0;
+}   // end function: SpfEvaluator_clearAnswers
+
+static void
+SpfEvaluator_clearPrefetch(SpfEvaluator *self)
+{
+    for (size_t i = 0; i < self->prefetch_num; ++i) {
+        SpfEvaluator_releaseQuery(&(self->prefetch[i]));
+    }   // end for
+    self->prefetch_num = 0;
+}   // end function: SpfEvaluator_clearPrefetch
+
+/*
+ * @return the index of the query of the type and the name, num if not found.
+ */
+static size_t
+SpfEvaluator_findQuery(const SpfDnsQuery *query, size_t num, int rrtype, const char *qname)
+{
+    for (size_t i = 0; i < num; ++i) {
+        if (rrtype == query[i].rrtype && NULL != query[i].qname
+            && 0 == strcasecmp(qname, query[i].qname)) {
+            return i;
         }   // end if
-        // fall through
+    }   // end for
+    return num;
+}   // end function: SpfEvaluator_findQuery
 
-    case DNS_STAT_NOVALIDANSWER:
-        return SPF_SCORE_NONE;
+static SpfDnsQuery *
+SpfEvaluator_appendQuery(SpfDnsQuery **query, size_t *num, size_t *capacity)
+{
+    if (*capacity <= *num) {
+        size_t newcapacity = 0 < *capacity ? *capacity * 2 : 4;
+        SpfDnsQuery *newquery = (SpfDnsQuery *) realloc(*query, sizeof(SpfDnsQuery) * newcapacity);
+        if (NULL == newquery) {
+            LogNoResource();
+            return NULL;
+        }   // end if
+        *query = newquery;
+        *capacity = newcapacity;
+    }   // end if
+    SpfDnsQuery *appended = &((*query)[(*num)++]);
+    memset(appended, 0, sizeof(SpfDnsQuery));
+    return appended;
+}   // end function: SpfEvaluator_appendQuery
 
-    case DNS_STAT_NXDOMAIN:
-        /*
-         * [RFC4406] 4.3.
-         * When performing the PRA version of the test, if the DNS query returns
-         * "non-existent domain" (RCODE 3), then check_host() exits immediately
-         * with the result "Fail".
-         * [RFC4408] 4.3.
-         * If the <domain> is malformed (label longer than 63 characters, zero-
-         * length label not at the end, etc.) or is not a fully qualified domain
-         * name, or if the DNS lookup returns "domain does not exist" (RCODE 3),
-         * check_host() immediately returns the result "None".
-         */
-        if (count_void_lookup
-            && SPF_SCORE_PERMERROR == SpfEvaluator_incrementVoidLookupCounter(self,
-                                                                              txtquery_stat)) {
-            LogDnsError("txt", domain, "SPF Record", "VOIDLOOKUP_EXCEEDS");
-            return SPF_SCORE_PERMERROR;
+/**
+ * Registers a DNS lookup the evaluation has to wait for.
+ * The lookup is answered at once if it has been looked up speculatively.
+ * @param qname the name to look up, NULL for PTR RR of <ip>.
+ *              it must stay valid until the answer is consumed.
+ */
+static SpfStat
+SpfEvaluator_addQuery(SpfEvaluator *self, int rrtype, const char *qname)
+{
+    SpfDnsQuery prefetched;
+    memset(&prefetched, 0, sizeof(SpfDnsQuery));
+    if (NULL != qname) {
+        size_t index = SpfEvaluator_findQuery(self->prefetch, self->prefetch_num, rrtype, qname);
+        if (index < self->prefetch_num) {
+            prefetched = self->prefetch[index];
+            self->prefetch[index] = self->prefetch[--self->prefetch_num];
+            free((char *) prefetched.qname);
+        } else {
+            // the speculative lookup still in progress is replaced with this one
+            index = SpfEvaluator_findQuery(self->query, self->query_num, rrtype, qname);
+            if (index < self->query_num && self->query[index].speculative) {
+                SpfEvaluator_releaseQuery(&(self->query[index]));
+                memmove(&(self->query[index]), &(self->query[index + 1]),
+                        sizeof(SpfDnsQuery) * (self->query_num - index - 1));
+                --self->query_num;
+            }   // end if
         }   // end if
-        return (self->scope & SPF_RECORD_SCOPE_SPF2_PRA) ? SPF_SCORE_FAIL : SPF_SCORE_NONE;
+    }   // end if
 
-    case DNS_STAT_FORMERR:
-    case DNS_STAT_SERVFAIL:
-    case DNS_STAT_NOTIMPL:
-    case DNS_STAT_REFUSED:
-    case DNS_STAT_YXDOMAIN:
-    case DNS_STAT_YXRRSET:
-    case DNS_STAT_NXRRSET:
-    case DNS_STAT_NOTAUTH:
-    case DNS_STAT_NOTZONE:
-    case DNS_STAT_RESERVED11:
-    case DNS_STAT_RESERVED12:
-    case DNS_STAT_RESERVED13:
-    case DNS_STAT_RESERVED14:
-    case DNS_STAT_RESERVED15:
-    case DNS_STAT_RESOLVER:
-    case DNS_STAT_RESOLVER_INTERNAL:
-        /*
-         * [RFC4408] 4.4.
-         * If all DNS lookups that are made return a server failure (RCODE 2),
-         * or other error (RCODE other than 0 or 3), or time out, then
-         * check_host() exits immediately with the result "TempError".
-         */
-        LogDnsError("txt", domain, "SPF Record", DnsResolver_getErrorSymbol(self->resolver));
-        return SPF_SCORE_TEMPERROR;
-    case DNS_STAT_BADREQUEST:
-    case DNS_STAT_SYSTEM:
-    case DNS_STAT_NOMEMORY:
+    SpfDnsQuery *query =
+        SpfEvaluator_appendQuery(&(self->query), &(self->query_num), &(self->query_capacity));
+    if (NULL == query) {
+        SpfEvaluator_freeResponse(rrtype, prefetched.resp);
+        return SPF_STAT_NO_RESOURCE;
+    }   // end if
+    query->rrtype = rrtype;
+    query->qname = qname;
+    if (prefetched.answered) {
+        query->answered = true;
+        query->status = prefetched.status;
+        query->resp = prefetched.resp;
+        query->error_symbol = prefetched.error_symbol;
+    }   // end if
+    return SPF_STAT_OK;
+}   // end function: SpfEvaluator_addQuery
+
+/*
+ * Registers a DNS lookup ahead of the evaluation.
+ * The evaluation doesn't wait for it, and its answer is kept until the evaluation asks for it.
+ * Nothing is registered if the same lookup has already been registered or on memory shortage.
+ * @return true if registered, false otherwise.
+ */
+static bool
+SpfEvaluator_addSpeculativeQuery(SpfEvaluator *self, int rrtype, const char *qname)
+{
+    if (self->query_num > SpfEvaluator_findQuery(self->query, self->query_num, rrtype, qname)
+        || self->prefetch_num > SpfEvaluator_findQuery(self->prefetch, self->prefetch_num, rrtype,
+                                                       qname)) {
+        return false;
+    }   // end if
+    char *owned_qname = strdup(qname);
+    if (NULL == owned_qname) {
+        return false;
+    }   // end if
+    SpfDnsQuery *query =
+        SpfEvaluator_appendQuery(&(self->query), &(self->query_num), &(self->query_capacity));
+    if (NULL == query) {
+        free(owned_qname);
+        return false;
+    }   // end if
+    query->rrtype = rrtype;
+    query->qname = owned_qname;
+    query->speculative = true;
+    return true;
+}   // end function: SpfEvaluator_addSpeculativeQuery
+
+/**
+ * Registers A RR lookup for IPv4 <ip>, AAAA RR lookup for IPv6 <ip>.
+ */
+static SpfStat
+SpfEvaluator_addAddrQuery(SpfEvaluator *self, const char *qname)
+{
+    switch (self->sa_family) {
+    case AF_INET:
+        return SpfEvaluator_addQuery(self, ns_t_a, qname);
+    case AF_INET6:
+        return SpfEvaluator_addQuery(self, ns_t_aaaa, qname);
     default:
-        LogDnsError("txt", domain, "SPF Record", DnsResolver_getErrorSymbol(self->resolver));
-        return SPF_SCORE_SYSERROR;
+        abort();
     }   // end switch
-}   // end function: SpfEvaluator_fetch
+}   // end function: SpfEvaluator_addAddrQuery
+
+static SpfEvalFrame *
+SpfEvaluator_getCurrentFrame(SpfEvaluator *self)
+{
+    return 0 < self->frame_num ? &(self->frame[self->frame_num - 1]) : NULL;
+}   // end function: SpfEvaluator_getCurrentFrame
+
+static SpfEvalFrame *
+SpfEvaluator_pushFrame(SpfEvaluator *self, SpfEvalFrameType type, bool count_void_lookup)
+{
+    if (self->frame_capacity <= self->frame_num) {
+        size_t newcapacity = 0 < self->frame_capacity ? self->frame_capacity * 2 : 4;
+        SpfEvalFrame *newframe =
+            (SpfEvalFrame *) realloc(self->frame, sizeof(SpfEvalFrame) * newcapacity);
+        if (NULL == newframe) {
+            LogNoResource();
+            return NULL;
+        }   // end if
+        self->frame = newframe;
+        self->frame_capacity = newcapacity;
+    }   // end if
+    SpfEvalFrame *frame = &(self->frame[self->frame_num++]);
+    memset(frame, 0, sizeof(SpfEvalFrame));
+    frame->type = type;
+    frame->count_void_lookup = count_void_lookup;
+    frame->score = SPF_SCORE_NULL;
+    return frame;
+}   // end function: SpfEvaluator_pushFrame
+
+/**
+ * Discards the innermost check_host() invocation along with its <domain>.
+ */
+static void
+SpfEvaluator_popFrame(SpfEvaluator *self)
+{
+    assert(0 < self->frame_num);
+    SpfEvalFrame *frame = &(self->frame[--self->frame_num]);
+    if (NULL != frame->local_policy_record) {
+        SpfRecord_free(frame->local_policy_record);
+        self->local_policy_mode = false;
+    }   // end if
+    SpfRecord_free(frame->record);
+    DnsMxResponse_free(frame->mxresp);
+    DnsPtrResponse_free(frame->ptrresp);
+    SpfEvaluator_popDomain(self);
+}   // end function: SpfEvaluator_popFrame
+
+/**
+ * Returns the result of the innermost check_host() invocation to its caller.
+ */
+static void
+SpfEvaluator_finishFrame(SpfEvaluator *self, SpfScore score)
+{
+    SpfEvaluator_popFrame(self);
+    SpfEvaluator_deliverScore(self, score);
+}   // end function: SpfEvaluator_finishFrame
 
 static SpfScore
-SpfEvaluator_lookupRecord(SpfEvaluator *self, const char *domain, bool count_void_lookup,
+SpfEvaluator_selectRecord(SpfEvaluator *self, const char *domain, DnsTxtResponse *txtresp,
                           SpfRecord **record)
 {
-    DnsTxtResponse *txtresp = NULL;
-    SpfScore fetch_score = SpfEvaluator_fetch(self, domain, count_void_lookup, &txtresp);
-    if (SPF_SCORE_NULL != fetch_score) {
-        return fetch_score;
-    }   // end if
     assert(NULL != txtresp);
 
     // 各レコードのスコープを調べる
@@ -365,7 +495,6 @@ SpfEvaluator_lookupRecord(SpfEvaluator *self, const char *domain, bool count_voi
                 ("multiple spf2 record found: domain=%s, spf2-mfrom=%s, spf2-pra=%s",
                  domain, self->scope & SPF_RECORD_SCOPE_SPF2_MFROM ? "true" : "false",
                  self->scope & SPF_RECORD_SCOPE_SPF2_PRA ? "true" : "false");
-            DnsTxtResponse_free(txtresp);
             return select_score;
         }   // end if
     }   // end if
@@ -377,7 +506,6 @@ SpfEvaluator_lookupRecord(SpfEvaluator *self, const char *domain, bool count_voi
         if (SPF_SCORE_NULL != select_score) {
             SpfLogPermFail("multiple spf1 record found: domain=%s, spf1=%s", domain,
                            self->scope & SPF_RECORD_SCOPE_SPF1 ? "true" : "false");
-            DnsTxtResponse_free(txtresp);
             return select_score;
         }   // end if
     }   // end if
@@ -388,7 +516,6 @@ SpfEvaluator_lookupRecord(SpfEvaluator *self, const char *domain, bool count_voi
                  self->scope & SPF_RECORD_SCOPE_SPF1 ? "true" : "false",
                  self->scope & SPF_RECORD_SCOPE_SPF2_MFROM ? "true" : "false",
                  self->scope & SPF_RECORD_SCOPE_SPF2_PRA ? "true" : "false");
-        DnsTxtResponse_free(txtresp);
         return SPF_SCORE_NONE;
     }   // end if
 
@@ -396,7 +523,6 @@ SpfEvaluator_lookupRecord(SpfEvaluator *self, const char *domain, bool count_voi
     // レコードのパース
     SpfStat build_stat =
         SpfRecord_build(self, selected->scope, selected->scope_tail, selected->record_tail, record);
-    DnsTxtResponse_free(txtresp);
     switch (build_stat) {
     case SPF_STAT_OK:
         return SPF_SCORE_NULL;
@@ -405,7 +531,7 @@ SpfEvaluator_lookupRecord(SpfEvaluator *self, const char *domain, bool count_voi
     default:
         return SPF_SCORE_PERMERROR;
     }   // end switch
-}   // end function: SpfEvaluator_lookupRecord
+}   // end function: SpfEvaluator_selectRecord
 
 static const char *
 SpfEvaluator_getTargetName(const SpfEvaluator *self, const SpfTerm *term)
@@ -414,26 +540,123 @@ SpfEvaluator_getTargetName(const SpfEvaluator *self, const SpfTerm *term)
 }   // end function: SpfEvaluator_getTargetName
 
 /*
- * メカニズム評価中の DNS レスポンスエラーコードを SPF のスコアにマップする.
+ * Starts looking up the targets of the record which has just been parsed ahead of the evaluation,
+ * up to SpfEvalPolicy::prefetch_depth in the order of the directives and "redirect=".
+ * As macros are expanded while parsing, every target is known at this point.
+ * Targets beyond the limit of DNS mechanisms are not looked up as the evaluation never reaches them.
+ * Speculative lookups are counted neither as DNS mechanisms nor as void lookups,
+ * which are counted only when the evaluation consumes the answers.
  */
-static SpfScore
-SpfEvaluator_mapMechDnsResponseToSpfScore(dns_stat_t resolv_stat)
+static void
+SpfEvaluator_prefetchTargets(SpfEvaluator *self, const SpfRecord *record)
 {
-    /*
-     * [RFC4408 5.]
-     * Several mechanisms rely on information fetched from DNS.  For these
-     * DNS queries, except where noted, if the DNS server returns an error
-     * (RCODE other than 0 or 3) or the query times out, the mechanism
-     * throws the exception "TempError".  If the server returns "domain does
-     * not exist" (RCODE 3), then evaluation of the mechanism continues as
-     * if the server returned no error (RCODE 0) and zero answer records.
-     */
-    switch (resolv_stat) {
+    int record_rrtype = self->policy->lookup_spf_rr ? 99 /* as ns_t_spf */ : ns_t_txt;
+    int addr_rrtype = AF_INET6 == self->sa_family ? ns_t_aaaa : ns_t_a;
+    unsigned int remaining = self->policy->prefetch_depth;
+    unsigned int dns_mech_count = self->dns_mech_count;
+    size_t directive_num = PtrArray_getCount(record->directives);
+    for (size_t n = 0; n < directive_num && 0 < remaining; ++n) {
+        const SpfTerm *term = PtrArray_get(record->directives, n);
+        if (!term->attr->involve_dnslookup) {
+            continue;
+        }   // end if
+        if (self->policy->max_dns_mech <= dns_mech_count++) {
+            return;
+        }   // end if
+        bool registered;
+        switch (term->attr->type) {
+        case SPF_TERM_MECH_INCLUDE:
+            registered = SpfEvaluator_addSpeculativeQuery(self, record_rrtype, term->querydomain);
+            break;
+        case SPF_TERM_MECH_A:
+            registered = SpfEvaluator_addSpeculativeQuery(self, addr_rrtype,
+                                                          SpfEvaluator_getTargetName(self, term));
+            break;
+        case SPF_TERM_MECH_MX:
+            registered = SpfEvaluator_addSpeculativeQuery(self, ns_t_mx,
+                                                          SpfEvaluator_getTargetName(self, term));
+            break;
+        case SPF_TERM_MECH_EXISTS:
+            registered = SpfEvaluator_addSpeculativeQuery(self, ns_t_a, term->querydomain);
+            break;
+        default:
+            // "ptr" mechanism is not worth looking up ahead
+            registered = false;
+            break;
+        }   // end switch
+        if (registered) {
+            --remaining;
+        }   // end if
+    }   // end for
+    if (0 < remaining && NULL != record->modifiers.rediect
+        && dns_mech_count < self->policy->max_dns_mech) {
+        (void) SpfEvaluator_addSpeculativeQuery(self, record_rrtype,
+                                                record->modifiers.rediect->querydomain);
+    }   // end if
+}   // end function: SpfEvaluator_prefetchTargets
+
+static void
+SpfEvaluator_onRecordAnswer(SpfEvaluator *self, SpfEvalFrame *frame, SpfDnsQuery *answer)
+{
+    SpfRecord *record = NULL;
+    SpfScore select_score =
+        SpfEvaluator_selectRecord(self, SpfEvaluator_getDomain(self), answer->resp, &record);
+    if (SPF_SCORE_NULL != select_score) {
+        SpfEvaluator_finishFrame(self, select_score);
+        return;
+    }   // end if
+
+    frame->record = record;
+    frame->directives = record->directives;
+    frame->directive_index = 0;
+    frame->step = SPF_EVAL_STEP_DIRECTIVE;
+    if (0 < self->policy->prefetch_depth) {
+        SpfEvaluator_prefetchTargets(self, record);
+    }   // end if
+}   // end function: SpfEvaluator_onRecordAnswer
+
+static void
+SpfEvaluator_onSpfRrAnswer(SpfEvaluator *self, SpfEvalFrame *frame, SpfDnsQuery *answer)
+{
+    SpfScore eval_score;
+    switch (answer->status) {
     case DNS_STAT_NOERROR:
+        /*
+         * RFC4406, 4408 とも SPF RR が存在した場合は全ての TXT RR を破棄するので,
+         * SPF RR が見つかった場合は TXT RR をルックアップせずにこのまま評価すればよい.
+         * [RFC4406] 4.4.
+         * 1. If any records of type SPF are in the set, then all records of
+         *    type TXT are discarded.
+         * [RFC4408] 4.5.
+         * 2. If any records of type SPF are in the set, then all records of
+         *    type TXT are discarded.
+         */
+        SpfEvaluator_onRecordAnswer(self, frame, answer);
+        return;
     case DNS_STAT_NODATA:
     case DNS_STAT_NOVALIDANSWER:
+        // SPF RR がないので TXT RR にフォールバック
+        frame->step = SPF_EVAL_STEP_LOOKUP_TXT;
+        if (SPF_STAT_OK == SpfEvaluator_addQuery(self, ns_t_txt, SpfEvaluator_getDomain(self))) {
+            return;
+        }   // end if
+        eval_score = SPF_SCORE_SYSERROR;
+        break;
     case DNS_STAT_NXDOMAIN:
-        return SPF_SCORE_NULL;
+        /*
+         * [RFC4406] 4.3.
+         * When performing the PRA version of the test, if the DNS query returns
+         * "non-existent domain" (RCODE 3), then check_host() exits immediately
+         * with the result "Fail".
+         * [RFC4408] 4.3.
+         * If the <domain> is malformed (label longer than 63 characters, zero-
+         * length label not at the end, etc.) or is not a fully qualified domain
+         * name, or if the DNS lookup returns "domain does not exist" (RCODE 3),
+         * check_host() immediately returns the result "None".
+         */
+        eval_score = (self->scope & SPF_RECORD_SCOPE_SPF2_PRA)
+            ? SPF_SCORE_FAIL : SPF_SCORE_NONE;
+        break;
     case DNS_STAT_FORMERR:
     case DNS_STAT_SERVFAIL:
     case DNS_STAT_NOTIMPL:
@@ -450,33 +673,180 @@ SpfEvaluator_mapMechDnsResponseToSpfScore(dns_stat_t resolv_stat)
     case DNS_STAT_RESERVED15:
     case DNS_STAT_RESOLVER:
     case DNS_STAT_RESOLVER_INTERNAL:
-        return SPF_SCORE_TEMPERROR;
+        /*
+         * [RFC4408] 4.4.
+         * If all DNS lookups that are made return a server failure (RCODE 2),
+         * or other error (RCODE other than 0 or 3), or time out, then
+         * check_host() exits immediately with the result "TempError".
+         */
+        LogDnsError("spf", answer->qname, "SPF Record", answer->error_symbol);
+        eval_score = SPF_SCORE_TEMPERROR;
+        break;
     case DNS_STAT_BADREQUEST:
     case DNS_STAT_SYSTEM:
     case DNS_STAT_NOMEMORY:
     default:
-        return SPF_SCORE_SYSERROR;
+        LogDnsError("spf", answer->qname, "SPF Record", answer->error_symbol);
+        eval_score = SPF_SCORE_SYSERROR;
+        break;
     }   // end switch
-}   // end function: SpfEvaluator_mapMechDnsResponseToSpfScore
-
-static SpfScore
-SpfEvaluator_incrementDnsMechCounter(SpfEvaluator *self)
-{
-    if (++(self->dns_mech_count) <= self->policy->max_dns_mech) {
-        return SPF_SCORE_NULL;
-    } else {
-        SpfLogPermFail("over %d mechanisms with dns look up evaluated: sender=%s, domain=%s",
-                       self->policy->max_dns_mech, InetMailbox_getDomain(self->sender),
-                       SpfEvaluator_getDomain(self));
-        return SPF_SCORE_PERMERROR;
-    }   // end if
-}   // end function: SpfEvaluator_incrementDnsMechCounter
+    SpfEvaluator_finishFrame(self, eval_score);
+}   // end function: SpfEvaluator_onSpfRrAnswer
 
-static SpfScore
-SpfEvaluator_checkMaliceOfCidrLength(const SpfEvaluator *self, char ip_version,
-                                     unsigned short cidr_length,
-                                     unsigned char malicious_cidr_length,
-                                     SpfCustomAction action_on_malicious_cidr_length)
+static void
+SpfEvaluator_onTxtRrAnswer(SpfEvaluator *self, SpfEvalFrame *frame, SpfDnsQuery *answer)
+{
+    SpfScore eval_score;
+    switch (answer->status) {
+    case DNS_STAT_NOERROR:
+        SpfEvaluator_onRecordAnswer(self, frame, answer);
+        return;
+    case DNS_STAT_NODATA:  // NOERROR
+        /*
+         * [RFC4406] 4.4.
+         * If there are no matching records remaining after the initial DNS
+         * query or any subsequent optional DNS queries, then check_host() exits
+         * immediately with the result "None".
+         * [RFC4408] 4.5.
+         * If no matching records are returned, an SPF client MUST assume that
+         * the domain makes no SPF declarations.  SPF processing MUST stop and
+         * return "None".
+         */
+        if (frame->count_void_lookup
+            && SPF_SCORE_PERMERROR == SpfEvaluator_incrementVoidLookupCounter(self,
+                                                                              answer->status)) {
+            LogDnsError("txt", answer->qname, "SPF Record", "VOIDLOOKUP_EXCEEDS");
+            eval_score = SPF_SCORE_PERMERROR;
+            break;
+        }   // end if
+        // fall through
+
+    case DNS_STAT_NOVALIDANSWER:
+        eval_score = SPF_SCORE_NONE;
+        break;
+
+    case DNS_STAT_NXDOMAIN:
+        /*
+         * [RFC4406] 4.3.
+         * When performing the PRA version of the test, if the DNS query returns
+         * "non-existent domain" (RCODE 3), then check_host() exits immediately
+         * with the result "Fail".
+         * [RFC4408] 4.3.
+         * If the <domain> is malformed (label longer than 63 characters, zero-
+         * length label not at the end, etc.) or is not a fully qualified domain
+         * name, or if the DNS lookup returns "domain does not exist" (RCODE 3),
+         * check_host() immediately returns the result "None".
+         */
+        if (frame->count_void_lookup
+            && SPF_SCORE_PERMERROR == SpfEvaluator_incrementVoidLookupCounter(self,
+                                                                              answer->status)) {
+            LogDnsError("txt", answer->qname, "SPF Record", "VOIDLOOKUP_EXCEEDS");
+            eval_score = SPF_SCORE_PERMERROR;
+            break;
+        }   // end if
+        eval_score = (self->scope & SPF_RECORD_SCOPE_SPF2_PRA) ? SPF_SCORE_FAIL : SPF_SCORE_NONE;
+        break;
+
+    case DNS_STAT_FORMERR:
+    case DNS_STAT_SERVFAIL:
+    case DNS_STAT_NOTIMPL:
+    case DNS_STAT_REFUSED:
+    case DNS_STAT_YXDOMAIN:
+    case DNS_STAT_YXRRSET:
+    case DNS_STAT_NXRRSET:
+    case DNS_STAT_NOTAUTH:
+    case DNS_STAT_NOTZONE:
+    case DNS_STAT_RESERVED11:
+    case DNS_STAT_RESERVED12:
+    case DNS_STAT_RESERVED13:
+    case DNS_STAT_RESERVED14:
+    case DNS_STAT_RESERVED15:
+    case DNS_STAT_RESOLVER:
+    case DNS_STAT_RESOLVER_INTERNAL:
+        /*
+         * [RFC4408] 4.4.
+         * If all DNS lookups that are made return a server failure (RCODE 2),
+         * or other error (RCODE other than 0 or 3), or time out, then
+         * check_host() exits immediately with the result "TempError".
+         */
+        LogDnsError("txt", answer->qname, "SPF Record", answer->error_symbol);
+        eval_score = SPF_SCORE_TEMPERROR;
+        break;
+    case DNS_STAT_BADREQUEST:
+    case DNS_STAT_SYSTEM:
+    case DNS_STAT_NOMEMORY:
+    default:
+        LogDnsError("txt", answer->qname, "SPF Record", answer->error_symbol);
+        eval_score = SPF_SCORE_SYSERROR;
+        break;
+    }   // end switch
+    SpfEvaluator_finishFrame(self, eval_score);
+}   // end function: SpfEvaluator_onTxtRrAnswer
+
+/*
+ * メカニズム評価中の DNS レスポンスエラーコードを SPF のスコアにマップする.
+ */
+static SpfScore
+SpfEvaluator_mapMechDnsResponseToSpfScore(dns_stat_t resolv_stat)
+{
+    /*
+     * [RFC4408 5.]
+     * Several mechanisms rely on information fetched from DNS.  For these
+     * DNS queries, except where noted, if the DNS server returns an error
+     * (RCODE other than 0 or 3) or the query times out, the mechanism
+     * throws the exception "TempError".  If the server returns "domain does
+     * not exist" (RCODE 3), then evaluation of the mechanism continues as
+     * if the server returned no error (RCODE 0) and zero answer records.
+     */
+    switch (resolv_stat) {
+    case DNS_STAT_NOERROR:
+    case DNS_STAT_NODATA:
+    case DNS_STAT_NOVALIDANSWER:
+    case DNS_STAT_NXDOMAIN:
+        return SPF_SCORE_NULL;
+    case DNS_STAT_FORMERR:
+    case DNS_STAT_SERVFAIL:
+    case DNS_STAT_NOTIMPL:
+    case DNS_STAT_REFUSED:
+    case DNS_STAT_YXDOMAIN:
+    case DNS_STAT_YXRRSET:
+    case DNS_STAT_NXRRSET:
+    case DNS_STAT_NOTAUTH:
+    case DNS_STAT_NOTZONE:
+    case DNS_STAT_RESERVED11:
+    case DNS_STAT_RESERVED12:
+    case DNS_STAT_RESERVED13:
+    case DNS_STAT_RESERVED14:
+    case DNS_STAT_RESERVED15:
+    case DNS_STAT_RESOLVER:
+    case DNS_STAT_RESOLVER_INTERNAL:
+        return SPF_SCORE_TEMPERROR;
+    case DNS_STAT_BADREQUEST:
+    case DNS_STAT_SYSTEM:
+    case DNS_STAT_NOMEMORY:
+    default:
+        return SPF_SCORE_SYSERROR;
+    }   // end switch
+}   // end function: SpfEvaluator_mapMechDnsResponseToSpfScore
+
+static SpfScore
+SpfEvaluator_incrementDnsMechCounter(SpfEvaluator *self)
+{
+    if (++(self->dns_mech_count) <= self->policy->max_dns_mech) {
+        return SPF_SCORE_NULL;
+    } else {
+        SpfLogPermFail("over %d mechanisms with dns look up evaluated: sender=%s, domain=%s",
+                       self->policy->max_dns_mech, InetMailbox_getDomain(self->sender),
+                       SpfEvaluator_getDomain(self));
+        return SPF_SCORE_PERMERROR;
+    }   // end if
+}   // end function: SpfEvaluator_incrementDnsMechCounter
+
+static SpfScore
+SpfEvaluator_checkMaliceOfCidrLength(const SpfEvaluator *self, char ip_version,
+                                     unsigned short cidr_length,
+                                     unsigned char malicious_cidr_length,
+                                     SpfCustomAction action_on_malicious_cidr_length)
 {
     if (SPF_CUSTOM_ACTION_NULL != action_on_malicious_cidr_length
         && cidr_length <= malicious_cidr_length) {
@@ -571,13 +941,12 @@ SpfEvaluator_evalMechAll(const SpfEvaluator *self, const SpfTerm *term)
         : self->policy->overwrite_all_directive_score;
 }   // end function: SpfEvaluator_evalMechAll
 
+/*
+ * include メカニズムで再帰呼び出しした check_host() の結果をメカニズムの評価結果にマップする.
+ */
 static SpfScore
-SpfEvaluator_evalMechInclude(SpfEvaluator *self, const SpfTerm *term)
+SpfEvaluator_mapIncludeScore(const SpfTerm *term, SpfScore eval_score)
 {
-    assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
-    ++(self->include_depth);
-    SpfScore eval_score = SpfEvaluator_checkHost(self, term->querydomain, true);
-    --(self->include_depth);
     /*
      * [RFC4408] 5.2.
      * Whether this mechanism matches, does not match, or throws an
@@ -621,109 +990,73 @@ SpfEvaluator_evalMechInclude(SpfEvaluator *self, const SpfTerm *term)
     default:
         abort();
     }   // end switch
-}   // end function: SpfEvaluator_evalMechInclude
+}   // end function: SpfEvaluator_mapIncludeScore
 
 /*
  * "a" メカニズムと "mx" メカニズムの共通部分を実装する関数
  */
 static SpfScore
-SpfEvaluator_evalByALookup(SpfEvaluator *self, const char *domain, const SpfTerm *term,
-                           bool count_void_lookup)
+SpfEvaluator_evalByAddrAnswer(SpfEvaluator *self, const SpfDnsQuery *answer,
+                              const SpfTerm *term, bool count_void_lookup)
 {
     size_t n;
-    switch (self->sa_family) {
-    case AF_INET:;
-        DnsAResponse *resp4;
-        dns_stat_t query4_stat = DnsResolver_lookupA(self->resolver, domain, &resp4);
-        if (DNS_STAT_NOERROR != query4_stat) {
+    switch (answer->rrtype) {
+    case ns_t_a:
+        if (DNS_STAT_NOERROR != answer->status) {
             if (count_void_lookup
                 && SPF_SCORE_PERMERROR == SpfEvaluator_incrementVoidLookupCounter(self,
-                                                                                  query4_stat)) {
-                LogDnsError("a", domain, "SPF \'a\' mechanism", "VOIDLOOKUP_EXCEEDS");
+                                                                                  answer->status)) {
+                LogDnsError("a", answer->qname, "SPF \'a\' mechanism", "VOIDLOOKUP_EXCEEDS");
                 return SPF_SCORE_PERMERROR;
             }   // end if
-            LogDnsError("a", domain, "SPF \'a\' mechanism",
-                        DnsResolver_getErrorSymbol(self->resolver));
-            return SpfEvaluator_mapMechDnsResponseToSpfScore(query4_stat);
+            LogDnsError("a", answer->qname, "SPF \'a\' mechanism", answer->error_symbol);
+            return SpfEvaluator_mapMechDnsResponseToSpfScore(answer->status);
         }   // end if
 
+        const DnsAResponse *resp4 = (const DnsAResponse *) answer->resp;
         for (n = 0; n < resp4->num; ++n) {
             if (0 == bitmemcmp(&(self->ipaddr.addr4), &(resp4->addr[n]), term->ip4cidr)) {
-                DnsAResponse_free(resp4);
                 return SpfEvaluator_getScoreByQualifier(term->qualifier);
             }   // end if
         }   // end for
-        DnsAResponse_free(resp4);
         break;
 
-    case AF_INET6:;
-        DnsAaaaResponse *resp6;
-        dns_stat_t query6_stat = DnsResolver_lookupAaaa(self->resolver, domain, &resp6);
-        if (DNS_STAT_NOERROR != query6_stat) {
+    case ns_t_aaaa:
+        if (DNS_STAT_NOERROR != answer->status) {
             if (count_void_lookup
                 && SPF_SCORE_PERMERROR == SpfEvaluator_incrementVoidLookupCounter(self,
-                                                                                  query6_stat)) {
-                LogDnsError("aaaa", domain, "SPF \'a\' mechanism", "VOIDLOOKUP_EXCEEDS");
+                                                                                  answer->status)) {
+                LogDnsError("aaaa", answer->qname, "SPF \'a\' mechanism", "VOIDLOOKUP_EXCEEDS");
                 return SPF_SCORE_PERMERROR;
             }   // end if
-            LogDnsError("aaaa", domain, "SPF \'a\' mechanism",
-                        DnsResolver_getErrorSymbol(self->resolver));
-            return SpfEvaluator_mapMechDnsResponseToSpfScore(query6_stat);
+            LogDnsError("aaaa", answer->qname, "SPF \'a\' mechanism", answer->error_symbol);
+            return SpfEvaluator_mapMechDnsResponseToSpfScore(answer->status);
         }   // end if
 
+        const DnsAaaaResponse *resp6 = (const DnsAaaaResponse *) answer->resp;
         for (n = 0; n < resp6->num; ++n) {
             if (0 == bitmemcmp(&(self->ipaddr.addr6), &(resp6->addr[n]), term->ip6cidr)) {
-                DnsAaaaResponse_free(resp6);
                 return SpfEvaluator_getScoreByQualifier(term->qualifier);
             }   // end if
         }   // end for
-        DnsAaaaResponse_free(resp6);
         break;
 
     default:
         abort();
-    }   // end if
+    }   // end switch
 
     return SPF_SCORE_NULL;
-}   // end function: SpfEvaluator_evalByALookup
+}   // end function: SpfEvaluator_evalByAddrAnswer
 
-static SpfScore
-SpfEvaluator_evalMechA(SpfEvaluator *self, const SpfTerm *term)
+static const SpfTerm *
+SpfEvaluator_getCurrentTerm(const SpfEvalFrame *frame)
 {
-    assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
-
-    SpfScore score = SpfEvaluator_checkMaliceOfDualCidrLength(self, term);
-    if (score != SPF_SCORE_NULL) {
-        return score;
-    }   // end if
-
-    const char *domain = SpfEvaluator_getTargetName(self, term);
-    return SpfEvaluator_evalByALookup(self, domain, term, true);
-}   // end function: SpfEvaluator_evalMechA
+    return PtrArray_get(frame->directives, frame->directive_index);
+}   // end function: SpfEvaluator_getCurrentTerm
 
-static SpfScore
-SpfEvaluator_evalMechMx(SpfEvaluator *self, const SpfTerm *term)
+static void
+SpfEvaluator_lookupMxExchanges(SpfEvaluator *self, SpfEvalFrame *frame)
 {
-    assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
-
-    SpfScore score = SpfEvaluator_checkMaliceOfDualCidrLength(self, term);
-    if (score != SPF_SCORE_NULL) {
-        return score;
-    }   // end if
-
-    const char *domain = SpfEvaluator_getTargetName(self, term);
-    DnsMxResponse *respmx;
-    dns_stat_t mxquery_stat = DnsResolver_lookupMx(self->resolver, domain, &respmx);
-    if (DNS_STAT_NOERROR != mxquery_stat) {
-        if (SPF_SCORE_PERMERROR == SpfEvaluator_incrementVoidLookupCounter(self, mxquery_stat)) {
-            LogDnsError("mx", term->querydomain, "SPF \'mx\' mechanism", "VOIDLOOKUP_EXCEEDS");
-            return SPF_SCORE_PERMERROR;
-        }   // end if
-        LogDnsError("mx", domain, "SPF \'mx\' mechanism",
-                    DnsResolver_getErrorSymbol(self->resolver));
-        return SpfEvaluator_mapMechDnsResponseToSpfScore(mxquery_stat);
-    }   // end if
-
     /*
      * [RFC4408] 5.4.
      * check_host() first performs an MX lookup on the <target-name>.  Then
@@ -733,72 +1066,155 @@ SpfEvaluator_evalMechMx(SpfEvaluator *self, const SpfTerm *term)
      * evaluation of an "mx" mechanism (see Section 10).  If any address
      * matches, the mechanism matches.
      */
-    for (size_t n = 0; n < MIN(respmx->num, self->policy->max_mxrr_per_mxmech); ++n) {
-        SpfScore score = SpfEvaluator_evalByALookup(self, respmx->exchange[n]->domain, term, false);
-        if (SPF_SCORE_NULL != score) {
-            DnsMxResponse_free(respmx);
-            return score;
+    // the address lookups of all the exchanges are issued at once to be performed concurrently,
+    // their answers are examined in the order of the exchanges.
+    size_t resp_num_limit = MIN(frame->mxresp->num, self->policy->max_mxrr_per_mxmech);
+    if (0 < resp_num_limit) {
+        frame->step = SPF_EVAL_STEP_MECH_MX_ADDR;
+        for (size_t n = 0; n < resp_num_limit; ++n) {
+            if (SPF_STAT_OK != SpfEvaluator_addAddrQuery(self, frame->mxresp->exchange[n]->domain)) {
+                SpfEvaluator_clearQueries(self);
+                DnsMxResponse_free(frame->mxresp);
+                frame->mxresp = NULL;
+                SpfEvaluator_onMechanismResult(self, SPF_SCORE_SYSERROR);
+                return;
+            }   // end if
+        }   // end for
+        return;
+    }   // end if
+    DnsMxResponse_free(frame->mxresp);
+    frame->mxresp = NULL;
+    SpfEvaluator_onMechanismResult(self, SPF_SCORE_NULL);
+}   // end function: SpfEvaluator_lookupMxExchanges
+
+static void
+SpfEvaluator_onMechMxAnswer(SpfEvaluator *self, SpfEvalFrame *frame, SpfDnsQuery *answer)
+{
+    if (DNS_STAT_NOERROR != answer->status) {
+        const SpfTerm *term = SpfEvaluator_getCurrentTerm(frame);
+        if (SPF_SCORE_PERMERROR == SpfEvaluator_incrementVoidLookupCounter(self, answer->status)) {
+            LogDnsError("mx", term->querydomain, "SPF \'mx\' mechanism", "VOIDLOOKUP_EXCEEDS");
+            SpfEvaluator_onMechanismResult(self, SPF_SCORE_PERMERROR);
+            return;
         }   // end if
+        LogDnsError("mx", answer->qname, "SPF \'mx\' mechanism", answer->error_symbol);
+        SpfEvaluator_onMechanismResult(self,
+                                       SpfEvaluator_mapMechDnsResponseToSpfScore(answer->status));
+        return;
+    }   // end if
+
+    // the exchanges are referred to as query names while looking up their addresses
+    frame->mxresp = (DnsMxResponse *) answer->resp;
+    answer->resp = NULL;
+    SpfEvaluator_lookupMxExchanges(self, frame);
+}   // end function: SpfEvaluator_onMechMxAnswer
+
+static void
+SpfEvaluator_onMechMxAddrAnswer(SpfEvaluator *self, SpfEvalFrame *frame, SpfDnsQuery *answer,
+                                size_t answer_num)
+{
+    SpfScore eval_score = SPF_SCORE_NULL;
+    for (size_t n = 0; n < answer_num && SPF_SCORE_NULL == eval_score; ++n) {
+        eval_score = SpfEvaluator_evalByAddrAnswer(self, &(answer[n]),
+                                                   SpfEvaluator_getCurrentTerm(frame), false);
     }   // end for
-    DnsMxResponse_free(respmx);
-    return SPF_SCORE_NULL;
-}   // end function: SpfEvaluator_evalMechMx
+    DnsMxResponse_free(frame->mxresp);
+    frame->mxresp = NULL;
+    SpfEvaluator_onMechanismResult(self, eval_score);
+}   // end function: SpfEvaluator_onMechMxAddrAnswer
 
 /**
- * @param self SpfEvaluator object.
- * @param revdomain
- * @return 1 if IP addresses match.
- *         0 if IP addresses doesn't match.
- *         -1 if DNS error occurred.
+ * Performs the DNS lookup represented by the query synchronously.
  */
-static int
-SpfEvaluator_isValidatedDomainName4(const SpfEvaluator *self, const char *revdomain)
+static void
+SpfEvaluator_performQuery(const SpfEvaluator *self, DnsResolver *resolver, SpfDnsQuery *query)
 {
-    DnsAResponse *resp4;
-    dns_stat_t query_stat = DnsResolver_lookupA(self->resolver, revdomain, &resp4);
-    if (DNS_STAT_NOERROR != query_stat) {
-        LogDnsError("a", revdomain, "SPF domain validation, ignored",
-                    DnsResolver_getErrorSymbol(self->resolver));
-        return -1;
-    }   // end if
-    for (size_t m = 0; m < resp4->num; ++m) {
-        if (0 == memcmp(&(resp4->addr[m]), &(self->ipaddr.addr4), NS_INADDRSZ)) {
-            DnsAResponse_free(resp4);
-            return 1;
-        }   // end if
-    }   // end for
-    DnsAResponse_free(resp4);
-    return 0;
-}   // end function: SpfEvaluator_isValidatedDomainName4
+    switch (query->rrtype) {
+    case ns_t_a:;
+        DnsAResponse *resp4 = NULL;
+        query->status = DnsResolver_lookupA(resolver, query->qname, &resp4);
+        query->resp = resp4;
+        break;
+    case ns_t_aaaa:;
+        DnsAaaaResponse *resp6 = NULL;
+        query->status = DnsResolver_lookupAaaa(resolver, query->qname, &resp6);
+        query->resp = resp6;
+        break;
+    case ns_t_mx:;
+        DnsMxResponse *respmx = NULL;
+        query->status = DnsResolver_lookupMx(resolver, query->qname, &respmx);
+        query->resp = respmx;
+        break;
+    case ns_t_txt:;
+        DnsTxtResponse *resptxt = NULL;
+        query->status = DnsResolver_lookupTxt(resolver, query->qname, &resptxt);
+        query->resp = resptxt;
+        break;
+    case 99 /* as ns_t_spf */:;
+        DnsSpfResponse *respspf = NULL;
+        query->status = DnsResolver_lookupSpf(resolver, query->qname, &respspf);
+        query->resp = respspf;
+        break;
+    case ns_t_ptr:;
+        DnsPtrResponse *respptr = NULL;
+        query->status =
+            DnsResolver_lookupPtr(resolver, self->sa_family, &(self->ipaddr), &respptr);
+        query->resp = respptr;
+        break;
+    default:
+        abort();
+    }   // end switch
+    query->error_symbol = DnsResolver_getErrorSymbol(resolver);
+    query->answered = true;
+}   // end function: SpfEvaluator_performQuery
 
 /**
  * @param self SpfEvaluator object.
- * @param revdomain
+ * @param answer the response of A RR or AAAA RR lookup of a domain name.
  * @return 1 if IP addresses match.
  *         0 if IP addresses doesn't match.
  *         -1 if DNS error occurred.
  */
 static int
-SpfEvaluator_isValidatedDomainName6(const SpfEvaluator *self, const char *revdomain)
+SpfEvaluator_validateAddrAnswer(const SpfEvaluator *self, const SpfDnsQuery *answer)
 {
-    DnsAaaaResponse *resp6;
-    dns_stat_t query_stat = DnsResolver_lookupAaaa(self->resolver, revdomain, &resp6);
-    if (DNS_STAT_NOERROR != query_stat) {
-        LogDnsError("aaaa", revdomain, "SPF domain validation, ignored",
-                    DnsResolver_getErrorSymbol(self->resolver));
-        return -1;
-    }   // end if
-    for (size_t m = 0; m < resp6->num; ++m) {
-        if (0 == memcmp(&(resp6->addr[m]), &(self->ipaddr.addr6), NS_IN6ADDRSZ)) {
-            DnsAaaaResponse_free(resp6);
-            return 1;
+    size_t m;
+    switch (answer->rrtype) {
+    case ns_t_a:
+        if (DNS_STAT_NOERROR != answer->status) {
+            LogDnsError("a", answer->qname, "SPF domain validation, ignored",
+                        answer->error_symbol);
+            return -1;
         }   // end if
-    }   // end for
-    DnsAaaaResponse_free(resp6);
-    return 0;
-}   // end function: SpfMacro_isValidatedDomainName6
+        const DnsAResponse *resp4 = (const DnsAResponse *) answer->resp;
+        for (m = 0; m < resp4->num; ++m) {
+            if (0 == memcmp(&(resp4->addr[m]), &(self->ipaddr.addr4), NS_INADDRSZ)) {
+                return 1;
+            }   // end if
+        }   // end for
+        return 0;
+    case ns_t_aaaa:
+        if (DNS_STAT_NOERROR != answer->status) {
+            LogDnsError("aaaa", answer->qname, "SPF domain validation, ignored",
+                        answer->error_symbol);
+            return -1;
+        }   // end if
+        const DnsAaaaResponse *resp6 = (const DnsAaaaResponse *) answer->resp;
+        for (m = 0; m < resp6->num; ++m) {
+            if (0 == memcmp(&(resp6->addr[m]), &(self->ipaddr.addr6), NS_IN6ADDRSZ)) {
+                return 1;
+            }   // end if
+        }   // end for
+        return 0;
+    default:
+        abort();
+    }   // end switch
+}   // end function: SpfEvaluator_validateAddrAnswer
 
 /*
+ * Validates the domain name synchronously with the DnsResolver object
+ * the SpfEvaluator object was created with.
+ * Only the expansion of "p" macro uses this function.
  * @param self SpfEvaluator object.
  * @param revdomain
  * @return 1 if IP addresses match.
@@ -808,25 +1224,73 @@ SpfEvaluator_isValidatedDomainName6(const SpfEvaluator *self, const char *revdom
 int
 SpfEvaluator_isValidatedDomainName(const SpfEvaluator *self, const char *revdomain)
 {
+    if (NULL == self->resolver) {
+        return -1;
+    }   // end if
+
+    SpfDnsQuery query;
+    memset(&query, 0, sizeof(SpfDnsQuery));
     switch (self->sa_family) {
     case AF_INET:
-        return SpfEvaluator_isValidatedDomainName4(self, revdomain);
+        query.rrtype = ns_t_a;
+        break;
     case AF_INET6:
-        return SpfEvaluator_isValidatedDomainName6(self, revdomain);
+        query.rrtype = ns_t_aaaa;
+        break;
     default:
         abort();
     }   // end switch
+    query.qname = revdomain;
+    SpfEvaluator_performQuery(self, self->resolver, &query);
+    int validation_stat = SpfEvaluator_validateAddrAnswer(self, &query);
+    SpfEvaluator_freeResponse(query.rrtype, query.resp);
+    return validation_stat;
 }   // end function: SpfEvaluator_isValidatedDomainName
 
-static SpfScore
-SpfEvaluator_evalMechPtr(SpfEvaluator *self, const SpfTerm *term)
-{
-    assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
-    const char *domain = SpfEvaluator_getTargetName(self, term);
-    DnsPtrResponse *respptr;
-    dns_stat_t ptrquery_stat =
-        DnsResolver_lookupPtr(self->resolver, self->sa_family, &(self->ipaddr), &respptr);
-    if (DNS_STAT_NOERROR != ptrquery_stat) {
+static void
+SpfEvaluator_lookupPtrNames(SpfEvaluator *self, SpfEvalFrame *frame)
+{
+    const char *domain = SpfEvaluator_getTargetName(self, SpfEvaluator_getCurrentTerm(frame));
+    size_t resp_num_limit = MIN(frame->ptrresp->num, self->policy->max_ptrrr_per_ptrmech);
+    // the address lookups of all the candidates are issued at once to be performed concurrently,
+    // their answers are examined in the order of the PTR RRs.
+    size_t query_num = 0;
+    for (size_t n = 0; n < resp_num_limit; ++n) {
+        // アルゴリズムをよく読むと validated domain が <target-name> で終わっているかどうかの判断を
+        // 先におこなった方が DNS ルックアップの回数が少なくて済む場合があることがわかる.
+        /*
+         * [RFC4408] 5.5.
+         * Check all validated domain names to see if they end in the
+         * <target-name> domain.  If any do, this mechanism matches.  If no
+         * validated domain name can be found, or if none of the validated
+         * domain names end in the <target-name>, this mechanism fails to match.
+         */
+        const char *revdomain = frame->ptrresp->domain[n];
+        if (!InetDomain_isParent(domain, revdomain)) {
+            continue;
+        }   // end if
+        if (SPF_STAT_OK != SpfEvaluator_addAddrQuery(self, revdomain)) {
+            SpfEvaluator_clearQueries(self);
+            DnsPtrResponse_free(frame->ptrresp);
+            frame->ptrresp = NULL;
+            SpfEvaluator_onMechanismResult(self, SPF_SCORE_SYSERROR);
+            return;
+        }   // end if
+        ++query_num;
+    }   // end for
+    if (0 < query_num) {
+        frame->step = SPF_EVAL_STEP_MECH_PTR_ADDR;
+        return;
+    }   // end if
+    DnsPtrResponse_free(frame->ptrresp);
+    frame->ptrresp = NULL;
+    SpfEvaluator_onMechanismResult(self, SPF_SCORE_NULL);
+}   // end function: SpfEvaluator_lookupPtrNames
+
+static void
+SpfEvaluator_onMechPtrAnswer(SpfEvaluator *self, SpfEvalFrame *frame, SpfDnsQuery *answer)
+{
+    if (DNS_STAT_NOERROR != answer->status) {
         /*
          * [RFC4408] 5.5.
          * If a DNS error occurs while doing the PTR RR lookup, then this
@@ -835,14 +1299,15 @@ SpfEvaluator_evalMechPtr(SpfEvaluator *self, const SpfTerm *term)
         char addrbuf[INET6_ADDRSTRLEN];
         (void) inet_ntop(self->sa_family, &(self->ipaddr), addrbuf, sizeof(addrbuf));
 
-        if (SPF_SCORE_PERMERROR == SpfEvaluator_incrementVoidLookupCounter(self, ptrquery_stat)) {
+        if (SPF_SCORE_PERMERROR == SpfEvaluator_incrementVoidLookupCounter(self, answer->status)) {
             LogDnsError("ptr", addrbuf, "SPF \'ptr\' mechanism", "VOIDLOOKUP_EXCEEDS");
-            return SPF_SCORE_PERMERROR;
+            SpfEvaluator_onMechanismResult(self, SPF_SCORE_PERMERROR);
+            return;
         }   // end if
 
-        LogDnsError("ptr", addrbuf, "SPF \'ptr\' mechanism, ignored",
-                    DnsResolver_getErrorSymbol(self->resolver));
-        return SPF_SCORE_NULL;
+        LogDnsError("ptr", addrbuf, "SPF \'ptr\' mechanism, ignored", answer->error_symbol);
+        SpfEvaluator_onMechanismResult(self, SPF_SCORE_NULL);
+        return;
     }   // end if
 
     /*
@@ -856,35 +1321,32 @@ SpfEvaluator_evalMechPtr(SpfEvaluator *self, const SpfTerm *term)
      * a "ptr" mechanism (see Section 10).  If <ip> is among the returned IP
      * addresses, then that domain name is validated.
      */
-    size_t resp_num_limit = MIN(respptr->num, self->policy->max_ptrrr_per_ptrmech);
-    for (size_t n = 0; n < resp_num_limit; ++n) {
-        // アルゴリズムをよく読むと validated domain が <target-name> で終わっているかどうかの判断を
-        // 先におこなった方が DNS ルックアップの回数が少なくて済む場合があることがわかる.
-        /*
-         * [RFC4408] 5.5.
-         * Check all validated domain names to see if they end in the
-         * <target-name> domain.  If any do, this mechanism matches.  If no
-         * validated domain name can be found, or if none of the validated
-         * domain names end in the <target-name>, this mechanism fails to match.
-         */
-        if (!InetDomain_isParent(domain, respptr->domain[n])) {
-            continue;
-        }   // end if
+    frame->ptrresp = (DnsPtrResponse *) answer->resp;
+    answer->resp = NULL;
+    SpfEvaluator_lookupPtrNames(self, frame);
+}   // end function: SpfEvaluator_onMechPtrAnswer
 
-        int validation_stat = SpfEvaluator_isValidatedDomainName(self, respptr->domain[n]);
+static void
+SpfEvaluator_onMechPtrAddrAnswer(SpfEvaluator *self, SpfEvalFrame *frame, SpfDnsQuery *answer,
+                                 size_t answer_num)
+{
+    SpfScore eval_score = SPF_SCORE_NULL;
+    for (size_t n = 0; n < answer_num; ++n) {
         /*
          * [RFC4408] 5.5.
          * If a DNS error occurs while doing an A RR
          * lookup, then that domain name is skipped and the search continues.
          */
-        if (1 == validation_stat) {
-            DnsPtrResponse_free(respptr);
-            return SpfEvaluator_getScoreByQualifier(term->qualifier);
+        if (1 == SpfEvaluator_validateAddrAnswer(self, &(answer[n]))) {
+            eval_score =
+                SpfEvaluator_getScoreByQualifier(SpfEvaluator_getCurrentTerm(frame)->qualifier);
+            break;
         }   // end if
     }   // end for
-    DnsPtrResponse_free(respptr);
-    return SPF_SCORE_NULL;
-}   // end function: SpfEvaluator_evalMechPtr
+    DnsPtrResponse_free(frame->ptrresp);
+    frame->ptrresp = NULL;
+    SpfEvaluator_onMechanismResult(self, eval_score);
+}   // end function: SpfEvaluator_onMechPtrAddrAnswer
 
 static SpfScore
 SpfEvaluator_evalMechIp4(const SpfEvaluator *self, const SpfTerm *term)
@@ -912,50 +1374,66 @@ SpfEvaluator_evalMechIp6(const SpfEvaluator *self, const SpfTerm *term)
         ? SpfEvaluator_getScoreByQualifier(term->qualifier) : SPF_SCORE_NULL;
 }   // end function: SpfEvaluator_evalMechIp6
 
-static SpfScore
-SpfEvaluator_evalMechExists(SpfEvaluator *self, const SpfTerm *term)
+/**
+ * Evaluates the run of "ip4" and "ip6" directives beginning at the current directive
+ * with a single walk of its prefix trie, instead of matching the directives one by one.
+ * @return true if the run has been evaluated,
+ *         false if the directives have to be evaluated one by one.
+ */
+static bool
+SpfEvaluator_evalIpDirectives(SpfEvaluator *self, SpfEvalFrame *frame)
 {
-    assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
-    DnsAResponse *resp4;
-    dns_stat_t aquery_stat = DnsResolver_lookupA(self->resolver, term->querydomain, &resp4);
-    if (DNS_STAT_NOERROR != aquery_stat) {
-        if (SPF_SCORE_PERMERROR == SpfEvaluator_incrementVoidLookupCounter(self, aquery_stat)) {
-            LogDnsError("a", term->querydomain, "SPF \'exist\' mechanism", "VOIDLOOKUP_EXCEEDS");
-            return SPF_SCORE_PERMERROR;
-        }   // end if
-        LogDnsError("a", term->querydomain, "SPF \'exist\' mechanism",
-                    DnsResolver_getErrorSymbol(self->resolver));
-        return SpfEvaluator_mapMechDnsResponseToSpfScore(aquery_stat);
+    // the malicious cidr-length check is applied to each directive in order
+    if (SPF_CUSTOM_ACTION_NULL != self->policy->action_on_malicious_ip4_cidr_length
+        || SPF_CUSTOM_ACTION_NULL != self->policy->action_on_malicious_ip6_cidr_length) {
+        return false;
     }   // end if
 
-    size_t num = resp4->num;
-    DnsAResponse_free(resp4);
-    return (0 < num) ? SpfEvaluator_getScoreByQualifier(term->qualifier) : SPF_SCORE_NULL;
-}   // end function: SpfEvaluator_evalMechExists
+    const SpfRecord *record =
+        NULL != frame->local_policy_record ? frame->local_policy_record : frame->record;
+    unsigned int run_tail;
+    const SpfIpTrie *trie = SpfRecord_getIpTrie(record, frame->directive_index, &run_tail);
+    if (NULL == trie) {
+        return false;
+    }   // end if
 
-static SpfScore
-SpfEvaluator_evalModRedirect(SpfEvaluator *self, const SpfTerm *term)
+    unsigned int matched;
+    if (SpfIpTrie_lookup(trie, self->sa_family, &(self->ipaddr), &matched)) {
+        frame->directive_index = matched;
+        const SpfTerm *term = SpfEvaluator_getCurrentTerm(frame);
+        SpfEvaluator_onMechanismResult(self, SpfEvaluator_getScoreByQualifier(term->qualifier));
+    } else {
+        // skip to the last directive of the run
+        frame->directive_index = run_tail - 1;
+        SpfEvaluator_onMechanismResult(self, SPF_SCORE_NULL);
+    }   // end if
+    return true;
+}   // end function: SpfEvaluator_evalIpDirectives
+
+static void
+SpfEvaluator_onMechExistsAnswer(SpfEvaluator *self, SpfEvalFrame *frame, SpfDnsQuery *answer)
 {
-    assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
-    SpfScore incr_stat = SpfEvaluator_incrementDnsMechCounter(self);
-    if (SPF_SCORE_NULL != incr_stat) {
-        return incr_stat;
+    const SpfTerm *term = SpfEvaluator_getCurrentTerm(frame);
+    if (DNS_STAT_NOERROR != answer->status) {
+        if (SPF_SCORE_PERMERROR == SpfEvaluator_incrementVoidLookupCounter(self, answer->status)) {
+            LogDnsError("a", term->querydomain, "SPF \'exist\' mechanism", "VOIDLOOKUP_EXCEEDS");
+            SpfEvaluator_onMechanismResult(self, SPF_SCORE_PERMERROR);
+            return;
+        }   // end if
+        LogDnsError("a", term->querydomain, "SPF \'exist\' mechanism", answer->error_symbol);
+        SpfEvaluator_onMechanismResult(self,
+                                       SpfEvaluator_mapMechDnsResponseToSpfScore(answer->status));
+        return;
     }   // end if
-    ++(self->redirect_depth);
-    SpfScore eval_score = SpfEvaluator_checkHost(self, term->querydomain, true);
-    --(self->redirect_depth);
-    /*
-     * [RFC4408] 6.1.
-     * The result of this new evaluation of check_host() is then considered
-     * the result of the current evaluation with the exception that if no
-     * SPF record is found, or if the target-name is malformed, the result
-     * is a "PermError" rather than "None".
-     */
-    return SPF_SCORE_NONE == eval_score ? SPF_SCORE_PERMERROR : eval_score;
-}   // end function: SpfEvaluator_evalModRedirect
 
-static SpfStat
-SpfEvaluator_evalModExplanation(SpfEvaluator *self, const SpfTerm *term)
+    size_t num = ((const DnsAResponse *) answer->resp)->num;
+    SpfEvaluator_onMechanismResult(self, (0 < num)
+                                   ? SpfEvaluator_getScoreByQualifier(term->qualifier)
+                                   : SPF_SCORE_NULL);
+}   // end function: SpfEvaluator_onMechExistsAnswer
+
+static void
+SpfEvaluator_onExplanationAnswer(SpfEvaluator *self, SpfEvalFrame *frame, SpfDnsQuery *answer)
 {
     /*
      * [RFC4408] 6.2.
@@ -964,61 +1442,297 @@ SpfEvaluator_evalModExplanation(SpfEvaluator *self, const SpfTerm *term)
      * than one record is returned, or if there are syntax errors in the
      * explanation string, then proceed as if no exp modifier was given.
      */
+    if (DNS_STAT_NOERROR != answer->status) {
+        LogDnsError("txt", answer->qname, "SPF \'exp\' modifier, ignored", answer->error_symbol);
+    } else {
+        const DnsTxtResponse *resptxt = (const DnsTxtResponse *) answer->resp;
+        if (1 == resptxt->num) {
+            (void) SpfEvaluator_setExplanation(self, answer->qname, resptxt->data[0]);
+        }   // end if
+    }   // end if
+    SpfEvaluator_finishFrame(self, frame->score);
+}   // end function: SpfEvaluator_onExplanationAnswer
 
-    assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
+/**
+ * Finishes the check_host() invocation as a mechanism of the record matched.
+ */
+static void
+SpfEvaluator_onRecordMatched(SpfEvaluator *self, SpfEvalFrame *frame, SpfScore eval_score)
+{
+    /*
+     * SpfEvalPolicy で "exp=" を取得するようの指定されている場合に "exp=" を取得する.
+     * ただし, 以下の点に注意する:
+     * - include メカニズム中の exp= は評価しない.
+     * - redirect 評価中に元のドメインの exp= は評価しない.
+     * [RFC4408] 6.2.
+     * Note: During recursion into an "include" mechanism, an exp= modifier
+     * from the <target-name> MUST NOT be used.  In contrast, when executing
+     * a "redirect" modifier, an exp= modifier from the original domain MUST
+     * NOT be used.
+     *
+     * <target-name> は メカニズムの引数で指定されている <domain-spec>,
+     * 指定されていない場合は check_host() 関数の <domain>.
+     * [RFC4408] 4.8.
+     * Several of these mechanisms and modifiers have a <domain-spec>
+     * section.  The <domain-spec> string is macro expanded (see Section 8).
+     * The resulting string is the common presentation form of a fully-
+     * qualified DNS name: a series of labels separated by periods.  This
+     * domain is called the <target-name> in the rest of this document.
+     */
+    if (self->policy->lookup_exp && SPF_SCORE_FAIL == eval_score
+        && 0 == self->include_depth && NULL != frame->record->modifiers.exp) {
+        const SpfTerm *term = frame->record->modifiers.exp;
+        assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
+        frame->score = eval_score;
+        frame->step = SPF_EVAL_STEP_EXPLANATION;
+        if (SPF_STAT_OK == SpfEvaluator_addQuery(self, ns_t_txt, term->querydomain)) {
+            return;
+        }   // end if
+        // proceed as if no exp modifier was given
+    }   // end if
+    SpfEvaluator_finishFrame(self, eval_score);
+}   // end function: SpfEvaluator_onRecordMatched
 
-    DnsTxtResponse *resptxt;
-    dns_stat_t txtquery_stat = DnsResolver_lookupTxt(self->resolver, term->querydomain, &resptxt);
-    if (DNS_STAT_NOERROR != txtquery_stat) {
-        LogDnsError("txt", term->querydomain, "SPF \'exp\' modifier, ignored",
-                    DnsResolver_getErrorSymbol(self->resolver));
-        return SPF_STAT_OK;
+/**
+ * @return true if the evaluation of the local policy has started, false otherwise.
+ */
+static bool
+SpfEvaluator_beginLocalPolicy(SpfEvaluator *self, SpfEvalFrame *frame)
+{
+    // 再帰評価 (include や redirect) の内側にいない場合のみ, ローカルポリシーの評価をおこなう
+    if (0 < SpfEvaluator_getDepth(self) || NULL == self->policy->local_policy
+        || self->local_policy_mode) {
+        return false;
     }   // end if
 
-    if (1 != resptxt->num) {
-        DnsTxtResponse_free(resptxt);
-        return SPF_STAT_OK;
+    LogDebug("evaluating local policy: policy=%s", self->policy->local_policy);
+    // SPF/SIDF 評価過程で遭遇した DNS をひくメカニズムのカウンタをクリア
+    SpfRecord *local_policy_record = NULL;
+    SpfStat build_stat = SpfRecord_build(self, self->scope, self->policy->local_policy,
+                                         STRTAIL(self->policy->local_policy),
+                                         &local_policy_record);
+    if (SPF_STAT_OK != build_stat) {
+        SpfLogConfigError("failed to build local policy record: policy=%s",
+                          self->policy->local_policy);
+        return false;
     }   // end if
+    self->dns_mech_count = 0;   // 本物のレコード評価中に遭遇した DNS ルックアップを伴うメカニズムの数は忘れる
+    self->local_policy_mode = true; // ローカルポリシー評価中に, さらにローカルポリシーを適用して無限ループに入らないようにフラグを立てる.
+    frame->local_policy_record = local_policy_record;
+    frame->directives = local_policy_record->directives;
+    frame->directive_index = 0;
+    frame->step = SPF_EVAL_STEP_DIRECTIVE;
+    return true;
+}   // end function: SpfEvaluator_beginLocalPolicy
 
-    SpfStat expand_stat = SpfEvaluator_setExplanation(self, term->querydomain, resptxt->data[0]);
-    DnsTxtResponse_free(resptxt);
-    return expand_stat;
-}   // end function: SpfEvaluator_evalModExplanation
+static void
+SpfEvaluator_endLocalPolicy(SpfEvaluator *self, SpfEvalFrame *frame, SpfScore local_policy_score)
+{
+    self->local_policy_mode = false;
+    SpfRecord_free(frame->local_policy_record);
+    frame->local_policy_record = NULL;
+    frame->directives = frame->record->directives;
 
-static SpfScore
-SpfEvaluator_evalMechanism(SpfEvaluator *self, const SpfTerm *term)
+    switch (local_policy_score) {
+    case SPF_SCORE_PERMERROR:
+    case SPF_SCORE_TEMPERROR:
+        // ローカルポリシー評価中の temperror, permerror は無視する
+        LogDebug("ignoring local policy score: score=%s",
+                 SpfEnum_lookupScoreByValue(local_policy_score));
+        local_policy_score = SPF_SCORE_NULL;
+        break;
+    default:
+        LogDebug("applying local policy score: score=%s",
+                 SpfEnum_lookupScoreByValue(local_policy_score));
+        break;
+    }   // end switch
+
+    if (SPF_SCORE_NULL != local_policy_score) {
+        // exp= を評価する条件は directive によってスコアが決定する場合とほぼ同じ.
+        // 違いは local_policy_explanation を使用する点.
+        if (self->policy->lookup_exp && SPF_SCORE_FAIL == local_policy_score
+            && 0 == self->include_depth && NULL != self->policy->local_policy_explanation) {
+            // local policy 専用の explanation をセットする.
+            (void) SpfEvaluator_setExplanation(self, SpfEvaluator_getDomain(self),
+                                               self->policy->local_policy_explanation);
+        }   // end if
+        SpfEvaluator_finishFrame(self, local_policy_score);
+        return;
+    }   // end if
+
+    // returns "Neutral" as default socre
+    LogDebug("default score applied: domain=%s", SpfEvaluator_getDomain(self));
+    SpfEvaluator_finishFrame(self, SPF_SCORE_NEUTRAL);
+}   // end function: SpfEvaluator_endLocalPolicy
+
+/**
+ * Proceeds the evaluation with the result of the mechanism at directive_index.
+ * @param eval_score SPF_SCORE_NULL if the mechanism doesn't match.
+ */
+static void
+SpfEvaluator_onMechanismResult(SpfEvaluator *self, SpfScore eval_score)
+{
+    SpfEvalFrame *frame = SpfEvaluator_getCurrentFrame(self);
+    const SpfTerm *term = SpfEvaluator_getCurrentTerm(frame);
+    if (SPF_SCORE_NULL != eval_score) {
+        LogDebug("mechanism match: domain=%s, mech%02u=%s, score=%s",
+                 SpfEvaluator_getDomain(self), frame->directive_index, term->attr->name,
+                 SpfEnum_lookupScoreByValue(eval_score));
+        if (NULL != frame->local_policy_record) {
+            SpfEvaluator_endLocalPolicy(self, frame, eval_score);
+        } else {
+            SpfEvaluator_onRecordMatched(self, frame, eval_score);
+        }   // end if
+        return;
+    }   // end if
+    LogDebug("mechanism not match: domain=%s, mech_no=%u, mech=%s",
+             SpfEvaluator_getDomain(self), frame->directive_index, term->attr->name);
+    ++(frame->directive_index);
+    frame->step = SPF_EVAL_STEP_DIRECTIVE;
+}   // end function: SpfEvaluator_onMechanismResult
+
+/**
+ * Finishes or continues the check_host() invocation when none of the mechanisms matched.
+ */
+static void
+SpfEvaluator_onRecordUnmatched(SpfEvaluator *self, SpfEvalFrame *frame)
+{
+    /*
+     * レコード中の全てのメカニズムにマッチしなかった場合
+     * [RFC4408] 4.7.
+     * If none of the mechanisms match and there is no "redirect" modifier,
+     * then the check_host() returns a result of "Neutral", just as if
+     * "?all" were specified as the last directive.  If there is a
+     * "redirect" modifier, check_host() proceeds as defined in Section 6.1.
+     */
+
+    // "redirect=" modifier evaluation
+    const SpfTerm *term = frame->record->modifiers.rediect;
+    if (NULL != term) {
+        LogDebug("redirect: from=%s, to=%s", SpfEvaluator_getDomain(self), term->param.domain);
+        assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
+        SpfScore incr_stat = SpfEvaluator_incrementDnsMechCounter(self);
+        if (SPF_SCORE_NULL != incr_stat) {
+            SpfEvaluator_finishFrame(self, incr_stat);
+            return;
+        }   // end if
+        ++(self->redirect_depth);
+        frame->step = SPF_EVAL_STEP_REDIRECT;
+        SpfEvaluator_beginCheckHost(self, SPF_EVAL_FRAME_REDIRECT, term->querydomain, true);
+        return;
+    }   // end if
+
+    if (SpfEvaluator_beginLocalPolicy(self, frame)) {
+        return;
+    }   // end if
+
+    // returns "Neutral" as default socre
+    LogDebug("default score applied: domain=%s", SpfEvaluator_getDomain(self));
+    SpfEvaluator_finishFrame(self, SPF_SCORE_NEUTRAL);
+}   // end function: SpfEvaluator_onRecordUnmatched
+
+/**
+ * Evaluates the directive at directive_index.
+ * Mechanisms without DNS lookups are evaluated immediately,
+ * the others register DNS lookups or start a recursive check_host() invocation.
+ */
+static void
+SpfEvaluator_evalDirective(SpfEvaluator *self, SpfEvalFrame *frame)
 {
+    if (PtrArray_getCount(frame->directives) <= frame->directive_index) {
+        if (NULL != frame->local_policy_record) {
+            SpfEvaluator_endLocalPolicy(self, frame, SPF_SCORE_NULL);
+        } else {
+            SpfEvaluator_onRecordUnmatched(self, frame);
+        }   // end if
+        return;
+    }   // end if
+
+    const SpfTerm *term = SpfEvaluator_getCurrentTerm(frame);
     assert(NULL != term);
     assert(NULL != term->attr);
 
+    SpfScore eval_score;
     if (term->attr->involve_dnslookup) {
-        SpfScore incr_stat = SpfEvaluator_incrementDnsMechCounter(self);
-        if (SPF_SCORE_NULL != incr_stat) {
-            return incr_stat;
+        eval_score = SpfEvaluator_incrementDnsMechCounter(self);
+        if (SPF_SCORE_NULL != eval_score) {
+            SpfEvaluator_onMechanismResult(self, eval_score);
+            return;
         }   // end if
     }   // end if
 
     switch (term->attr->type) {
     case SPF_TERM_MECH_ALL:
-        return SpfEvaluator_evalMechAll(self, term);
+        eval_score = SpfEvaluator_evalMechAll(self, term);
+        break;
     case SPF_TERM_MECH_INCLUDE:
-        return SpfEvaluator_evalMechInclude(self, term);
+        assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
+        ++(self->include_depth);
+        if (self->cost.include_depth < self->include_depth) {
+            self->cost.include_depth = self->include_depth;
+        }   // end if
+        frame->step = SPF_EVAL_STEP_INCLUDE;
+        SpfEvaluator_beginCheckHost(self, SPF_EVAL_FRAME_INCLUDE, term->querydomain, true);
+        return;
     case SPF_TERM_MECH_A:
-        return SpfEvaluator_evalMechA(self, term);
+        assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
+        eval_score = SpfEvaluator_checkMaliceOfDualCidrLength(self, term);
+        if (SPF_SCORE_NULL != eval_score) {
+            break;
+        }   // end if
+        frame->step = SPF_EVAL_STEP_MECH_A;
+        if (SPF_STAT_OK ==
+            SpfEvaluator_addAddrQuery(self, SpfEvaluator_getTargetName(self, term))) {
+            return;
+        }   // end if
+        eval_score = SPF_SCORE_SYSERROR;
+        break;
     case SPF_TERM_MECH_MX:
-        return SpfEvaluator_evalMechMx(self, term);
+        assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
+        eval_score = SpfEvaluator_checkMaliceOfDualCidrLength(self, term);
+        if (SPF_SCORE_NULL != eval_score) {
+            break;
+        }   // end if
+        frame->step = SPF_EVAL_STEP_MECH_MX;
+        if (SPF_STAT_OK ==
+            SpfEvaluator_addQuery(self, ns_t_mx, SpfEvaluator_getTargetName(self, term))) {
+            return;
+        }   // end if
+        eval_score = SPF_SCORE_SYSERROR;
+        break;
     case SPF_TERM_MECH_PTR:
-        return SpfEvaluator_evalMechPtr(self, term);
+        assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
+        frame->step = SPF_EVAL_STEP_MECH_PTR;
+        if (SPF_STAT_OK == SpfEvaluator_addQuery(self, ns_t_ptr, NULL)) {
+            return;
+        }   // end if
+        eval_score = SPF_SCORE_SYSERROR;
+        break;
     case SPF_TERM_MECH_IP4:
-        return SpfEvaluator_evalMechIp4(self, term);
+        if (SpfEvaluator_evalIpDirectives(self, frame)) {
+            return;
+        }   // end if
+        eval_score = SpfEvaluator_evalMechIp4(self, term);
+        break;
     case SPF_TERM_MECH_IP6:
-        return SpfEvaluator_evalMechIp6(self, term);
+        if (SpfEvaluator_evalIpDirectives(self, frame)) {
+            return;
+        }   // end if
+        eval_score = SpfEvaluator_evalMechIp6(self, term);
+        break;
     case SPF_TERM_MECH_EXISTS:
-        return SpfEvaluator_evalMechExists(self, term);
+        assert(SPF_TERM_PARAM_DOMAINSPEC == term->attr->param_type);
+        frame->step = SPF_EVAL_STEP_MECH_EXISTS;
+        if (SPF_STAT_OK == SpfEvaluator_addQuery(self, ns_t_a, term->querydomain)) {
+            return;
+        }   // end if
+        eval_score = SPF_SCORE_SYSERROR;
+        break;
     default:
         abort();
     }   // end switch
-}   // end function: SpfEvaluator_evalMechanism
+    SpfEvaluator_onMechanismResult(self, eval_score);
+}   // end function: SpfEvaluator_evalDirective
 
 static SpfScore
 SpfEvaluator_checkDomain(const SpfEvaluator *self, const char *domain)
@@ -1061,174 +1775,844 @@ SpfEvaluator_checkDomain(const SpfEvaluator *self, const char *domain)
         return SPF_SCORE_NONE;
     }   // end if
 
-    // "include" mechanism や "redirect=" modifier でループを形成していないかチェックする.
-    if (0 <= StrArray_linearSearchIgnoreCase(self->domain, domain)) {
-        SpfLogPermFail("evaluation loop detected: domain=%s", domain);
-        return SPF_SCORE_PERMERROR;
+    // "include" mechanism や "redirect=" modifier でループを形成していないかチェックする.
+    if (0 <= StrArray_linearSearchIgnoreCase(self->domain, domain)) {
+        SpfLogPermFail("evaluation loop detected: domain=%s", domain);
+        return SPF_SCORE_PERMERROR;
+    }   // end if
+
+    return SPF_SCORE_NULL;
+}   // end function: SpfEvaluator_checkDomain
+
+/**
+ * Hands the result of the check_host() invocation just finished over to its caller,
+ * that is the "include:" mechanism or the "redirect=" modifier of the enclosing invocation,
+ * or SpfEvaluator_eval() if there is no enclosing invocation.
+ */
+static void
+SpfEvaluator_deliverScore(SpfEvaluator *self, SpfScore eval_score)
+{
+    for (;;) {
+        SpfEvalFrame *frame = SpfEvaluator_getCurrentFrame(self);
+        if (NULL == frame) {
+            self->score = eval_score;
+            return;
+        }   // end if
+
+        switch (frame->step) {
+        case SPF_EVAL_STEP_INCLUDE:
+            --(self->include_depth);
+            SpfEvaluator_onMechanismResult(self,
+                                           SpfEvaluator_mapIncludeScore
+                                           (SpfEvaluator_getCurrentTerm(frame), eval_score));
+            return;
+        case SPF_EVAL_STEP_REDIRECT:
+            --(self->redirect_depth);
+            /*
+             * [RFC4408] 6.1.
+             * The result of this new evaluation of check_host() is then considered
+             * the result of the current evaluation with the exception that if no
+             * SPF record is found, or if the target-name is malformed, the result
+             * is a "PermError" rather than "None".
+             */
+            if (SPF_SCORE_NONE == eval_score) {
+                eval_score = SPF_SCORE_PERMERROR;
+            }   // end if
+            SpfEvaluator_popFrame(self);
+            break;
+        default:
+            abort();
+        }   // end switch
+    }   // end for
+}   // end function: SpfEvaluator_deliverScore
+
+/**
+ * The check_host() Function as defined in Section 4 of RFC4408
+ * The invocation is pushed onto the frame stack and proceeds through SpfEvaluator_run().
+ * Its result is handed over to the caller by SpfEvaluator_deliverScore().
+ * @param self SpfEvaluator object.
+ * @param type the caller of the check_host() function.
+ * @param domain <domain> parameter of the check_host() function
+ */
+static void
+SpfEvaluator_beginCheckHost(SpfEvaluator *self, SpfEvalFrameType type, const char *domain,
+                            bool count_void_lookup)
+{
+    // check <domain> parameter
+    SpfScore precond_score = SpfEvaluator_checkDomain(self, domain);
+    if (SPF_SCORE_NULL != precond_score) {
+        SpfEvaluator_deliverScore(self, precond_score);
+        return;
+    }   // end if
+
+    // register <domain> parameter
+    SpfStat push_stat = SpfEvaluator_pushDomain(self, domain);
+    if (SPF_STAT_OK != push_stat) {
+        SpfEvaluator_deliverScore(self, SPF_SCORE_SYSERROR);
+        return;
+    }   // end if
+    SpfEvalFrame *frame = SpfEvaluator_pushFrame(self, type, count_void_lookup);
+    if (NULL == frame) {
+        SpfEvaluator_popDomain(self);
+        SpfEvaluator_deliverScore(self, SPF_SCORE_SYSERROR);
+        return;
+    }   // end if
+
+    SpfStat query_stat;
+    if (self->policy->lookup_spf_rr) {
+        frame->step = SPF_EVAL_STEP_LOOKUP_SPF;
+        query_stat = SpfEvaluator_addQuery(self, 99 /* as ns_t_spf */ ,
+                                           SpfEvaluator_getDomain(self));
+    } else {
+        frame->step = SPF_EVAL_STEP_LOOKUP_TXT;
+        query_stat = SpfEvaluator_addQuery(self, ns_t_txt, SpfEvaluator_getDomain(self));
+    }   // end if
+    if (SPF_STAT_OK != query_stat) {
+        SpfEvaluator_finishFrame(self, SPF_SCORE_SYSERROR);
+    }   // end if
+}   // end function: SpfEvaluator_beginCheckHost
+
+/**
+ * Advances the innermost check_host() invocation by one step.
+ * @param answer the answered DNS lookups the current step is waiting for,
+ *               in the order they are registered.
+ *               the responses left in them are released by the caller.
+ * @param answer_num the number of the answered DNS lookups,
+ *                   answer points to an empty query if 0.
+ */
+static void
+SpfEvaluator_step(SpfEvaluator *self, SpfDnsQuery *answer, size_t answer_num)
+{
+    SpfEvalFrame *frame = SpfEvaluator_getCurrentFrame(self);
+    switch (frame->step) {
+    case SPF_EVAL_STEP_LOOKUP_SPF:
+        SpfEvaluator_onSpfRrAnswer(self, frame, answer);
+        break;
+    case SPF_EVAL_STEP_LOOKUP_TXT:
+        SpfEvaluator_onTxtRrAnswer(self, frame, answer);
+        break;
+    case SPF_EVAL_STEP_DIRECTIVE:
+        SpfEvaluator_evalDirective(self, frame);
+        break;
+    case SPF_EVAL_STEP_MECH_A:
+        SpfEvaluator_onMechanismResult(self,
+                                       SpfEvaluator_evalByAddrAnswer(self, answer,
+                                                                     SpfEvaluator_getCurrentTerm
+                                                                     (frame), true));
+        break;
+    case SPF_EVAL_STEP_MECH_MX:
+        SpfEvaluator_onMechMxAnswer(self, frame, answer);
+        break;
+    case SPF_EVAL_STEP_MECH_MX_ADDR:
+        SpfEvaluator_onMechMxAddrAnswer(self, frame, answer, answer_num);
+        break;
+    case SPF_EVAL_STEP_MECH_PTR:
+        SpfEvaluator_onMechPtrAnswer(self, frame, answer);
+        break;
+    case SPF_EVAL_STEP_MECH_PTR_ADDR:
+        SpfEvaluator_onMechPtrAddrAnswer(self, frame, answer, answer_num);
+        break;
+    case SPF_EVAL_STEP_MECH_EXISTS:
+        SpfEvaluator_onMechExistsAnswer(self, frame, answer);
+        break;
+    case SPF_EVAL_STEP_EXPLANATION:
+        SpfEvaluator_onExplanationAnswer(self, frame, answer);
+        break;
+    case SPF_EVAL_STEP_INCLUDE:
+    case SPF_EVAL_STEP_REDIRECT:
+    default:
+        // the innermost invocation never waits for another invocation
+        abort();
+    }   // end switch
+}   // end function: SpfEvaluator_step
+
+static uint64_t
+SpfEvaluator_now(void)
+{
+    struct timespec ts;
+    if (0 != clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        return (uint64_t) time(NULL) * 1000000;
+    }   // end if
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}   // end function: SpfEvaluator_now
+
+/*
+ * Completes the cost of the evaluation just finished
+ * and accounts it to the table of the policy if any.
+ */
+static void
+SpfEvaluator_accountCost(SpfEvaluator *self)
+{
+    if (0 == self->cost_started) {
+        return;
+    }   // end if
+    self->cost.dns_mech_count = self->dns_mech_count;
+    self->cost.void_lookup_count = self->void_lookup_count;
+    self->cost.elapsed = SpfEvaluator_now() - self->cost_started;
+    self->cost_started = 0;
+    if (NULL != self->policy->cost_table) {
+        SpfCostTable_add(self->policy->cost_table, InetMailbox_getDomain(self->sender),
+                         &(self->cost));
+    }   // end if
+}   // end function: SpfEvaluator_accountCost
+
+static SpfEvalProgress
+SpfEvaluator_run(SpfEvaluator *self, SpfScore *score)
+{
+    while (0 < self->frame_num) {
+        for (size_t i = 0; i < self->query_num; ++i) {
+            if (!self->query[i].answered && !self->query[i].speculative) {
+                return SPF_EVAL_PROGRESS_NEED_DNS;
+            }   // end if
+        }   // end for
+        // the answers are moved aside so that the step can register new DNS lookups
+        SpfDnsQuery *swapped = self->answer;
+        size_t swapped_capacity = self->answer_capacity;
+        self->answer = self->query;
+        self->answer_num = self->query_num;
+        self->answer_capacity = self->query_capacity;
+        self->query = swapped;
+        self->query_num = 0;
+        self->query_capacity = swapped_capacity;
+
+        // answered speculative lookups are kept until the evaluation asks for them,
+        // and speculative lookups in progress are carried over.
+        size_t answer_num = 0;
+        for (size_t i = 0; i < self->answer_num; ++i) {
+            SpfDnsQuery *answer = &(self->answer[i]);
+            if (!answer->speculative) {
+                self->answer[answer_num++] = *answer;
+                continue;
+            }   // end if
+            SpfDnsQuery *moved = answer->answered
+                ? SpfEvaluator_appendQuery(&(self->prefetch), &(self->prefetch_num),
+                                           &(self->prefetch_capacity))
+                : SpfEvaluator_appendQuery(&(self->query), &(self->query_num),
+                                           &(self->query_capacity));
+            if (NULL == moved) {
+                SpfEvaluator_releaseQuery(answer);  // speculative lookups can be discarded
+                continue;
+            }   // end if
+            *moved = *answer;
+        }   // end for
+        self->answer_num = answer_num;
+        self->cost.query_count += (unsigned int) answer_num;
+
+        SpfDnsQuery noanswer;
+        memset(&noanswer, 0, sizeof(SpfDnsQuery));
+        SpfEvaluator_step(self, 0 < self->answer_num ? self->answer : &noanswer, self->answer_num);
+        SpfEvaluator_clearAnswers(self);
+    }   // end while
+    SpfEvaluator_clearQueries(self);
+    SpfEvaluator_clearPrefetch(self);
+    SpfEvaluator_accountCost(self);
+    *score = self->score;
+    return SPF_EVAL_PROGRESS_DONE;
+}   // end function: SpfEvaluator_run
+
+/*
+ * Discards the evaluation in progress.
+ */
+static void
+SpfEvaluator_abandon(SpfEvaluator *self)
+{
+    while (0 < self->frame_num) {
+        SpfEvaluator_popFrame(self);
+    }   // end while
+    SpfEvaluator_clearQueries(self);
+    SpfEvaluator_clearAnswers(self);
+    SpfEvaluator_clearPrefetch(self);
+    self->redirect_depth = 0;
+    self->include_depth = 0;
+    self->local_policy_mode = false;
+}   // end function: SpfEvaluator_abandon
+
+/**
+ * Starts the evaluation without blocking on DNS lookups.
+ * When SPF_EVAL_PROGRESS_NEED_DNS is returned, answer all the lookups
+ * enumerated by SpfEvaluator_getQueryCount() and SpfEvaluator_getQuery()
+ * with SpfEvaluator_setAnswer() or SpfEvaluator_lookupQuery(),
+ * then call SpfEvaluator_resume() to proceed.
+ * If speculative lookups are enabled by SpfEvalPolicy_setPrefetchDepth(), the lookups include
+ * the ones the evaluation may need later. They should be performed concurrently,
+ * but the evaluation proceeds without them when left unanswered.
+ * The evaluation counts DNS lookups and void lookups exactly as SpfEvaluator_eval() does.
+ * @param score receives the result when SPF_EVAL_PROGRESS_DONE is returned,
+ *              the same value as SpfEvaluator_eval() returns.
+ * @return SPF_EVAL_PROGRESS_DONE if the evaluation has completed,
+ *         SPF_EVAL_PROGRESS_NEED_DNS if the evaluation is waiting for DNS lookups.
+ */
+SpfEvalProgress
+SpfEvaluator_start(SpfEvaluator *self, SpfRecordScope scope, SpfScore *score)
+{
+    assert(NULL != self);
+    assert(NULL != score);
+
+    if (SPF_SCORE_NULL != self->score) {
+        *score = self->score;
+        return SPF_EVAL_PROGRESS_DONE;
+    }   // end if
+    SpfEvaluator_abandon(self);
+
+    self->scope = scope;
+    self->dns_mech_count = 0;
+    self->void_lookup_count = 0;
+    memset(&(self->cost), 0, sizeof(SpfEvalCost));
+    self->cost_started = 0;
+    if (0 == self->sa_family || NULL == self->helo_domain) {
+        *score = SPF_SCORE_NULL;
+        return SPF_EVAL_PROGRESS_DONE;
+    }   // end if
+    if (NULL == self->sender) {
+        /*
+         * [RFC4408] 4.3.
+         * If the <sender> has no localpart, substitute the string "postmaster"
+         * for the localpart.
+         */
+        self->sender = InetMailbox_build(SPF_EVAL_DEFAULT_LOCALPART, self->helo_domain);
+        if (NULL == self->sender) {
+            LogNoResource();
+            *score = SPF_SCORE_SYSERROR;
+            return SPF_EVAL_PROGRESS_DONE;
+        }   // end if
+        self->is_sender_context = false;
+    } else {
+        self->is_sender_context = true;
+    }   // end if
+    if (NULL != self->policy->flat_cache
+        && SpfFlatCache_lookup(self->policy->flat_cache, scope, InetMailbox_getDomain(self->sender),
+                               self->sa_family, &(self->ipaddr), score)) {
+        LogDebug("flattened record matched: domain=%s, score=%s",
+                 InetMailbox_getDomain(self->sender), SpfEnum_lookupScoreByValue(*score));
+        self->score = *score;
+        return SPF_EVAL_PROGRESS_DONE;
+    }   // end if
+    self->cost_started = SpfEvaluator_now();
+    SpfEvaluator_beginCheckHost(self, SPF_EVAL_FRAME_TOP, InetMailbox_getDomain(self->sender),
+                                false);
+    return SpfEvaluator_run(self, score);
+}   // end function: SpfEvaluator_start
+
+/**
+ * Resumes the evaluation suspended by SpfEvaluator_start() or SpfEvaluator_resume().
+ * @return SPF_EVAL_PROGRESS_DONE if the evaluation has completed,
+ *         SPF_EVAL_PROGRESS_NEED_DNS if some DNS lookups are left unanswered
+ *         or the evaluation is waiting for new DNS lookups.
+ */
+SpfEvalProgress
+SpfEvaluator_resume(SpfEvaluator *self, SpfScore *score)
+{
+    assert(NULL != self);
+    assert(NULL != score);
+    return SpfEvaluator_run(self, score);
+}   // end function: SpfEvaluator_resume
+
+/**
+ * @return the number of DNS lookups the suspended evaluation is waiting for.
+ */
+size_t
+SpfEvaluator_getQueryCount(const SpfEvaluator *self)
+{
+    assert(NULL != self);
+    return self->query_num;
+}   // end function: SpfEvaluator_getQueryCount
+
+/**
+ * @param index index of the DNS lookup, less than SpfEvaluator_getQueryCount().
+ * @param rrtype receives the RR type to look up, 99 for SPF RR.
+ * @return the domain name to look up,
+ *         NULL for PTR RR which is the reverse lookup of the IP address
+ *         set by SpfEvaluator_setIpAddr() or SpfEvaluator_setIpAddrString().
+ *         The returned string is valid until SpfEvaluator_resume() is called.
+ */
+const char *
+SpfEvaluator_getQuery(const SpfEvaluator *self, size_t index, int *rrtype)
+{
+    assert(NULL != self);
+    assert(index < self->query_num);
+    if (NULL != rrtype) {
+        *rrtype = self->query[index].rrtype;
+    }   // end if
+    return self->query[index].qname;
+}   // end function: SpfEvaluator_getQuery
+
+/**
+ * Answers a DNS lookup the suspended evaluation is waiting for.
+ * @param index index of the DNS lookup, less than SpfEvaluator_getQueryCount().
+ * @param status the result of the lookup.
+ * @param resp the response of the type corresponding to the RR type
+ *             (DnsAResponse for A RR, DnsTxtResponse for TXT RR and SPF RR, etc.)
+ *             if status is DNS_STAT_NOERROR, NULL otherwise.
+ *             The SpfEvaluator object takes the ownership.
+ * @param error_symbol the string logged on the error, which must be valid until the evaluation completes.
+ */
+void
+SpfEvaluator_setAnswer(SpfEvaluator *self, size_t index, dns_stat_t status, void *resp,
+                       const char *error_symbol)
+{
+    assert(NULL != self);
+    assert(index < self->query_num);
+
+    SpfDnsQuery *query = &(self->query[index]);
+    SpfEvaluator_freeResponse(query->rrtype, query->resp);
+    query->status = status;
+    query->resp = resp;
+    query->error_symbol = error_symbol;
+    query->answered = true;
+}   // end function: SpfEvaluator_setAnswer
+
+/**
+ * Answers a DNS lookup the suspended evaluation is waiting for
+ * by looking up synchronously with the specified DnsResolver object.
+ * @param index index of the DNS lookup, less than SpfEvaluator_getQueryCount().
+ * @return the result of the lookup.
+ */
+dns_stat_t
+SpfEvaluator_lookupQuery(SpfEvaluator *self, size_t index, DnsResolver *resolver)
+{
+    assert(NULL != self);
+    assert(NULL != resolver);
+    assert(index < self->query_num);
+
+    SpfDnsQuery *query = &(self->query[index]);
+    SpfEvaluator_freeResponse(query->rrtype, query->resp);
+    query->resp = NULL;
+    SpfEvaluator_performQuery(self, resolver, query);
+    return query->status;
+}   // end function: SpfEvaluator_lookupQuery
+
+/*
+ * discard the speculative lookups left unanswered, which the resolver has dropped.
+ */
+static void
+SpfEvaluator_discardSpeculativeQueries(SpfEvaluator *self)
+{
+    size_t query_num = 0;
+    for (size_t i = 0; i < self->query_num; ++i) {
+        SpfDnsQuery *query = &(self->query[i]);
+        if (query->speculative && !query->answered) {
+            SpfEvaluator_releaseQuery(query);
+            continue;
+        }   // end if
+        self->query[query_num++] = *query;
+    }   // end for
+    self->query_num = query_num;
+}   // end function: SpfEvaluator_discardSpeculativeQueries
+
+/**
+ * Answers all the DNS lookups the suspended evaluation is waiting for
+ * by looking up synchronously with the specified DnsResolver object.
+ * The lookups other than PTR RR are performed concurrently if the resolver supports it.
+ * Speculative lookups the resolver drops are discarded.
+ */
+void
+SpfEvaluator_lookupQueries(SpfEvaluator *self, DnsResolver *resolver)
+{
+    assert(NULL != self);
+    assert(NULL != resolver);
+
+    if (0 == self->query_num) {
+        return;
+    }   // end if
+    DnsBatchQuery batch[self->query_num];
+    size_t index[self->query_num];
+    size_t batch_num = 0;
+    for (size_t i = 0; i < self->query_num; ++i) {
+        if (!self->query[i].answered && ns_t_ptr != self->query[i].rrtype) {
+            batch[batch_num].rrtype = (uint16_t) self->query[i].rrtype;
+            batch[batch_num].qname = self->query[i].qname;
+            batch[batch_num].speculative = self->query[i].speculative;
+            index[batch_num++] = i;
+        }   // end if
+    }   // end for
+    DnsResolver_lookupBatch(resolver, batch, batch_num);
+    for (size_t n = 0; n < batch_num; ++n) {
+        if (batch[n].dropped) {
+            continue;
+        }   // end if
+        SpfDnsQuery *query = &(self->query[index[n]]);
+        SpfEvaluator_freeResponse(query->rrtype, query->resp);
+        query->status = batch[n].status;
+        query->resp = batch[n].resp;
+        query->error_symbol = batch[n].error_symbol;
+        query->answered = true;
+    }   // end for
+    SpfEvaluator_discardSpeculativeQueries(self);
+    for (size_t i = 0; i < self->query_num; ++i) {
+        if (!self->query[i].answered) {
+            (void) SpfEvaluator_lookupQuery(self, i, resolver);
+        }   // end if
+    }   // end for
+}   // end function: SpfEvaluator_lookupQueries
+
+/*
+ * state of SpfEvaluator_flatten() shared by the whole include/redirect tree
+ */
+typedef struct SpfFlatState {
+    SpfIpTrie *trie;            // the trie the current record is flattened into
+    unsigned int seq;           // the number of the directives flattened so far, orders the tags
+    uint32_t ttl;               // the smallest TTL among the answers the tree depends on
+    unsigned int dns_mech_count;
+    unsigned int void_lookup_count;
+} SpfFlatState;
+
+// the arguments of SpfEvaluator_insertFlatRegion()
+typedef struct SpfFlatRegionArg {
+    SpfIpTrie *trie;
+    unsigned int seq;
+    SpfScore score;             // SPF_SCORE_NULL to take over the scores of the regions
+} SpfFlatRegionArg;
+
+static bool SpfEvaluator_flattenCheckHost(SpfEvaluator *self, SpfFlatState *state,
+                                          const char *domain, bool toplevel);
+
+static uint32_t
+SpfEvaluator_getResponseTtl(int rrtype, const void *resp)
+{
+    switch (rrtype) {
+    case ns_t_a:
+        return ((const DnsAResponse *) resp)->ttl;
+    case ns_t_aaaa:
+        return ((const DnsAaaaResponse *) resp)->ttl;
+    case ns_t_mx:
+        return ((const DnsMxResponse *) resp)->ttl;
+    case ns_t_txt:
+    case 99 /* as ns_t_spf */:
+        return ((const DnsTxtResponse *) resp)->ttl;
+    default:
+        abort();
+    }   // end switch
+}   // end function: SpfEvaluator_getResponseTtl
+
+/*
+ * Looks up the records synchronously and bounds the TTL of the flattened tree by the answer.
+ */
+static dns_stat_t
+SpfEvaluator_flattenLookup(SpfEvaluator *self, SpfFlatState *state, int rrtype,
+                           const char *qname, SpfDnsQuery *query)
+{
+    memset(query, 0, sizeof(SpfDnsQuery));
+    query->rrtype = rrtype;
+    query->qname = qname;
+    SpfEvaluator_performQuery(self, self->resolver, query);
+    if (DNS_STAT_NOERROR == query->status) {
+        uint32_t ttl = SpfEvaluator_getResponseTtl(rrtype, query->resp);
+        if (ttl < state->ttl) {
+            state->ttl = ttl;
+        }   // end if
     }   // end if
+    return query->status;
+}   // end function: SpfEvaluator_flattenLookup
 
-    return SPF_SCORE_NULL;
-}   // end function: SpfEvaluator_checkDomain
+/*
+ * @return true if the lookup result makes the mechanism simply unmatched,
+ *         false if it throws an exception or may do so depending on the order of evaluation.
+ */
+static bool
+SpfEvaluator_flattenVoidLookup(const SpfEvaluator *self, SpfFlatState *state,
+                               dns_stat_t status, bool count_void_lookup)
+{
+    switch (status) {
+    case DNS_STAT_NODATA:
+    case DNS_STAT_NXDOMAIN:
+        if (count_void_lookup) {
+            // every client may encounter all the void lookups in the tree
+            ++state->void_lookup_count;
+            return self->policy->void_lookup_limit < 0
+                || state->void_lookup_count <= (unsigned int) self->policy->void_lookup_limit;
+        }   // end if
+        return true;
+    case DNS_STAT_NOVALIDANSWER:
+        return true;
+    default:
+        return false;
+    }   // end switch
+}   // end function: SpfEvaluator_flattenVoidLookup
 
-static SpfScore
-SpfEvaluator_evalDirectives(SpfEvaluator *self, const PtrArray *directives)
+/*
+ * @return true if any SPF/SIDF record in the response may contain macros.
+ */
+static bool
+SpfEvaluator_hasMacro(const DnsTxtResponse *txtresp)
 {
-    const char *domain = SpfEvaluator_getDomain(self);
-    unsigned int directive_num = PtrArray_getCount(directives);
-    for (unsigned int i = 0; i < directive_num; ++i) {
-        SpfTerm *term = PtrArray_get(directives, i);
-        SpfScore eval_score = SpfEvaluator_evalMechanism(self, term);
-        if (SPF_SCORE_NULL != eval_score) {
-            LogDebug("mechanism match: domain=%s, mech%02u=%s, score=%s",
-                     domain, i, term->attr->name, SpfEnum_lookupScoreByValue(eval_score));
-            return eval_score;
+    for (size_t n = 0; n < txtresp->num; ++n) {
+        SpfRecordScope scope;
+        const char *scope_tail;
+        if (SPF_STAT_OK == SpfRecord_getSpfScope(txtresp->data[n], STRTAIL(txtresp->data[n]),
+                                                 &scope, &scope_tail)
+            && NULL != strchr(scope_tail, '%')) {
+            return true;
         }   // end if
-        LogDebug("mechanism not match: domain=%s, mech_no=%u, mech=%s",
-                 domain, i, term->attr->name);
-    }   // end if
-    return SPF_SCORE_NULL;
-}   // end function: SpfEvaluator_evalDirectives
+    }   // end for
+    return false;
+}   // end function: SpfEvaluator_hasMacro
 
-static SpfScore
-SpfEvaluator_evalLocalPolicy(SpfEvaluator *self)
+static bool
+SpfEvaluator_insertFlatAddr(SpfFlatState *state, const SpfDnsQuery *answer, const SpfTerm *term)
 {
-    // 再帰評価 (include や redirect) の内側にいない場合のみ, ローカルポリシーの評価をおこなう
-    if (0 < SpfEvaluator_getDepth(self) || NULL == self->policy->local_policy
-        || self->local_policy_mode) {
-        return SPF_SCORE_NULL;
+    unsigned int tag = SPF_FLAT_TAG(state->seq, SpfEvaluator_getScoreByQualifier(term->qualifier));
+    if (ns_t_aaaa == answer->rrtype) {
+        const DnsAaaaResponse *resp6 = (const DnsAaaaResponse *) answer->resp;
+        for (size_t n = 0; n < resp6->num; ++n) {
+            if (!SpfIpTrie_insert(state->trie, AF_INET6, &(resp6->addr[n]), term->ip6cidr, tag)) {
+                return false;
+            }   // end if
+        }   // end for
+    } else {
+        const DnsAResponse *resp4 = (const DnsAResponse *) answer->resp;
+        for (size_t n = 0; n < resp4->num; ++n) {
+            if (!SpfIpTrie_insert(state->trie, AF_INET, &(resp4->addr[n]), term->ip4cidr, tag)) {
+                return false;
+            }   // end if
+        }   // end for
     }   // end if
+    return true;
+}   // end function: SpfEvaluator_insertFlatAddr
 
-    LogDebug("evaluating local policy: policy=%s", self->policy->local_policy);
-    // SPF/SIDF 評価過程で遭遇した DNS をひくメカニズムのカウンタをクリア
-    SpfRecord *local_policy_record = NULL;
-    SpfStat build_stat = SpfRecord_build(self, self->scope, self->policy->local_policy,
-                                         STRTAIL(self->policy->local_policy),
-                                         &local_policy_record);
-    if (SPF_STAT_OK != build_stat) {
-        SpfLogConfigError("failed to build local policy record: policy=%s",
-                          self->policy->local_policy);
-        return SPF_SCORE_NULL;
+/*
+ * Flattens an "a" mechanism, or an exchange of a "mx" mechanism.
+ */
+static bool
+SpfEvaluator_flattenAddr(SpfEvaluator *self, SpfFlatState *state, const char *qname,
+                         const SpfTerm *term, bool count_void_lookup)
+{
+    SpfDnsQuery query;
+    int rrtype = AF_INET6 == self->sa_family ? ns_t_aaaa : ns_t_a;
+    dns_stat_t status = SpfEvaluator_flattenLookup(self, state, rrtype, qname, &query);
+    bool flattened = DNS_STAT_NOERROR == status
+        ? SpfEvaluator_insertFlatAddr(state, &query, term)
+        : SpfEvaluator_flattenVoidLookup(self, state, status, count_void_lookup);
+    SpfEvaluator_releaseQuery(&query);
+    return flattened;
+}   // end function: SpfEvaluator_flattenAddr
+
+static bool
+SpfEvaluator_flattenMx(SpfEvaluator *self, SpfFlatState *state, const SpfTerm *term)
+{
+    SpfDnsQuery query;
+    dns_stat_t status = SpfEvaluator_flattenLookup(self, state, ns_t_mx,
+                                                   SpfEvaluator_getTargetName(self, term), &query);
+    if (DNS_STAT_NOERROR != status) {
+        SpfEvaluator_releaseQuery(&query);
+        return SpfEvaluator_flattenVoidLookup(self, state, status, true);
     }   // end if
-    self->dns_mech_count = 0;   // 本物のレコード評価中に遭遇した DNS ルックアップを伴うメカニズムの数は忘れる
-    self->local_policy_mode = true; // ローカルポリシー評価中に, さらにローカルポリシーを適用して無限ループに入らないようにフラグを立てる.
-    SpfScore local_policy_score =
-        SpfEvaluator_evalDirectives(self, local_policy_record->directives);
-    self->local_policy_mode = false;
-    SpfRecord_free(local_policy_record);
+    const DnsMxResponse *respmx = (const DnsMxResponse *) query.resp;
+    size_t resp_num_limit = MIN(respmx->num, self->policy->max_mxrr_per_mxmech);
+    bool flattened = true;
+    for (size_t n = 0; flattened && n < resp_num_limit; ++n) {
+        flattened = SpfEvaluator_flattenAddr(self, state, respmx->exchange[n]->domain, term, false);
+    }   // end for
+    SpfEvaluator_releaseQuery(&query);
+    return flattened;
+}   // end function: SpfEvaluator_flattenMx
 
-    switch (local_policy_score) {
-    case SPF_SCORE_PERMERROR:
-    case SPF_SCORE_TEMPERROR:
-        // ローカルポリシー評価中の temperror, permerror は無視する
-        LogDebug("ignoring local policy score: score=%s",
-                 SpfEnum_lookupScoreByValue(local_policy_score));
-        return SPF_SCORE_NULL;
-    default:
-        LogDebug("applying local policy score: score=%s",
-                 SpfEnum_lookupScoreByValue(local_policy_score));
-        return local_policy_score;
-    }   // end switch
-}   // end function: SpfEvaluator_evalLocalPolicy
+static bool
+SpfEvaluator_insertFlatRegion(sa_family_t sa_family, const void *addr, unsigned int prefixlen,
+                              unsigned int tag, void *arg)
+{
+    const SpfFlatRegionArg *region = (const SpfFlatRegionArg *) arg;
+    SpfScore score = SPF_FLAT_TAG_SCORE(tag);
+    if (SPF_SCORE_NULL != region->score) {
+        // "include:" matches only where the included record passes
+        if (SPF_SCORE_PASS != score) {
+            return true;
+        }   // end if
+        score = region->score;
+    }   // end if
+    return SpfIpTrie_insert(region->trie, sa_family, addr, prefixlen,
+                            SPF_FLAT_TAG(region->seq, score));
+}   // end function: SpfEvaluator_insertFlatRegion
 
-/**
- * The check_host() Function as defined in Section 4 of RFC4408
- * @param self SpfEvaluator object.
- * @param domain <domain> parameter of the check_host() function
+/*
+ * Flattens the record of the target of "include:" or "redirect=" on its own trie,
+ * then copies its regions into the trie of the current record.
+ * @param score the score of the "include:" mechanism, SPF_SCORE_NULL for "redirect=".
  */
-static SpfScore
-SpfEvaluator_checkHost(SpfEvaluator *self, const char *domain, bool count_void_lookup)
+static bool
+SpfEvaluator_flattenChild(SpfEvaluator *self, SpfFlatState *state, const char *domain,
+                          SpfScore score)
 {
-    // check <domain> parameter
-    SpfScore precond_score = SpfEvaluator_checkDomain(self, domain);
-    if (SPF_SCORE_NULL != precond_score) {
-        return precond_score;
+    SpfIpTrie *parent = state->trie;
+    state->trie = SpfIpTrie_new();
+    if (NULL == state->trie) {
+        state->trie = parent;
+        LogNoResource();
+        return false;
     }   // end if
-
-    // register <domain> parameter
-    SpfStat push_stat = SpfEvaluator_pushDomain(self, domain);
-    if (SPF_STAT_OK != push_stat) {
-        return SPF_SCORE_SYSERROR;
+    bool flattened = SpfEvaluator_flattenCheckHost(self, state, domain, false);
+    SpfIpTrie *child = state->trie;
+    state->trie = parent;
+    if (flattened) {
+        SpfFlatRegionArg region = { parent, state->seq, score };
+        flattened = SpfIpTrie_walk(child, self->sa_family, SpfEvaluator_insertFlatRegion, &region);
     }   // end if
+    SpfIpTrie_free(child);
+    return flattened;
+}   // end function: SpfEvaluator_flattenChild
 
-    SpfRecord *record = NULL;
-    SpfScore lookup_score =
-        SpfEvaluator_lookupRecord(self, SpfEvaluator_getDomain(self), count_void_lookup, &record);
-    if (SPF_SCORE_NULL != lookup_score) {
-        SpfEvaluator_popDomain(self);
-        return lookup_score;
+static bool
+SpfEvaluator_insertFlatDefault(SpfEvaluator *self, SpfFlatState *state, SpfScore score)
+{
+    static const struct in6_addr any;
+    return SpfIpTrie_insert(state->trie, self->sa_family, &any, 0,
+                            SPF_FLAT_TAG(state->seq++, score));
+}   // end function: SpfEvaluator_insertFlatDefault
+
+static bool
+SpfEvaluator_flattenRecord(SpfEvaluator *self, SpfFlatState *state, const SpfRecord *record,
+                           bool toplevel)
+{
+    if (self->policy->lookup_exp && NULL != record->modifiers.exp) {
+        return false;   // "Fail" needs the explanation
     }   // end if
+    size_t directive_num = PtrArray_getCount(record->directives);
+    for (size_t n = 0; n < directive_num; ++n) {
+        const SpfTerm *term = PtrArray_get(record->directives, n);
+        if (term->attr->involve_dnslookup
+            && self->policy->max_dns_mech < ++(state->dns_mech_count)) {
+            return false;
+        }   // end if
+        bool flattened;
+        switch (term->attr->type) {
+        case SPF_TERM_MECH_ALL:
+            if (SPF_SCORE_NULL != SpfEvaluator_checkPlusAllDirective(self, term)) {
+                return false;
+            }   // end if
+            // the directives after "all" and "redirect=" are never evaluated
+            return SpfEvaluator_insertFlatDefault(self, state, SpfEvaluator_evalMechAll(self, term));
+        case SPF_TERM_MECH_INCLUDE:
+            flattened = SpfEvaluator_flattenChild(self, state, term->querydomain,
+                                                  SpfEvaluator_getScoreByQualifier(term->qualifier));
+            break;
+        case SPF_TERM_MECH_A:
+            flattened = SpfEvaluator_flattenAddr(self, state, SpfEvaluator_getTargetName(self, term),
+                                                 term, true);
+            break;
+        case SPF_TERM_MECH_MX:
+            flattened = SpfEvaluator_flattenMx(self, state, term);
+            break;
+        case SPF_TERM_MECH_IP4:
+            flattened = AF_INET != self->sa_family
+                || SpfIpTrie_insert(state->trie, AF_INET, &(term->param.addr4), term->ip4cidr,
+                                    SPF_FLAT_TAG(state->seq,
+                                                 SpfEvaluator_getScoreByQualifier(term->qualifier)));
+            break;
+        case SPF_TERM_MECH_IP6:
+            flattened = AF_INET6 != self->sa_family
+                || SpfIpTrie_insert(state->trie, AF_INET6, &(term->param.addr6), term->ip6cidr,
+                                    SPF_FLAT_TAG(state->seq,
+                                                 SpfEvaluator_getScoreByQualifier(term->qualifier)));
+            break;
+        default:
+            // "ptr" and "exists:" depend on more than the client address
+            return false;
+        }   // end switch
+        if (!flattened) {
+            return false;
+        }   // end if
+        ++(state->seq);
+    }   // end for
 
-    // mechanism evaluation
-    SpfScore eval_score = SpfEvaluator_evalDirectives(self, record->directives);
-    if (SPF_SCORE_NULL != eval_score) {
-        /*
-         * SpfEvalPolicy で "exp=" を取得するようの指定されている場合に "exp=" を取得する.
-         * ただし, 以下の点に注意する:
-         * - include メカニズム中の exp= は評価しない.
-         * - redirect 評価中に元のドメインの exp= は評価しない.
-         * [RFC4408] 6.2.
-         * Note: During recursion into an "include" mechanism, an exp= modifier
-         * from the <target-name> MUST NOT be used.  In contrast, when executing
-         * a "redirect" modifier, an exp= modifier from the original domain MUST
-         * NOT be used.
-         *
-         * <target-name> は メカニズムの引数で指定されている <domain-spec>,
-         * 指定されていない場合は check_host() 関数の <domain>.
-         * [RFC4408] 4.8.
-         * Several of these mechanisms and modifiers have a <domain-spec>
-         * section.  The <domain-spec> string is macro expanded (see Section 8).
-         * The resulting string is the common presentation form of a fully-
-         * qualified DNS name: a series of labels separated by periods.  This
-         * domain is called the <target-name> in the rest of this document.
-         */
-        if (self->policy->lookup_exp && SPF_SCORE_FAIL == eval_score
-            && 0 == self->include_depth && NULL != record->modifiers.exp) {
-            (void) SpfEvaluator_evalModExplanation(self, record->modifiers.exp);
+    const SpfTerm *redirect = record->modifiers.rediect;
+    if (NULL != redirect) {
+        if (self->policy->max_dns_mech < ++(state->dns_mech_count)
+            || !SpfEvaluator_flattenChild(self, state, redirect->querydomain, SPF_SCORE_NULL)) {
+            return false;
         }   // end if
-        goto finally;
+        ++(state->seq);
+        return true;
     }   // end if
+    // the local policy applies where the top-level record matches nothing,
+    // such regions are left uncovered to be evaluated as usual
+    if (!toplevel || NULL == self->policy->local_policy) {
+        return SpfEvaluator_insertFlatDefault(self, state, SPF_SCORE_NEUTRAL);
+    }   // end if
+    return true;
+}   // end function: SpfEvaluator_flattenRecord
 
-    /*
-     * レコード中の全てのメカニズムにマッチしなかった場合
-     * [RFC4408] 4.7.
-     * If none of the mechanisms match and there is no "redirect" modifier,
-     * then the check_host() returns a result of "Neutral", just as if
-     * "?all" were specified as the last directive.  If there is a
-     * "redirect" modifier, check_host() proceeds as defined in Section 6.1.
-     */
-
-    // "redirect=" modifier evaluation
-    if (NULL != record->modifiers.rediect) {
-        LogDebug("redirect: from=%s, to=%s", domain, record->modifiers.rediect->param.domain);
-        eval_score = SpfEvaluator_evalModRedirect(self, record->modifiers.rediect);
-        goto finally;
+static bool
+SpfEvaluator_flattenCheckHost(SpfEvaluator *self, SpfFlatState *state, const char *domain,
+                              bool toplevel)
+{
+    if (SPF_SCORE_NULL != SpfEvaluator_checkDomain(self, domain)
+        || SPF_STAT_OK != SpfEvaluator_pushDomain(self, domain)) {
+        return false;
     }   // end if
 
-    eval_score = SpfEvaluator_evalLocalPolicy(self);
-    if (SPF_SCORE_NULL != eval_score) {
-        // exp= を評価する条件は directive によってスコアが決定する場合とほぼ同じ.
-        // 違いは local_policy_explanation を使用する点.
-        if (self->policy->lookup_exp && SPF_SCORE_FAIL == eval_score
-            && 0 == self->include_depth && NULL != self->policy->local_policy_explanation) {
-            // local policy 専用の explanation をセットする.
-            (void) SpfEvaluator_setExplanation(self, domain,
-                                               self->policy->local_policy_explanation);
+    bool flattened = false;
+    SpfRecord *record = NULL;
+    SpfDnsQuery query;
+    dns_stat_t status = DNS_STAT_NODATA;
+    if (self->policy->lookup_spf_rr) {
+        status = SpfEvaluator_flattenLookup(self, state, 99 /* as ns_t_spf */, domain, &query);
+        if (DNS_STAT_NODATA == status || DNS_STAT_NOVALIDANSWER == status) {
+            SpfEvaluator_releaseQuery(&query);
+            status = SpfEvaluator_flattenLookup(self, state, ns_t_txt, domain, &query);
         }   // end if
+    } else {
+        status = SpfEvaluator_flattenLookup(self, state, ns_t_txt, domain, &query);
+    }   // end if
+    // domains without records make the result "None" or "PermError"
+    if (DNS_STAT_NOERROR != status || SpfEvaluator_hasMacro(query.resp)
+        || SPF_SCORE_NULL != SpfEvaluator_selectRecord(self, domain, query.resp, &record)) {
         goto finally;
     }   // end if
-
-    // returns "Neutral" as default socre
-    eval_score = SPF_SCORE_NEUTRAL;
-    LogDebug("default score applied: domain=%s", domain);
+    flattened = SpfEvaluator_flattenRecord(self, state, record, toplevel);
 
   finally:
-    SpfEvaluator_popDomain(self);
     SpfRecord_free(record);
-    return eval_score;
-}   // end function: SpfEvaluator_checkHost
+    SpfEvaluator_releaseQuery(&query);
+    SpfEvaluator_popDomain(self);
+    return flattened;
+}   // end function: SpfEvaluator_flattenCheckHost
+
+/**
+ * Flattens the record of the domain into prefixes of the client addresses,
+ * so that the result of check_host() for the domain is obtained by SpfIpTrie_lookup()
+ * without any DNS lookups. The prefixes are tagged with SPF_FLAT_TAG(),
+ * SPF_FLAT_TAG_SCORE() of the tag found is the result.
+ * Only the records whose result depends on nothing but the client address are flattened,
+ * that is, the whole include/redirect tree is free from macros, "ptr" and "exists:",
+ * and is evaluated without any errors or custom actions whatever the client address is.
+ * The addresses the tree matches nothing are left uncovered if the local policy is set.
+ * DNS lookups are performed synchronously with the DnsResolver object
+ * the SpfEvaluator object was created with.
+ * @param trie an empty SpfIpTrie object to store the prefixes of sa_family.
+ * @param ttl receives the smallest TTL among the DNS answers the result depends on,
+ *            not updated if it is already smaller.
+ * @return true if the record is flattened, false if the tree has to be evaluated as usual.
+ */
+bool
+SpfEvaluator_flatten(SpfEvaluator *self, SpfRecordScope scope, const char *domain,
+                     sa_family_t sa_family, SpfIpTrie *trie, uint32_t *ttl)
+{
+    assert(NULL != self);
+    assert(NULL != trie);
+    assert(NULL != ttl);
+
+    SpfEvaluator_reset(self);
+    if (SPF_CUSTOM_ACTION_NULL != self->policy->action_on_malicious_ip4_cidr_length
+        || SPF_CUSTOM_ACTION_NULL != self->policy->action_on_malicious_ip6_cidr_length) {
+        return false;
+    }   // end if
+    self->scope = scope;
+    self->sa_family = sa_family;
+    SpfFlatState state;
+    memset(&state, 0, sizeof(SpfFlatState));
+    state.trie = trie;
+    state.ttl = *ttl;
+    bool flattened = SpfEvaluator_flattenCheckHost(self, &state, domain, true);
+    if (flattened) {
+        *ttl = state.ttl;
+    }   // end if
+    SpfEvaluator_reset(self);
+    return flattened;
+}   // end function: SpfEvaluator_flatten
 
 /**
  * HELO は指定必須. sender が指定されていない場合, postmaster@(HELOとして指定したドメイン) を sender として使用する.
+ * DNS lookups are performed synchronously with the DnsResolver object
+ * the SpfEvaluator object was created with.
  * @return SPF_SCORE_NULL: 引数がセットされていない.
  *         SPF_SCORE_SYSERROR: メモリの確保に失敗した.
  *         それ以外の場合は評価結果.
@@ -1238,36 +2622,236 @@ SpfEvaluator_eval(SpfEvaluator *self, SpfRecordScope scope)
 {
     assert(NULL != self);
 
-    if (SPF_SCORE_NULL != self->score) {
-        return self->score;
+    SpfScore score;
+    SpfEvalProgress progress = SpfEvaluator_start(self, scope, &score);
+    while (SPF_EVAL_PROGRESS_NEED_DNS == progress) {
+        SpfEvaluator_lookupQueries(self, self->resolver);
+        progress = SpfEvaluator_resume(self, &score);
+    }   // end while
+    return score;
+}   // end function: SpfEvaluator_eval
+
+/*
+ * DNS lookups shared by the evaluations of SpfEvaluator_evalPair().
+ * the responses are kept until both evaluations complete,
+ * and each evaluation is answered with a copy of them.
+ */
+typedef struct SpfSharedLookup {
+    DnsResolver *resolver;
+    bool share_ptr;             // true if both evaluations have the same <ip>
+    SpfDnsQuery *answer;        // answered lookups, qname is owned (NULL for PTR RR)
+    size_t answer_num;
+    size_t answer_capacity;
+} SpfSharedLookup;
+
+/*
+ * @return the index of the answered lookup, shared->answer_num if not found.
+ */
+static size_t
+SpfEvaluator_findSharedAnswer(const SpfSharedLookup *shared, int rrtype, const char *qname)
+{
+    if (NULL != qname) {
+        return SpfEvaluator_findQuery(shared->answer, shared->answer_num, rrtype, qname);
     }   // end if
+    if (shared->share_ptr) {
+        for (size_t i = 0; i < shared->answer_num; ++i) {
+            if (rrtype == shared->answer[i].rrtype && NULL == shared->answer[i].qname) {
+                return i;
+            }   // end if
+        }   // end for
+    }   // end if
+    return shared->answer_num;
+}   // end function: SpfEvaluator_findSharedAnswer
 
-    self->scope = scope;
-    self->dns_mech_count = 0;
-    self->void_lookup_count = 0;
-    if (0 == self->sa_family || NULL == self->helo_domain) {
-        return SPF_SCORE_NULL;
+/*
+ * Keeps the answer of a lookup to share it. The ownership of resp is taken even on failure.
+ */
+static void
+SpfEvaluator_addSharedAnswer(SpfSharedLookup *shared, int rrtype, const char *qname,
+                             dns_stat_t status, void *resp, const char *error_symbol)
+{
+    if (NULL == qname && !shared->share_ptr) {
+        SpfEvaluator_freeResponse(rrtype, resp);
+        return;
     }   // end if
-    if (NULL == self->sender) {
-        /*
-         * [RFC4408] 4.3.
-         * If the <sender> has no localpart, substitute the string "postmaster"
-         * for the localpart.
-         */
-        self->sender = InetMailbox_build(SPF_EVAL_DEFAULT_LOCALPART, self->helo_domain);
-        if (NULL == self->sender) {
-            LogNoResource();
-            return SPF_SCORE_SYSERROR;
+    char *owned_qname = NULL;
+    if (NULL != qname && NULL == (owned_qname = strdup(qname))) {
+        LogNoResource();
+        SpfEvaluator_freeResponse(rrtype, resp);
+        return;
+    }   // end if
+    SpfDnsQuery *answer = SpfEvaluator_appendQuery(&(shared->answer), &(shared->answer_num),
+                                                   &(shared->answer_capacity));
+    if (NULL == answer) {
+        free(owned_qname);
+        SpfEvaluator_freeResponse(rrtype, resp);
+        return;
+    }   // end if
+    answer->rrtype = rrtype;
+    answer->qname = owned_qname;
+    answer->speculative = true; // to release qname with SpfEvaluator_releaseQuery()
+    answer->answered = true;
+    answer->status = status;
+    answer->resp = resp;
+    answer->error_symbol = error_symbol;
+}   // end function: SpfEvaluator_addSharedAnswer
+
+/*
+ * Answers the lookups the evaluation is waiting for with the shared answers.
+ * @param lookup true to look up the rest synchronously and share their answers.
+ */
+static void
+SpfEvaluator_answerShared(SpfEvaluator *self, SpfSharedLookup *shared, bool lookup)
+{
+    for (size_t i = 0; i < self->query_num; ++i) {
+        SpfDnsQuery *query = &(self->query[i]);
+        if (query->answered) {
+            continue;
         }   // end if
-        self->is_sender_context = false;
-    } else {
-        self->is_sender_context = true;
+        size_t index = SpfEvaluator_findSharedAnswer(shared, query->rrtype, query->qname);
+        if (index < shared->answer_num) {
+            const SpfDnsQuery *answer = &(shared->answer[index]);
+            dns_stat_t status = answer->status;
+            const char *error_symbol = answer->error_symbol;
+            void *resp = NULL;
+            if (NULL != answer->resp
+                && NULL == (resp = SpfEvaluator_duplicateResponse(answer->rrtype, answer->resp))) {
+                LogNoResource();
+                status = DNS_STAT_NOMEMORY;
+                error_symbol = DnsResolver_symbolizeErrorCode(DNS_STAT_NOMEMORY);
+            }   // end if
+            SpfEvaluator_setAnswer(self, i, status, resp, error_symbol);
+        } else if (lookup) {
+            (void) SpfEvaluator_lookupQuery(self, i, shared->resolver);
+            void *resp = NULL;
+            if (NULL != query->resp
+                && NULL == (resp = SpfEvaluator_duplicateResponse(query->rrtype, query->resp))) {
+                LogNoResource();
+                continue;
+            }   // end if
+            SpfEvaluator_addSharedAnswer(shared, query->rrtype, query->qname, query->status, resp,
+                                         query->error_symbol);
+        }   // end if
+    }   // end for
+}   // end function: SpfEvaluator_answerShared
+
+/*
+ * Answers the lookups the evaluations are waiting for,
+ * looking up the same RR type of the same name only once among them.
+ */
+static void
+SpfEvaluator_lookupSharedQueries(SpfSharedLookup *shared, SpfEvaluator **evaluator,
+                                 size_t evaluator_num)
+{
+    size_t query_num = 0;
+    for (size_t e = 0; e < evaluator_num; ++e) {
+        SpfEvaluator_answerShared(evaluator[e], shared, false);
+        query_num += evaluator[e]->query_num;
+    }   // end for
+    if (0 == query_num) {
+        return;
     }   // end if
-    self->redirect_depth = 0;
-    self->include_depth = 0;
-    self->score = SpfEvaluator_checkHost(self, InetMailbox_getDomain(self->sender), false);
-    return self->score;
-}   // end function: SpfEvaluator_eval
+
+    // the lookups other than PTR RR are performed concurrently
+    DnsBatchQuery batch[query_num];
+    size_t batch_num = 0;
+    for (size_t e = 0; e < evaluator_num; ++e) {
+        for (size_t i = 0; i < evaluator[e]->query_num; ++i) {
+            const SpfDnsQuery *query = &(evaluator[e]->query[i]);
+            if (query->answered || ns_t_ptr == query->rrtype) {
+                continue;
+            }   // end if
+            size_t n;
+            for (n = 0; n < batch_num; ++n) {
+                if (query->rrtype == batch[n].rrtype
+                    && 0 == strcasecmp(query->qname, batch[n].qname)) {
+                    // speculative only if no evaluation is waiting for it
+                    batch[n].speculative = batch[n].speculative && query->speculative;
+                    break;
+                }   // end if
+            }   // end for
+            if (n == batch_num) {
+                batch[batch_num].rrtype = (uint16_t) query->rrtype;
+                batch[batch_num].qname = query->qname;
+                batch[batch_num].speculative = query->speculative;
+                ++batch_num;
+            }   // end if
+        }   // end for
+    }   // end for
+    if (0 < batch_num) {
+        DnsResolver_lookupBatch(shared->resolver, batch, batch_num);
+        for (size_t n = 0; n < batch_num; ++n) {
+            if (batch[n].dropped) {
+                continue;
+            }   // end if
+            SpfEvaluator_addSharedAnswer(shared, batch[n].rrtype, batch[n].qname, batch[n].status,
+                                         batch[n].resp, batch[n].error_symbol);
+        }   // end for
+    }   // end if
+    for (size_t e = 0; e < evaluator_num; ++e) {
+        SpfEvaluator_answerShared(evaluator[e], shared, false);
+        SpfEvaluator_discardSpeculativeQueries(evaluator[e]);
+        SpfEvaluator_answerShared(evaluator[e], shared, true);
+    }   // end for
+}   // end function: SpfEvaluator_lookupSharedQueries
+
+/**
+ * Evaluates two SpfEvaluator objects at once, typically SPF and Sender ID of the same message.
+ * Each DNS record is looked up only once even if both evaluations refer to it,
+ * and the lookups both evaluations are waiting for are performed concurrently.
+ * Each evaluation selects the records of its own scope, and counts DNS lookups
+ * and void lookups by itself, so that the scores are the same as SpfEvaluator_eval() returns.
+ * DNS lookups are performed synchronously with the DnsResolver object
+ * the first SpfEvaluator object was created with.
+ * @param score receives the score of self, the same value as SpfEvaluator_eval() returns.
+ * @param peer_score receives the score of peer, the same value as SpfEvaluator_eval() returns.
+ */
+void
+SpfEvaluator_evalPair(SpfEvaluator *self, SpfRecordScope scope, SpfScore *score,
+                      SpfEvaluator *peer, SpfRecordScope peer_scope, SpfScore *peer_score)
+{
+    assert(NULL != self);
+    assert(NULL != score);
+    assert(NULL != peer);
+    assert(NULL != peer_score);
+
+    SpfEvaluator *evaluator[] = {self, peer};
+    SpfScore *result[] = {score, peer_score};
+    SpfEvalProgress progress[] = {
+        SpfEvaluator_start(self, scope, score),
+        SpfEvaluator_start(peer, peer_scope, peer_score),
+    };
+
+    SpfSharedLookup shared;
+    memset(&shared, 0, sizeof(SpfSharedLookup));
+    shared.resolver = self->resolver;
+    shared.share_ptr = bool_cast(self->sa_family == peer->sa_family
+                                 && 0 == memcmp(&(self->ipaddr), &(peer->ipaddr),
+                                                AF_INET == self->sa_family
+                                                ? sizeof(struct in_addr)
+                                                : sizeof(struct in6_addr)));
+    while (SPF_EVAL_PROGRESS_NEED_DNS == progress[0]
+           || SPF_EVAL_PROGRESS_NEED_DNS == progress[1]) {
+        SpfEvaluator *waiting[2];
+        size_t waiting_num = 0;
+        for (size_t e = 0; e < 2; ++e) {
+            if (SPF_EVAL_PROGRESS_NEED_DNS == progress[e]) {
+                waiting[waiting_num++] = evaluator[e];
+            }   // end if
+        }   // end for
+        SpfEvaluator_lookupSharedQueries(&shared, waiting, waiting_num);
+        for (size_t e = 0; e < 2; ++e) {
+            if (SPF_EVAL_PROGRESS_NEED_DNS == progress[e]) {
+                progress[e] = SpfEvaluator_resume(evaluator[e], result[e]);
+            }   // end if
+        }   // end for
+    }   // end while
+
+    for (size_t i = 0; i < shared.answer_num; ++i) {
+        SpfEvaluator_releaseQuery(&(shared.answer[i]));
+    }   // end for
+    free(shared.answer);
+}   // end function: SpfEvaluator_evalPair
 
 /**
  * This function sets an IP address to the SpfEvaluator object via sockaddr structure.
@@ -1369,10 +2953,44 @@ SpfEvaluator_setHeloDomain(SpfEvaluator *self, const char *domain)
     return true;
 }   // end function: SpfEvaluator_setHeloDomain
 
+/**
+ * HELO ドメインを評価済みの結果を SpfEvaluator にセットする.
+ * 以後の SpfEvaluator_eval() などは評価をやり直さずにこの結果を返し,
+ * SpfEvaluator_getEvaluatedDomain() や SpfEvaluator_getExplanation() も評価後と同様に振る舞う.
+ * SpfEvaluator_setIpAddr() と SpfEvaluator_setHeloDomain() の後, <sender> をセットせずに呼ぶこと.
+ * @param explanation the explanation of the result, NULL if none.
+ * @return 成功した場合は true, メモリの確保に失敗した場合は false.
+ */
+bool
+SpfEvaluator_setHeloResult(SpfEvaluator *self, SpfRecordScope scope, SpfScore score,
+                           const char *explanation)
+{
+    assert(NULL != self);
+    assert(NULL != self->helo_domain);
+    assert(NULL == self->sender);
+
+    char *tmp = NULL;
+    if (NULL != explanation && NULL == (tmp = strdup(explanation))) {
+        return false;
+    }   // end if
+    self->sender = InetMailbox_build(SPF_EVAL_DEFAULT_LOCALPART, self->helo_domain);
+    if (NULL == self->sender) {
+        free(tmp);
+        return false;
+    }   // end if
+    self->is_sender_context = false;
+    self->scope = scope;
+    free(self->explanation);
+    self->explanation = tmp;
+    self->score = score;
+    return true;
+}   // end function: SpfEvaluator_setHeloResult
+
 void
 SpfEvaluator_reset(SpfEvaluator *self)
 {
     assert(NULL != self);
+    SpfEvaluator_abandon(self);
     self->scope = SPF_RECORD_SCOPE_NULL;
     self->sa_family = 0;
     memset(&(self->ipaddr), 0, sizeof(union ipaddr46));
@@ -1383,6 +3001,8 @@ SpfEvaluator_reset(SpfEvaluator *self)
     self->void_lookup_count = 0;
     self->redirect_depth = 0;
     self->include_depth = 0;
+    memset(&(self->cost), 0, sizeof(SpfEvalCost));
+    self->cost_started = 0;
     self->is_sender_context = false;
     self->local_policy_mode = false;
     if (NULL != self->xbuf) {
@@ -1414,8 +3034,14 @@ SpfEvaluator_free(SpfEvaluator *self)
         return;
     }   // end if
 
+    SpfEvaluator_abandon(self);
+    free(self->frame);
+    free(self->query);
+    free(self->answer);
+    free(self->prefetch);
     StrArray_free(self->domain);
     XBuffer_free(self->xbuf);
+    SpfMacroProgram_free(self->macro_program);
     InetMailbox_free(self->sender);
     free(self->helo_domain);
     free(self->explanation);
@@ -1442,6 +3068,10 @@ SpfEvaluator_new(const SpfEvalPolicy *policy, DnsResolver *resolver)
     if (NULL == self->xbuf) {
         goto cleanup;
     }   // end if
+    self->macro_program = SpfMacroProgram_new();
+    if (NULL == self->macro_program) {
+        goto cleanup;
+    }   // end if
     self->policy = policy;
     self->resolver = resolver;
     self->is_sender_context = false;
@@ -13,6 +13,7 @@
 #define __SPF_EVALUATOR_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -21,15 +22,73 @@
 
 #include "xbuffer.h"
 #include "strarray.h"
+#include "ptrarray.h"
 #include "inetmailbox.h"
 #include "dnsresolv.h"
 #include "spf.h"
 #include "spfevalpolicy.h"
+#include "spfiptrie.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct SpfRecord SpfRecord;
+typedef struct SpfMacroProgram SpfMacroProgram;
+
+// tags of the prefixes SpfEvaluator_flatten() stores, the earlier directives have the smaller tags
+#define SPF_FLAT_TAG(__seq, __score) (((__seq) << 4) | (__score))
+#define SPF_FLAT_TAG_SCORE(__tag) ((SpfScore) ((__tag) & 0x0f))
+
+typedef enum SpfEvalFrameType {
+    SPF_EVAL_FRAME_TOP,     // check_host() called by SpfEvaluator_eval()
+    SPF_EVAL_FRAME_INCLUDE, // check_host() called by "include:" mechanism
+    SPF_EVAL_FRAME_REDIRECT,    // check_host() called by "redirect=" modifier
+} SpfEvalFrameType;
+
+typedef enum SpfEvalStep {
+    SPF_EVAL_STEP_LOOKUP_SPF,   // waiting for SPF RR of <domain>
+    SPF_EVAL_STEP_LOOKUP_TXT,   // waiting for TXT RR of <domain>
+    SPF_EVAL_STEP_DIRECTIVE,    // ready to evaluate the directive at directive_index
+    SPF_EVAL_STEP_MECH_A,       // waiting for A/AAAA RR of "a" mechanism
+    SPF_EVAL_STEP_MECH_MX,      // waiting for MX RR of "mx" mechanism
+    SPF_EVAL_STEP_MECH_MX_ADDR, // waiting for A/AAAA RR of the exchanges
+    SPF_EVAL_STEP_MECH_PTR,     // waiting for PTR RR of "ptr" mechanism
+    SPF_EVAL_STEP_MECH_PTR_ADDR,    // waiting for A/AAAA RR of the domain names
+    SPF_EVAL_STEP_MECH_EXISTS,  // waiting for A RR of "exists" mechanism
+    SPF_EVAL_STEP_INCLUDE,      // waiting for the result of check_host() called by "include:"
+    SPF_EVAL_STEP_REDIRECT,     // waiting for the result of check_host() called by "redirect="
+    SPF_EVAL_STEP_EXPLANATION,  // waiting for TXT RR of "exp=" modifier
+} SpfEvalStep;
+
+/*
+ * state of a check_host() invocation.
+ * include/redirect nesting is kept on SpfEvaluator::frame instead of the C stack
+ * so that the evaluation can be suspended whenever a DNS lookup is needed.
+ */
+typedef struct SpfEvalFrame {
+    SpfEvalFrameType type;
+    SpfEvalStep step;
+    bool count_void_lookup;
+    SpfRecord *record;
+    SpfRecord *local_policy_record; // non-NULL while evaluating the local policy
+    const PtrArray *directives; // directives of record or local_policy_record
+    unsigned int directive_index;
+    SpfScore score;             // the score decided while looking up "exp="
+    DnsMxResponse *mxresp;
+    DnsPtrResponse *ptrresp;
+} SpfEvalFrame;
+
+typedef struct SpfDnsQuery {
+    int rrtype;
+    const char *qname;          // NULL for PTR RR, the reverse lookup of <ip>
+    bool speculative;           // looked up ahead of the evaluation, qname is owned if true
+    bool answered;
+    dns_stat_t status;
+    void *resp;
+    const char *error_symbol;
+} SpfDnsQuery;
+
 struct SpfEvaluator {
     const SpfEvalPolicy *policy;
     SpfRecordScope scope;       // evaluation scope: SPF1, SPF2_MFROM or SPF2_PRA
@@ -52,13 +111,30 @@ struct SpfEvaluator {
     unsigned int include_depth; // the depth of "include:" mechanism
     bool local_policy_mode;     // true while evaluating local-policy, to prevent infinite loop
     XBuffer *xbuf;
+    SpfMacroProgram *macro_program; // macro-string being compiled and expanded
     DnsResolver *resolver;      // reference to the DnsResolver object
     SpfScore score;             /// final score (as cache)
     char *explanation;          // explanation string provided by "exp=" modifier at "fail" (="hardfail") result
+    SpfEvalFrame *frame;        // stack of check_host() invocations
+    size_t frame_num;
+    size_t frame_capacity;
+    SpfDnsQuery *query;         // DNS lookups the evaluation is waiting for
+    size_t query_num;
+    size_t query_capacity;
+    SpfDnsQuery *answer;        // answered DNS lookups being consumed by the current step
+    size_t answer_num;
+    size_t answer_capacity;
+    SpfDnsQuery *prefetch;      // answered speculative DNS lookups not asked for by the evaluation yet
+    size_t prefetch_num;
+    size_t prefetch_capacity;
+    SpfEvalCost cost;           // the cost of the last evaluation
+    uint64_t cost_started;      // the time the evaluation in progress started, 0 if none
 };
 
 extern const char *SpfEvaluator_getDomain(const SpfEvaluator *self);
 extern int SpfEvaluator_isValidatedDomainName(const SpfEvaluator *self, const char *revdomain);
+extern bool SpfEvaluator_flatten(SpfEvaluator *self, SpfRecordScope scope, const char *domain,
+                                 sa_family_t sa_family, SpfIpTrie *trie, uint32_t *ttl);
 
 #ifdef __cplusplus
 }
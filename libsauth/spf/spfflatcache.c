@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2008-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "loghandler.h"
+#include "dnsresolv.h"
+#include "spf.h"
+#include "spfevaluator.h"
+#include "spfiptrie.h"
+#include "spfflatcache.h"
+
+#define SPF_FLAT_CACHE_BUCKET_NUM 1021
+
+typedef struct SpfFlatEntry {
+    struct SpfFlatEntry *next;
+    struct SpfFlatEntry *next_pending;  // link of the queue of the worker thread
+    SpfRecordScope scope;
+    bool pending;       // queued or being flattened by the worker thread
+    time_t expire;      // the entry is refreshed after this time
+    SpfIpTrie *trie4;   // NULL if the record is not flattened for IPv4 clients
+    SpfIpTrie *trie6;   // NULL if the record is not flattened for IPv6 clients
+    char domain[];
+} SpfFlatEntry;
+
+/*
+ * cache of SPF/SIDF records flattened into prefixes of the client addresses.
+ * the records are flattened in the background by a worker thread with its own SpfEvaluator,
+ * the evaluations meanwhile proceed as usual.
+ * the records which cannot be flattened are remembered as such until max_ttl passes.
+ */
+struct SpfFlatCache {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t worker;
+    bool worker_started;    // the worker thread is started on demand as the process may fork
+    bool worker_failed;
+    bool shutdown;
+    SpfEvaluator *evaluator;    // used only by the worker thread
+    size_t max_entries;
+    time_t max_ttl;
+    size_t entry_num;
+    SpfFlatEntry *pending_head;
+    SpfFlatEntry *pending_tail;
+    SpfFlatEntry *bucket[SPF_FLAT_CACHE_BUCKET_NUM];
+};
+
+static time_t
+SpfFlatCache_now(void)
+{
+    struct timespec ts;
+    if (0 != clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        return time(NULL);
+    }   // end if
+    return ts.tv_sec;
+}   // end function: SpfFlatCache_now
+
+static unsigned int
+SpfFlatCache_hash(SpfRecordScope scope, const char *domain)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261U ^ (uint32_t) scope;
+    for (const char *p = domain; '\0' != *p; ++p) {
+        hash ^= (uint32_t) tolower((unsigned char) *p);
+        hash *= 16777619U;
+    }   // end for
+    return hash % SPF_FLAT_CACHE_BUCKET_NUM;
+}   // end function: SpfFlatCache_hash
+
+static SpfFlatEntry *
+SpfFlatCache_find(SpfFlatCache *self, unsigned int hash, SpfRecordScope scope, const char *domain)
+{
+    for (SpfFlatEntry *entry = self->bucket[hash]; NULL != entry; entry = entry->next) {
+        if (scope == entry->scope && 0 == strcasecmp(entry->domain, domain)) {
+            return entry;
+        }   // end if
+    }   // end for
+    return NULL;
+}   // end function: SpfFlatCache_find
+
+static void
+SpfFlatCache_freeEntry(SpfFlatEntry *entry)
+{
+    SpfIpTrie_free(entry->trie4);
+    SpfIpTrie_free(entry->trie6);
+    free(entry);
+}   // end function: SpfFlatCache_freeEntry
+
+/*
+ * 上限に達している場合は, 期限の切れたエントリを捨てて空きを作る.
+ * @return true if there is room for a new entry, false otherwise.
+ */
+static bool
+SpfFlatCache_purge(SpfFlatCache *self, time_t now)
+{
+    if (self->entry_num < self->max_entries) {
+        return true;
+    }   // end if
+    for (size_t i = 0; i < SPF_FLAT_CACHE_BUCKET_NUM; ++i) {
+        SpfFlatEntry **pp = &self->bucket[i];
+        while (NULL != *pp) {
+            SpfFlatEntry *entry = *pp;
+            if (!entry->pending && entry->expire <= now) {
+                *pp = entry->next;
+                SpfFlatCache_freeEntry(entry);
+                --self->entry_num;
+            } else {
+                pp = &entry->next;
+            }   // end if
+        }   // end while
+    }   // end for
+    return self->entry_num < self->max_entries;
+}   // end function: SpfFlatCache_purge
+
+static SpfFlatEntry *
+SpfFlatCache_insert(SpfFlatCache *self, unsigned int hash, SpfRecordScope scope,
+                    const char *domain, time_t now)
+{
+    if (!SpfFlatCache_purge(self, now)) {
+        return NULL;
+    }   // end if
+    size_t len = strlen(domain);
+    SpfFlatEntry *entry = (SpfFlatEntry *) malloc(sizeof(SpfFlatEntry) + len + 1);
+    if (NULL == entry) {
+        LogNoResource();
+        return NULL;
+    }   // end if
+    memset(entry, 0, sizeof(SpfFlatEntry));
+    for (size_t i = 0; i < len; ++i) {
+        entry->domain[i] = tolower((unsigned char) domain[i]);
+    }   // end for
+    entry->domain[len] = '\0';
+    entry->scope = scope;
+    entry->next = self->bucket[hash];
+    self->bucket[hash] = entry;
+    ++self->entry_num;
+    return entry;
+}   // end function: SpfFlatCache_insert
+
+static void
+SpfFlatCache_flatten(SpfFlatCache *self, SpfRecordScope scope, const char *domain,
+                     sa_family_t sa_family, SpfIpTrie **trie, uint32_t *ttl)
+{
+    *trie = SpfIpTrie_new();
+    if (NULL == *trie) {
+        LogNoResource();
+        return;
+    }   // end if
+    if (!SpfEvaluator_flatten(self->evaluator, scope, domain, sa_family, *trie, ttl)) {
+        SpfIpTrie_free(*trie);
+        *trie = NULL;
+    }   // end if
+}   // end function: SpfFlatCache_flatten
+
+static void *
+SpfFlatCache_work(void *arg)
+{
+    SpfFlatCache *self = (SpfFlatCache *) arg;
+
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return NULL;
+    }   // end if
+    while (!self->shutdown) {
+        SpfFlatEntry *entry = self->pending_head;
+        if (NULL == entry) {
+            (void) pthread_cond_wait(&self->cond, &self->lock);
+            continue;
+        }   // end if
+        self->pending_head = entry->next_pending;
+        if (NULL == self->pending_head) {
+            self->pending_tail = NULL;
+        }   // end if
+        (void) pthread_mutex_unlock(&self->lock);
+
+        // pending entries are never purged, entry->domain stays valid without the lock
+        uint32_t ttl = (uint32_t) self->max_ttl;
+        SpfIpTrie *trie4 = NULL;
+        SpfIpTrie *trie6 = NULL;
+        SpfFlatCache_flatten(self, entry->scope, entry->domain, AF_INET, &trie4, &ttl);
+        SpfFlatCache_flatten(self, entry->scope, entry->domain, AF_INET6, &trie6, &ttl);
+        if (0 == ttl) {
+            // not worth caching
+            SpfIpTrie_free(trie4);
+            SpfIpTrie_free(trie6);
+            trie4 = NULL;
+            trie6 = NULL;
+        }   // end if
+        if (NULL != trie4 || NULL != trie6) {
+            LogDebug("SPF record flattened: domain=%s, ipv4=%s, ipv6=%s, ttl=%u", entry->domain,
+                     NULL != trie4 ? "true" : "false", NULL != trie6 ? "true" : "false", ttl);
+        } else {
+            LogDebug("SPF record not flattened: domain=%s", entry->domain);
+            ttl = (uint32_t) self->max_ttl;
+        }   // end if
+
+        ret = pthread_mutex_lock(&self->lock);
+        if (0 != ret) {
+            LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+            SpfIpTrie_free(trie4);
+            SpfIpTrie_free(trie6);
+            return NULL;
+        }   // end if
+        SpfIpTrie_free(entry->trie4);
+        SpfIpTrie_free(entry->trie6);
+        entry->trie4 = trie4;
+        entry->trie6 = trie6;
+        entry->expire = SpfFlatCache_now() + (time_t) ttl;
+        entry->pending = false;
+    }   // end while
+    (void) pthread_mutex_unlock(&self->lock);
+    return NULL;
+}   // end function: SpfFlatCache_work
+
+/*
+ * Queues the entry to be flattened, with the lock held.
+ */
+static void
+SpfFlatCache_enqueue(SpfFlatCache *self, SpfFlatEntry *entry)
+{
+    if (self->worker_failed) {
+        return;
+    }   // end if
+    if (!self->worker_started) {
+        int ret = pthread_create(&self->worker, NULL, SpfFlatCache_work, self);
+        if (0 != ret) {
+            LogError("pthread_create failed: errno=%s", strerror(ret));
+            self->worker_failed = true;
+            return;
+        }   // end if
+        self->worker_started = true;
+    }   // end if
+    entry->pending = true;
+    entry->next_pending = NULL;
+    if (NULL == self->pending_tail) {
+        self->pending_head = entry;
+    } else {
+        self->pending_tail->next_pending = entry;
+    }   // end if
+    self->pending_tail = entry;
+    (void) pthread_cond_signal(&self->cond);
+}   // end function: SpfFlatCache_enqueue
+
+/**
+ * Looks up the result of check_host() for the domain in the flattened records.
+ * The domains missing from the cache or expired are queued to be flattened in the background.
+ * @param addr a pointer to struct in_addr for AF_INET, struct in6_addr for AF_INET6.
+ * @param score receives the result when true is returned.
+ * @return true if the result is found, false if the domain has to be evaluated as usual.
+ */
+bool
+SpfFlatCache_lookup(SpfFlatCache *self, SpfRecordScope scope, const char *domain,
+                    sa_family_t sa_family, const void *addr, SpfScore *score)
+{
+    assert(NULL != self);
+    assert(NULL != domain);
+
+    unsigned int hash = SpfFlatCache_hash(scope, domain);
+
+    int ret = pthread_mutex_lock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_lock failed: errno=%s", strerror(ret));
+        return false;
+    }   // end if
+
+    bool found = false;
+    time_t now = SpfFlatCache_now();
+    SpfFlatEntry *entry = SpfFlatCache_find(self, hash, scope, domain);
+    if (NULL == entry) {
+        entry = SpfFlatCache_insert(self, hash, scope, domain, now);
+        if (NULL != entry) {
+            SpfFlatCache_enqueue(self, entry);
+        }   // end if
+    } else if (!entry->pending) {
+        if (entry->expire <= now) {
+            SpfFlatCache_enqueue(self, entry);
+        } else {
+            const SpfIpTrie *trie = AF_INET6 == sa_family ? entry->trie6 : entry->trie4;
+            unsigned int tag;
+            if (NULL != trie && SpfIpTrie_lookup(trie, sa_family, addr, &tag)) {
+                *score = SPF_FLAT_TAG_SCORE(tag);
+                found = true;
+            }   // end if
+        }   // end if
+    }   // end if
+
+    ret = pthread_mutex_unlock(&self->lock);
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+
+    return found;
+}   // end function: SpfFlatCache_lookup
+
+/**
+ * release SpfFlatCache object, waiting for the worker thread to finish the record in progress.
+ * @param self SpfFlatCache object to release
+ */
+void
+SpfFlatCache_free(SpfFlatCache *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+
+    if (self->worker_started) {
+        (void) pthread_mutex_lock(&self->lock);
+        self->shutdown = true;
+        (void) pthread_cond_signal(&self->cond);
+        (void) pthread_mutex_unlock(&self->lock);
+        (void) pthread_join(self->worker, NULL);
+    }   // end if
+    for (size_t i = 0; i < SPF_FLAT_CACHE_BUCKET_NUM; ++i) {
+        SpfFlatEntry *entry = self->bucket[i];
+        while (NULL != entry) {
+            SpfFlatEntry *next = entry->next;
+            SpfFlatCache_freeEntry(entry);
+            entry = next;
+        }   // end while
+    }   // end for
+    SpfEvaluator_free(self->evaluator);
+    (void) pthread_cond_destroy(&self->cond);
+    (void) pthread_mutex_destroy(&self->lock);
+    free(self);
+}   // end function: SpfFlatCache_free
+
+/**
+ * create SpfFlatCache object
+ * @param policy the policy the records are evaluated with, must outlive the cache.
+ * @param resolver DnsResolver object used only by the worker thread, must outlive the cache.
+ * @param max_entries the maximum number of domains cached.
+ * @param max_ttl the maximum number of seconds to keep a flattened record,
+ *                and the number of seconds to remember the records which cannot be flattened.
+ * @return initialized SpfFlatCache object, or NULL if memory allocation failed.
+ */
+SpfFlatCache *
+SpfFlatCache_new(const SpfEvalPolicy *policy, DnsResolver *resolver, size_t max_entries,
+                 time_t max_ttl)
+{
+    SpfFlatCache *self = (SpfFlatCache *) malloc(sizeof(SpfFlatCache));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(SpfFlatCache));
+
+    int ret = pthread_mutex_init(&self->lock, NULL);
+    if (0 != ret) {
+        free(self);
+        return NULL;
+    }   // end if
+    ret = pthread_cond_init(&self->cond, NULL);
+    if (0 != ret) {
+        (void) pthread_mutex_destroy(&self->lock);
+        free(self);
+        return NULL;
+    }   // end if
+    self->evaluator = SpfEvaluator_new(policy, resolver);
+    if (NULL == self->evaluator) {
+        SpfFlatCache_free(self);
+        return NULL;
+    }   // end if
+
+    self->max_entries = max_entries;
+    self->max_ttl = 0 < max_ttl ? max_ttl : 0;
+    return self;
+}   // end function: SpfFlatCache_new
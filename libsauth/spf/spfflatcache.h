@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2008-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __SPF_FLAT_CACHE_H__
+#define __SPF_FLAT_CACHE_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "spf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern bool SpfFlatCache_lookup(SpfFlatCache *self, SpfRecordScope scope, const char *domain,
+                                sa_family_t sa_family, const void *addr, SpfScore *score);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SPF_FLAT_CACHE_H__ */
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2008-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "spfiptrie.h"
+
+#define SPF_IP_TRIE_NONE UINT32_MAX
+#define SPF_IP_TRIE_ROOT4 0
+#define SPF_IP_TRIE_ROOT6 1
+
+typedef struct SpfIpTrieNode {
+    uint32_t child[2];  // indexes of the child nodes, SPF_IP_TRIE_NONE if absent
+    uint32_t tag;       // the smallest tag of the prefixes ending at this node, SPF_IP_TRIE_NONE if none
+} SpfIpTrieNode;
+
+/*
+ * binary trie of IPv4 and IPv6 prefixes.
+ * each prefix carries a tag, and a lookup finds the smallest tag among the prefixes
+ * covering the address, so that tagging the prefixes with their positions
+ * makes the lookup return the first matching one.
+ * the nodes are kept in a single array and refer to each other by index.
+ */
+struct SpfIpTrie {
+    SpfIpTrieNode *node;
+    size_t node_num;
+    size_t node_capacity;
+};
+
+static uint32_t
+SpfIpTrie_appendNode(SpfIpTrie *self)
+{
+    if (self->node_capacity <= self->node_num) {
+        size_t newcapacity = 0 < self->node_capacity ? self->node_capacity * 2 : 64;
+        SpfIpTrieNode *newnode =
+            (SpfIpTrieNode *) realloc(self->node, sizeof(SpfIpTrieNode) * newcapacity);
+        if (NULL == newnode) {
+            return SPF_IP_TRIE_NONE;
+        }   // end if
+        self->node = newnode;
+        self->node_capacity = newcapacity;
+    }   // end if
+    SpfIpTrieNode *node = &(self->node[self->node_num]);
+    node->child[0] = SPF_IP_TRIE_NONE;
+    node->child[1] = SPF_IP_TRIE_NONE;
+    node->tag = SPF_IP_TRIE_NONE;
+    return (uint32_t) self->node_num++;
+}   // end function: SpfIpTrie_appendNode
+
+static bool
+SpfIpTrie_getRoot(sa_family_t sa_family, uint32_t *root, unsigned int *maxlen)
+{
+    switch (sa_family) {
+    case AF_INET:
+        *root = SPF_IP_TRIE_ROOT4;
+        *maxlen = 32;
+        return true;
+    case AF_INET6:
+        *root = SPF_IP_TRIE_ROOT6;
+        *maxlen = 128;
+        return true;
+    default:
+        return false;
+    }   // end switch
+}   // end function: SpfIpTrie_getRoot
+
+static unsigned int
+SpfIpTrie_getBit(const unsigned char *addr, unsigned int pos)
+{
+    return (addr[pos / 8] >> (7 - pos % 8)) & 1;
+}   // end function: SpfIpTrie_getBit
+
+/**
+ * Adds a prefix.
+ * @param addr a pointer to struct in_addr for AF_INET, struct in6_addr for AF_INET6.
+ * @param prefixlen the prefix length, clamped to the address length.
+ * @param tag the value returned by SpfIpTrie_lookup() when this is the best matching prefix.
+ * @return true on successful completion, false if memory allocation failed.
+ */
+bool
+SpfIpTrie_insert(SpfIpTrie *self, sa_family_t sa_family, const void *addr,
+                 unsigned int prefixlen, unsigned int tag)
+{
+    uint32_t current;
+    unsigned int maxlen;
+    if (!SpfIpTrie_getRoot(sa_family, &current, &maxlen)) {
+        return true;    // never matches anyway
+    }   // end if
+    if (maxlen < prefixlen) {
+        prefixlen = maxlen;
+    }   // end if
+    for (unsigned int pos = 0; pos < prefixlen; ++pos) {
+        unsigned int bit = SpfIpTrie_getBit((const unsigned char *) addr, pos);
+        uint32_t next = self->node[current].child[bit];
+        if (SPF_IP_TRIE_NONE == next) {
+            // self->node may move
+            next = SpfIpTrie_appendNode(self);
+            if (SPF_IP_TRIE_NONE == next) {
+                return false;
+            }   // end if
+            self->node[current].child[bit] = next;
+        }   // end if
+        current = next;
+    }   // end for
+    if (tag < self->node[current].tag) {
+        self->node[current].tag = tag;
+    }   // end if
+    return true;
+}   // end function: SpfIpTrie_insert
+
+/**
+ * Finds the prefixes covering the address.
+ * @param addr a pointer to struct in_addr for AF_INET, struct in6_addr for AF_INET6.
+ * @param tag receives the smallest tag among the prefixes covering the address.
+ * @return true if any prefix covers the address, false otherwise.
+ */
+bool
+SpfIpTrie_lookup(const SpfIpTrie *self, sa_family_t sa_family, const void *addr,
+                 unsigned int *tag)
+{
+    uint32_t current;
+    unsigned int maxlen;
+    if (!SpfIpTrie_getRoot(sa_family, &current, &maxlen)) {
+        return false;
+    }   // end if
+    uint32_t found = self->node[current].tag;
+    for (unsigned int pos = 0; pos < maxlen; ++pos) {
+        current = self->node[current].child[SpfIpTrie_getBit((const unsigned char *) addr, pos)];
+        if (SPF_IP_TRIE_NONE == current) {
+            break;
+        }   // end if
+        if (self->node[current].tag < found) {
+            found = self->node[current].tag;
+        }   // end if
+    }   // end for
+    if (SPF_IP_TRIE_NONE == found) {
+        return false;
+    }   // end if
+    *tag = found;
+    return true;
+}   // end function: SpfIpTrie_lookup
+
+static bool
+SpfIpTrie_walkNode(const SpfIpTrie *self, sa_family_t sa_family, uint32_t index,
+                   unsigned char *addr, unsigned int depth, unsigned int maxlen, uint32_t tag,
+                   SpfIpTrie_walker *walker, void *arg)
+{
+    const SpfIpTrieNode *node = &(self->node[index]);
+    if (node->tag < tag) {
+        tag = node->tag;
+    }   // end if
+    if (maxlen <= depth
+        || (SPF_IP_TRIE_NONE == node->child[0] && SPF_IP_TRIE_NONE == node->child[1])) {
+        return SPF_IP_TRIE_NONE == tag || walker(sa_family, addr, depth, tag, arg);
+    }   // end if
+    bool cont = true;
+    for (unsigned int bit = 0; cont && bit < 2; ++bit) {
+        if (0 == bit) {
+            addr[depth / 8] &= ~(0x80 >> (depth % 8));
+        } else {
+            addr[depth / 8] |= 0x80 >> (depth % 8);
+        }   // end if
+        if (SPF_IP_TRIE_NONE != node->child[bit]) {
+            cont = SpfIpTrie_walkNode(self, sa_family, node->child[bit], addr, depth + 1, maxlen,
+                                      tag, walker, arg);
+        } else if (SPF_IP_TRIE_NONE != tag) {
+            cont = walker(sa_family, addr, depth + 1, tag, arg);
+        }   // end if
+    }   // end for
+    addr[depth / 8] &= ~(0x80 >> (depth % 8));
+    return cont;
+}   // end function: SpfIpTrie_walkNode
+
+/**
+ * Enumerates the address space as disjoint prefixes.
+ * Each covered region is passed to the walker once with the tag SpfIpTrie_lookup() returns
+ * for the addresses in it. The regions no prefix covers are skipped.
+ * @param walker callback, returns false to stop the enumeration.
+ * @return true if the enumeration is completed, false if the walker stopped it.
+ */
+bool
+SpfIpTrie_walk(const SpfIpTrie *self, sa_family_t sa_family, SpfIpTrie_walker *walker, void *arg)
+{
+    uint32_t root;
+    unsigned int maxlen;
+    if (!SpfIpTrie_getRoot(sa_family, &root, &maxlen)) {
+        return true;
+    }   // end if
+    unsigned char addr[sizeof(struct in6_addr)];
+    memset(addr, 0, sizeof(addr));
+    return SpfIpTrie_walkNode(self, sa_family, root, addr, 0, maxlen, SPF_IP_TRIE_NONE, walker,
+                              arg);
+}   // end function: SpfIpTrie_walk
+
+/**
+ * release SpfIpTrie object
+ * @param self SpfIpTrie object to release
+ */
+void
+SpfIpTrie_free(SpfIpTrie *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    free(self->node);
+    free(self);
+}   // end function: SpfIpTrie_free
+
+/**
+ * create SpfIpTrie object
+ * @return initialized SpfIpTrie object, or NULL if memory allocation failed.
+ */
+SpfIpTrie *
+SpfIpTrie_new(void)
+{
+    SpfIpTrie *self = (SpfIpTrie *) malloc(sizeof(SpfIpTrie));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(SpfIpTrie));
+    // the roots for IPv4 and IPv6
+    if (SPF_IP_TRIE_ROOT4 != SpfIpTrie_appendNode(self)
+        || SPF_IP_TRIE_ROOT6 != SpfIpTrie_appendNode(self)) {
+        SpfIpTrie_free(self);
+        return NULL;
+    }   // end if
+    return self;
+}   // end function: SpfIpTrie_new
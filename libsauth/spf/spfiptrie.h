@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2008-2015 Internet Initiative Japan Inc. All rights reserved.
+ *
+ * The terms and conditions of the accompanying program
+ * shall be provided separately by Internet Initiative Japan Inc.
+ * Any use, reproduction or distribution of the program are permitted
+ * provided that you agree to be bound to such terms and conditions.
+ *
+ * $Id$
+ */
+
+#ifndef __SPF_IP_TRIE_H__
+#define __SPF_IP_TRIE_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SpfIpTrie SpfIpTrie;
+
+/*
+ * callback of SpfIpTrie_walk(), receives a prefix and its tag.
+ * returns false to stop the enumeration.
+ */
+typedef bool SpfIpTrie_walker(sa_family_t sa_family, const void *addr, unsigned int prefixlen,
+                              unsigned int tag, void *arg);
+
+extern SpfIpTrie *SpfIpTrie_new(void);
+extern void SpfIpTrie_free(SpfIpTrie *self);
+extern bool SpfIpTrie_insert(SpfIpTrie *self, sa_family_t sa_family, const void *addr,
+                             unsigned int prefixlen, unsigned int tag);
+extern bool SpfIpTrie_lookup(const SpfIpTrie *self, sa_family_t sa_family, const void *addr,
+                             unsigned int *tag);
+extern bool SpfIpTrie_walk(const SpfIpTrie *self, sa_family_t sa_family,
+                           SpfIpTrie_walker *walker, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SPF_IP_TRIE_H__ */
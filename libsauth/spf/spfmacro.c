@@ -80,6 +80,40 @@ static const struct SpfMacroLetterMap spf_macro_letter_table[] = {
     {'\0', SPF_MACRO_NULL, false},
 };
 
+typedef enum SpfMacroOpType {
+    SPF_MACRO_OP_LITERAL,       // appends the literal as is
+    SPF_MACRO_OP_EXPAND,        // expands the macro-letter with its transformers and delimiters
+} SpfMacroOpType;
+
+typedef struct SpfMacroOp {
+    SpfMacroOpType type;
+    // SPF_MACRO_OP_LITERAL の場合のみ有効. コンパイル元の文字列か静的な文字列への参照
+    const char *literal;
+    size_t literal_len;
+    SpfMacro macro;             // SPF_MACRO_OP_EXPAND の場合のみ有効
+} SpfMacroOp;
+
+/*
+ * macro-string をコンパイルした命令列.
+ * 展開時に macro-string を再度パースせずに済ませる.
+ */
+struct SpfMacroProgram {
+    SpfMacroOp *op;
+    size_t op_num;
+    size_t op_capacity;
+};
+
+/*
+ * マクロの展開元となる文字列.
+ * %{s} を連結せずに扱うため, 最大3つの断片から構成される.
+ */
+typedef struct SpfMacroSource {
+    const char *part[3];
+    size_t part_len[3];
+    size_t part_num;
+    size_t len;
+} SpfMacroSource;
+
 static void
 SpfMacro_init(SpfMacro *self)
 {
@@ -89,32 +123,59 @@ SpfMacro_init(SpfMacro *self)
     self->transformer = 0;
 }   // end function: SpfMacro_init
 
-/**
- * @attention The returned string should be released with free() when no longer needed.
+static void
+SpfMacroSource_append(SpfMacroSource *self, const char *s, size_t len)
+{
+    self->part[self->part_num] = s;
+    self->part_len[self->part_num] = len;
+    ++self->part_num;
+    self->len += len;
+}   // end function: SpfMacroSource_append
+
+static void
+SpfMacroSource_set(SpfMacroSource *self, const char *s)
+{
+    memset(self, 0, sizeof(SpfMacroSource));
+    SpfMacroSource_append(self, s, strlen(s));
+}   // end function: SpfMacroSource_set
+
+static char
+SpfMacroSource_charAt(const SpfMacroSource *self, size_t pos)
+{
+    for (size_t n = 0; n < self->part_num; ++n) {
+        if (pos < self->part_len[n]) {
+            return self->part[n][pos];
+        }   // end if
+        pos -= self->part_len[n];
+    }   // end for
+    abort();
+}   // end function: SpfMacroSource_charAt
+
+/*
+ * appends the range [head, tail) of the source to xbuf.
  */
-static char *
-SpfMacro_dupMailboxAsString(const InetMailbox *mailbox)
+static void
+SpfMacroSource_appendRange(const SpfMacroSource *self, size_t head, size_t tail, XBuffer *xbuf)
 {
-    const char *localpart = InetMailbox_getLocalPart(mailbox);
-    const char *domainpart = InetMailbox_getDomain(mailbox);
-    size_t localpart_len = strlen(localpart);
-    size_t domainpart_len = strlen(domainpart);
-    char *mailaddr = (char *) malloc(localpart_len + domainpart_len + 2);   // 2 は '@' と終端文字
-    if (NULL == mailaddr) {
-        return NULL;
-    }   // end if
-    memcpy(mailaddr, localpart, localpart_len);
-    mailaddr[localpart_len] = '@';
-    memcpy(mailaddr + localpart_len + 1, domainpart, domainpart_len);
-    mailaddr[localpart_len + domainpart_len + 1] = '\0';
-    return mailaddr;
-}   // end function: SpfMacro_dupMailboxAsString
+    size_t offset = 0;
+    for (size_t n = 0; n < self->part_num && head < tail; ++n) {
+        size_t part_tail = offset + self->part_len[n];
+        if (head < part_tail) {
+            size_t len = MIN(tail, part_tail) - head;
+            XBuffer_appendStringN(xbuf, self->part[n] + (head - offset), len);
+            head += len;
+        }   // end if
+        offset = part_tail;
+    }   // end for
+}   // end function: SpfMacroSource_appendRange
 
 /**
- * @attention The returned string should be released with free() when no longer needed.
+ * Chooses the validated domain name of <ip>.
+ * @param buf buffer to store the name, NS_MAXDNAME bytes or larger.
  */
-static char *
-SpfMacro_dupValidatedDomainName(const SpfEvaluator *evaluator, const char *domain)
+static void
+SpfMacro_getValidatedDomainName(const SpfEvaluator *evaluator, const char *domain, char *buf,
+                                size_t buflen)
 {
     /*
      * [RFC4408] 8.1.
@@ -126,18 +187,23 @@ SpfMacro_dupValidatedDomainName(const SpfEvaluator *evaluator, const char *domai
      * used.  If there are no validated domain names or if a DNS error
      * occurs, the string "unknown" is used.
      */
+    snprintf(buf, buflen, "%s", SPF_MACRO_DEFAULT_P_MACRO_VALUE);
+
+    // "p" macro is expanded synchronously, only with the resolver the evaluator is created with
+    if (NULL == evaluator->resolver) {
+        return;
+    }   // end if
 
     DnsPtrResponse *respptr;
     dns_stat_t ptrquery_stat =
         DnsResolver_lookupPtr(evaluator->resolver, evaluator->sa_family, &(evaluator->ipaddr),
                               &respptr);
     if (DNS_STAT_NOERROR != ptrquery_stat) {
-        return strdup(SPF_MACRO_DEFAULT_P_MACRO_VALUE);
+        return;
     }   // end if
 
     // TODO: stable sort をする代わりにリストを3回なめている. stable sort をする方がエレガント.
     size_t resp_num_limit = MIN(respptr->num, SPF_MACRO_DOMAIN_VALIDATION_PTRRR_MAXNUM);
-    char *expand = NULL;
 
     /*
      * [RFC4408] 8.1.
@@ -148,13 +214,13 @@ SpfMacro_dupValidatedDomainName(const SpfEvaluator *evaluator, const char *domai
         if (InetDomain_equals(domain, revdomain)) {
             switch (SpfEvaluator_isValidatedDomainName(evaluator, revdomain)) {
             case 1:
-                expand = strdup(revdomain);
+                snprintf(buf, buflen, "%s", revdomain);
                 goto finally;
             case 0:
                 // do nothing
                 break;
             case -1:
-                goto use_default_macro_value;
+                goto finally;
             default:
                 abort();
             }   // end switch
@@ -170,13 +236,13 @@ SpfMacro_dupValidatedDomainName(const SpfEvaluator *evaluator, const char *domai
         if (InetDomain_isParent(domain, revdomain) && !InetDomain_equals(domain, revdomain)) {
             switch (SpfEvaluator_isValidatedDomainName(evaluator, revdomain)) {
             case 1:
-                expand = strdup(revdomain);
+                snprintf(buf, buflen, "%s", revdomain);
                 goto finally;
             case 0:
                 // do nothing
                 break;
             case -1:
-                goto use_default_macro_value;
+                goto finally;
             default:
                 abort();
             }   // end switch
@@ -192,30 +258,27 @@ SpfMacro_dupValidatedDomainName(const SpfEvaluator *evaluator, const char *domai
         if (!InetDomain_isParent(domain, revdomain)) {
             switch (SpfEvaluator_isValidatedDomainName(evaluator, revdomain)) {
             case 1:
-                expand = strdup(revdomain);
+                snprintf(buf, buflen, "%s", revdomain);
                 goto finally;
             case 0:
                 // do nothing
                 break;
             case -1:
-                goto use_default_macro_value;
+                goto finally;
             default:
                 abort();
             }   // end switch
         }   // end if
     }   // end for
 
-  use_default_macro_value:
     /*
      * [RFC4408] 8.1.
      * If there are no validated domain names or if a DNS error occurs, the string "unknown" is used.
      */
-    expand = strdup(SPF_MACRO_DEFAULT_P_MACRO_VALUE);
 
   finally:
     DnsPtrResponse_free(respptr);
-    return expand;
-}   // end function: SpfMacro_dupValidatedDomainName
+}   // end function: SpfMacro_getValidatedDomainName
 
 /*
  * The argument must be in the range 0-15, otherwise the behavior is undefined.
@@ -227,146 +290,193 @@ xtoa(unsigned char p)
 }   // end function: xtoa
 
 /**
- * @attention The returned string should be released with free() when no longer needed.
+ * @param buf buffer to store the address, SPF_MACRO_DOTTED_INET6ADDRLEN bytes or larger.
  */
-static char *
-SpfMacro_dupDottedIpAddr(const SpfEvaluator *evaluator)
+static void
+SpfMacro_getDottedIpAddr(const SpfEvaluator *evaluator, char *buf, size_t buflen)
 {
     switch (evaluator->sa_family) {
-    case AF_INET:;
-        char addrbuf4[INET_ADDRSTRLEN];
-        (void) inet_ntop(AF_INET, &(evaluator->ipaddr), addrbuf4, sizeof(addrbuf4));
-        return strdup(addrbuf4);
+    case AF_INET:
+        (void) inet_ntop(AF_INET, &(evaluator->ipaddr), buf, buflen);
+        break;
     case AF_INET6:;
-        char addrbuf6[SPF_MACRO_DOTTED_INET6ADDRLEN];
         const unsigned char *rawaddr = (const unsigned char *) &(evaluator->ipaddr.addr6);
         const unsigned char *rawaddr_tail = rawaddr + NS_IN6ADDRSZ;
-        char *bufp = addrbuf6;
+        char *bufp = buf;
         for (; rawaddr < rawaddr_tail; ++rawaddr) {
             *(bufp++) = xtoa((*rawaddr & 0xf0) >> 4);
             *(bufp++) = '.';
             *(bufp++) = xtoa(*rawaddr & 0x0f);
             *(bufp++) = '.';
         }   // end for
-        return strpdup(addrbuf6, bufp - 1);
+        *(bufp - 1) = '\0';
+        break;
     default:
         abort();
     }   // end switch
-}   // end function: SpfMacro_dupDottedIpAddr
+}   // end function: SpfMacro_getDottedIpAddr
 
 /**
- * @attention The returned string should be released with free() when no longer needed.
+ * Sets up the string the macro-letter expands to without copying it as far as possible.
+ * @param buf buffer for the strings built on expansion, NS_MAXDNAME bytes or larger.
+ *        src may refer to it.
  */
-static char *
-SpfMacro_dupMacroSource(const SpfEvaluator *evaluator, SpfMacroLetter macro_letter)
+static void
+SpfMacro_getMacroSource(const SpfEvaluator *evaluator, SpfMacroLetter macro_letter,
+                        SpfMacroSource *src, char *buf, size_t buflen)
 {
     switch (macro_letter) {
-    case SPF_MACRO_S_SENDER:
-        return SpfMacro_dupMailboxAsString(evaluator->sender);
+    case SPF_MACRO_S_SENDER:;
+        const char *localpart = InetMailbox_getLocalPart(evaluator->sender);
+        const char *domainpart = InetMailbox_getDomain(evaluator->sender);
+        SpfMacroSource_set(src, localpart);
+        SpfMacroSource_append(src, "@", 1);
+        SpfMacroSource_append(src, domainpart, strlen(domainpart));
+        break;
     case SPF_MACRO_L_SENDER_LOCALPART:
-        return strdup(InetMailbox_getLocalPart(evaluator->sender));
+        SpfMacroSource_set(src, InetMailbox_getLocalPart(evaluator->sender));
+        break;
     case SPF_MACRO_O_SENDER_DOMAIN:
-        return strdup(InetMailbox_getDomain(evaluator->sender));
+        SpfMacroSource_set(src, InetMailbox_getDomain(evaluator->sender));
+        break;
     case SPF_MACRO_D_DOMAIN:
-        return strdup(SpfEvaluator_getDomain(evaluator));
+        SpfMacroSource_set(src, SpfEvaluator_getDomain(evaluator));
+        break;
     case SPF_MACRO_I_DOTTED_IPADDR:
-        return SpfMacro_dupDottedIpAddr(evaluator);
+        SpfMacro_getDottedIpAddr(evaluator, buf, buflen);
+        SpfMacroSource_set(src, buf);
+        break;
     case SPF_MACRO_P_IPADDR_VALID_DOMAIN:
-        return SpfMacro_dupValidatedDomainName(evaluator, SpfEvaluator_getDomain(evaluator));
+        SpfMacro_getValidatedDomainName(evaluator, SpfEvaluator_getDomain(evaluator), buf, buflen);
+        SpfMacroSource_set(src, buf);
+        break;
     case SPF_MACRO_V_REVADDR_SUFFIX:
-        return strdup(AF_INET == evaluator->sa_family ? "in-addr" : "ip6");
+        SpfMacroSource_set(src, AF_INET == evaluator->sa_family ? "in-addr" : "ip6");
+        break;
     case SPF_MACRO_H_HELO_DOMAIN:
-        return strdup(evaluator->helo_domain);
-    case SPF_MACRO_C_TEXT_IPADDR:;
-        char addrbuf[INET6_ADDRSTRLEN];
-        (void) inet_ntop(evaluator->sa_family, &(evaluator->ipaddr), addrbuf, sizeof(addrbuf));
-        return strdup(addrbuf);
+        SpfMacroSource_set(src, evaluator->helo_domain);
+        break;
+    case SPF_MACRO_C_TEXT_IPADDR:
+        (void) inet_ntop(evaluator->sa_family, &(evaluator->ipaddr), buf, buflen);
+        SpfMacroSource_set(src, buf);
+        break;
     case SPF_MACRO_R_CHECKING_DOMAIN:
         // 受信した MTA (= SPF の検証をしたホスト) の名前
-        return strdup(PTROR(evaluator->policy->checking_domain, SPF_MACRO_DEFAULT_R_MACRO_VALUE));
-    case SPF_MACRO_T_TIMESTAMP:;
-        char timebuf[20];
-        snprintf(timebuf, sizeof(timebuf), "%ld", (long) time(NULL));
-        return strdup(timebuf);
+        SpfMacroSource_set(src,
+                           PTROR(evaluator->policy->checking_domain,
+                                 SPF_MACRO_DEFAULT_R_MACRO_VALUE));
+        break;
+    case SPF_MACRO_T_TIMESTAMP:
+        snprintf(buf, buflen, "%ld", (long) time(NULL));
+        SpfMacroSource_set(src, buf);
+        break;
     default:
         abort();
     }   // end switch
-}   // end function: SpfMacro_dupMacroSource
+}   // end function: SpfMacro_getMacroSource
 
-/**
- * 与えられた文字列の領域をセパレーターで区切り, 2次元配列を構築する.
- * s 内の delimstr を NULL で置き換え, 各要素の先頭を示すポインタからなる配列を返す.
- * @param s 区切りたい文字列
- * @param delimstr デリミタとして使う文字を繋げたNULL終端文字列
- * @param num 要素の数を受け取る変数へのポインタ
- * @attention s will be overwritten
- * @attention The returned string should be released with free() when no longer needed.
+/*
+ * 展開元の文字列をデリミタで区切り, reverse と transformer を適用した上で '.' で連結して xbuf に追加する.
+ * 区切った要素を配列に格納する代わりに, 展開元の文字列を前から (reverse の場合は後ろから) 走査する.
  */
-static char **
-SpfMacro_splitMacroSource(char *s, const char *delimstr, size_t *num)
+static void
+SpfMacro_expandMacro(const SpfMacro *macro, const SpfEvaluator *evaluator, XBuffer *xbuf)
 {
-    // 必要な配列のサイズを見積もる
-    size_t n;
-    char *q;
-    for (n = 0, q = s; NULL != (q = strpbrk(q, delimstr)); ++n, ++q);
-    // メモリの確保
-    char **r = (char **) malloc((n + 2) * sizeof(char *));
-    if (NULL == r) {
-        return NULL;
+    char buf[NS_MAXDNAME];
+    SpfMacroSource src;
+    SpfMacro_getMacroSource(evaluator, macro->letter, &src, buf, sizeof(buf));
+
+    // 要素の数を数える
+    size_t num = 1;
+    for (size_t pos = 0; pos < src.len; ++pos) {
+        if (NULL != strchr(macro->delims, SpfMacroSource_charAt(&src, pos))) {
+            ++num;
+        }   // end if
+    }   // end for
+
+    // 右から transformer 個の要素のみを使用する
+    size_t skip = (0 == macro->transformer || num <= macro->transformer)
+        ? 0 : num - macro->transformer;
+    // TODO: 大文字のマクロは対応する小文字のマクロと同様に展開し, URLエスケープすること
+    // NOTE: URL エスケープは explanation レコードのみを対象とすべきではないのか?
+    size_t idx = 0;
+    if (macro->reverse) {
+        size_t part_tail = src.len;
+        for (size_t pos = src.len; 0 < pos; --pos) {
+            if (NULL != strchr(macro->delims, SpfMacroSource_charAt(&src, pos - 1))) {
+                if (skip <= idx) {
+                    if (skip < idx) {
+                        XBuffer_appendChar(xbuf, '.');
+                    }   // end if
+                    SpfMacroSource_appendRange(&src, pos, part_tail, xbuf);
+                }   // end if
+                ++idx;
+                part_tail = pos - 1;
+            }   // end if
+        }   // end for
+        if (skip < idx) {
+            XBuffer_appendChar(xbuf, '.');
+        }   // end if
+        SpfMacroSource_appendRange(&src, 0, part_tail, xbuf);
+    } else {
+        size_t part_head = 0;
+        for (size_t pos = 0; pos < src.len; ++pos) {
+            if (NULL != strchr(macro->delims, SpfMacroSource_charAt(&src, pos))) {
+                if (skip <= idx) {
+                    if (skip < idx) {
+                        XBuffer_appendChar(xbuf, '.');
+                    }   // end if
+                    SpfMacroSource_appendRange(&src, part_head, pos, xbuf);
+                }   // end if
+                ++idx;
+                part_head = pos + 1;
+            }   // end if
+        }   // end for
+        if (skip < idx) {
+            XBuffer_appendChar(xbuf, '.');
+        }   // end if
+        SpfMacroSource_appendRange(&src, part_head, src.len, xbuf);
     }   // end if
+}   // end function: SpfMacro_expandMacro
 
-    char *token_tail;
-    int idx = 0;
-    r[idx] = s;
-    while (NULL != (token_tail = strpbrk(r[idx], delimstr))) {
-        *token_tail = '\0';
-        r[++idx] = token_tail + 1;
-    }   // end while
-    r[++idx] = NULL;
-    *num = idx;
-    return r;
-}   // end function: SpfMacro_splitMacroSource
+static SpfMacroOp *
+SpfMacroProgram_appendOp(SpfMacroProgram *self, SpfMacroOpType type)
+{
+    if (self->op_capacity <= self->op_num) {
+        size_t newcapacity = 0 < self->op_capacity ? self->op_capacity * 2 : 8;
+        SpfMacroOp *newop = (SpfMacroOp *) realloc(self->op, sizeof(SpfMacroOp) * newcapacity);
+        if (NULL == newop) {
+            LogNoResource();
+            return NULL;
+        }   // end if
+        self->op = newop;
+        self->op_capacity = newcapacity;
+    }   // end if
+    SpfMacroOp *op = &(self->op[self->op_num++]);
+    memset(op, 0, sizeof(SpfMacroOp));
+    op->type = type;
+    return op;
+}   // end function: SpfMacroProgram_appendOp
 
 static SpfStat
-SpfMacro_expandMacro(const SpfMacro *macro, const SpfEvaluator *evaluator, XBuffer *xbuf)
+SpfMacroProgram_appendLiteral(SpfMacroProgram *self, const char *literal, size_t literal_len)
 {
-    char *macro_source = SpfMacro_dupMacroSource(evaluator, macro->letter);
-    if (NULL == macro_source) {
-        LogNoResource();
-        return SPF_STAT_NO_RESOURCE;
+    if (0 < self->op_num) {
+        // 直前の literal と連続していれば連結する
+        SpfMacroOp *last = &(self->op[self->op_num - 1]);
+        if (SPF_MACRO_OP_LITERAL == last->type && last->literal + last->literal_len == literal) {
+            last->literal_len += literal_len;
+            return SPF_STAT_OK;
+        }   // end if
     }   // end if
-    size_t num;
-    char **macro_parts = SpfMacro_splitMacroSource(macro_source, macro->delims, &num);
-    if (NULL == macro_parts) {
-        free(macro_source);
-        LogNoResource();
+    SpfMacroOp *op = SpfMacroProgram_appendOp(self, SPF_MACRO_OP_LITERAL);
+    if (NULL == op) {
         return SPF_STAT_NO_RESOURCE;
     }   // end if
-
-    // reverse が指定されている場合は反転する
-    if (macro->reverse) {
-        for (size_t n = 0; n < num / 2; ++n) {
-            size_t pos = num - n - 1;
-            char *tmp = macro_parts[pos];
-            macro_parts[pos] = macro_parts[n];
-            macro_parts[n] = tmp;
-        }   // end for
-    }   // end if
-
-    size_t idx = (0 == macro->transformer || num <= macro->transformer)
-        ? 0 : num - macro->transformer;
-    // TODO: 大文字のマクロは対応する小文字のマクロと同様に展開し, URLエスケープすること
-    // NOTE: URL エスケープは explanation レコードのみを対象とすべきではないのか?
-    XBuffer_appendString(xbuf, macro_parts[idx]);
-    for (++idx; NULL != macro_parts[idx]; ++idx) {
-        XBuffer_appendChar(xbuf, '.');
-        XBuffer_appendString(xbuf, macro_parts[idx]);
-    }   // end for
-
-    free(macro_parts);
-    free(macro_source);
+    op->literal = literal;
+    op->literal_len = literal_len;
     return SPF_STAT_OK;
-}   // end function: SpfMacro_expandMacro
+}   // end function: SpfMacroProgram_appendLiteral
 
 /*
  * [RFC4408]
@@ -481,11 +591,12 @@ SpfMacro_parseTransformers(SpfMacro *macro, const char *head, const char *tail,
  *                    / "%%" / "%_" / "%-"
  */
 static SpfStat
-SpfMacro_parseMacroExpand(const SpfEvaluator *evaluator, const char *head, const char *tail,
-                          bool exp_record, const char **nextp, XBuffer *xbuf)
+SpfMacro_parseMacroExpand(SpfMacroProgram *program, const char *head, const char *tail,
+                          bool exp_record, const char **nextp)
 {
     const char *p = head;
     if (head + 1 < tail && '%' == *p) {
+        SpfStat append_stat;
         switch (*(++p)) {
         case '{':;
             // マクロのパース結果を格納するための用構造体を準備
@@ -507,19 +618,13 @@ SpfMacro_parseMacroExpand(const SpfEvaluator *evaluator, const char *head, const
             }   // end if
 
             if (0 < XSkip_char(p, tail, '}', &p)) {
-                // ここでやっとマクロとして確定したので展開する
-                SpfStat expand_stat = SpfMacro_expandMacro(&macro, evaluator, xbuf);
-                if (SPF_STAT_OK != expand_stat) {
-                    *nextp = head;
-                    return expand_stat;
-                }   // end if
-                if (evaluator->policy->macro_expansion_limit < XBuffer_getSize(xbuf)) {
-                    SpfLogPermFail("expanded macro too long: limit=%u, length=%u",
-                                   evaluator->policy->macro_expansion_limit,
-                                   (unsigned int) XBuffer_getSize(xbuf));
+                // ここでやっとマクロとして確定したので命令列に追加する
+                SpfMacroOp *op = SpfMacroProgram_appendOp(program, SPF_MACRO_OP_EXPAND);
+                if (NULL == op) {
                     *nextp = head;
-                    return SPF_STAT_MALICIOUS_MACRO_EXPANSION;
+                    return SPF_STAT_NO_RESOURCE;
                 }   // end if
+                op->macro = macro;
                 *nextp = p;
                 return SPF_STAT_OK;
             } else {
@@ -533,27 +638,24 @@ SpfMacro_parseMacroExpand(const SpfEvaluator *evaluator, const char *head, const
              * [RFC4408] 8.1.
              * A literal "%" is expressed by "%%".
              */
-            XBuffer_appendChar(xbuf, '%');
-            *nextp = head + 2;
-            return SPF_STAT_OK;
+            append_stat = SpfMacroProgram_appendLiteral(program, "%", 1);
+            break;
 
         case '_':
             /*
              * [RFC4408] 8.1.
              * "%_" expands to a single " " space.
              */
-            XBuffer_appendChar(xbuf, 0x20);
-            *nextp = head + 2;
-            return SPF_STAT_OK;
+            append_stat = SpfMacroProgram_appendLiteral(program, " ", 1);
+            break;
 
         case '-':
             /*
              * [RFC4408] 8.1.
              * "%-" expands to a URL-encoded space, viz., "%20".
              */
-            XBuffer_appendString(xbuf, "%20");
-            *nextp = head + 2;
-            return SPF_STAT_OK;
+            append_stat = SpfMacroProgram_appendLiteral(program, "%20", 3);
+            break;
 
         default:
             // [RFC4408] 8.1.
@@ -564,26 +666,31 @@ SpfMacro_parseMacroExpand(const SpfEvaluator *evaluator, const char *head, const
             *nextp = head;
             return SPF_STAT_RECORD_SYNTAX_VIOLATION;
         }   // end switch
+        *nextp = SPF_STAT_OK == append_stat ? head + 2 : head;
+        return append_stat;
     }   // end if
     *nextp = head;
     return SPF_STAT_RECORD_NOT_MATCH;
 }   // end function: SpfMacro_parseMacroExpand
 
 /*
+ * @return the length of the literal, -1 on memory allocation failure.
+ *
  * [RFC4408]
  * macro-literal    = %x21-24 / %x26-7E
  *                    ; visible characters except "%"
  */
 static int
-SpfMacro_parseMacroLiteralBlock(const char *head, const char *tail, const char **nextp,
-                                XBuffer *xbuf)
+SpfMacro_parseMacroLiteralBlock(SpfMacroProgram *program, const char *head, const char *tail,
+                                const char **nextp)
 {
     const char *p;
     for (p = head; p < tail && IS_MACRO_LITERAL(*p); ++p);
     *nextp = p;
     int matchlen = *nextp - head;
-    if (0 < matchlen) {
-        XBuffer_appendStringN(xbuf, head, matchlen);
+    if (0 < matchlen && SPF_STAT_OK != SpfMacroProgram_appendLiteral(program, head, matchlen)) {
+        *nextp = head;
+        return -1;
     }   // end if
     return matchlen;
 }   // end function: SpfMacro_parseMacroLiteralBlock
@@ -593,14 +700,17 @@ SpfMacro_parseMacroLiteralBlock(const char *head, const char *tail, const char *
  * macro-string     = *( macro-expand / macro-literal )
  */
 static SpfStat
-SpfMacro_parseMacroString(const SpfEvaluator *evaluator, const char *head, const char *tail,
-                          bool exp_record, const char **nextp, bool *literal_terminated,
-                          XBuffer *xbuf)
+SpfMacro_parseMacroString(SpfMacroProgram *program, const char *head, const char *tail,
+                          bool exp_record, const char **nextp, bool *literal_terminated)
 {
     const char *p = head;
     while (true) {
-        int literal_len = SpfMacro_parseMacroLiteralBlock(p, tail, &p, xbuf);
-        SpfStat macro_stat = SpfMacro_parseMacroExpand(evaluator, p, tail, exp_record, &p, xbuf);
+        int literal_len = SpfMacro_parseMacroLiteralBlock(program, p, tail, &p);
+        if (0 > literal_len) {
+            *nextp = head;
+            return SPF_STAT_NO_RESOURCE;
+        }   // end if
+        SpfStat macro_stat = SpfMacro_parseMacroExpand(program, p, tail, exp_record, &p);
         switch (macro_stat) {
         case SPF_STAT_OK:
             break;
@@ -615,18 +725,26 @@ SpfMacro_parseMacroString(const SpfEvaluator *evaluator, const char *head, const
     }   // end while
 }   // end function: SpfMacro_parseMacroString
 
-/*
+/**
+ * Compiles explain-string into the program.
+ * The program refers to the compiled string, which must be kept until the program is reset.
+ * @return SPF_STAT_OK on success, SPF_STAT_RECORD_NOT_MATCH if nothing matches, or the error.
+ *
  * [RFC4408]
  * explain-string   = *( macro-string / SP )
  */
 SpfStat
-SpfMacro_parseExplainString(const SpfEvaluator *evaluator, const char *head, const char *tail,
-                            const char **nextp, XBuffer *xbuf)
+SpfMacro_compileExplainString(SpfMacroProgram *program, const char *head, const char *tail,
+                              const char **nextp)
 {
     const char *p = head;
     while (true) {
-        int sp_match = XParse_char(p, tail, ' ', &p, xbuf);
-        SpfStat parse_stat = SpfMacro_parseMacroString(evaluator, p, tail, true, &p, NULL, xbuf);
+        int sp_match = XSkip_char(p, tail, ' ', &p);
+        if (0 < sp_match && SPF_STAT_OK != SpfMacroProgram_appendLiteral(program, p - 1, 1)) {
+            *nextp = head;
+            return SPF_STAT_NO_RESOURCE;
+        }   // end if
+        SpfStat parse_stat = SpfMacro_parseMacroString(program, p, tail, true, &p, NULL);
         switch (parse_stat) {
         case SPF_STAT_OK:
             break;
@@ -641,7 +759,7 @@ SpfMacro_parseExplainString(const SpfEvaluator *evaluator, const char *head, con
             return parse_stat;
         }   // end switch
     }   // end while
-}   // end function: SpfMacro_parseExplainString
+}   // end function: SpfMacro_compileExplainString
 
 /*
  * [RFC4408]
@@ -678,7 +796,11 @@ SpfMacro_skipbackTopLabel(const char *head, const char *tail, const char **prevp
     return 0;
 }   // end function: SpfMacro_skipbackTopLabel
 
-/*
+/**
+ * Compiles domain-spec into the program.
+ * The program refers to the compiled string, which must be kept until the program is reset.
+ * @return SPF_STAT_OK on success, SPF_STAT_RECORD_NOT_MATCH if nothing matches, or the error.
+ *
  * [RFC4408]
  * domain-spec      = macro-string domain-end
  * domain-end       = ( "." toplabel [ "." ] ) / macro-expand
@@ -688,8 +810,8 @@ SpfMacro_skipbackTopLabel(const char *head, const char *tail, const char **prevp
  * domain-spec      = *( macro-expand / macro-literal ) ( ( "." sub-domain [ "." ] ) / macro-expand )
  */
 SpfStat
-SpfMacro_parseDomainSpec(const SpfEvaluator *evaluator, const char *head, const char *tail,
-                         const char **nextp, XBuffer *xbuf)
+SpfMacro_compileDomainSpec(SpfMacroProgram *program, const char *head, const char *tail,
+                           const char **nextp)
 // NOTE: macro-string 中の macro-literal がなんでも食っちゃう. domain-end を判別できないのが一番ツライ
 // NOTE: 少なくとも "/", "=", ":" は macro-string から抜くべき.
 // label = alphanum / "-" / "_" くらいでいいと思う
@@ -705,7 +827,7 @@ SpfMacro_parseDomainSpec(const SpfEvaluator *evaluator, const char *head, const
     const char *p = head;
     bool literal_terminated;
     SpfStat parse_stat =
-        SpfMacro_parseMacroString(evaluator, p, tail, false, &p, &literal_terminated, xbuf);
+        SpfMacro_parseMacroString(program, p, tail, false, &p, &literal_terminated);
     if (SPF_STAT_OK != parse_stat) {
         *nextp = head;
         return parse_stat;
@@ -725,4 +847,73 @@ SpfMacro_parseDomainSpec(const SpfEvaluator *evaluator, const char *head, const
 
     *nextp = p;
     return SPF_STAT_OK;
-}   // end function: SpfMacro_parseDomainSpec
+}   // end function: SpfMacro_compileDomainSpec
+
+/**
+ * Expands the compiled macro-string, appending the result to xbuf.
+ * Nothing is allocated except the DNS lookups for "p" macro.
+ * @return SPF_STAT_OK on success,
+ *         SPF_STAT_MALICIOUS_MACRO_EXPANSION if the result exceeds SpfEvalPolicy::macro_expansion_limit.
+ */
+SpfStat
+SpfMacro_expand(const SpfMacroProgram *program, const SpfEvaluator *evaluator, XBuffer *xbuf)
+{
+    for (size_t n = 0; n < program->op_num; ++n) {
+        const SpfMacroOp *op = &(program->op[n]);
+        switch (op->type) {
+        case SPF_MACRO_OP_LITERAL:
+            XBuffer_appendStringN(xbuf, op->literal, op->literal_len);
+            break;
+        case SPF_MACRO_OP_EXPAND:
+            SpfMacro_expandMacro(&(op->macro), evaluator, xbuf);
+            if (evaluator->policy->macro_expansion_limit < XBuffer_getSize(xbuf)) {
+                SpfLogPermFail("expanded macro too long: limit=%u, length=%u",
+                               evaluator->policy->macro_expansion_limit,
+                               (unsigned int) XBuffer_getSize(xbuf));
+                return SPF_STAT_MALICIOUS_MACRO_EXPANSION;
+            }   // end if
+            break;
+        default:
+            abort();
+        }   // end switch
+    }   // end for
+    return SPF_STAT_OK;
+}   // end function: SpfMacro_expand
+
+/**
+ * Clears the program to compile another macro-string, keeping the allocated memory.
+ */
+void
+SpfMacroProgram_reset(SpfMacroProgram *self)
+{
+    self->op_num = 0;
+}   // end function: SpfMacroProgram_reset
+
+/**
+ * release SpfMacroProgram object
+ * @param self SpfMacroProgram object to release
+ */
+void
+SpfMacroProgram_free(SpfMacroProgram *self)
+{
+    if (NULL == self) {
+        return;
+    }   // end if
+    free(self->op);
+    free(self);
+}   // end function: SpfMacroProgram_free
+
+/**
+ * create SpfMacroProgram object
+ * @return initialized SpfMacroProgram object, or NULL if memory allocation failed.
+ */
+SpfMacroProgram *
+SpfMacroProgram_new(void)
+{
+    SpfMacroProgram *self = (SpfMacroProgram *) malloc(sizeof(SpfMacroProgram));
+    if (NULL == self) {
+        return NULL;
+    }   // end if
+    memset(self, 0, sizeof(SpfMacroProgram));
+    return self;
+}   // end function: SpfMacroProgram_new
@@ -20,10 +20,15 @@
 extern "C" {
 #endif
 
-extern SpfStat SpfMacro_parseDomainSpec(const SpfEvaluator *evaluator, const char *head,
-                                        const char *tail, const char **nextp, XBuffer *xbuf);
-extern SpfStat SpfMacro_parseExplainString(const SpfEvaluator *evaluator, const char *head,
-                                           const char *tail, const char **nextp, XBuffer *xbuf);
+extern SpfMacroProgram *SpfMacroProgram_new(void);
+extern void SpfMacroProgram_reset(SpfMacroProgram *self);
+extern void SpfMacroProgram_free(SpfMacroProgram *self);
+extern SpfStat SpfMacro_compileDomainSpec(SpfMacroProgram *program, const char *head,
+                                          const char *tail, const char **nextp);
+extern SpfStat SpfMacro_compileExplainString(SpfMacroProgram *program, const char *head,
+                                             const char *tail, const char **nextp);
+extern SpfStat SpfMacro_expand(const SpfMacroProgram *program, const SpfEvaluator *evaluator,
+                               XBuffer *xbuf);
 
 #ifdef __cplusplus
 }
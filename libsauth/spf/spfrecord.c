@@ -37,6 +37,8 @@
 
 #define SPF_RECORD_SPF1_PREFIX "v=spf1"
 #define SPF_RECORD_SIDF20_PREFIX "spf2.0"
+// the minimum number of consecutive "ip4" and "ip6" directives to compile into a prefix trie
+#define SPF_RECORD_IPTRIE_MIN_DIRECTIVES 4
 
 // maximum value of ip4-cidr-length
 #define SPF_IP4_MAX_CIDR_LENGTH 32
@@ -246,9 +248,18 @@ static SpfStat
 SpfRecord_parseDomainSpec(SpfRecord *self, const char *head, const char *tail, SpfTerm *term,
                           const char **nextp)
 {
+    // マクロは一旦命令列にコンパイルしてから展開する
     XBuffer_reset(self->evaluator->xbuf);
+    SpfMacroProgram_reset(self->evaluator->macro_program);
     SpfStat parse_stat =
-        SpfMacro_parseDomainSpec(self->evaluator, head, tail, nextp, self->evaluator->xbuf);
+        SpfMacro_compileDomainSpec(self->evaluator->macro_program, head, tail, nextp);
+    if (SPF_STAT_OK == parse_stat) {
+        parse_stat =
+            SpfMacro_expand(self->evaluator->macro_program, self->evaluator, self->evaluator->xbuf);
+        if (SPF_STAT_OK != parse_stat) {
+            *nextp = head;
+        }   // end if
+    }   // end if
     if (SPF_STAT_OK == parse_stat) {
         SpfLogParseTrace("    domainspec: %.*s as [%s]\n",
                          *nextp - head, head, XBuffer_getString(self->evaluator->xbuf));
@@ -773,6 +784,93 @@ SpfRecord_parse(SpfRecord *self, const char *head, const char *tail)
     }   // end if
 }   // end function: SpfRecord_parseTerms
 
+static bool
+SpfRecord_isIpDirective(const SpfTerm *term)
+{
+    return SPF_TERM_MECH_IP4 == term->attr->type || SPF_TERM_MECH_IP6 == term->attr->type;
+}   // end function: SpfRecord_isIpDirective
+
+static SpfStat
+SpfRecord_compileIpRun(SpfRecord *self, unsigned int head, unsigned int tail)
+{
+    SpfIpRun *newruns =
+        (SpfIpRun *) realloc(self->ipruns, sizeof(SpfIpRun) * (self->iprun_num + 1));
+    if (NULL == newruns) {
+        LogNoResource();
+        return SPF_STAT_NO_RESOURCE;
+    }   // end if
+    self->ipruns = newruns;
+    SpfIpRun *run = &(self->ipruns[self->iprun_num]);
+    run->head = head;
+    run->tail = tail;
+    run->trie = SpfIpTrie_new();
+    if (NULL == run->trie) {
+        LogNoResource();
+        return SPF_STAT_NO_RESOURCE;
+    }   // end if
+    ++(self->iprun_num);
+
+    for (unsigned int n = head; n < tail; ++n) {
+        const SpfTerm *term = PtrArray_get(self->directives, n);
+        bool insert_stat = (SPF_TERM_MECH_IP4 == term->attr->type)
+            ? SpfIpTrie_insert(run->trie, AF_INET, &(term->param.addr4), term->ip4cidr, n)
+            : SpfIpTrie_insert(run->trie, AF_INET6, &(term->param.addr6), term->ip6cidr, n);
+        if (!insert_stat) {
+            LogNoResource();
+            return SPF_STAT_NO_RESOURCE;
+        }   // end if
+    }   // end for
+    return SPF_STAT_OK;
+}   // end function: SpfRecord_compileIpRun
+
+/**
+ * compiles each run of consecutive "ip4" and "ip6" directives into a prefix trie,
+ * so that the evaluator can examine the whole run with a single walk.
+ * the directive index of each prefix is used as its tag, which keeps the first-match order.
+ */
+static SpfStat
+SpfRecord_compileIpRuns(SpfRecord *self)
+{
+    unsigned int directive_num = (unsigned int) PtrArray_getCount(self->directives);
+    unsigned int head = 0;
+    while (head < directive_num) {
+        if (!SpfRecord_isIpDirective(PtrArray_get(self->directives, head))) {
+            ++head;
+            continue;
+        }   // end if
+        unsigned int tail = head + 1;
+        while (tail < directive_num
+               && SpfRecord_isIpDirective(PtrArray_get(self->directives, tail))) {
+            ++tail;
+        }   // end while
+        if (SPF_RECORD_IPTRIE_MIN_DIRECTIVES <= tail - head) {
+            SpfStat compile_stat = SpfRecord_compileIpRun(self, head, tail);
+            if (SPF_STAT_OK != compile_stat) {
+                return compile_stat;
+            }   // end if
+        }   // end if
+        head = tail;
+    }   // end while
+    return SPF_STAT_OK;
+}   // end function: SpfRecord_compileIpRuns
+
+/**
+ * returns the prefix trie of the run of "ip4" and "ip6" directives beginning at directive_index.
+ * @param run_tail receives the index of the directive next to the last one of the run.
+ * @return the prefix trie, or NULL if no compiled run begins at directive_index.
+ */
+const SpfIpTrie *
+SpfRecord_getIpTrie(const SpfRecord *self, unsigned int directive_index, unsigned int *run_tail)
+{
+    for (size_t n = 0; n < self->iprun_num; ++n) {
+        if (self->ipruns[n].head == directive_index) {
+            *run_tail = self->ipruns[n].tail;
+            return self->ipruns[n].trie;
+        }   // end if
+    }   // end for
+    return NULL;
+}   // end function: SpfRecord_getIpTrie
+
 /**
  * release SpfRecord object
  * @param self SpfRecord object to release
@@ -784,6 +882,10 @@ SpfRecord_free(SpfRecord *self)
         return;
     }   // end if
 
+    for (size_t n = 0; n < self->iprun_num; ++n) {
+        SpfIpTrie_free(self->ipruns[n].trie);
+    }   // end for
+    free(self->ipruns);
     PtrArray_free(self->directives);
     SpfTerm_free(self->modifiers.rediect);
     SpfTerm_free(self->modifiers.exp);
@@ -844,6 +946,9 @@ SpfRecord_build(const SpfEvaluator *evaluator, SpfRecordScope scope, const char
     self->scope = scope;
 
     SpfStat build_stat = SpfRecord_parse(self, record_head, record_tail);
+    if (SPF_STAT_OK == build_stat) {
+        build_stat = SpfRecord_compileIpRuns(self);
+    }   // end if
     if (SPF_STAT_OK == build_stat) {
         *recordobj = self;
     } else {
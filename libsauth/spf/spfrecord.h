@@ -21,6 +21,7 @@
 #include "spf.h"
 #include "spfenum.h"
 #include "spfevaluator.h"
+#include "spfiptrie.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -60,7 +61,14 @@ typedef struct SpfTerm {
     const char *querydomain;
 } SpfTerm;
 
-typedef struct SpfRecord {
+// a run of consecutive "ip4" and "ip6" directives compiled into a prefix trie
+typedef struct SpfIpRun {
+    unsigned int head;  // index of the first directive of the run
+    unsigned int tail;  // index of the directive next to the last one of the run
+    SpfIpTrie *trie;    // prefixes of the run tagged with their directive indexes
+} SpfIpRun;
+
+struct SpfRecord {
     // マクロを展開してから保持する選択をしたので, リクエストに依存するのは避けられない
     const SpfEvaluator *evaluator;
     SpfRecordScope scope;
@@ -71,12 +79,16 @@ typedef struct SpfRecord {
         SpfTerm *exp;
     } modifiers;
     // PtrArray *modifiers;
-} SpfRecord;
+    SpfIpRun *ipruns;
+    size_t iprun_num;
+};
 
 extern SpfStat SpfRecord_build(const SpfEvaluator *evaluator, SpfRecordScope scope,
                                const char *record_head, const char *record_tail,
                                SpfRecord **recordobj);
 extern void SpfRecord_free(SpfRecord *self);
+extern const SpfIpTrie *SpfRecord_getIpTrie(const SpfRecord *self, unsigned int directive_index,
+                                            unsigned int *run_tail);
 extern SpfStat SpfRecord_getSpfScope(const char *record_head,
                                      const char *record_tail, SpfRecordScope *scope,
                                      const char **scope_tail);
@@ -22,21 +22,54 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <syslog.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
+#include "stdaux.h"
 #include "ptrop.h"
 #include "loghandler.h"
+#include "inetmailbox.h"
 #include "dnsresolv.h"
 #include "spf.h"
 
+#define SPFEVAL_BATCH_MAX_THREADS 1024
+
+// state of the batch mode shared by the worker threads
+typedef struct SpfEvalBatch {
+    FILE *input;
+    pthread_mutex_t input_lock;
+    unsigned long line_num;     // the number of the lines read so far
+    const SpfEvalPolicy *policy;
+    SpfRecordScope scope;
+    const char *resolver_engine;
+    const char *resolver_conf;
+    bool quiet;                 // true to suppress the per-line results
+} SpfEvalBatch;
+
+// a worker thread of the batch mode and its statistics
+typedef struct SpfEvalWorker {
+    SpfEvalBatch *batch;
+    pthread_t thread;
+    bool failed;                // true if the worker couldn't start
+    uint64_t *latency;          // elapsed time of each evaluation in microseconds
+    size_t eval_num;
+    size_t latency_capacity;
+    unsigned long long query_count; // total DNS queries issued by the evaluations
+    unsigned long error_num;    // the number of the lines which couldn't be evaluated
+    unsigned long score_count[SPF_SCORE_MAX];
+} SpfEvalWorker;
+
 static void
 usage(FILE *fp)
 {
-    fprintf(fp, "\nUsage: spfeval [-46mpsv] username@domain IP-address1 IP-address2 ...\n\n");
+    fprintf(fp, "\nUsage: spfeval [-46mpsvw] [-r engine] [-c conf] username@domain IP-address1 IP-address2 ...\n");
+    fprintf(fp, "       spfeval [-mpsqvw] [-r engine] [-c conf] [-j threads] -b file\n\n");
     fprintf(fp, "handling of IP address:\n");
     fprintf(fp, "  -4    handle \"IP-address\" as IPv4 address\n");
     fprintf(fp, "  -6    handle \"IP-address\" as IPv6 address\n\n");
@@ -47,9 +80,283 @@ usage(FILE *fp)
     fprintf(fp, "features:\n");
     fprintf(fp, "  -v  verbose mode\n");
     fprintf(fp, "  -w look up SPF RR first\n");
+    fprintf(fp, "  -r engine  resolver engine (ldns, bind, resolv or zone)\n");
+    fprintf(fp, "  -c conf    configuration file of the resolver engine\n");
+    fprintf(fp, "batch mode:\n");
+    fprintf(fp, "  -b file     evaluate \"IP-address sender [helo]\" lines of the file, \"-\" for stdin\n");
+    fprintf(fp, "              sender may be \"<>\", helo defaults to the domain of sender\n");
+    fprintf(fp, "  -j threads  the number of evaluation threads (default 1)\n");
+    fprintf(fp, "  -q          print only the statistics\n");
     exit(EX_USAGE);
 }   // end function: usage
 
+static uint64_t
+spfeval_now(void)
+{
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}   // end function: spfeval_now
+
+static bool
+spfeval_batch_record(SpfEvalWorker *worker, uint64_t latency, unsigned int query_count,
+                     SpfScore score)
+{
+    if (worker->latency_capacity <= worker->eval_num) {
+        size_t newcapacity = 0 < worker->latency_capacity ? worker->latency_capacity * 2 : 1024;
+        uint64_t *newlatency =
+            (uint64_t *) realloc(worker->latency, sizeof(uint64_t) * newcapacity);
+        if (NULL == newlatency) {
+            return false;
+        }   // end if
+        worker->latency = newlatency;
+        worker->latency_capacity = newcapacity;
+    }   // end if
+    worker->latency[worker->eval_num++] = latency;
+    worker->query_count += query_count;
+    ++worker->score_count[score];
+    return true;
+}   // end function: spfeval_batch_record
+
+/*
+ * Evaluates a "IP-address sender [helo]" line.
+ * @return true if evaluated, false if the line is malformed.
+ */
+static bool
+spfeval_batch_evaluate(SpfEvalWorker *worker, SpfEvaluator *evaluator, DnsResolver *resolver,
+                       unsigned long line_num, char *line)
+{
+    char *saveptr = NULL;
+    const char *ipaddr = strtok_r(line, " \t\r\n", &saveptr);
+    const char *sender = strtok_r(NULL, " \t\r\n", &saveptr);
+    const char *helo = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (NULL == ipaddr) {
+        return true;    // skip empty lines
+    }   // end if
+    if (NULL == sender) {
+        LogError("sender missing: line=%lu", line_num);
+        return false;
+    }   // end if
+
+    SpfEvaluator_reset(evaluator);
+    if (!SpfEvaluator_setIpAddrString(evaluator, NULL != strchr(ipaddr, ':') ? AF_INET6 : AF_INET,
+                                      ipaddr)) {
+        LogError("invalid IP address: line=%lu, ip-address=%s", line_num, ipaddr);
+        return false;
+    }   // end if
+    const char *dummy;
+    InetMailbox *envfrom =
+        InetMailbox_buildSendmailReversePath(sender, STRTAIL(sender), &dummy, NULL);
+    if (NULL == envfrom) {
+        LogError("invalid sender: line=%lu, sender=%s", line_num, sender);
+        return false;
+    }   // end if
+    if (!InetMailbox_isNullAddr(envfrom)) {
+        SpfEvaluator_setSender(evaluator, envfrom);
+        if (NULL == helo) {
+            helo = InetMailbox_getDomain(envfrom);
+        }   // end if
+    }   // end if
+    if (NULL == helo) {
+        LogError("helo missing for null sender: line=%lu", line_num);
+        InetMailbox_free(envfrom);
+        return false;
+    }   // end if
+    SpfEvaluator_setHeloDomain(evaluator, helo);
+
+    // the budget is used only to count DNS queries of the evaluation
+    DnsResolver_setBudget(resolver, 0, 0);
+    uint64_t start = spfeval_now();
+    SpfScore score = SpfEvaluator_eval(evaluator, worker->batch->scope);
+    uint64_t latency = spfeval_now() - start;
+    unsigned int query_count = DnsResolver_getBudget(resolver)->query_count;
+    InetMailbox_free(envfrom);
+
+    if (!spfeval_batch_record(worker, latency, query_count, score)) {
+        LogNoResource();
+        return false;
+    }   // end if
+    if (!worker->batch->quiet) {
+        LogPlain("%lu %s %s %s %llu.%03llums %u", line_num, ipaddr, sender,
+                 SpfEnum_lookupScoreByValue(score), (unsigned long long) (latency / 1000),
+                 (unsigned long long) (latency % 1000), query_count);
+    }   // end if
+    return true;
+}   // end function: spfeval_batch_evaluate
+
+static void *
+spfeval_batch_worker(void *arg)
+{
+    SpfEvalWorker *worker = (SpfEvalWorker *) arg;
+    SpfEvalBatch *batch = worker->batch;
+    char *line = NULL;
+    size_t linecap = 0;
+
+    // each worker has its own resolver as DnsResolver objects are not thread-safe
+    DnsResolver *resolver = DnsResolver_new(batch->resolver_engine, batch->resolver_conf);
+    if (NULL == resolver) {
+        LogError("resolver initialization failed: engine=%s, conf=%s",
+                 NNSTR(batch->resolver_engine), NNSTR(batch->resolver_conf));
+        worker->failed = true;
+        return NULL;
+    }   // end if
+    SpfEvaluator *evaluator = SpfEvaluator_new(batch->policy, resolver);
+    if (NULL == evaluator) {
+        LogError("SpfEvaluator_new failed: errno=%s", strerror(errno));
+        worker->failed = true;
+        goto finally;
+    }   // end if
+
+    while (true) {
+        pthread_mutex_lock(&batch->input_lock);
+        ssize_t linelen = getline(&line, &linecap, batch->input);
+        unsigned long line_num = ++batch->line_num;
+        pthread_mutex_unlock(&batch->input_lock);
+        if (linelen < 0) {
+            break;
+        }   // end if
+        if (!spfeval_batch_evaluate(worker, evaluator, resolver, line_num, line)) {
+            ++worker->error_num;
+        }   // end if
+    }   // end while
+
+  finally:
+    free(line);
+    SpfEvaluator_free(evaluator);
+    DnsResolver_free(resolver);
+    return NULL;
+}   // end function: spfeval_batch_worker
+
+static int
+spfeval_compare_latency(const void *a, const void *b)
+{
+    uint64_t la = *(const uint64_t *) a;
+    uint64_t lb = *(const uint64_t *) b;
+    return la < lb ? -1 : (la > lb ? 1 : 0);
+}   // end function: spfeval_compare_latency
+
+/*
+ * @return the latency at the percentile by the nearest-rank method, in milliseconds.
+ */
+static double
+spfeval_percentile(const uint64_t *sorted, size_t num, double percentile)
+{
+    size_t rank = (size_t) (percentile / 100.0 * num + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }   // end if
+    return sorted[MIN(rank, num) - 1] / 1000.0;
+}   // end function: spfeval_percentile
+
+static void
+spfeval_batch_report(SpfEvalWorker *workers, unsigned int thread_num, uint64_t elapsed)
+{
+    size_t eval_num = 0;
+    unsigned long error_num = 0;
+    unsigned long long query_count = 0;
+    unsigned long score_count[SPF_SCORE_MAX];
+    memset(score_count, 0, sizeof(score_count));
+    for (unsigned int i = 0; i < thread_num; ++i) {
+        eval_num += workers[i].eval_num;
+        error_num += workers[i].error_num;
+        query_count += workers[i].query_count;
+        for (int score = 0; score < SPF_SCORE_MAX; ++score) {
+            score_count[score] += workers[i].score_count[score];
+        }   // end for
+    }   // end for
+
+    LogPlain("evaluations: %zu, errors: %lu, threads: %u, elapsed: %.3fs, throughput: %.1f/s",
+             eval_num, error_num, thread_num, elapsed / 1000000.0,
+             0 < elapsed ? eval_num * 1000000.0 / elapsed : 0.0);
+    if (0 == eval_num) {
+        return;
+    }   // end if
+
+    uint64_t *latency = (uint64_t *) malloc(sizeof(uint64_t) * eval_num);
+    if (NULL == latency) {
+        LogNoResource();
+        return;
+    }   // end if
+    size_t filled = 0;
+    for (unsigned int i = 0; i < thread_num; ++i) {
+        memcpy(latency + filled, workers[i].latency, sizeof(uint64_t) * workers[i].eval_num);
+        filled += workers[i].eval_num;
+    }   // end for
+    qsort(latency, eval_num, sizeof(uint64_t), spfeval_compare_latency);
+    LogPlain("latency: p50=%.3fms, p90=%.3fms, p99=%.3fms, p99.9=%.3fms, max=%.3fms",
+             spfeval_percentile(latency, eval_num, 50.0),
+             spfeval_percentile(latency, eval_num, 90.0),
+             spfeval_percentile(latency, eval_num, 99.0),
+             spfeval_percentile(latency, eval_num, 99.9), latency[eval_num - 1] / 1000.0);
+    free(latency);
+
+    LogPlain("DNS queries: %llu, %.2f per evaluation", query_count,
+             (double) query_count / eval_num);
+    for (int score = SPF_SCORE_NULL; score < SPF_SCORE_MAX; ++score) {
+        if (0 < score_count[score]) {
+            LogPlain("score: %s=%lu", NNSTR(SpfEnum_lookupScoreByValue(score)), score_count[score]);
+        }   // end if
+    }   // end for
+}   // end function: spfeval_batch_report
+
+/*
+ * Evaluates the lines of the file on the threads.
+ * @return exit status
+ */
+static int
+spfeval_batch(SpfEvalBatch *batch, const char *filename, unsigned int thread_num)
+{
+    if (0 == strcmp(filename, "-")) {
+        batch->input = stdin;
+    } else {
+        batch->input = fopen(filename, "r");
+        if (NULL == batch->input) {
+            LogError("failed to open file: file=%s, errno=%s", filename, strerror(errno));
+            return EX_NOINPUT;
+        }   // end if
+    }   // end if
+    pthread_mutex_init(&batch->input_lock, NULL);
+
+    SpfEvalWorker *workers = (SpfEvalWorker *) malloc(sizeof(SpfEvalWorker) * thread_num);
+    if (NULL == workers) {
+        LogNoResource();
+        return EX_OSERR;
+    }   // end if
+    memset(workers, 0, sizeof(SpfEvalWorker) * thread_num);
+
+    int exit_status = EX_OK;
+    unsigned int started = 0;
+    uint64_t start = spfeval_now();
+    for (; started < thread_num; ++started) {
+        workers[started].batch = batch;
+        int ret = pthread_create(&workers[started].thread, NULL, spfeval_batch_worker,
+                                 &workers[started]);
+        if (0 != ret) {
+            LogError("pthread_create failed: errno=%s", strerror(ret));
+            exit_status = EX_OSERR;
+            break;
+        }   // end if
+    }   // end for
+    for (unsigned int i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].failed) {
+            exit_status = EX_OSERR;
+        }   // end if
+    }   // end for
+    uint64_t elapsed = spfeval_now() - start;
+
+    spfeval_batch_report(workers, started, elapsed);
+    for (unsigned int i = 0; i < started; ++i) {
+        free(workers[i].latency);
+    }   // end for
+    free(workers);
+    pthread_mutex_destroy(&batch->input_lock);
+    if (stdin != batch->input) {
+        fclose(batch->input);
+    }   // end if
+    return exit_status;
+}   // end function: spfeval_batch
+
 int
 main(int argc, char **argv)
 {
@@ -57,12 +364,17 @@ main(int argc, char **argv)
     int ai_flags = 0;
     bool lookup_spf_rr = false;
     SpfRecordScope scope = SPF_RECORD_SCOPE_SPF1;
+    const char *resolver_engine = NULL;
+    const char *resolver_conf = NULL;
+    const char *batch_file = NULL;
+    unsigned int thread_num = 1;
+    bool quiet = false;
 
     LogHandler_init();
     LogHandler_switchToStdout();
 
     int c;
-    while (-1 != (c = getopt(argc, argv, "46mnpshvw"))) {
+    while (-1 != (c = getopt(argc, argv, "46b:c:j:mnpqr:shvw"))) {
         switch (c) {
         case '4':  // IPv4
             af = AF_INET;
@@ -70,6 +382,19 @@ main(int argc, char **argv)
         case '6':  // IPv6
             af = AF_INET6;
             break;
+        case 'b':  // batch mode
+            batch_file = optarg;
+            break;
+        case 'c':  // resolver configuration
+            resolver_conf = optarg;
+            break;
+        case 'j':  // the number of threads in batch mode
+            thread_num = (unsigned int) strtoul(optarg, NULL, 10);
+            if (0 == thread_num || SPFEVAL_BATCH_MAX_THREADS < thread_num) {
+                fprintf(stdout, "[Error] invalid number of threads: %s\n", optarg);
+                usage(stdout);
+            }   // end if
+            break;
         case 'm':  // SIDF/mfrom
             scope = SPF_RECORD_SCOPE_SPF2_MFROM;
             break;
@@ -79,6 +404,12 @@ main(int argc, char **argv)
         case 'p':  // SIDF/pra
             scope = SPF_RECORD_SCOPE_SPF2_PRA;
             break;
+        case 'q':  // statistics only in batch mode
+            quiet = true;
+            break;
+        case 'r':  // resolver engine
+            resolver_engine = optarg;
+            break;
         case 's':  // SPF
             scope = SPF_RECORD_SCOPE_SPF1;
             break;
@@ -101,18 +432,10 @@ main(int argc, char **argv)
     argc -= optind;
     argv += optind;
 
-    if (argc < 2) {
+    if (NULL == batch_file && argc < 2) {
         usage(stdout);
     }   // end if
 
-    DnsResolver *resolver = DnsResolver_new(NULL, NULL);
-    if (NULL == resolver) {
-        LogError("resolver initialization failed: errno=%s", strerror(errno));
-        exit(EX_OSERR);
-    }   // end if
-
-    const char *mailbox = argv[0];
-
     SpfEvalPolicy *policy = SpfEvalPolicy_new();
     if (NULL == policy) {
         LogError("SpfEvalPolicy_new failed: errno=%s", strerror(errno));
@@ -120,6 +443,27 @@ main(int argc, char **argv)
     }   // end if
     SpfEvalPolicy_setSpfRRLookup(policy, lookup_spf_rr);
 
+    if (NULL != batch_file) {
+        SpfEvalBatch batch;
+        memset(&batch, 0, sizeof(SpfEvalBatch));
+        batch.policy = policy;
+        batch.scope = scope;
+        batch.resolver_engine = resolver_engine;
+        batch.resolver_conf = resolver_conf;
+        batch.quiet = quiet;
+        int exit_status = spfeval_batch(&batch, batch_file, thread_num);
+        SpfEvalPolicy_free(policy);
+        exit(exit_status);
+    }   // end if
+
+    DnsResolver *resolver = DnsResolver_new(resolver_engine, resolver_conf);
+    if (NULL == resolver) {
+        LogError("resolver initialization failed: errno=%s", strerror(errno));
+        exit(EX_OSERR);
+    }   // end if
+
+    const char *mailbox = argv[0];
+
     SpfEvaluator *evaluator = SpfEvaluator_new(policy, resolver);
     if (NULL == evaluator) {
         LogError("SpfEvaluator_new failed: errno=%s", strerror(errno));
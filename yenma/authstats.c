@@ -24,8 +24,18 @@
 #include "spf.h"
 #include "dkim.h"
 #include "dmarc.h"
+#include "dnsresolv.h"
+#include "keywordmap.h"
 #include "authstats.h"
 
+static const KeywordMap authstats_dns_counter_tbl[] = {
+    {"query", AUTHSTATS_DNS_QUERY},
+    {"elapsed-msec", AUTHSTATS_DNS_ELAPSED},
+    {"refused", AUTHSTATS_DNS_REFUSED},
+    {"exhausted", AUTHSTATS_DNS_EXHAUSTED},
+    {NULL, AUTHSTATS_DNS_MAX},  // sentinel
+};
+
 AuthStatistics *
 AuthStatistics_new(void)
 {
@@ -71,6 +81,7 @@ AuthStatistics_reset(AuthStatistics *self, AuthStatistics *copy)
         memcpy(&(copy->dkim), &(self->dkim), sizeof(self->dkim));
         memcpy(&(copy->dkim_adsp), &(self->dkim_adsp), sizeof(self->dkim_adsp));
         memcpy(&(copy->dmarc), &(self->dmarc), sizeof(self->dmarc));
+        memcpy(&(copy->dns), &(self->dns), sizeof(self->dns));
     }   // end if
 
     memset(&(self->spf), 0, sizeof(self->spf));
@@ -78,6 +89,7 @@ AuthStatistics_reset(AuthStatistics *self, AuthStatistics *copy)
     memset(&(self->dkim), 0, sizeof(self->dkim));
     memset(&(self->dkim_adsp), 0, sizeof(self->dkim_adsp));
     memset(&(self->dmarc), 0, sizeof(self->dmarc));
+    memset(&(self->dns), 0, sizeof(self->dns));
 
     ret = pthread_mutex_unlock(&(self->lock));
     if (0 != ret) {
@@ -102,6 +114,7 @@ AuthStatistics_copy(const AuthStatistics *self, AuthStatistics *copy)
     memcpy(&(copy->dkim), &(self->dkim), sizeof(self->dkim));
     memcpy(&(copy->dkim_adsp), &(self->dkim_adsp), sizeof(self->dkim_adsp));
     memcpy(&(copy->dmarc), &(self->dmarc), sizeof(self->dmarc));
+    memcpy(&(copy->dns), &(self->dns), sizeof(self->dns));
 
     ret = pthread_mutex_unlock((pthread_mutex_t *) &(self->lock));
     if (0 != ret) {
@@ -134,6 +147,37 @@ AuthStatistics_increment(AuthStatistics *self, SpfScore spf_score, SpfScore sidf
     }   // end if
 }   // end function: AuthStatistics_increment
 
+void
+AuthStatistics_addDnsSpend(AuthStatistics *self, const DnsResolverBudget *budget)
+{
+    assert(NULL != self);
+    assert(NULL != budget);
+
+    int ret = pthread_mutex_lock(&(self->lock));
+    if (0 != ret) {
+        LogError("pthread_mutex_init failed: errno=%s", strerror(ret));
+        return;
+    }   // end if
+
+    self->dns[AUTHSTATS_DNS_QUERY] += budget->query_count;
+    self->dns[AUTHSTATS_DNS_ELAPSED] += budget->elapsed / 1000;
+    self->dns[AUTHSTATS_DNS_REFUSED] += budget->refused_count;
+    if (0 < budget->refused_count) {
+        ++(self->dns[AUTHSTATS_DNS_EXHAUSTED]);
+    }   // end if
+
+    ret = pthread_mutex_unlock(&(self->lock));
+    if (0 != ret) {
+        LogError("pthread_mutex_unlock failed: errno=%s", strerror(ret));
+    }   // end if
+}   // end function: AuthStatistics_addDnsSpend
+
+const char *
+AuthStatistics_lookupDnsCounterByValue(AuthStatsDnsCounter value)
+{
+    return KeywordMap_lookupByValue(authstats_dns_counter_tbl, value);
+}   // end function: AuthStatistics_lookupDnsCounterByValue
+
 void
 AuthStatistics_dump(const AuthStatistics *self)
 {
@@ -173,4 +217,8 @@ AuthStatistics_dump(const AuthStatistics *self)
              stats.dmarc[DMARC_SCORE_PASS], stats.dmarc[DMARC_SCORE_FAIL],
              stats.dmarc[DMARC_SCORE_POLICY], stats.dmarc[DMARC_SCORE_TEMPERROR],
              stats.dmarc[DMARC_SCORE_PERMERROR]);
+    LogPlain("DNS statistics: query=%" PRIu64 ", elapsed-msec=%" PRIu64 ", refused=%" PRIu64
+             ", exhausted=%" PRIu64, stats.dns[AUTHSTATS_DNS_QUERY],
+             stats.dns[AUTHSTATS_DNS_ELAPSED], stats.dns[AUTHSTATS_DNS_REFUSED],
+             stats.dns[AUTHSTATS_DNS_EXHAUSTED]);
 }   // end function: AuthStatistics_syslog
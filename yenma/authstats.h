@@ -18,11 +18,20 @@
 #include "spf.h"
 #include "dkim.h"
 #include "dmarc.h"
+#include "dnsresolv.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef enum AuthStatsDnsCounter {
+    AUTHSTATS_DNS_QUERY = 0,    // DNS 問い合わせの回数
+    AUTHSTATS_DNS_ELAPSED,      // DNS 問い合わせに費やした時間 (ミリ秒)
+    AUTHSTATS_DNS_REFUSED,      // 予算超過のためおこなわなかった DNS 問い合わせの回数
+    AUTHSTATS_DNS_EXHAUSTED,    // DNS 問い合わせの予算を使い切ったメッセージの数
+    AUTHSTATS_DNS_MAX,  // the number of counters
+} AuthStatsDnsCounter;
+
 typedef struct AuthStatistics {
     pthread_mutex_t lock;
     // スコアは列挙型の値をインデックスとする配列に格納する.
@@ -32,6 +41,7 @@ typedef struct AuthStatistics {
     uint64_t dkim[DKIM_BASE_SCORE_MAX];
     uint64_t dkim_adsp[DKIM_ADSP_SCORE_MAX];
     uint64_t dmarc[DMARC_SCORE_MAX];
+    uint64_t dns[AUTHSTATS_DNS_MAX];
 } AuthStatistics;
 
 extern AuthStatistics *AuthStatistics_new(void);
@@ -41,6 +51,8 @@ extern void AuthStatistics_copy(const AuthStatistics *self, AuthStatistics *copy
 extern void AuthStatistics_increment(AuthStatistics *self, SpfScore spf_score, SpfScore sidf_score,
                                      DkimBaseScore dkim_score, DkimAdspScore dkim_adsp_score,
                                      DmarcScore dmarc_score);
+extern void AuthStatistics_addDnsSpend(AuthStatistics *self, const DnsResolverBudget *budget);
+extern const char *AuthStatistics_lookupDnsCounterByValue(AuthStatsDnsCounter value);
 extern void AuthStatistics_dump(const AuthStatistics *self);
 
 #ifdef __cplusplus
@@ -32,6 +32,9 @@ struct ResolverPool {
     const char *initfile;
     int timeout_overwrite;
     int retry_count_overwrite;
+    DnsCircuitBreaker *breaker;
+    DnsRttTable *rtt_table;
+    DnsCapture *capture;
     DnsResolver *slot[];
 };
 
@@ -58,6 +61,39 @@ ResolverPool_new(DnsResolver_initializer *initializer, const char *initfile, siz
     return self;
 }   // end function: ResolverPool_new
 
+/**
+ * Attaches the circuit breaker to resolvers created afterward.
+ * @attention call this before the first ResolverPool_acquire().
+ * the breaker must outlive the pool.
+ */
+void
+ResolverPool_setCircuitBreaker(ResolverPool *self, DnsCircuitBreaker *breaker)
+{
+    self->breaker = breaker;
+}   // end function: ResolverPool_setCircuitBreaker
+
+/**
+ * Enables hedged queries of resolvers created afterward.
+ * @attention call this before the first ResolverPool_acquire().
+ * the table must outlive the pool.
+ */
+void
+ResolverPool_setHedging(ResolverPool *self, DnsRttTable *rtt_table)
+{
+    self->rtt_table = rtt_table;
+}   // end function: ResolverPool_setHedging
+
+/**
+ * Attaches the capture of DNS lookups to resolvers created afterward.
+ * @attention call this before the first ResolverPool_acquire().
+ * the capture must outlive the pool.
+ */
+void
+ResolverPool_setCapture(ResolverPool *self, DnsCapture *capture)
+{
+    self->capture = capture;
+}   // end function: ResolverPool_setCapture
+
 DnsResolver *
 ResolverPool_acquire(ResolverPool *self)
 {
@@ -88,6 +124,9 @@ ResolverPool_acquire(ResolverPool *self)
             if (0 <= self->retry_count_overwrite) {
                 DnsResolver_setRetryCount(resolver, self->retry_count_overwrite);
             }   // end if
+            DnsResolver_setCircuitBreaker(resolver, self->breaker);
+            DnsResolver_setHedging(resolver, self->rtt_table);
+            DnsResolver_setCapture(resolver, self->capture);
         }   // end if
     }   // end if
 
@@ -24,6 +24,9 @@ typedef struct ResolverPool ResolverPool;
 extern ResolverPool *ResolverPool_new(DnsResolver_initializer *initializer, const char *initfile,
                                       size_t slotnum, int timeout_overwrite,
                                       int retry_count_overwrite);
+extern void ResolverPool_setCircuitBreaker(ResolverPool *self, DnsCircuitBreaker *breaker);
+extern void ResolverPool_setHedging(ResolverPool *self, DnsRttTable *rtt_table);
+extern void ResolverPool_setCapture(ResolverPool *self, DnsCapture *capture);
 extern DnsResolver *ResolverPool_acquire(ResolverPool *self);
 extern void ResolverPool_release(ResolverPool *self, DnsResolver *resolver);
 extern void ResolverPool_free(ResolverPool *self);
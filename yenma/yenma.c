@@ -41,6 +41,7 @@
 #include "stdaux.h"
 #include "loghandler.h"
 #include "cryptomutex.h"
+#include "openssl_compat.h"
 #include "daemon_stuff.h"
 #include "configloader.h"
 #include "milteraux.h"
@@ -197,6 +198,7 @@ main(int argc, char **argv)
 
     // initialization of OpenSSL
     Crypto_mutex_init();
+    OpenSSL_initDigests();
 
     LogNotice("yenma " YENMA_VERSION_INFO " starting up");  // for console
 
@@ -263,6 +265,7 @@ main(int argc, char **argv)
     }   // end if
 
     // OpenSSL cleanup
+    OpenSSL_cleanupDigests();
     Crypto_mutex_cleanup();
     ERR_free_strings(); // XXX Is this needed even if ERR_load_crypto_strings() is not called?
     EVP_cleanup();
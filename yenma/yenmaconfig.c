@@ -15,6 +15,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <netdb.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -102,6 +103,47 @@ static const ConfigEntry yenma_config_table[] = {
     {"Resolver.RetryCount", CONFIG_TYPE_INT64, "-1",
      offsetof(YenmaConfig, resolver_retry_count), NULL},
 
+    {"Resolver.MessageTimeBudget", CONFIG_TYPE_UINT64, "0",
+     offsetof(YenmaConfig, resolver_message_time_budget),
+     "total time of DNS lookups per message in milliseconds, 0 for unlimited"},
+
+    {"Resolver.MessageQueryBudget", CONFIG_TYPE_UINT64, "0",
+     offsetof(YenmaConfig, resolver_message_query_budget),
+     "the number of DNS lookups per message, 0 for unlimited"},
+
+    {"Resolver.CircuitBreakerThreshold", CONFIG_TYPE_UINT64, "0",
+     offsetof(YenmaConfig, resolver_circuit_breaker_threshold),
+     "failure rate in percent to open the circuit breaker of a zone, 0 to disable"},
+
+    {"Resolver.CircuitBreakerMinQueries", CONFIG_TYPE_UINT64, "5",
+     offsetof(YenmaConfig, resolver_circuit_breaker_min_queries), NULL},
+
+    {"Resolver.CircuitBreakerWindow", CONFIG_TYPE_TIME, "60",
+     offsetof(YenmaConfig, resolver_circuit_breaker_window), NULL},
+
+    {"Resolver.CircuitBreakerCoolingTime", CONFIG_TYPE_TIME, "30",
+     offsetof(YenmaConfig, resolver_circuit_breaker_cooling_time), NULL},
+
+    {"Resolver.Hedging", CONFIG_TYPE_BOOLEAN, "false",
+     offsetof(YenmaConfig, resolver_hedging), NULL},
+
+    {"Resolver.HedgingMinDelay", CONFIG_TYPE_UINT64, "10",
+     offsetof(YenmaConfig, resolver_hedging_min_delay), NULL},
+
+    {"Resolver.HedgingMaxDelay", CONFIG_TYPE_UINT64, "500",
+     offsetof(YenmaConfig, resolver_hedging_max_delay), NULL},
+
+    {"Resolver.RecordFile", CONFIG_TYPE_STRING, NULL,
+     offsetof(YenmaConfig, resolver_record_file),
+     "file to append all DNS lookups and their answers to"},
+
+    {"Resolver.ReplayFile", CONFIG_TYPE_STRING, NULL,
+     offsetof(YenmaConfig, resolver_replay_file),
+     "file recorded by Resolver.RecordFile to answer DNS lookups from"},
+
+    {"Resolver.ReplayLatencyScale", CONFIG_TYPE_DOUBLE, "1.0",
+     offsetof(YenmaConfig, resolver_replay_latency_scale), NULL},
+
 // Authentication-Results
     {"AuthResult.ServId", CONFIG_TYPE_STRING, NULL,
      offsetof(YenmaConfig, authresult_servid), NULL},
@@ -126,6 +168,20 @@ static const ConfigEntry yenma_config_table[] = {
     {"SPF.VoidLookupLimit", CONFIG_TYPE_INT64, "2",
      offsetof(YenmaConfig, spf_void_lookup_limit), NULL},
 
+    {"SPF.PrefetchDepth", CONFIG_TYPE_INT64, "0",
+     offsetof(YenmaConfig, spf_prefetch_depth), NULL},
+
+    {"SPF.FlatCacheSize", CONFIG_TYPE_UINT64, "0",
+     offsetof(YenmaConfig, spf_flat_cache_size),
+     "the number of domains whose records are kept flattened, 0 to disable"},
+
+    {"SPF.FlatCacheMaxTTL", CONFIG_TYPE_TIME, "3600",
+     offsetof(YenmaConfig, spf_flat_cache_max_ttl), NULL},
+
+    {"SPF.CostTableSize", CONFIG_TYPE_UINT64, "0",
+     offsetof(YenmaConfig, spf_cost_table_size),
+     "the number of most expensive domains to keep track of, 0 to disable"},
+
 // Sender ID verification
     {"SIDF.Verify", CONFIG_TYPE_BOOLEAN, "false",
      offsetof(YenmaConfig, sidf_verify), NULL},
@@ -142,6 +198,20 @@ static const ConfigEntry yenma_config_table[] = {
     {"SIDF.VoidLookupLimit", CONFIG_TYPE_INT64, "2",
      offsetof(YenmaConfig, sidf_void_lookup_limit), NULL},
 
+    {"SIDF.PrefetchDepth", CONFIG_TYPE_INT64, "0",
+     offsetof(YenmaConfig, sidf_prefetch_depth), NULL},
+
+    {"SIDF.FlatCacheSize", CONFIG_TYPE_UINT64, "0",
+     offsetof(YenmaConfig, sidf_flat_cache_size),
+     "the number of domains whose records are kept flattened, 0 to disable"},
+
+    {"SIDF.FlatCacheMaxTTL", CONFIG_TYPE_TIME, "3600",
+     offsetof(YenmaConfig, sidf_flat_cache_max_ttl), NULL},
+
+    {"SIDF.CostTableSize", CONFIG_TYPE_UINT64, "0",
+     offsetof(YenmaConfig, sidf_cost_table_size),
+     "the number of most expensive domains to keep track of, 0 to disable"},
+
 // DKIM verification
     {"Dkim.Verify", CONFIG_TYPE_BOOLEAN, "true",
      offsetof(YenmaConfig, dkim_verify), NULL},
@@ -164,6 +234,23 @@ static const ConfigEntry yenma_config_table[] = {
     {"Dkim.MaxClockSkew", CONFIG_TYPE_TIME, "0",
      offsetof(YenmaConfig, dkim_max_clock_skew), NULL},
 
+    {"Dkim.CryptoThreads", CONFIG_TYPE_UINT64, "0",
+     offsetof(YenmaConfig, dkim_crypto_threads),
+     "the number of threads to verify DKIM signatures on, 0 to verify on the milter threads"},
+
+    {"Dkim.CryptoThreadAffinity", CONFIG_TYPE_BOOLEAN, "true",
+     offsetof(YenmaConfig, dkim_crypto_thread_affinity), NULL},
+
+    {"Dkim.BodyQueueLimit", CONFIG_TYPE_UINT64, "0",
+     offsetof(YenmaConfig, dkim_body_queue_limit),
+     "the number of octets of a message body queued to be hashed on the crypto threads, 0 to hash on the milter threads"},
+
+    {"Dkim.LazyVerification", CONFIG_TYPE_BOOLEAN, "false",
+     offsetof(YenmaConfig, dkim_lazy_verification), NULL},
+
+    {"Dkim.BodyHashFirst", CONFIG_TYPE_BOOLEAN, "false",
+     offsetof(YenmaConfig, dkim_body_hash_first), NULL},
+
     {"DkimAtps.Verify", CONFIG_TYPE_BOOLEAN, "false",
      offsetof(YenmaConfig, dkim_atps_verify), NULL},
 
@@ -237,6 +324,19 @@ YenmaConfig_load(YenmaConfig *self, const char *filename)
     }   // end if
     ConfigLoader_applyDefaultValue((ConfigStorageBase *) self);
 
+    // DnsResolver_setBudget() takes the time limit in milliseconds as uint64_t
+    // and converts it into microseconds, and the query limit as unsigned int
+    if (UINT64_MAX / 1000 < self->resolver_message_time_budget) {
+        LogError("Resolver.MessageTimeBudget is out of range: value=%llu",
+                 (unsigned long long) self->resolver_message_time_budget);
+        return false;
+    }   // end if
+    if (UINT_MAX < self->resolver_message_query_budget) {
+        LogError("Resolver.MessageQueryBudget is out of range: value=%llu",
+                 (unsigned long long) self->resolver_message_query_budget);
+        return false;
+    }   // end if
+
     // setup hostname (used as "authserv-id" of Authentication-Results: header)
     if (NULL == self->authresult_servid) {
         char tmphostname[AUTHHOSTNAMELEN];
@@ -263,7 +363,7 @@ YenmaConfig_dump(const YenmaConfig *self)
 static SpfEvalPolicy *
 YenmaConfig_buildSpfEvalPolicyImpl(const char *authresult_servid, bool lookup_spf_rr,
                                    bool log_plus_all_directive, bool lookup_explanation,
-                                   int void_lookup_limit)
+                                   int void_lookup_limit, int64_t prefetch_depth)
 {
     SpfEvalPolicy *spfpolicy = SpfEvalPolicy_new();
     if (NULL == spfpolicy) {
@@ -280,6 +380,7 @@ YenmaConfig_buildSpfEvalPolicyImpl(const char *authresult_servid, bool lookup_sp
                                               SPF_CUSTOM_ACTION_NULL);
     SpfEvalPolicy_setVoidLookupLimit(spfpolicy, void_lookup_limit);
     SpfEvalPolicy_setExplanationLookup(spfpolicy, lookup_explanation);
+    SpfEvalPolicy_setPrefetchDepth(spfpolicy, 0 < prefetch_depth ? (unsigned int) prefetch_depth : 0);
     return spfpolicy;
 }   // end function: YenmaConfig_buildSpfEvalPolicyImpl
 
@@ -289,7 +390,8 @@ YenmaConfig_buildSpfEvalPolicy(const YenmaConfig *self)
     return YenmaConfig_buildSpfEvalPolicyImpl(self->authresult_servid, self->spf_lookup_spf_rr,
                                               self->spf_log_plus_all_directive,
                                               self->spf_append_explanation,
-                                              (int) self->spf_void_lookup_limit);
+                                              (int) self->spf_void_lookup_limit,
+                                              self->spf_prefetch_depth);
 }   // end function: YenmaConfig_buildSpfEvalPolicy
 
 SpfEvalPolicy *
@@ -298,7 +400,8 @@ YenmaConfig_buildSidfEvalPolicy(const YenmaConfig *self)
     return YenmaConfig_buildSpfEvalPolicyImpl(self->authresult_servid, self->sidf_lookup_spf_rr,
                                               self->sidf_log_plus_all_directive,
                                               self->sidf_append_explanation,
-                                              (int) self->sidf_void_lookup_limit);
+                                              (int) self->sidf_void_lookup_limit,
+                                              self->sidf_prefetch_depth);
 }   // end function: YenmaConfig_buildSidfEvalPolicy
 
 DkimStatus
@@ -318,6 +421,9 @@ YenmaConfig_buildDkimVerificationPolicy(const YenmaConfig *self, DkimVerificatio
     DkimVerificationPolicy_verifyAtpsDelegation(vpolicyobj, self->dkim_atps_verify);
     DkimVerificationPolicy_setRfc4871Compatible(vpolicyobj, self->dkim_rfc4871_compatible);
     DkimVerificationPolicy_setMinRSAKeyLength(vpolicyobj, (unsigned int) self->dkim_min_rsa_key_length);
+    DkimVerificationPolicy_setBodyQueueLimit(vpolicyobj, (size_t) self->dkim_body_queue_limit);
+    DkimVerificationPolicy_setLazyVerification(vpolicyobj, self->dkim_lazy_verification);
+    DkimVerificationPolicy_setBodyHashFirst(vpolicyobj, self->dkim_body_hash_first);
     *vpolicy = vpolicyobj;
     return DSTAT_OK;
 }   // end function: YenmaConfig_buildDkimVerificationPolicy
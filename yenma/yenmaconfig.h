@@ -49,6 +49,18 @@ typedef struct YenmaConfig {
     uint64_t resolver_pool_size;
     int64_t resolver_timeout;
     int64_t resolver_retry_count;
+    uint64_t resolver_message_time_budget;
+    uint64_t resolver_message_query_budget;
+    uint64_t resolver_circuit_breaker_threshold;
+    uint64_t resolver_circuit_breaker_min_queries;
+    time_t resolver_circuit_breaker_window;
+    time_t resolver_circuit_breaker_cooling_time;
+    bool resolver_hedging;
+    uint64_t resolver_hedging_min_delay;
+    uint64_t resolver_hedging_max_delay;
+    char *resolver_record_file;
+    char *resolver_replay_file;
+    double resolver_replay_latency_scale;
 // Authentication-Results
     char *authresult_servid;
     bool authresult_use_spf_hardfail;
@@ -58,12 +70,20 @@ typedef struct YenmaConfig {
     bool spf_log_plus_all_directive;
     bool spf_append_explanation;
     int64_t spf_void_lookup_limit;
+    int64_t spf_prefetch_depth;
+    uint64_t spf_flat_cache_size;
+    time_t spf_flat_cache_max_ttl;
+    uint64_t spf_cost_table_size;
 // Sender ID verification
     bool sidf_verify;
     bool sidf_lookup_spf_rr;
     bool sidf_log_plus_all_directive;
     bool sidf_append_explanation;
     int64_t sidf_void_lookup_limit;
+    int64_t sidf_prefetch_depth;
+    uint64_t sidf_flat_cache_size;
+    time_t sidf_flat_cache_max_ttl;
+    uint64_t sidf_cost_table_size;
 // DKIM verification
     bool dkim_verify;
     bool dkim_accept_expired_signature;
@@ -72,6 +92,11 @@ typedef struct YenmaConfig {
     bool dkim_rfc4871_compatible;
     uint64_t dkim_min_rsa_key_length;
     time_t dkim_max_clock_skew;
+    uint64_t dkim_crypto_threads;
+    bool dkim_crypto_thread_affinity;
+    uint64_t dkim_body_queue_limit;
+    bool dkim_lazy_verification;
+    bool dkim_body_hash_first;
     bool dkim_atps_verify;
     bool dkim_adsp_verify;
     char *dkim_canon_dump_dir;
@@ -34,6 +34,9 @@
 #include "yenmactrl.h"
 #include "yenmacontext.h"
 
+// upper limit of Dkim.CryptoThreads
+#define YENMA_DKIM_CRYPTO_THREADS_MAX 1024
+
 /*
  * @attention this function is thread-unsafe
  */
@@ -57,9 +60,20 @@ YenmaContext_free(void *p)
         free(self->config_file);
     }   // end if
 
+    // the worker threads of the caches use the resolvers and the policies
+    SpfFlatCache_free(self->spf_flat_cache);
+    SpfFlatCache_free(self->sidf_flat_cache);
+    SpfCostTable_free(self->spf_cost_table);
+    SpfCostTable_free(self->sidf_cost_table);
+    ResolverPool_release(self->resolver_pool, self->spf_flat_resolver);
+    ResolverPool_release(self->resolver_pool, self->sidf_flat_resolver);
     ResolverPool_free(self->resolver_pool);
+    DnsCircuitBreaker_free(self->dns_breaker);
+    DnsRttTable_free(self->dns_rtt_table);
+    DnsCapture_free(self->dns_capture);
     IpAddrBlockTree_free(self->exclusion_block);
     DkimVerificationPolicy_free(self->dkim_vpolicy);
+    DkimCryptoPool_free(self->dkim_crypto_pool);
     SpfEvalPolicy_free(self->spfevalpolicy);
     SpfEvalPolicy_free(self->sidfevalpolicy);
     PublicSuffix_free(self->public_suffix);
@@ -94,6 +108,74 @@ notstartwith(char *s, char c)
     return NULL != s && c != s[0];
 }   // end function: notstartwith
 
+/*
+ * Attaches a cache of flattened records to the policy.
+ * The worker thread of the cache is started on the first evaluation, after the daemon has forked.
+ */
+static bool
+YenmaContext_buildSpfFlatCache(YenmaContext *self, SpfEvalPolicy *policy, uint64_t cache_size,
+                               time_t max_ttl, SpfFlatCache **cache, DnsResolver **resolver)
+{
+    if (0 == cache_size) {
+        return true;
+    }   // end if
+    *resolver = ResolverPool_acquire(self->resolver_pool);
+    if (NULL == *resolver) {
+        LogError("failed to initialize DNS resolver for the flattened record cache");
+        return false;
+    }   // end if
+    *cache = SpfFlatCache_new(policy, *resolver, (size_t) cache_size, max_ttl);
+    if (NULL == *cache) {
+        LogNoResource();
+        return false;
+    }   // end if
+    SpfEvalPolicy_setFlatCache(policy, *cache);
+    return true;
+}   // end function: YenmaContext_buildSpfFlatCache
+
+/*
+ * Attaches a table of the most expensive domains to the policy.
+ */
+static bool
+YenmaContext_buildSpfCostTable(SpfEvalPolicy *policy, uint64_t table_size, SpfCostTable **table)
+{
+    if (0 == table_size) {
+        return true;
+    }   // end if
+    *table = SpfCostTable_new((size_t) table_size);
+    if (NULL == *table) {
+        LogNoResource();
+        return false;
+    }   // end if
+    SpfEvalPolicy_setCostTable(policy, *table);
+    return true;
+}   // end function: YenmaContext_buildSpfCostTable
+
+/*
+ * Attaches the worker threads to verify DKIM signatures on to the policy.
+ * The worker threads are started on the first verification, after the daemon has forked.
+ */
+static bool
+YenmaContext_buildDkimCryptoPool(DkimVerificationPolicy *vpolicy, uint64_t thread_num,
+                                 bool pin_cores, DkimCryptoPool **pool)
+{
+    if (0 == thread_num) {
+        return true;
+    }   // end if
+    if (YENMA_DKIM_CRYPTO_THREADS_MAX < thread_num) {
+        LogError("too many DKIM crypto threads: threads=%llu, max=%u",
+                 (unsigned long long) thread_num, YENMA_DKIM_CRYPTO_THREADS_MAX);
+        return false;
+    }   // end if
+    *pool = DkimCryptoPool_new((unsigned int) thread_num, pin_cores);
+    if (NULL == *pool) {
+        LogNoResource();
+        return false;
+    }   // end if
+    DkimVerificationPolicy_setCryptoPool(vpolicy, *pool);
+    return true;
+}   // end function: YenmaContext_buildDkimCryptoPool
+
 /**
  * @attention this function may rewrite yenmacfg
  */
@@ -114,6 +196,44 @@ YenmaContext_buildPolicies(YenmaContext *self, YenmaConfig *yenmacfg)
         LogNoResource();
         return false;
     }   // end if
+    if (0 < yenmacfg->resolver_circuit_breaker_threshold) {
+        self->dns_breaker =
+            DnsCircuitBreaker_new((unsigned int) yenmacfg->resolver_circuit_breaker_threshold,
+                                  (unsigned int) yenmacfg->resolver_circuit_breaker_min_queries,
+                                  yenmacfg->resolver_circuit_breaker_window,
+                                  yenmacfg->resolver_circuit_breaker_cooling_time);
+        if (NULL == self->dns_breaker) {
+            LogNoResource();
+            return false;
+        }   // end if
+        ResolverPool_setCircuitBreaker(self->resolver_pool, self->dns_breaker);
+    }   // end if
+    if (yenmacfg->resolver_hedging) {
+        self->dns_rtt_table =
+            DnsRttTable_new((unsigned int) yenmacfg->resolver_hedging_min_delay,
+                            (unsigned int) yenmacfg->resolver_hedging_max_delay);
+        if (NULL == self->dns_rtt_table) {
+            LogNoResource();
+            return false;
+        }   // end if
+        ResolverPool_setHedging(self->resolver_pool, self->dns_rtt_table);
+    }   // end if
+    if (NULL != yenmacfg->resolver_replay_file) {
+        if (NULL != yenmacfg->resolver_record_file) {
+            LogError("Resolver.RecordFile and Resolver.ReplayFile are exclusive");
+            return false;
+        }   // end if
+        self->dns_capture =
+            DnsCapture_newReplayer(yenmacfg->resolver_replay_file,
+                                   yenmacfg->resolver_replay_latency_scale);
+    } else if (NULL != yenmacfg->resolver_record_file) {
+        self->dns_capture = DnsCapture_newRecorder(yenmacfg->resolver_record_file);
+    }   // end if
+    if (NULL != self->dns_capture) {
+        ResolverPool_setCapture(self->resolver_pool, self->dns_capture);
+    } else if (NULL != yenmacfg->resolver_replay_file || NULL != yenmacfg->resolver_record_file) {
+        return false;
+    }   // end if
 
     // DMARC setup
     if (yenmacfg->dmarc_verify) {
@@ -138,6 +258,9 @@ YenmaContext_buildPolicies(YenmaContext *self, YenmaConfig *yenmacfg)
                      yenmacfg->dmarc_public_suffix_list);
             return false;
         }   // end if
+        if (NULL != self->dns_breaker) {
+            DnsCircuitBreaker_setPublicSuffix(self->dns_breaker, self->public_suffix);
+        }   // end if
 
         // check SMTP reject actions
         self->dmarc_reject_action = YenmaConfig_lookupSmtpRejectActionByKeyword(yenmacfg->dmarc_reject_action);
@@ -165,6 +288,13 @@ YenmaContext_buildPolicies(YenmaContext *self, YenmaConfig *yenmacfg)
         if (DSTAT_OK != config_stat) {
             return false;
         }   // end if
+        // the public suffix list is loaded only for DMARC
+        DkimVerificationPolicy_setPublicSuffix(self->dkim_vpolicy, self->public_suffix);
+        if (!YenmaContext_buildDkimCryptoPool(self->dkim_vpolicy, yenmacfg->dkim_crypto_threads,
+                                              yenmacfg->dkim_crypto_thread_affinity,
+                                              &self->dkim_crypto_pool)) {
+            return false;
+        }   // end if
     }   // end if
 
     // building SpfEvalPolicy for SPF (must be after determining authserv-id)
@@ -173,6 +303,16 @@ YenmaContext_buildPolicies(YenmaContext *self, YenmaConfig *yenmacfg)
         if (NULL == self->spfevalpolicy) {
             return false;
         }   // end if
+        if (!YenmaContext_buildSpfFlatCache(self, self->spfevalpolicy,
+                                            yenmacfg->spf_flat_cache_size,
+                                            yenmacfg->spf_flat_cache_max_ttl,
+                                            &self->spf_flat_cache, &self->spf_flat_resolver)) {
+            return false;
+        }   // end if
+        if (!YenmaContext_buildSpfCostTable(self->spfevalpolicy, yenmacfg->spf_cost_table_size,
+                                            &self->spf_cost_table)) {
+            return false;
+        }   // end if
     }   // end if
 
     // building SpfEvalPolicy for SIDF (must be after determining authserv-id)
@@ -181,6 +321,16 @@ YenmaContext_buildPolicies(YenmaContext *self, YenmaConfig *yenmacfg)
         if (NULL == self->sidfevalpolicy) {
             return false;
         }   // end if
+        if (!YenmaContext_buildSpfFlatCache(self, self->sidfevalpolicy,
+                                            yenmacfg->sidf_flat_cache_size,
+                                            yenmacfg->sidf_flat_cache_max_ttl,
+                                            &self->sidf_flat_cache, &self->sidf_flat_resolver)) {
+            return false;
+        }   // end if
+        if (!YenmaContext_buildSpfCostTable(self->sidfevalpolicy, yenmacfg->sidf_cost_table_size,
+                                            &self->sidf_cost_table)) {
+            return false;
+        }   // end if
     }   // end if
 
     if (NULL != yenmacfg->service_exclusion_blocks) {
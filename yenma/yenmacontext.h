@@ -18,6 +18,9 @@
 #include "ipaddrblocktree.h"
 #include "dnsresolv.h"
 #include "resolverpool.h"
+#include "dnscircuitbreaker.h"
+#include "dnsrtttable.h"
+#include "dnscapture.h"
 #include "spf.h"
 #include "dkim.h"
 #include "dmarc.h"
@@ -43,10 +46,20 @@ typedef struct YenmaContext {
     // reloadable attributes
     YenmaConfig *cfg;
     ResolverPool *resolver_pool;
+    DnsCircuitBreaker *dns_breaker;
+    DnsRttTable *dns_rtt_table;
+    DnsCapture *dns_capture;
     IpAddrBlockTree *exclusion_block;
     DkimVerificationPolicy *dkim_vpolicy;
+    DkimCryptoPool *dkim_crypto_pool;
     SpfEvalPolicy *spfevalpolicy;
     SpfEvalPolicy *sidfevalpolicy;
+    SpfFlatCache *spf_flat_cache;
+    SpfFlatCache *sidf_flat_cache;
+    DnsResolver *spf_flat_resolver;     // used by the worker thread of spf_flat_cache
+    DnsResolver *sidf_flat_resolver;    // used by the worker thread of sidf_flat_cache
+    SpfCostTable *spf_cost_table;
+    SpfCostTable *sidf_cost_table;
     PublicSuffix *public_suffix;
     sfsistat dmarc_reject_action;
 } YenmaContext;
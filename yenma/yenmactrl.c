@@ -44,6 +44,8 @@
 
 static bool YenmaCtrl_onShowCounter(ProtocolHandler *handler, const char *param);
 static bool YenmaCtrl_onResetCounter(ProtocolHandler *handler, const char *param);
+static bool YenmaCtrl_onShowBreaker(ProtocolHandler *handler, const char *param);
+static bool YenmaCtrl_onShowSpfCost(ProtocolHandler *handler, const char *param);
 static bool YenmaCtrl_onReload(ProtocolHandler *handler, const char *param);
 static bool YenmaCtrl_onShutdown(ProtocolHandler *handler, const char *param);
 static bool YenmaCtrl_onQuit(ProtocolHandler *handler, const char *param);
@@ -53,6 +55,8 @@ static bool YenmaCtrl_onUndefined(ProtocolHandler *handler, const char *param);
 static const CommandHandlerMap yenma_ctrl_table[] = {
     {"SHOW-COUNTER", YenmaCtrl_onShowCounter},
     {"RESET-COUNTER", YenmaCtrl_onResetCounter},
+    {"SHOW-BREAKER", YenmaCtrl_onShowBreaker},
+    {"SHOW-SPF-COST", YenmaCtrl_onShowSpfCost},
     {"RELOAD", YenmaCtrl_onReload},
     {"SHUTDOWN", YenmaCtrl_onShutdown},
     {"QUIT", YenmaCtrl_onQuit},
@@ -145,6 +149,8 @@ YenmaCtrl_showStatistics(ProtocolHandler *handler, const AuthStatistics *stats,
                               (Enum_lookupScoreByValue *) DkimEnum_lookupAdspScoreByValue);
     YenmaCtrl_writeStatisticsFunc(handler->swriter, "dmarc", stats->dmarc, DMARC_SCORE_MAX,
                               (Enum_lookupScoreByValue *) DmarcEnum_lookupScoreByValue);
+    YenmaCtrl_writeStatisticsFunc(handler->swriter, "dns", stats->dns, AUTHSTATS_DNS_MAX,
+                              (Enum_lookupScoreByValue *) AuthStatistics_lookupDnsCounterByValue);
 
     if (YENMA_STATS_FORMAT_JSON == stats_format) {
         SocketWriter_writeString(handler->swriter, "}\n");
@@ -173,6 +179,99 @@ YenmaCtrl_onResetCounter(ProtocolHandler *handler, const char *param)
     return false;
 }   // end function: YenmaCtrl_onResetCounter
 
+static void
+YenmaCtrl_appendBreakerState(const char *zone, DnsCircuitState state, unsigned int failure_count,
+                             unsigned int query_count, time_t remaining, void *arg)
+{
+    XBuffer *buf = (XBuffer *) arg;
+    if (DNS_CIRCUIT_CLOSED == state && 0 == failure_count) {
+        return;
+    }   // end if
+    XBuffer_appendFormatString(buf, "%s: state=%s, failure=%u, query=%u, remaining=%ds\n", zone,
+                               DnsCircuitBreaker_symbolizeState(state), failure_count, query_count,
+                               (int) remaining);
+}   // end function: YenmaCtrl_appendBreakerState
+
+static bool
+YenmaCtrl_onShowBreaker(ProtocolHandler *handler, const char *param __attribute__((unused)))
+// XXX エラーハンドリング, ロギング
+{
+    YenmaContext *ctx = yenma_get_context_reference();
+    if (NULL == ctx) {
+        SocketWriter_writeString(handler->swriter, "500 INTERNAL ERROR\n");
+        SocketWriter_flush(handler->swriter);
+        return false;
+    }   // end if
+
+    if (NULL != ctx->dns_breaker) {
+        // ブレーカーのロックを保持したままソケットに書き出さないよう, 一旦バッファに溜める
+        XBuffer *buf = XBuffer_new(0);
+        if (NULL != buf) {
+            DnsCircuitBreaker_iterate(ctx->dns_breaker, YenmaCtrl_appendBreakerState, buf);
+            if (0 == XBuffer_status(buf)) {
+                SocketWriter_writeString(handler->swriter, XBuffer_getString(buf));
+            }   // end if
+            XBuffer_free(buf);
+        }   // end if
+    }   // end if
+    SocketWriter_flush(handler->swriter);
+    YenmaContext_unref(ctx);
+
+    return false;
+}   // end function: YenmaCtrl_onShowBreaker
+
+typedef struct YenmaCtrlSpfCostArg {
+    XBuffer *buf;
+    const char *mech;
+} YenmaCtrlSpfCostArg;
+
+static void
+YenmaCtrl_appendSpfCost(const char *domain, uint64_t eval_count, uint64_t query_count,
+                        uint64_t elapsed, const SpfEvalCost *max, void *arg)
+{
+    YenmaCtrlSpfCostArg *costarg = (YenmaCtrlSpfCostArg *) arg;
+    XBuffer_appendFormatString(costarg->buf,
+                               "%s: domain=%s, eval=%" PRIu64 ", query=%" PRIu64
+                               ", elapsed=%" PRIu64 "ms, max-query=%u, max-elapsed=%" PRIu64
+                               "ms, max-dns-mech=%u, max-void-lookup=%u, max-include-depth=%u\n",
+                               costarg->mech, domain, eval_count, query_count, elapsed / 1000,
+                               max->query_count, max->elapsed / 1000, max->dns_mech_count,
+                               max->void_lookup_count, max->include_depth);
+}   // end function: YenmaCtrl_appendSpfCost
+
+static bool
+YenmaCtrl_onShowSpfCost(ProtocolHandler *handler, const char *param __attribute__((unused)))
+// XXX エラーハンドリング, ロギング
+{
+    YenmaContext *ctx = yenma_get_context_reference();
+    if (NULL == ctx) {
+        SocketWriter_writeString(handler->swriter, "500 INTERNAL ERROR\n");
+        SocketWriter_flush(handler->swriter);
+        return false;
+    }   // end if
+
+    // テーブルのロックを保持したままソケットに書き出さないよう, 一旦バッファに溜める
+    XBuffer *buf = XBuffer_new(0);
+    if (NULL != buf) {
+        YenmaCtrlSpfCostArg costarg = {buf, "spf"};
+        if (NULL != ctx->spf_cost_table) {
+            SpfCostTable_iterate(ctx->spf_cost_table, YenmaCtrl_appendSpfCost, &costarg);
+        }   // end if
+        costarg.mech = "sidf";
+        if (NULL != ctx->sidf_cost_table) {
+            SpfCostTable_iterate(ctx->sidf_cost_table, YenmaCtrl_appendSpfCost, &costarg);
+        }   // end if
+        if (0 == XBuffer_status(buf)) {
+            SocketWriter_writeString(handler->swriter, XBuffer_getString(buf));
+        }   // end if
+        XBuffer_free(buf);
+    }   // end if
+    SocketWriter_flush(handler->swriter);
+    YenmaContext_unref(ctx);
+
+    return false;
+}   // end function: YenmaCtrl_onShowSpfCost
+
 static YenmaContext *
 YenmaCtrl_rebuildContext(YenmaContext *oldctx)
 {
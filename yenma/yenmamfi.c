@@ -16,6 +16,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <netdb.h>
 #include <pthread.h>
@@ -375,12 +376,68 @@ yenma_spfv_prepare_request(YenmaSession *session, SpfEvaluator *evaluator, bool
 }   // end function: yenma_spfv_prepare_request
 
 /**
- * SPF evaluation and Authentication-Results header insertion
- * @param session session context
+ * 同じコネクション中で既に HELO を評価していれば, その結果を使い回す.
+ * 結果は SpfEvaluator にもセットし, DMARC のアラインメント判定などで再評価されないようにする.
+ * yenma_spfv_setup() の後に呼ぶこと.
+ * @param score HELO の評価結果を受け取る変数へのポインタ.
+ * @return true if the HELO identity is to be evaluated and its result is available.
+ */
+static bool
+yenma_spfv_reuse_helo_result(YenmaSession *session, SpfScore *score)
+{
+    // Sender がセットされていなければ HELO が評価対象
+    if (SPF_SCORE_NULL == session->helo_spf_score
+        || NULL != SpfEvaluator_getSender(session->spfevaluator)) {
+        return false;
+    }   // end if
+    if (!SpfEvaluator_setHeloResult(session->spfevaluator, SPF_RECORD_SCOPE_SPF1,
+                                    session->helo_spf_score, session->helo_spf_explanation)) {
+        // ignoring memory allocation error, the result is just evaluated again
+        LogNoResource();
+        return false;
+    }   // end if
+    LogDebug("SPF result of HELO reused: helo=%s, spf=%s", session->helohost,
+             SpfEnum_lookupScoreByValue(session->helo_spf_score));
+    *score = session->helo_spf_score;
+    return true;
+}   // end function: yenma_spfv_reuse_helo_result
+
+/**
+ * HELO で評価した場合, 結果をコネクション中で使い回せるよう記憶する.
+ * 一時的なエラーは記憶しない.
+ */
+static void
+yenma_spfv_keep_helo_result(YenmaSession *session, SpfScore score)
+{
+    if (SpfEvaluator_isSenderContext(session->spfevaluator)) {
+        return;
+    }   // end if
+    switch (score) {
+    case SPF_SCORE_NULL:
+    case SPF_SCORE_SYSERROR:
+    case SPF_SCORE_TEMPERROR:
+        return;
+    default:
+        break;
+    }   // end switch
+    const char *explanation = SpfEvaluator_getExplanation(session->spfevaluator);
+    if (NULL != explanation) {
+        // ignoring memory allocation error, the result is just evaluated again
+        session->helo_spf_explanation = strdup(explanation);
+        if (NULL == session->helo_spf_explanation) {
+            return;
+        }   // end if
+    }   // end if
+    session->helo_spf_score = score;
+}   // end function: yenma_spfv_keep_helo_result
+
+/**
+ * SPF 評価の準備
+ * @param spfready SPF の検証が続行可能かを受け取る変数へのポインタ.
  * @return true on success, false on error.
  */
 static bool
-yenma_spfv_eom(YenmaSession *session)
+yenma_spfv_setup(YenmaSession *session, bool *spfready)
 {
     if (NULL == session->spfevaluator) {
         session->spfevaluator = SpfEvaluator_new(session->ctx->spfevalpolicy, session->resolver);
@@ -392,14 +449,19 @@ yenma_spfv_eom(YenmaSession *session)
         SpfEvaluator_reset(session->spfevaluator);
     }   // end if
 
-    bool spfready;
-    if (!yenma_spfv_prepare_request(session, session->spfevaluator, &spfready)) {
-        return false;
-    }   // end if
+    return yenma_spfv_prepare_request(session, session->spfevaluator, spfready);
+}   // end function: yenma_spfv_setup
 
+/**
+ * SPF の評価結果の記録と Authentication-Results header insertion
+ * @param spfready yenma_spfv_setup() で SPF の検証が続行可能とされたか.
+ * @param score SPF の評価結果, spfready が false の場合は無視される.
+ * @return true on success, false on error.
+ */
+static bool
+yenma_spfv_record_result(YenmaSession *session, bool spfready, SpfScore score)
+{
     if (spfready) {
-        // SPF 評価の実行
-        SpfScore score = SpfEvaluator_eval(session->spfevaluator, SPF_RECORD_SCOPE_SPF1);
         session->validated_result->spf_score = score;
         if (SPF_SCORE_SYSERROR == score || SPF_SCORE_NULL == score) {
             LogWarning("SpfEvaluator_eval failed: spf=0x%x", score);
@@ -431,6 +493,28 @@ yenma_spfv_eom(YenmaSession *session)
     }   // end if
 
     return true;
+}   // end function: yenma_spfv_record_result
+
+/**
+ * SPF evaluation and Authentication-Results header insertion
+ * @param session session context
+ * @return true on success, false on error.
+ */
+static bool
+yenma_spfv_eom(YenmaSession *session)
+{
+    bool spfready;
+    if (!yenma_spfv_setup(session, &spfready)) {
+        return false;
+    }   // end if
+
+    // SPF 評価の実行
+    SpfScore score = SPF_SCORE_NULL;
+    if (spfready && !yenma_spfv_reuse_helo_result(session, &score)) {
+        score = SpfEvaluator_eval(session->spfevaluator, SPF_RECORD_SCOPE_SPF1);
+        yenma_spfv_keep_helo_result(session, score);
+    }   // end if
+    return yenma_spfv_record_result(session, spfready, score);
 }   // end function: yenma_spfv_eom
 
 /**
@@ -493,12 +577,16 @@ yenma_sidfv_prepare_request(YenmaSession *session, SpfEvaluator *evaluator, bool
 }   // end function: yenma_sidfv_prepare_request
 
 /**
- * SenderID evaluation and Authentication-Results header insertion
- * @param session session context
+ * SenderID 評価の準備
+ * @param sidfready SIDF の検証が続行可能かを受け取る変数へのポインタ.
+ * @param pra_header PRA ヘッダのフィールド名を受け取る変数へのポインタ.
+ * @param pra_mailbox PRA ヘッダから抽出したメールボックスを受け取る変数へのポインタ.
+ *        yenma_sidfv_record_result() で解放される.
  * @return true on success, false on error.
  */
 static bool
-yenma_sidfv_eom(YenmaSession *session)
+yenma_sidfv_setup(YenmaSession *session, bool *sidfready, const char **pra_header,
+                  InetMailbox **pra_mailbox)
 {
     if (NULL == session->sidfevaluator) {
         session->sidfevaluator = SpfEvaluator_new(session->ctx->sidfevalpolicy, session->resolver);
@@ -510,20 +598,27 @@ yenma_sidfv_eom(YenmaSession *session)
         SpfEvaluator_reset(session->sidfevaluator);
     }   // end if
 
-    bool sidfready;
-    const char *pra_header = NULL;
-    InetMailbox *pra_mailbox = NULL;
-    if (!yenma_sidfv_prepare_request
-        (session, session->sidfevaluator, &sidfready, &pra_header, &pra_mailbox)) {
-        return false;
-    }   // end if
+    *pra_header = NULL;
+    *pra_mailbox = NULL;
+    return yenma_sidfv_prepare_request(session, session->sidfevaluator, sidfready, pra_header,
+                                       pra_mailbox);
+}   // end function: yenma_sidfv_setup
 
+/**
+ * SenderID の評価結果の記録と Authentication-Results header insertion
+ * @param sidfready yenma_sidfv_setup() で SIDF の検証が続行可能とされたか.
+ * @param score SIDF の評価結果, sidfready が false の場合は無視される.
+ * @return true on success, false on error.
+ */
+static bool
+yenma_sidfv_record_result(YenmaSession *session, bool sidfready, SpfScore score,
+                          const char *pra_header, InetMailbox *pra_mailbox)
+{
     if (sidfready) {
-        // SIDF 評価の実行
-        SpfScore score = SpfEvaluator_eval(session->sidfevaluator, SPF_RECORD_SCOPE_SPF2_PRA);
         session->validated_result->sidf_score = score;
         if (SPF_SCORE_SYSERROR == score || SPF_SCORE_NULL == score) {
             LogWarning("SpfEvaluator_eval failed: sender-id=0x%x", score);
+            InetMailbox_free(pra_mailbox);
             return false;
         }   // end if
         // Authentication-Results ヘッダの挿入
@@ -546,8 +641,72 @@ yenma_sidfv_eom(YenmaSession *session)
     }   // end if
 
     return true;
+}   // end function: yenma_sidfv_record_result
+
+/**
+ * SenderID evaluation and Authentication-Results header insertion
+ * @param session session context
+ * @return true on success, false on error.
+ */
+static bool
+yenma_sidfv_eom(YenmaSession *session)
+{
+    bool sidfready;
+    const char *pra_header;
+    InetMailbox *pra_mailbox;
+    if (!yenma_sidfv_setup(session, &sidfready, &pra_header, &pra_mailbox)) {
+        return false;
+    }   // end if
+
+    // SIDF 評価の実行
+    SpfScore score = sidfready
+        ? SpfEvaluator_eval(session->sidfevaluator, SPF_RECORD_SCOPE_SPF2_PRA) : SPF_SCORE_NULL;
+    return yenma_sidfv_record_result(session, sidfready, score, pra_header, pra_mailbox);
 }   // end function: yenma_sidfv_eom
 
+/**
+ * SPF and SenderID evaluation sharing DNS lookups, and Authentication-Results header insertion.
+ * 両方の評価で参照されるレコードは一度だけ引かれる. 評価結果は個別に評価した場合と同じ.
+ * @param session session context
+ * @return true on success, false on error.
+ */
+static bool
+yenma_spfv_sidfv_eom(YenmaSession *session)
+{
+    bool spfready, sidfready;
+    const char *pra_header;
+    InetMailbox *pra_mailbox;
+    if (!yenma_spfv_setup(session, &spfready)) {
+        return false;
+    }   // end if
+    if (!yenma_sidfv_setup(session, &sidfready, &pra_header, &pra_mailbox)) {
+        return false;
+    }   // end if
+
+    // SPF, SIDF 評価の実行
+    SpfScore spf_score = SPF_SCORE_NULL;
+    SpfScore sidf_score = SPF_SCORE_NULL;
+    // 使い回せる HELO の評価結果があれば SPF は評価しない
+    bool spf_eval = spfready && !yenma_spfv_reuse_helo_result(session, &spf_score);
+    if (spf_eval && sidfready) {
+        SpfEvaluator_evalPair(session->spfevaluator, SPF_RECORD_SCOPE_SPF1, &spf_score,
+                              session->sidfevaluator, SPF_RECORD_SCOPE_SPF2_PRA, &sidf_score);
+    } else if (spf_eval) {
+        spf_score = SpfEvaluator_eval(session->spfevaluator, SPF_RECORD_SCOPE_SPF1);
+    } else if (sidfready) {
+        sidf_score = SpfEvaluator_eval(session->sidfevaluator, SPF_RECORD_SCOPE_SPF2_PRA);
+    }   // end if
+    if (spf_eval) {
+        yenma_spfv_keep_helo_result(session, spf_score);
+    }   // end if
+
+    if (!yenma_spfv_record_result(session, spfready, spf_score)) {
+        InetMailbox_free(pra_mailbox);
+        return false;
+    }   // end if
+    return yenma_sidfv_record_result(session, sidfready, sidf_score, pra_header, pra_mailbox);
+}   // end function: yenma_spfv_sidfv_eom
+
 static bool
 yenma_dmarcv_eom(YenmaSession *session)
 {
@@ -565,13 +724,10 @@ yenma_dmarcv_eom(YenmaSession *session)
     session->aligners = PtrArray_new(0, (void (*)(void *)) DmarcAligner_free);
 
     bool author_found = false;
-    int headernum = InetMailHeaders_getCount(session->headers);
-    for (int i = 0; i < headernum; ++i) {
-        const char *headerf, *headerv;
-        InetMailHeaders_get(session->headers, i, &headerf, &headerv);
-        if (0 != strcasecmp(headerf, FROMHEADER)) {
-            continue;
-        }   // end if
+    for (int i = InetMailHeaders_getFirstIndex(session->headers, FROMHEADER); 0 <= i;
+         i = InetMailHeaders_getNextIndex(session->headers, i)) {
+        const char *headerv;
+        InetMailHeaders_get(session->headers, i, NULL, &headerv);
         const char *errptr = NULL;
         InetMailboxArray *authors =
             InetMailHeaders_parseMailboxList(headerv, STRTAIL(headerv), &errptr);
@@ -756,6 +912,13 @@ yenmamfi_negotiate(SMFICTX *ctx, unsigned long f0 __attribute__((unused)),
         *pf1 |= SMFIP_HDR_LEADSPC;
         session->keep_leading_header_space = true;
     }   // end if
+#if defined(SMFIP_SKIP)
+    // to stop receiving the message body no one needs
+    if (f1 & SMFIP_SKIP) {
+        *pf1 |= SMFIP_SKIP;
+        session->skip_body = true;
+    }   // end if
+#endif
 
     // The (output) parameters pf2 and pf3 should be set to 0 for compatibility with future versions.
     *pf2 = 0;
@@ -891,6 +1054,10 @@ yenmamfi_envfrom(SMFICTX *ctx, char **argv)
     // 2回目以降のトランザクションの場合に備えて掃除
     YenmaSession_reset(session);
 
+    // メッセージ単位の DNS 問い合わせの予算を設定
+    DnsResolver_setBudget(session->resolver, session->ctx->cfg->resolver_message_time_budget,
+                          (unsigned int) session->ctx->cfg->resolver_message_query_budget);
+
     // context init
     if (!(session->ctx->cfg->milter_lazy_qid_fetch)) {
         yenma_set_qid(ctx, session);
@@ -1045,6 +1212,15 @@ yenmamfi_body(SMFICTX *ctx, unsigned char *bodyp, size_t bodylen)
         }   // end if
     }   // end if
 
+#if defined(SMFIS_SKIP)
+    // the rest of the body is needed only for DKIM verification
+    if (session->skip_body
+        && (!session->ctx->cfg->dkim_verify || !DkimVerifier_needsBody(session->verifier))) {
+        LogDebug("the rest of the message body is skipped");
+        return SMFIS_SKIP;
+    }   // end if
+#endif
+
     return SMFIS_CONTINUE;
 }   // end function: yenmamfi_body
 
@@ -1083,14 +1259,21 @@ yenmamfi_eom(SMFICTX *ctx)
         return yenma_tempfail(session);
     }   // end if
 
-    // SPF evaluation
-    if (session->ctx->cfg->spf_verify && !yenma_spfv_eom(session)) {
-        return yenma_tempfail(session);
-    }   // end if
+    if (session->ctx->cfg->spf_verify && session->ctx->cfg->sidf_verify) {
+        // SPF and Sender ID evaluation at once
+        if (!yenma_spfv_sidfv_eom(session)) {
+            return yenma_tempfail(session);
+        }   // end if
+    } else {
+        // SPF evaluation
+        if (session->ctx->cfg->spf_verify && !yenma_spfv_eom(session)) {
+            return yenma_tempfail(session);
+        }   // end if
 
-    // Sender ID evaluation
-    if (session->ctx->cfg->sidf_verify && !yenma_sidfv_eom(session)) {
-        return yenma_tempfail(session);
+        // Sender ID evaluation
+        if (session->ctx->cfg->sidf_verify && !yenma_sidfv_eom(session)) {
+            return yenma_tempfail(session);
+        }   // end if
     }   // end if
 
     // DKIM verification
@@ -1123,6 +1306,13 @@ yenmamfi_eom(SMFICTX *ctx)
                              session->validated_result->dkim_adsp_score,
                              session->validated_result->dmarc_score);
 
+    // update DNS lookup statistics
+    const DnsResolverBudget *dns_budget = DnsResolver_getBudget(session->resolver);
+    LogEvent("DNS", "query=%u, elapsed=%" PRIu64 "ms, refused=%u, speculative=%u",
+             dns_budget->query_count, dns_budget->elapsed / 1000, dns_budget->refused_count,
+             dns_budget->speculative_count);
+    AuthStatistics_addDnsSpend(session->ctx->stats, dns_budget);
+
     // reset the session
     YenmaSession_reset(session);
     (void) LogHandler_setPrefix(NULL);
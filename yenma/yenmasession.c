@@ -41,6 +41,7 @@ YenmaSession_new(YenmaContext *yenmactx)
 
     self->ctx = yenmactx;
     self->keep_leading_header_space = false;
+    self->helo_spf_score = SPF_SCORE_NULL;
 
     self->delauthhdr = IntArray_new(0);
     if (NULL == self->delauthhdr) {
@@ -128,6 +129,7 @@ YenmaSession_free(YenmaSession *self)
     free(self->qid);
     free(self->hostaddr);
     free(self->helohost);
+    free(self->helo_spf_explanation);
     IntArray_free(self->delauthhdr);
     AuthResult_free(self->authresult);
     SpfEvaluator_free(self->spfevaluator);
@@ -21,6 +21,7 @@
 #include "inetmailheaders.h"
 #include "socketaddress.h"
 #include "dnsresolv.h"
+#include "spf.h"
 #include "validatedresult.h"
 #include "authresult.h"
 #include "yenma.h"
@@ -36,9 +37,13 @@ typedef struct YenmaSession {
     YenmaContext *ctx;
     DnsResolver *resolver;
     bool keep_leading_header_space;
+    bool skip_body;             // the MTA accepts SMFIS_SKIP from xxfi_body (SMFIP_SKIP)
     _SOCK_ADDR *hostaddr;
     char *helohost;
     char ipaddr[MAX_NUMERICINFO_LEN + 1];
+    // HELO と IP アドレスはコネクション中で変わらないので, HELO での SPF の評価結果は使い回す
+    SpfScore helo_spf_score;    // SPF_SCORE_NULL if HELO identity has not been evaluated yet
+    char *helo_spf_explanation;
 // per message
     SpfEvaluator *spfevaluator;
     SpfEvaluator *sidfevaluator;